@@ -1,10 +1,54 @@
 #include <iostream>
+#include <sstream>
+#include <fstream>
 #include <string>
-#include <queue>
-#include <stack>
 #include <stdexcept>
 #include <iomanip>
 #include <limits>
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <array>
+#include <cstdio>
+#include <cinttypes>
+#include <random>
+#include <cstring>
+#include <cstddef>
+#include <cerrno>
+#include <string_view>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#endif
+#include <sys/stat.h>
 using namespace std;
 
 // Custom exceptions
@@ -17,15 +61,6 @@ public:
     }
 };
 
-class InsufficientFundsException : public exception {
-    string message;
-public:
-    InsufficientFundsException(const string& msg) : message(msg) {}
-    const char* what() const noexcept override {
-        return message.c_str();
-    }
-};
-
 class DatabaseException : public exception {
     string message;
 public:
@@ -35,614 +70,12485 @@ public:
     }
 };
 
-// Customer structure
-struct Customer {
-    string customerId;
-    string password;
-    string name;
-    string email;
-    string address;
-    string phone;
-    double savingsBalance;
-    double currentBalance;
-    bool isFirstLogin;
+// Outcome of a routine operation, returned instead of thrown so declines
+// cost no unwinding or allocation. Exceptions remain for genuine faults.
+enum class Status : uint8_t {
+    OK,
+    OK_WITH_PENALTY,
+    INVALID_AMOUNT,
+    INVALID_ACCOUNT_TYPE,
+    CUSTOMER_NOT_FOUND,
+    INVALID_CREDENTIALS,
+    INSUFFICIENT_FUNDS,
+    ACCOUNT_BUSY,
+    SESSION_EXPIRED,
+    VELOCITY_LIMIT,
+    ACCOUNT_LOCKED
 };
 
-// Stack for managing default credentials
-class DefaultCredentials {
-private:
-    stack<pair<string, string>> credentials;
+inline bool succeeded(Status status) {
+    return status == Status::OK || status == Status::OK_WITH_PENALTY;
+}
 
-public:
-    DefaultCredentials() {
-        try {
-            credentials.push({"CUST010", "PASS010"});
-            credentials.push({"CUST009", "PASS009"});
-            credentials.push({"CUST008", "PASS008"});
-            credentials.push({"CUST007", "PASS007"});
-            credentials.push({"CUST006", "PASS006"});
-            credentials.push({"CUST005", "PASS005"});
-            credentials.push({"CUST004", "PASS004"});
-            credentials.push({"CUST003", "PASS003"});
-            credentials.push({"CUST002", "PASS002"});
-            credentials.push({"CUST001", "PASS001"});
-        } catch (...) {
-            throw DatabaseException("Failed to initialize default credentials");
-        }
+inline const char* statusMessage(Status status) {
+    switch (status) {
+        case Status::OK:
+            return "Success";
+        case Status::OK_WITH_PENALTY:
+            return "Success, service charge applied";
+        case Status::INVALID_AMOUNT:
+            return "Invalid amount";
+        case Status::INVALID_ACCOUNT_TYPE:
+            return "Invalid account type";
+        case Status::CUSTOMER_NOT_FOUND:
+            return "Customer not found";
+        case Status::INVALID_CREDENTIALS:
+            return "Invalid credentials";
+        case Status::INSUFFICIENT_FUNDS:
+            return "Insufficient funds";
+        case Status::ACCOUNT_BUSY:
+            return "Account is busy, please try again";
+        case Status::SESSION_EXPIRED:
+            return "Session expired, please log in again";
+        case Status::VELOCITY_LIMIT:
+            return "Transaction limit reached, please try again later";
+        case Status::ACCOUNT_LOCKED:
+            return "Too many failed logins, account is locked for now";
     }
+    return "Unknown error";
+}
 
-    pair<string, string> getNextCredential() {
-        if (credentials.empty()) {
-            throw DatabaseException("No more default credentials available");
-        }
-        pair<string, string> cred = credentials.top();
-        credentials.pop();
-        return cred;
-    }
+// Money is held as integer paise so balance arithmetic is exact
+typedef int64_t Paise;
+
+inline Paise toPaise(double rupees) {
+    return static_cast<Paise>(llround(rupees * 100));
+}
+
+inline double toRupees(Paise amount) {
+    return amount / 100.0;
+}
+
+// Operations timed by Metrics
+enum MetricOperation {
+    METRIC_FIND_CUSTOMER,
+    METRIC_VALIDATE_CREDENTIALS,
+    METRIC_ADD_CUSTOMER,
+    METRIC_IMPORT_CUSTOMERS,
+    METRIC_CHANGE_PASSWORD,
+    METRIC_COMMIT,
+    METRIC_CHECKPOINT,
+    METRIC_CHECK_BALANCE,
+    METRIC_WITHDRAW,
+    METRIC_TRANSFER,
+    METRIC_TRANSFER_LEG,
+    METRIC_APPLY_BATCH,
+    METRIC_COUNT
 };
 
-// Database management class
-class CustomerDatabase {
+// Process-wide latency histograms and outcome counters for ATM and
+// CustomerDatabase operations. Each thread records into its own slab with
+// plain relaxed stores, so recording takes no lock and shares no cache
+// line; a dump walks the list of slabs and adds them up. Latencies are
+// kept in CPU timestamp ticks where available and converted to
+// nanoseconds only when dumped.
+//
+// Every operation is counted, but by default only one in SAMPLE_PERIOD
+// per thread is timed: reading the clock twice costs more than all the
+// bookkeeping, and the histogram shape needs far fewer samples than that.
+// A thread-local countdown picks the timed ones, and the same branch
+// claims the thread's slab on its first operation.
+//
+// Histogram buckets are log-linear as in HdrHistogram: values below 32
+// ticks get a bucket each, larger ones keep their top five significant
+// bits, which bounds the error of a reported percentile to about 3%.
+class Metrics {
+public:
+    static const size_t STATUS_COUNT = static_cast<size_t>(Status::ACCOUNT_LOCKED) + 1;
+    static const uint32_t SAMPLE_PERIOD = 16;
+
 private:
-    static const int MAX_CUSTOMERS = 100;
-    Customer customers[MAX_CUSTOMERS][1];
-    int customerCount;
+    friend class OperationTimer;
 
-public:
-    CustomerDatabase() : customerCount(0) {}
+    static const int SUB_BITS = 5;
+    static const uint64_t SUB_COUNT = uint64_t(1) << SUB_BITS;
+    static const size_t BUCKETS = SUB_COUNT + 46 * (SUB_COUNT / 2);
 
-    void addCustomer(const Customer& customer) {
-        try {
-            if (customerCount >= MAX_CUSTOMERS) {
-                throw DatabaseException("Maximum customer limit reached");
-            }
-            if (findCustomer(customer.customerId) != nullptr) {
-                throw DatabaseException("Customer ID already exists");
+    struct Slab {
+        atomic<uint64_t> buckets[METRIC_COUNT][BUCKETS];
+        atomic<uint64_t> outcomes[METRIC_COUNT][STATUS_COUNT];
+        atomic<uint64_t> maxTicks[METRIC_COUNT];
+        atomic<bool> inUse;
+        Slab* next;
+    };
+
+    // Returns a thread's slab for reuse when the thread exits; the counts
+    // in it stay part of every later dump
+    struct Lease {
+        Slab* slab = nullptr;
+
+        ~Lease() {
+            if (slab) {
+                slab->inUse.store(false, memory_order_release);
             }
-            customers[customerCount][0] = customer;
-            customerCount++;
-        } catch (const DatabaseException& e) {
-            throw;
-        } catch (...) {
-            throw DatabaseException("Unknown error while adding customer");
         }
-    }
+    };
 
-    Customer* findCustomer(const string& customerId) {
-        try {
-            for (int i = 0; i < customerCount; i++) {
-                if (customers[i][0].customerId == customerId) {
-                    return &customers[i][0];
-                }
+    // What the hot path reads of its own thread. The initializer is
+    // constant, so reaching it needs no TLS initialization check.
+    struct Local {
+        Slab* slab;             // null until the thread's first operation
+        uint32_t untilSample;   // operations left until the next timed one
+    };
+
+    static thread_local Local local;
+
+    atomic<Slab*> slabs;
+    atomic<bool> enabled;
+    atomic<uint32_t> samplePeriod;
+    uint64_t startTicks;
+    chrono::steady_clock::time_point startTime;
+
+    Metrics() : slabs(nullptr), enabled(true), samplePeriod(SAMPLE_PERIOD),
+                startTicks(ticks()), startTime(chrono::steady_clock::now()) {}
+
+    Slab* claimSlab() {
+        for (Slab* slab = slabs.load(memory_order_acquire); slab; slab = slab->next) {
+            bool idle = false;
+            if (slab->inUse.compare_exchange_strong(idle, true)) {
+                return slab;
             }
-            return nullptr;
-        } catch (...) {
-            throw DatabaseException("Error while searching for customer");
         }
+        Slab* slab = new Slab();    // value-initialized, so every count starts at 0
+        slab->inUse.store(true, memory_order_relaxed);
+        slab->next = slabs.load(memory_order_relaxed);
+        while (!slabs.compare_exchange_weak(slab->next, slab, memory_order_release)) {
+        }
+        return slab;
     }
 
-    bool validateCredentials(const string& customerId, const string& password) {
-        try {
-            Customer* customer = findCustomer(customerId);
-            return (customer != nullptr && customer->password == password);
-        } catch (...) {
-            throw DatabaseException("Error while validating credentials");
+    static void recordLatency(Slab& slab, MetricOperation op, uint64_t elapsed) {
+        bump(slab.buckets[op][bucketOf(elapsed)]);
+        if (elapsed > slab.maxTicks[op].load(memory_order_relaxed)) {
+            slab.maxTicks[op].store(elapsed, memory_order_relaxed);
         }
     }
 
-    bool changePassword(const string& customerId, const string& newPassword) {
-        try {
-            Customer* customer = findCustomer(customerId);
-            if (customer) {
-                customer->password = newPassword;
-                customer->isFirstLogin = false;
-                return true;
-            }
-            return false;
-        } catch (...) {
-            throw DatabaseException("Error while changing password");
+    // startedTicks is 0 for an operation that was counted but not timed
+    static void record(Slab& slab, MetricOperation op, uint64_t startedTicks, Status status) {
+        bump(slab.outcomes[op][static_cast<size_t>(status)]);
+        if (startedTicks != 0) {
+            recordLatency(slab, op, ticks() - startedTicks);
         }
     }
-};
 
-// ATM operations class
-class ATM {
-private:
-    CustomerDatabase& db;
-    queue<string> accessQueue;
-    const double MIN_SAVINGS_BALANCE = 1000;
-    const double MIN_CURRENT_BALANCE = 5000;
-    const double SAVINGS_PENALTY = 50;
-    const double CURRENT_PENALTY = 250;
+    // Gives the calling thread a slab, held by a lease that releases it
+    // when the thread exits
+    void claimLocal() {
+        thread_local Lease lease;
+        lease.slab = local.slab = claimSlab();
+    }
 
-public:
-    ATM(CustomerDatabase& database) : db(database) {}
+    static void bump(atomic<uint64_t>& counter) {
+        // Only the owning thread writes a slab, so no read-modify-write
+        counter.store(counter.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
 
-    void addToQueue(const string& customerId) {
-        try {
-            accessQueue.push(customerId);
-        } catch (...) {
-            throw runtime_error("Error adding customer to queue");
+    static size_t bucketOf(uint64_t value) {
+        if (value < SUB_COUNT) {
+            return static_cast<size_t>(value);
         }
+        int shift = 63 - __builtin_clzll(value) - (SUB_BITS - 1);
+        size_t bucket = SUB_COUNT + static_cast<size_t>(shift - 1) * (SUB_COUNT / 2) +
+                        static_cast<size_t>((value >> shift) - SUB_COUNT / 2);
+        return min(bucket, BUCKETS - 1);
     }
 
-    bool isNextInQueue(const string& customerId) {
-        try {
-            return !accessQueue.empty() && accessQueue.front() == customerId;
-        } catch (...) {
-            throw runtime_error("Error checking queue status");
+    // Midpoint of the values that land in bucket
+    static double bucketValue(size_t bucket) {
+        if (bucket < SUB_COUNT) {
+            return static_cast<double>(bucket);
         }
+        size_t shift = (bucket - SUB_COUNT) / (SUB_COUNT / 2) + 1;
+        uint64_t mantissa = (bucket - SUB_COUNT) % (SUB_COUNT / 2) + SUB_COUNT / 2;
+        return (static_cast<double>(mantissa) + 0.5) * static_cast<double>(uint64_t(1) << shift);
     }
 
-    void removeFromQueue() {
-        try {
-            if (!accessQueue.empty()) {
-                accessQueue.pop();
+    // count comes from the outcome counters; percentiles and max only
+    // from the timed samples
+    struct Summary {
+        uint64_t count;
+        double p50, p99, p999, max;
+        uint64_t outcomes[STATUS_COUNT];
+    };
+
+    double nanosPerTick() {
+        uint64_t elapsedTicks = ticks() - startTicks;
+        double elapsedNanos = chrono::duration<double, nano>(chrono::steady_clock::now() - startTime).count();
+        return elapsedTicks > 0 ? elapsedNanos / static_cast<double>(elapsedTicks) : 1.0;
+    }
+
+    Summary summarize(size_t op, double scale) {
+        vector<uint64_t> merged(BUCKETS, 0);
+        Summary summary = Summary();
+        uint64_t maxTicks = 0;
+        for (Slab* slab = slabs.load(memory_order_acquire); slab; slab = slab->next) {
+            for (size_t bucket = 0; bucket < BUCKETS; bucket++) {
+                merged[bucket] += slab->buckets[op][bucket].load(memory_order_relaxed);
             }
-        } catch (...) {
-            throw runtime_error("Error removing customer from queue");
+            for (size_t status = 0; status < STATUS_COUNT; status++) {
+                summary.outcomes[status] += slab->outcomes[op][status].load(memory_order_relaxed);
+            }
+            maxTicks = max(maxTicks, slab->maxTicks[op].load(memory_order_relaxed));
+        }
+        uint64_t samples = 0;
+        for (uint64_t count : merged) {
+            samples += count;
+        }
+        for (uint64_t count : summary.outcomes) {
+            summary.count += count;
+        }
+        double* targets[] = {&summary.p50, &summary.p99, &summary.p999};
+        const double fractions[] = {0.50, 0.99, 0.999};
+        uint64_t seen = 0;
+        size_t next = 0;
+        for (size_t bucket = 0; bucket < BUCKETS && next < 3; bucket++) {
+            seen += merged[bucket];
+            while (next < 3 && samples > 0 &&
+                   seen >= static_cast<uint64_t>(ceil(fractions[next] * samples))) {
+                *targets[next++] = bucketValue(bucket) * scale;
+            }
+        }
+        summary.max = static_cast<double>(maxTicks) * scale;
+        for (double* target : targets) {
+            *target = min(*target, summary.max);
         }
+        return summary;
     }
 
-    void checkBalance(const string& customerId) {
-        try {
-            Customer* customer = db.findCustomer(customerId);
-            if (!customer) {
-                throw ValidationException("Customer not found");
-            }
+public:
+    static const char* operationName(size_t op) {
+        static const char* names[METRIC_COUNT] = {
+            "find_customer", "validate_credentials", "add_customer", "import_customers",
+            "change_password", "commit", "checkpoint", "check_balance", "withdraw",
+            "transfer", "transfer_leg", "apply_batch"};
+        return names[op];
+    }
 
-            cout << "\nAccount Balances for " << customer->name << ":" << endl;
-            cout << "Savings Account: Rs. " << fixed << setprecision(2) 
-                 << customer->savingsBalance << endl;
-            cout << "Current Account: Rs. " << customer->currentBalance << endl;
-        } catch (const ValidationException& e) {
-            throw;
-        } catch (...) {
-            throw runtime_error("Error checking balance");
-        }
+    static const char* statusName(size_t status) {
+        static const char* names[STATUS_COUNT] = {
+            "ok", "ok_with_penalty", "invalid_amount", "invalid_account_type",
+            "customer_not_found", "invalid_credentials", "insufficient_funds", "account_busy",
+            "session_expired", "velocity_limit", "account_locked"};
+        return names[status];
     }
 
-    void withdraw(const string& customerId, char accountType, double amount) {
-        try {
-            if (amount <= 0) {
-                throw ValidationException("Invalid withdrawal amount");
-            }
+    static Metrics instance;
 
-            Customer* customer = db.findCustomer(customerId);
-            if (!customer) {
-                throw ValidationException("Customer not found");
-            }
+    static Metrics& global() {
+        return instance;
+    }
+
+    static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+    }
+
+    bool isEnabled() const {
+        return enabled.load(memory_order_relaxed);
+    }
+
+    void setEnabled(bool on) {
+        enabled.store(on, memory_order_relaxed);
+    }
 
-            double& balance = (accountType == 'S') ? 
-                            customer->savingsBalance : customer->currentBalance;
-            double minBalance = (accountType == 'S') ? 
-                              MIN_SAVINGS_BALANCE : MIN_CURRENT_BALANCE;
-            double penalty = (accountType == 'S') ? 
-                           SAVINGS_PENALTY : CURRENT_PENALTY;
+    // Times one operation in every period per thread; 1 times them all
+    void setSamplePeriod(uint32_t period) {
+        samplePeriod.store(max<uint32_t>(period, 1), memory_order_relaxed);
+    }
 
-            if (balance - amount < minBalance) {
-                if (balance - amount - penalty < 0) {
-                    throw InsufficientFundsException("Insufficient funds for withdrawal");
+    // One line per operation that has run: count, latency percentiles in
+    // nanoseconds and the non-zero outcome counts
+    void dumpText(ostream& out) {
+        double scale = nanosPerTick();
+        out << left << setw(22) << "operation" << right << setw(10) << "count"
+            << setw(12) << "p50 (ns)" << setw(12) << "p99 (ns)" << setw(12) << "p999 (ns)"
+            << setw(12) << "max (ns)" << "  outcomes\n";
+        out << fixed << setprecision(0);
+        for (size_t op = 0; op < METRIC_COUNT; op++) {
+            Summary summary = summarize(op, scale);
+            if (summary.count == 0) {
+                continue;
+            }
+            out << left << setw(22) << operationName(op) << right << setw(10) << summary.count
+                << setw(12) << summary.p50 << setw(12) << summary.p99
+                << setw(12) << summary.p999 << setw(12) << summary.max << " ";
+            for (size_t status = 0; status < STATUS_COUNT; status++) {
+                if (summary.outcomes[status] > 0) {
+                    out << " " << statusName(status) << "=" << summary.outcomes[status];
                 }
-                balance -= (amount + penalty);
-                cout << "Service charge of Rs. " << penalty << " applied" << endl;
-            } else {
-                balance -= amount;
             }
-            
-            cout << "Withdrawal successful" << endl;
-            checkBalance(customerId);
-        } catch (const ValidationException& e) {
-            throw;
-        } catch (const InsufficientFundsException& e) {
-            throw;
-        } catch (...) {
-            throw runtime_error("Error processing withdrawal");
+            out << "\n";
         }
     }
 
-    void transfer(const string& fromId, const string& toId, 
-                 char fromAccountType, char toAccountType, double amount) {
-        try {
-            if (amount <= 0) {
-                throw ValidationException("Invalid transfer amount");
+    void dumpJson(ostream& out) {
+        double scale = nanosPerTick();
+        out << fixed << setprecision(0) << "{\"operations\":{";
+        bool first = true;
+        for (size_t op = 0; op < METRIC_COUNT; op++) {
+            Summary summary = summarize(op, scale);
+            if (summary.count == 0) {
+                continue;
+            }
+            out << (first ? "" : ",") << "\"" << operationName(op) << "\":{"
+                << "\"count\":" << summary.count << ",\"p50_ns\":" << summary.p50
+                << ",\"p99_ns\":" << summary.p99 << ",\"p999_ns\":" << summary.p999
+                << ",\"max_ns\":" << summary.max << ",\"outcomes\":{";
+            bool firstOutcome = true;
+            for (size_t status = 0; status < STATUS_COUNT; status++) {
+                if (summary.outcomes[status] > 0) {
+                    out << (firstOutcome ? "" : ",") << "\"" << statusName(status) << "\":"
+                        << summary.outcomes[status];
+                    firstOutcome = false;
+                }
             }
+            out << "}}";
+            first = false;
+        }
+        out << "}}\n";
+    }
+};
 
-            Customer* fromCustomer = db.findCustomer(fromId);
-            Customer* toCustomer = db.findCustomer(toId);
+Metrics Metrics::instance;
+thread_local Metrics::Local Metrics::local = {nullptr, 1};
 
-            if (!fromCustomer || !toCustomer) {
-                throw ValidationException("Invalid customer ID(s)");
+// Counts one operation in Metrics::global(), timing it when sampled, from
+// construction until finish() or, failing that, destruction
+class OperationTimer {
+private:
+    MetricOperation op;
+    Metrics::Slab* slab;    // null once recorded, or when metrics are off
+    uint64_t started;
+
+public:
+    // Only the enabled check and the countdown are inline; everything
+    // else stays out of the caller's hot path
+    explicit OperationTimer(MetricOperation operation) : op(operation), slab(nullptr), started(0) {
+        if (Metrics::global().isEnabled()) {
+            Metrics::Local& local = Metrics::local;
+            slab = local.slab;
+            if (--local.untilSample == 0) {
+                sample(local);
             }
+        }
+    }
 
-            double& fromBalance = (fromAccountType == 'S') ? 
-                                fromCustomer->savingsBalance : fromCustomer->currentBalance;
-            double& toBalance = (toAccountType == 'S') ? 
-                              toCustomer->savingsBalance : toCustomer->currentBalance;
-            
-            double minBalance = (fromAccountType == 'S') ? 
-                              MIN_SAVINGS_BALANCE : MIN_CURRENT_BALANCE;
-            double penalty = (fromAccountType == 'S') ? 
-                           SAVINGS_PENALTY : CURRENT_PENALTY;
+    ~OperationTimer() {
+        if (slab) {
+            stop(Status::OK);
+        }
+    }
 
-            if (fromBalance - amount < minBalance) {
-                if (fromBalance - amount - penalty < 0) {
-                    throw InsufficientFundsException("Insufficient funds for transfer");
-                }
-                fromBalance -= (amount + penalty);
-                cout << "Service charge of Rs. " << penalty << " applied" << endl;
-            } else {
-                fromBalance -= amount;
-            }
+    OperationTimer(const OperationTimer&) = delete;
+    OperationTimer& operator=(const OperationTimer&) = delete;
 
-            toBalance += amount;
-            cout << "Transfer successful" << endl;
-            checkBalance(fromId);
-        } catch (const ValidationException& e) {
-            throw;
-        } catch (const InsufficientFundsException& e) {
-            throw;
-        } catch (...) {
-            throw runtime_error("Error processing transfer");
+    Status finish(Status status) {
+        if (slab) {
+            stop(status);
         }
+        return status;
     }
-};
 
-// Main application class
-class BankApplication {
 private:
-    CustomerDatabase db;
-    DefaultCredentials defaultCreds;
-    ATM atm;
-    string currentUserId;
+    __attribute__((noinline)) void sample(Metrics::Local& local) {
+        Metrics& metrics = Metrics::global();
+        if (!local.slab) {
+            metrics.claimLocal();
+            slab = local.slab;
+        }
+        local.untilSample = metrics.samplePeriod.load(memory_order_relaxed);
+        started = Metrics::ticks();
+    }
 
-    bool isEmptyOrWhitespace(const string& str) {
-        return str.empty() || str.find_first_not_of(" \t\n\r") == string::npos;
+    void stop(Status status) {
+        Metrics::record(*slab, op, started, status);
+        slab = nullptr;
     }
+};
 
-    string getValidInput(const string& prompt, bool allowSpaces = true) {
-        string input;
-        bool valid = false;
-        
-        do {
-            try {
-                cout << prompt;
-                if (allowSpaces) {
-                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                    getline(cin, input);
-                } else {
-                    cin >> input;
-                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                }
+// Customer profile as passed in and out of CustomerDatabase, which stores
+// it packed as a CustomerProfile. Balances are kept separately in
+// BalanceStore so that passes over balances do not pull these strings
+// through the cache.
+struct Customer {
+    string customerId;
+    string password;        // salted hash, see PasswordHasher
+    string name;
+    string email;
+    string address;
+    string phone;
+    bool isFirstLogin;
+};
 
-                if (isEmptyOrWhitespace(input)) {
-                    throw ValidationException("Input cannot be empty or only whitespace");
-                }
-                valid = true;
-            } catch (const ValidationException& e) {
-                cout << "Error: " << e.what() << ". Please try again." << endl;
-            } catch (...) {
-                cout << "Error reading input. Please try again." << endl;
-            }
-        } while (!valid);
+// How far interest and monthly charges have been applied to an account
+// (see InterestAccrual). Days are counted from 1970-01-01.
+struct AccrualState {
+    uint32_t day;           // first day whose closing balance has not accrued
+    int64_t interest;       // savings interest not yet credited, see InterestAccrual::UNITS_PER_PAISA
+};
 
-        return input;
-    }
+// Coarse monotonic clock in nanoseconds. It moves in ticks of a few
+// milliseconds but costs a few nanoseconds to read, for limits and
+// timeouts checked on every operation.
+inline int64_t monotonicNanoseconds() {
+    timespec time;
+    ::clock_gettime(CLOCK_MONOTONIC_COARSE, &time);
+    return int64_t(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+// How much an account, or a terminal, has been debited lately (see
+// VelocityLimiter). Times are monotonicNanoseconds; zero is a full bucket.
+struct VelocityState {
+    int64_t amountFull;     // when the amount bucket is full again
+    int64_t countFull;      // when the count bucket is full again
+};
 
+// Balance columns, one per account product (see the policies below)
+enum AccountColumn : uint8_t {
+    COLUMN_SAVINGS,
+    COLUMN_CURRENT,
+    COLUMN_SALARY,
+    ACCOUNT_COLUMNS
+};
+
+// Columnar balance storage indexed by customer handle. Each column is a
+// list of fixed-size contiguous chunks, so growing the store never moves
+// existing balances and references handed out stay valid. The chunk
+// directories are reserved up front so appends never reallocate them
+// underneath concurrent readers.
+class BalanceStore {
 public:
-    BankApplication() : atm(db), currentUserId("") {}
+    static const size_t CHUNK_SHIFT = 16;
+    static const size_t CHUNK_SIZE = size_t(1) << CHUNK_SHIFT;
+    static const size_t MAX_CHUNKS = (size_t(1) << 32) >> CHUNK_SHIFT;
 
-    void run() {
-        while (true) {
-            try {
-                cout << "\n=== Bank ATM System ===" << endl;
-                cout << "1. Login" << endl;
-                cout << "2. Sign Up" << endl;
-                cout << "3. Exit" << endl;
-                cout << "Choose an option: ";
+private:
+    vector<unique_ptr<Paise[]>> balanceChunks[ACCOUNT_COLUMNS];
+    vector<unique_ptr<AccrualState[]>> accrualChunks;
+    vector<unique_ptr<VelocityState[]>> velocityChunks;
+    size_t count;
 
-                string choice = getValidInput("", false);
-                
-                switch (stoi(choice)) {
-                    case 1:
-                        login();
-                        break;
-                    case 2:
-                        signUp();
-                        break;
-                    case 3:
-                        cout << "Thank you for using our services!" << endl;
-                        return;
-                    default:
-                        throw ValidationException("Invalid option");
-                }
-            } catch (const ValidationException& e) {
-                cout << "Error: " << e.what() << endl;
-            } catch (const exception& e) {
-                cout << "An error occurred: " << e.what() << endl;
-            } catch (...) {
-                cout << "An unexpected error occurred" << endl;
-            }
+public:
+    BalanceStore() : count(0) {
+        for (vector<unique_ptr<Paise[]>>& column : balanceChunks) {
+            column.reserve(MAX_CHUNKS);
         }
+        accrualChunks.reserve(MAX_CHUNKS);
+        velocityChunks.reserve(MAX_CHUNKS);
     }
 
-private:
-    void login() {
-        try {
-            cout << "\n=== Login ===" << endl;
-            string customerId = getValidInput("Enter Customer ID: ", false);
-            string password = getValidInput("Enter Password: ", false);
+    size_t size() const {
+        return count;
+    }
 
-            if (db.validateCredentials(customerId, password)) {
-                currentUserId = customerId;
-                atm.addToQueue(currentUserId);
-                cout << "Login successful!" << endl;
-                
-                Customer* customer = db.findCustomer(customerId);
-                if (customer && customer->isFirstLogin) {
-                    cout << "\nThis is your first login. You must change your password." << endl;
-                    changePassword(true);
-                }
-                
-                showMainMenu();
-            } else {
-                throw ValidationException("Invalid credentials");
+    uint32_t append(Paise savings, Paise current, Paise salary, AccrualState accrualState) {
+        if ((count >> CHUNK_SHIFT) == accrualChunks.size()) {
+            for (vector<unique_ptr<Paise[]>>& column : balanceChunks) {
+                column.emplace_back(new Paise[CHUNK_SIZE]);
             }
-        } catch (const ValidationException& e) {
-            cout << "Login failed: " << e.what() << endl;
-        } catch (...) {
-            cout << "An error occurred during login" << endl;
+            accrualChunks.emplace_back(new AccrualState[CHUNK_SIZE]);
+            velocityChunks.emplace_back(new VelocityState[CHUNK_SIZE]);
         }
+        size_t chunk = count >> CHUNK_SHIFT;
+        size_t offset = count & (CHUNK_SIZE - 1);
+        balanceChunks[COLUMN_SAVINGS][chunk][offset] = savings;
+        balanceChunks[COLUMN_CURRENT][chunk][offset] = current;
+        balanceChunks[COLUMN_SALARY][chunk][offset] = salary;
+        accrualChunks[chunk][offset] = accrualState;
+        velocityChunks[chunk][offset] = VelocityState{0, 0};
+        return static_cast<uint32_t>(count++);
     }
 
-    void signUp() {
-        try {
-            Customer newCustomer;
-            cout << "\n=== New Customer Registration ===" << endl;
-            
-            newCustomer.name = getValidInput("Enter Name: ");
-            if (newCustomer.name.length() < 2) {
-                throw ValidationException("Name must be at least 2 characters long");
-            }
+    Paise& balance(uint32_t handle, size_t column) {
+        return balanceChunks[column][handle >> CHUNK_SHIFT][handle & (CHUNK_SIZE - 1)];
+    }
 
-            newCustomer.email = getValidInput("Enter Email: ");
-            if (newCustomer.email.find('@') == string::npos || 
-                newCustomer.email.find('.') == string::npos) {
-                throw ValidationException("Invalid email format");
-            }
+    Paise& savings(uint32_t handle) {
+        return balance(handle, COLUMN_SAVINGS);
+    }
 
-            newCustomer.address = getValidInput("Enter Address: ");
-            if (newCustomer.address.length() < 5) {
-                throw ValidationException("Address must be at least 5 characters long");
-            }
+    Paise& current(uint32_t handle) {
+        return balance(handle, COLUMN_CURRENT);
+    }
 
-            newCustomer.phone = getValidInput("Enter Phone: ", false);
-            if (newCustomer.phone.length() != 10 || 
-                !all_of(newCustomer.phone.begin(), newCustomer.phone.end(), ::isdigit)) {
-                throw ValidationException("Phone number must be exactly 10 digits");
+    Paise& salary(uint32_t handle) {
+        return balance(handle, COLUMN_SALARY);
+    }
+
+    AccrualState& accrual(uint32_t handle) {
+        return accrualChunks[handle >> CHUNK_SHIFT][handle & (CHUNK_SIZE - 1)];
+    }
+
+    // Not logged or snapshotted; a restart starts every account afresh
+    VelocityState& velocity(uint32_t handle) {
+        return velocityChunks[handle >> CHUNK_SHIFT][handle & (CHUNK_SIZE - 1)];
+    }
+
+    // Sum of every column over every account, walked chunk by chunk.
+    // Not synchronized with concurrent balance updates, and credits still
+    // in HotCredits slots are not included.
+    Paise total() const {
+        Paise sum = 0;
+        for (size_t chunk = 0; chunk < accrualChunks.size(); chunk++) {
+            size_t n = min(CHUNK_SIZE, count - (chunk << CHUNK_SHIFT));
+            for (const vector<unique_ptr<Paise[]>>& column : balanceChunks) {
+                const Paise* balances = column[chunk].get();
+                for (size_t i = 0; i < n; i++) {
+                    sum += balances[i];
+                }
             }
+        }
+        return sum;
+    }
+};
 
-            newCustomer.savingsBalance = 10000;
-            newCustomer.currentBalance = 25000;
-            newCustomer.isFirstLogin = true;
+// Banking rules of each account product as compile-time constants, which
+// InterestAccrual and the reconcile scan fold in directly. ATM reads the
+// debit rules from ACCOUNT_RULES instead (see AccountRules). A debit that
+// leaves less than MIN_BALANCE is charged PENALTY on top; one that would
+// take the balance below -OVERDRAFT is declined. INTEREST_BP and
+// MONTHLY_CHARGE are applied by InterestAccrual.
+struct SavingsPolicy {
+    static const char CODE = 'S';
+    static const AccountColumn COLUMN = COLUMN_SAVINGS;
+    static const Paise MIN_BALANCE = 100000;
+    static const Paise PENALTY = 5000;
+    static const Paise OVERDRAFT = 0;
+    static const int64_t INTEREST_BP = 350;       // a year, on each day's closing balance
+    static const Paise MONTHLY_CHARGE = 10000;    // while below MIN_BALANCE at month end
+};
 
-            pair<string, string> defaultCred = defaultCreds.getNextCredential();
-            newCustomer.customerId = defaultCred.first;
-            newCustomer.password = defaultCred.second;
+struct CurrentPolicy {
+    static const char CODE = 'C';
+    static const AccountColumn COLUMN = COLUMN_CURRENT;
+    static const Paise MIN_BALANCE = 500000;
+    static const Paise PENALTY = 25000;
+    static const Paise OVERDRAFT = 0;
+    static const int64_t INTEREST_BP = 0;
+    static const Paise MONTHLY_CHARGE = 50000;
+};
 
-            db.addCustomer(newCustomer);
+// Opens at zero with the customer and may be overdrawn
+struct SalaryPolicy {
+    static const char CODE = 'L';
+    static const AccountColumn COLUMN = COLUMN_SALARY;
+    static const Paise MIN_BALANCE = 0;
+    static const Paise PENALTY = 0;
+    static const Paise OVERDRAFT = 1000000;    // Rs. 10,000
+    static const int64_t INTEREST_BP = 0;
+    static const Paise MONTHLY_CHARGE = 0;
+};
 
-            cout << "\nRegistration successful!" << endl;
-            cout << "Your assigned credentials:" << endl;
-            cout << "Customer ID: " << newCustomer.customerId << endl;
-            cout << "Default Password: " << newCustomer.password << endl;
-            cout << "\nYou will be required to change your password upon first login." << endl;
+// A policy's debit rules as data, one row per balance column. An
+// operation looks its account type up here and reads the rules from the
+// row, so nothing branches on the type: a switch to code specialized per
+// policy mispredicted on settlement streams that mix the types at random.
+// Reading the rules costs a dependent load instead (see --policybench).
+struct AccountRules {
+    char code;
+    AccountColumn column;
+    Paise minBalance;
+    Paise penalty;
+    Paise overdraft;
 
-        } catch (const ValidationException& e) {
-            cout << "Registration failed: " << e.what() << endl;
-        } catch (const DatabaseException& e) {
-            cout << "Database error: " << e.what() << endl;
-        } catch (...) {
-            cout << "An unexpected error occurred during registration" << endl;
-        }
+    template <typename Policy>
+    static AccountRules of() {
+        return {Policy::CODE, Policy::COLUMN, Policy::MIN_BALANCE, Policy::PENALTY, Policy::OVERDRAFT};
+    }
+
+    // The rules for an account type code, or null if no product has it
+    static const AccountRules* find(char code);
+
+    // Applies the minimum-balance and overdraft rules to a debit. The
+    // caller must hold the account lock.
+    Status debit(Paise& balance, Paise amount) const {
+        Paise after = balance - amount;
+        Paise charge = after < minBalance ? penalty : 0;
+        if (after - charge < -overdraft) {
+            return Status::INSUFFICIENT_FUNDS;
+        }
+        balance = after - charge;
+        return charge != 0 ? Status::OK_WITH_PENALTY : Status::OK;
+    }
+};
+
+static const array<AccountRules, ACCOUNT_COLUMNS> ACCOUNT_RULES = [] {
+    array<AccountRules, ACCOUNT_COLUMNS> rules{};
+    rules[SavingsPolicy::COLUMN] = AccountRules::of<SavingsPolicy>();
+    rules[CurrentPolicy::COLUMN] = AccountRules::of<CurrentPolicy>();
+    rules[SalaryPolicy::COLUMN] = AccountRules::of<SalaryPolicy>();
+    return rules;
+}();
+
+// Row of ACCOUNT_RULES for each possible code byte, -1 for none
+static const array<int8_t, 256> ACCOUNT_RULE_ROWS = [] {
+    array<int8_t, 256> rows;
+    rows.fill(-1);
+    for (size_t row = 0; row < ACCOUNT_COLUMNS; row++) {
+        rows[static_cast<uint8_t>(ACCOUNT_RULES[row].code)] = static_cast<int8_t>(row);
+    }
+    return rows;
+}();
+
+inline const AccountRules* AccountRules::find(char code) {
+    int8_t row = ACCOUNT_RULE_ROWS[static_cast<uint8_t>(code)];
+    return row < 0 ? nullptr : &ACCOUNT_RULES[row];
+}
+
+// Caps on what may be debited from one account, or through one terminal:
+// a token bucket each for the amount and the number of debits, holding
+// maxAmount and maxCount and refilling in full over window. A cap of 0 is
+// not enforced.
+struct VelocityLimits {
+    Paise maxAmount;
+    uint32_t maxCount;
+    chrono::seconds window;
+
+    static VelocityLimits none() {
+        return VelocityLimits{0, 0, chrono::hours(24)};
+    }
+
+    // What the bank's own terminals apply to each customer, and to
+    // themselves (see BankApplication and SessionServer)
+    static VelocityLimits perCustomer() {
+        return VelocityLimits{toPaise(100000), 20, chrono::hours(24)};
+    }
+
+    static VelocityLimits perTerminal() {
+        return VelocityLimits{toPaise(500000), 200, chrono::hours(1)};
+    }
+};
+
+// Applies VelocityLimits to VelocityStates. A bucket is kept as the time
+// it will be full again: a debit pushes that later by its share of the
+// window and is allowed while it stays within one window of now, so a
+// check is a clock read and a few compares with no per-debit history.
+// Callers serialize use of a state; an account's is guarded by its lock.
+class VelocityLimiter {
+private:
+    VelocityLimits caps;
+    int64_t window;                 // nanoseconds
+    double nanosecondsPerPaisa;
+    int64_t nanosecondsPerDebit;
+
+    int64_t amountCost(Paise amount) const {
+        return static_cast<int64_t>(amount * nanosecondsPerPaisa);
+    }
+
+public:
+    explicit VelocityLimiter(const VelocityLimits& limits = VelocityLimits::none()) {
+        setLimits(limits);
+    }
+
+    // Not synchronized with checks; set before debits start
+    void setLimits(const VelocityLimits& limits) {
+        if (limits.maxAmount < 0 || limits.window.count() <= 0) {
+            throw invalid_argument("Invalid velocity limits");
+        }
+        caps = limits;
+        window = chrono::duration_cast<chrono::nanoseconds>(limits.window).count();
+        nanosecondsPerPaisa = limits.maxAmount != 0 ? double(window) / limits.maxAmount : 0;
+        nanosecondsPerDebit = limits.maxCount != 0 ? window / limits.maxCount : 0;
+    }
+
+    bool enforced() const {
+        return caps.maxAmount != 0 || caps.maxCount != 0;
+    }
+
+    // Whether state has room at time for a debit of amount
+    bool allows(const VelocityState& state, Paise amount, int64_t time) const {
+        if (caps.maxAmount != 0 &&
+            (amount > caps.maxAmount || max(state.amountFull, time) + amountCost(amount) - time > window)) {
+            return false;
+        }
+        return caps.maxCount == 0 || max(state.countFull, time) + nanosecondsPerDebit - time <= window;
+    }
+
+    // Counts a debit allows let through
+    void charge(VelocityState& state, Paise amount, int64_t time) const {
+        if (caps.maxAmount != 0) {
+            state.amountFull = max(state.amountFull, time) + amountCost(amount);
+        }
+        if (caps.maxCount != 0) {
+            state.countFull = max(state.countFull, time) + nanosecondsPerDebit;
+        }
+    }
+};
+
+// Interest and monthly charges, applied lazily. Every change to an
+// account's balances first brings its accrual up to date, so all the days
+// it has not accrued yet closed on the balances it holds now. That makes
+// catching up one step per calendar month instead of one per day, and
+// gives the same result whenever it runs: on the account's next touch, in
+// a background sweep (see AccrualSweeper) or after recovery.
+//
+// Savings earn SavingsPolicy::INTEREST_BP a year on each day's closing
+// balance. The interest is kept in fractions of a paisa and credited on
+// the last day of the month, after which each balance still below its
+// policy's MIN_BALANCE pays MONTHLY_CHARGE, as far as it covers it.
+class InterestAccrual {
+public:
+    static const int64_t UNITS_PER_PAISA = 10000 * 365;
+
+    static_assert(CurrentPolicy::INTEREST_BP == 0 && SalaryPolicy::INTEREST_BP == 0,
+                  "Only savings have an interest accumulator");
+    static_assert(SalaryPolicy::MONTHLY_CHARGE == 0, "Salary accounts are not charged");
+
+private:
+    // Howard Hinnant's conversions between day numbers and civil dates
+    static int64_t daysFromCivil(int64_t year, unsigned month, unsigned day) {
+        year -= month <= 2;
+        int64_t era = (year >= 0 ? year : year - 399) / 400;
+        unsigned yearOfEra = static_cast<unsigned>(year - era * 400);
+        unsigned dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+        unsigned dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+        return era * 146097 + static_cast<int64_t>(dayOfEra) - 719468;
+    }
+
+    static void civilFromDays(int64_t days, int64_t& year, unsigned& month) {
+        days += 719468;
+        int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+        unsigned dayOfEra = static_cast<unsigned>(days - era * 146097);
+        unsigned yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+        unsigned dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+        unsigned monthIndex = (5 * dayOfYear + 2) / 153;
+        month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+        year = static_cast<int64_t>(yearOfEra) + era * 400 + (month <= 2);
+    }
+
+    template <typename Policy>
+    static Paise monthlyCharge(Paise balance) {
+        Paise charge = Policy::MONTHLY_CHARGE;
+        return balance < Policy::MIN_BALANCE ? min(charge, max<Paise>(balance, 0)) : 0;
+    }
+
+    static void accrueSlow(Paise& savings, Paise& current, AccrualState& state, uint32_t today,
+                           Paise* charged) {
+        while (state.day < today) {
+            uint32_t monthEnd = nextMonth(state.day);
+            uint32_t until = min(today, monthEnd);
+            state.interest += max<Paise>(savings, 0) * SavingsPolicy::INTEREST_BP * (until - state.day);
+            state.day = until;
+            if (until == monthEnd) {
+                savings += state.interest / UNITS_PER_PAISA;
+                state.interest %= UNITS_PER_PAISA;
+                Paise savingsCharge = monthlyCharge<SavingsPolicy>(savings);
+                Paise currentCharge = monthlyCharge<CurrentPolicy>(current);
+                savings -= savingsCharge;
+                current -= currentCharge;
+                if (charged) {
+                    *charged += savingsCharge + currentCharge;
+                }
+            }
+        }
+    }
+
+public:
+    // Today's day number by the system clock
+    static uint32_t today() {
+        return static_cast<uint32_t>(chrono::duration_cast<chrono::seconds>(
+            chrono::system_clock::now().time_since_epoch()).count() / 86400);
+    }
+
+    // First day of the month after the one day falls in
+    static uint32_t nextMonth(uint32_t day) {
+        int64_t year;
+        unsigned month;
+        civilFromDays(day, year, month);
+        return static_cast<uint32_t>(month == 12 ? daysFromCivil(year + 1, 1, 1)
+                                                 : daysFromCivil(year, month + 1, 1));
+    }
+
+    // Accrues every day before today, adding the monthly charges taken to
+    // charged if given. The caller must hold the account lock. Returns
+    // whether there was anything to do.
+    static bool accrue(Paise& savings, Paise& current, AccrualState& state, uint32_t today,
+                       Paise* charged = nullptr) {
+        if (state.day >= today) {
+            return false;
+        }
+        accrueSlow(savings, current, state, today, charged);
+        return true;
+    }
+};
+
+// Customer ID held inline in a fixed-width, zero-padded key
+struct CustomerKey {
+    static const size_t MAX_LENGTH = 23;
+
+    char bytes[MAX_LENGTH + 1];
+
+    static bool fits(string_view customerId) {
+        return customerId.size() <= MAX_LENGTH;
+    }
+
+    void assign(string_view customerId) {
+        memset(bytes, 0, sizeof(bytes));
+        memcpy(bytes, customerId.data(), fits(customerId) ? customerId.size() : MAX_LENGTH);
+    }
+
+    const char* c_str() const {
+        return bytes;
+    }
+
+    string_view view() const {
+        return string_view(bytes, strlen(bytes));
+    }
+};
+
+// Stored form of a Customer. Apart from the ID, every field points into
+// the owning ProfileStore's string pool.
+struct CustomerProfile {
+    CustomerKey customerId;
+    string_view password;   // salted hash, see PasswordHasher
+    string_view name;
+    string_view email;
+    string_view address;
+    string_view phone;
+    bool isFirstLogin;
+    // Failed logins since the last that succeeded or locked the account,
+    // and the monotonic second it stays locked until; neither is logged
+    uint8_t failedLogins;
+    uint32_t lockedUntil;
+
+    Customer toCustomer() const {
+        return Customer{string(customerId.view()), string(password), string(name),
+                        string(email), string(address), string(phone), isFirstLogin};
+    }
+};
+
+// Append-only arena for profile strings. Space is bumped out of large
+// chunks that are never moved or freed while the pool lives, so views into
+// it stay valid. Bytes of a replaced value, such as an old password hash,
+// are not reused; they go away when the table is rebuilt from a snapshot.
+class StringPool {
+private:
+    static const size_t CHUNK_SIZE = size_t(1) << 20;
+
+    vector<unique_ptr<char[]>> chunks;
+    char* cursor;
+    size_t remaining;
+    size_t reserved;
+    mutex lock;
+
+public:
+    StringPool() : cursor(nullptr), remaining(0), reserved(0) {}
+
+    // Returns space for length bytes; safe to call from several threads
+    char* allocate(size_t length) {
+        lock_guard<mutex> guard(lock);
+        if (length > remaining) {
+            size_t size = length > CHUNK_SIZE ? length : CHUNK_SIZE;
+            chunks.emplace_back(new char[size]);
+            cursor = chunks.back().get();
+            remaining = size;
+            reserved += size;
+        }
+        char* space = cursor;
+        cursor += length;
+        remaining -= length;
+        return space;
+    }
+
+    string_view store(string_view value) {
+        if (value.empty()) {
+            return string_view();
+        }
+        char* space = allocate(value.size());
+        memcpy(space, value.data(), value.size());
+        return string_view(space, value.size());
+    }
+
+    size_t bytesReserved() {
+        lock_guard<mutex> guard(lock);
+        return reserved;
+    }
+
+    // Chunks allocated so far
+    size_t allocations() {
+        lock_guard<mutex> guard(lock);
+        return chunks.size();
+    }
+};
+
+// Customer profiles indexed by handle. Like BalanceStore, records sit in
+// fixed-size chunks whose directory is reserved up front, so appending
+// never moves a record; a record's strings are packed together into the
+// string pool with one allocation.
+class ProfileStore {
+public:
+    static const size_t CHUNK_SHIFT = 14;
+    static const size_t CHUNK_SIZE = size_t(1) << CHUNK_SHIFT;
+    static const size_t MAX_CHUNKS = (size_t(1) << 32) >> CHUNK_SHIFT;
+
+private:
+    vector<unique_ptr<CustomerProfile[]>> chunks;
+    size_t count;
+    StringPool pool;
+
+public:
+    ProfileStore() : count(0) {
+        chunks.reserve(MAX_CHUNKS);
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    CustomerProfile& operator[](uint32_t handle) {
+        return chunks[handle >> CHUNK_SHIFT][handle & (CHUNK_SIZE - 1)];
+    }
+
+    const CustomerProfile& operator[](uint32_t handle) const {
+        return chunks[handle >> CHUNK_SHIFT][handle & (CHUNK_SIZE - 1)];
+    }
+
+    string_view store(string_view value) {
+        return pool.store(value);
+    }
+
+    // Overwrites a record with customer, whose ID must satisfy
+    // CustomerKey::fits
+    void assign(uint32_t handle, const Customer& customer) {
+        CustomerProfile& profile = (*this)[handle];
+        const string* values[] = {&customer.password, &customer.name, &customer.email,
+                                  &customer.address, &customer.phone};
+        string_view* fields[] = {&profile.password, &profile.name, &profile.email,
+                                 &profile.address, &profile.phone};
+        size_t length = 0;
+        for (const string* value : values) {
+            length += value->size();
+        }
+        char* space = length > 0 ? pool.allocate(length) : nullptr;
+        for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+            *fields[i] = string_view();
+            if (!values[i]->empty()) {
+                memcpy(space, values[i]->data(), values[i]->size());
+                *fields[i] = string_view(space, values[i]->size());
+                space += values[i]->size();
+            }
+        }
+        profile.customerId.assign(customer.customerId);
+        profile.isFirstLogin = customer.isFirstLogin;
+        profile.failedLogins = 0;
+        profile.lockedUntil = 0;
+    }
+
+    uint32_t append(const Customer& customer) {
+        if ((count >> CHUNK_SHIFT) == chunks.size()) {
+            chunks.emplace_back(new CustomerProfile[CHUNK_SIZE]);
+        }
+        uint32_t handle = static_cast<uint32_t>(count);
+        assign(handle, customer);
+        count++;
+        return handle;
+    }
+
+    // Heap held by records and strings, including unused chunk space
+    size_t bytesReserved() {
+        return chunks.size() * CHUNK_SIZE * sizeof(CustomerProfile) + pool.bytesReserved();
+    }
+
+    // Heap allocations behind bytesReserved, plus the chunk directory
+    size_t allocations() {
+        return 1 + chunks.size() + pool.allocations();
+    }
+};
+
+// Customer IDs are CUSTOMER_ID_PREFIX followed by a number of at least
+// three digits, e.g. CUST001
+static const char CUSTOMER_ID_PREFIX[] = "CUST";
+
+// Returns the number in a customer ID, or 0 if it is not in that form
+inline uint64_t customerNumber(const string& customerId) {
+    const size_t prefixLength = sizeof(CUSTOMER_ID_PREFIX) - 1;
+    if (customerId.size() <= prefixLength || customerId.size() > prefixLength + 18 ||
+        customerId.compare(0, prefixLength, CUSTOMER_ID_PREFIX) != 0) {
+        return 0;
+    }
+    uint64_t number = 0;
+    for (size_t i = prefixLength; i < customerId.size(); i++) {
+        if (!isdigit(static_cast<unsigned char>(customerId[i]))) {
+            return 0;
+        }
+        number = number * 10 + static_cast<uint64_t>(customerId[i] - '0');
+    }
+    return number;
+}
+
+// Hands out new customer IDs and random one-time passwords. Each thread
+// claims a block of IDs with a single atomic add and then allocates from it
+// privately, so concurrent sign-ups never contend on a shared structure.
+// IDs left in a thread's block when it exits are simply never issued.
+class CredentialAllocator {
+private:
+    static const uint64_t BLOCK_SIZE = 64;
+    static const size_t PASSWORD_LENGTH = 10;
+
+    struct LocalBlock {
+        uint64_t owner;
+        uint64_t epoch;
+        uint64_t next;
+        uint64_t end;
+    };
+
+    static atomic<uint64_t> instances;
+    const uint64_t instanceId;
+    atomic<uint64_t> nextBlock;
+    atomic<uint64_t> epoch;     // bumped by reserveThrough to retire held blocks
+
+    static LocalBlock& localBlock() {
+        thread_local LocalBlock block = {0, 0, 0, 0};
+        return block;
+    }
+
+public:
+    explicit CredentialAllocator(uint64_t firstNumber = 1)
+        : instanceId(++instances), nextBlock(firstNumber), epoch(0) {}
+
+    // Makes sure every ID handed out from now on is above number, e.g. the
+    // highest one recovered from disk. Blocks threads already hold are
+    // dropped too.
+    void reserveThrough(uint64_t number) {
+        uint64_t current = nextBlock.load();
+        while (current <= number && !nextBlock.compare_exchange_weak(current, number + 1)) {
+        }
+        epoch++;
+    }
+
+    static string formatId(uint64_t number) {
+        char id[32];
+        snprintf(id, sizeof(id), "%s%03" PRIu64, CUSTOMER_ID_PREFIX, number);
+        return id;
+    }
+
+    static string generatePassword() {
+        static const char alphabet[] = "ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnpqrstuvwxyz23456789";
+        thread_local mt19937_64 random(random_device{}());
+        uniform_int_distribution<size_t> pick(0, sizeof(alphabet) - 2);
+        string password;
+        for (size_t i = 0; i < PASSWORD_LENGTH; i++) {
+            password.push_back(alphabet[pick(random)]);
+        }
+        return password;
+    }
+
+    pair<string, string> getNextCredential() {
+        LocalBlock& block = localBlock();
+        uint64_t currentEpoch = epoch.load(memory_order_acquire);
+        if (block.owner != instanceId || block.epoch != currentEpoch || block.next == block.end) {
+            uint64_t start = nextBlock.fetch_add(BLOCK_SIZE);
+            block = LocalBlock{instanceId, currentEpoch, start, start + BLOCK_SIZE};
+        }
+        return {formatId(block.next++), generatePassword()};
+    }
+};
+
+atomic<uint64_t> CredentialAllocator::instances(0);
+
+// Open-addressing hash index from customer ID to a dense record handle.
+// Each slot keeps the full 64-bit hash so probes only fall back to a string
+// compare when the hashes match.
+class CustomerIndex {
+private:
+    struct Slot {
+        uint64_t hash;
+        uint32_t handle;    // record handle + 1, 0 marks an empty slot
+    };
+
+    vector<Slot> slots;
+    size_t used;
+
+    void grow() {
+        vector<Slot> old;
+        old.swap(slots);
+        slots.assign(old.empty() ? 64 : old.size() * 2, Slot{0, 0});
+        for (const Slot& slot : old) {
+            if (slot.handle != 0) {
+                place(slot);
+            }
+        }
+    }
+
+    void place(const Slot& slot) {
+        size_t mask = slots.size() - 1;
+        size_t pos = slot.hash & mask;
+        while (slots[pos].handle != 0) {
+            pos = (pos + 1) & mask;
+        }
+        slots[pos] = slot;
+    }
+
+public:
+    static const uint32_t NOT_FOUND = 0xFFFFFFFFu;
+
+    CustomerIndex() : used(0) {}
+
+    static uint64_t hashId(const string& customerId) {
+        // FNV-1a followed by a final avalanche so sequential IDs spread out
+        uint64_t h = 1469598103934665603ULL;
+        for (unsigned char c : customerId) {
+            h = (h ^ c) * 1099511628211ULL;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    template <typename KeyAt>
+    uint32_t find(const string& customerId, uint64_t hash, KeyAt keyAt) const {
+        if (slots.empty()) {
+            return NOT_FOUND;
+        }
+        size_t mask = slots.size() - 1;
+        size_t pos = hash & mask;
+        while (slots[pos].handle != 0) {
+            if (slots[pos].hash == hash && keyAt(slots[pos].handle - 1) == customerId) {
+                return slots[pos].handle - 1;
+            }
+            pos = (pos + 1) & mask;
+        }
+        return NOT_FOUND;
+    }
+
+    void insert(uint64_t hash, uint32_t handle) {
+        // Keep the load factor at or below 1/2 so probe chains stay short
+        if ((used + 1) * 2 > slots.size()) {
+            grow();
+        }
+        place(Slot{hash, handle + 1});
+        used++;
+    }
+
+    void reserve(size_t count) {
+        while (count * 2 > slots.size()) {
+            grow();
+        }
+    }
+};
+
+// SHA-256 as specified in FIPS 180-4
+class Sha256 {
+public:
+    typedef array<uint8_t, 32> Digest;
+
+private:
+    uint32_t state[8];
+    uint8_t block[64];
+    size_t blockLength;
+    uint64_t totalLength;
+
+    static uint32_t rotr(uint32_t x, int n) {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void compress(const uint8_t* chunk) {
+        static const uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = uint32_t(chunk[4 * i]) << 24 | uint32_t(chunk[4 * i + 1]) << 16 |
+                   uint32_t(chunk[4 * i + 2]) << 8 | uint32_t(chunk[4 * i + 3]);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+
+public:
+    Sha256() : blockLength(0), totalLength(0) {
+        static const uint32_t initial[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        memcpy(state, initial, sizeof(state));
+    }
+
+    Sha256& update(const void* data, size_t length) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        totalLength += length;
+        while (length > 0) {
+            size_t take = min(length, sizeof(block) - blockLength);
+            memcpy(block + blockLength, bytes, take);
+            blockLength += take;
+            bytes += take;
+            length -= take;
+            if (blockLength == sizeof(block)) {
+                compress(block);
+                blockLength = 0;
+            }
+        }
+        return *this;
+    }
+
+    Digest final() {
+        uint64_t bits = totalLength * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (blockLength != 56) {
+            update(&pad, 1);
+        }
+        uint8_t length[8];
+        for (int i = 0; i < 8; i++) {
+            length[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+        }
+        update(length, 8);
+        Digest digest;
+        for (int i = 0; i < 8; i++) {
+            digest[4 * i] = static_cast<uint8_t>(state[i] >> 24);
+            digest[4 * i + 1] = static_cast<uint8_t>(state[i] >> 16);
+            digest[4 * i + 2] = static_cast<uint8_t>(state[i] >> 8);
+            digest[4 * i + 3] = static_cast<uint8_t>(state[i]);
+        }
+        return digest;
+    }
+};
+
+// Salted, memory-hard password hashing. The derivation is a ROMix-style
+// construction over SHA-256 (as in scrypt, without scrypt's Salsa20 core):
+// it fills 2^cost digests sequentially, then revisits them in a
+// data-dependent order, so each guess needs 32 * 2^cost bytes of memory.
+// Hashes are stored as "$rmx$<cost>$<salt hex>$<digest hex>".
+class PasswordHasher {
+public:
+    static const int DEFAULT_COST = 14;
+    static const int MIN_COST = 4;
+    static const int MAX_COST = 24;
+
+private:
+    static const size_t SALT_BYTES = 16;
+
+    static Sha256::Digest derive(const string& password, const string& salt, int cost) {
+        size_t blocks = size_t(1) << cost;
+        vector<Sha256::Digest> memory(blocks);
+        Sha256::Digest x = Sha256().update(salt.data(), salt.size())
+                                   .update(password.data(), password.size()).final();
+        for (size_t i = 0; i < blocks; i++) {
+            memory[i] = x;
+            x = Sha256().update(x.data(), x.size()).final();
+        }
+        for (size_t i = 0; i < blocks; i++) {
+            size_t j = (size_t(x[0]) | size_t(x[1]) << 8 | size_t(x[2]) << 16 | size_t(x[3]) << 24) &
+                       (blocks - 1);
+            for (size_t k = 0; k < x.size(); k++) {
+                x[k] ^= memory[j][k];
+            }
+            x = Sha256().update(x.data(), x.size()).final();
+        }
+        return Sha256().update(x.data(), x.size()).update(salt.data(), salt.size()).final();
+    }
+
+    static string toHex(const uint8_t* bytes, size_t length) {
+        static const char digits[] = "0123456789abcdef";
+        string hex;
+        for (size_t i = 0; i < length; i++) {
+            hex.push_back(digits[bytes[i] >> 4]);
+            hex.push_back(digits[bytes[i] & 15]);
+        }
+        return hex;
+    }
+
+    static int nibble(char c) {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        }
+        return -1;
+    }
+
+    static bool fromHex(const string& hex, string& bytes) {
+        if (hex.size() % 2 != 0) {
+            return false;
+        }
+        bytes.clear();
+        for (size_t i = 0; i < hex.size(); i += 2) {
+            int high = nibble(hex[i]);
+            int low = nibble(hex[i + 1]);
+            if (high < 0 || low < 0) {
+                return false;
+            }
+            bytes.push_back(static_cast<char>(high << 4 | low));
+        }
+        return true;
+    }
+
+    static bool constantTimeEquals(const string& a, const string& b) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        unsigned char difference = 0;
+        for (size_t i = 0; i < a.size(); i++) {
+            difference |= static_cast<unsigned char>(a[i] ^ b[i]);
+        }
+        return difference == 0;
+    }
+
+public:
+    static bool isHashed(const string& stored) {
+        return stored.compare(0, 5, "$rmx$") == 0;
+    }
+
+    static string hash(const string& password, int cost = DEFAULT_COST) {
+        if (cost < MIN_COST || cost > MAX_COST) {
+            throw invalid_argument("Password hash cost out of range");
+        }
+        random_device entropy;
+        string salt(SALT_BYTES, '\0');
+        for (size_t i = 0; i < SALT_BYTES; i++) {
+            salt[i] = static_cast<char>(entropy());
+        }
+        Sha256::Digest digest = derive(password, salt, cost);
+        return "$rmx$" + to_string(cost) + "$" +
+               toHex(reinterpret_cast<const uint8_t*>(salt.data()), salt.size()) + "$" +
+               toHex(digest.data(), digest.size());
+    }
+
+    // Checks a password against a stored hash. Records written before
+    // hashing was introduced hold the plaintext and are compared directly
+    // until their first successful login rehashes them (see
+    // CustomerDatabase::upgradePasswordHash). A record with no password
+    // cannot be logged into.
+    static bool verify(const string& password, const string& stored) {
+        if (!isHashed(stored)) {
+            return !stored.empty() && constantTimeEquals(password, stored);
+        }
+        size_t costEnd = stored.find('$', 5);
+        size_t saltEnd = costEnd == string::npos ? string::npos : stored.find('$', costEnd + 1);
+        if (saltEnd == string::npos) {
+            return false;
+        }
+        int cost = atoi(stored.substr(5, costEnd - 5).c_str());
+        string salt, expected;
+        if (cost < MIN_COST || cost > MAX_COST ||
+            !fromHex(stored.substr(costEnd + 1, saltEnd - costEnd - 1), salt) ||
+            !fromHex(stored.substr(saltEnd + 1), expected)) {
+            return false;
+        }
+        Sha256::Digest digest = derive(password, salt, cost);
+        return constantTimeEquals(string(digest.begin(), digest.end()), expected);
+    }
+};
+
+// Bounded, sharded cache of recently verified credentials, keyed by the
+// customer handle and a keyed fingerprint of the password presented. A hit
+// lets a repeat login skip the memory-hard hash. All entries for a handle
+// live in one shard, so a password change invalidates them with one scan;
+// each shard also counts invalidations so a verification that started
+// before a change cannot re-insert a stale entry.
+class CredentialCache {
+private:
+    static const size_t SHARDS = 64;
+
+    struct Entry {
+        uint64_t fingerprint;
+        uint32_t handle;
+        bool valid;
+        chrono::steady_clock::time_point expires;
+    };
+
+    struct alignas(64) Shard {
+        mutex lock;
+        vector<Entry> entries;
+        uint64_t generation = 0;
+    };
+
+    Shard shards[SHARDS];
+    chrono::seconds ttl;
+    string secret;
+
+    Shard& shardOf(uint32_t handle) {
+        return shards[handle % SHARDS];
+    }
+
+    static size_t slotOf(const Shard& shard, uint32_t handle, uint64_t fingerprint) {
+        return (fingerprint ^ (uint64_t(handle) * 0x9e3779b97f4a7c15ULL)) % shard.entries.size();
+    }
+
+public:
+    explicit CredentialCache(size_t capacity = 65536, chrono::seconds timeToLive = chrono::seconds(300))
+        : ttl(timeToLive) {
+        random_device entropy;
+        for (int i = 0; i < 32; i++) {
+            secret.push_back(static_cast<char>(entropy()));
+        }
+        resize(capacity);
+    }
+
+    // Drops every entry and sets the total capacity; 0 disables caching
+    void resize(size_t capacity) {
+        size_t perShard = (capacity + SHARDS - 1) / SHARDS;
+        for (Shard& shard : shards) {
+            lock_guard<mutex> guard(shard.lock);
+            shard.entries.assign(perShard, Entry{0, 0, false, chrono::steady_clock::time_point()});
+            shard.generation++;
+        }
+    }
+
+    uint64_t fingerprint(uint32_t handle, const string& password) const {
+        Sha256::Digest digest = Sha256().update(secret.data(), secret.size())
+                                        .update(&handle, sizeof(handle))
+                                        .update(password.data(), password.size()).final();
+        uint64_t value;
+        memcpy(&value, digest.data(), sizeof(value));
+        return value;
+    }
+
+    uint64_t generation(uint32_t handle) {
+        Shard& shard = shardOf(handle);
+        lock_guard<mutex> guard(shard.lock);
+        return shard.generation;
+    }
+
+    bool contains(uint32_t handle, uint64_t fingerprint) {
+        Shard& shard = shardOf(handle);
+        lock_guard<mutex> guard(shard.lock);
+        if (shard.entries.empty()) {
+            return false;
+        }
+        const Entry& entry = shard.entries[slotOf(shard, handle, fingerprint)];
+        return entry.valid && entry.handle == handle && entry.fingerprint == fingerprint &&
+               entry.expires > chrono::steady_clock::now();
+    }
+
+    // Records a successful verification unless the shard was invalidated
+    // since generation was read
+    void remember(uint32_t handle, uint64_t fingerprint, uint64_t generation) {
+        Shard& shard = shardOf(handle);
+        lock_guard<mutex> guard(shard.lock);
+        if (shard.entries.empty() || shard.generation != generation) {
+            return;
+        }
+        shard.entries[slotOf(shard, handle, fingerprint)] =
+            Entry{fingerprint, handle, true, chrono::steady_clock::now() + ttl};
+    }
+
+    void invalidate(uint32_t handle) {
+        Shard& shard = shardOf(handle);
+        lock_guard<mutex> guard(shard.lock);
+        for (Entry& entry : shard.entries) {
+            if (entry.handle == handle) {
+                entry.valid = false;
+            }
+        }
+        shard.generation++;
+    }
+};
+
+// Fixed set of worker threads running submitted tasks in FIFO order
+class WorkerPool {
+private:
+    vector<thread> workers;
+    mutex lock;
+    condition_variable available;
+    deque<function<void()>> tasks;
+    bool stopping;
+
+    void work() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            available.wait(guard, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+            function<void()> task = std::move(tasks.front());
+            tasks.pop_front();
+            guard.unlock();
+            task();
+            guard.lock();
+        }
+    }
+
+public:
+    explicit WorkerPool(size_t threads) : stopping(false) {
+        for (size_t i = 0; i < max<size_t>(threads, 1); i++) {
+            workers.emplace_back(&WorkerPool::work, this);
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        available.notify_all();
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // done, if given, runs on the worker once the result is ready
+    template <typename Task>
+    auto submit(Task task, function<void()> done = nullptr) -> future<decltype(task())> {
+        typedef decltype(task()) Result;
+        auto packaged = make_shared<packaged_task<Result()>>(std::move(task));
+        future<Result> result = packaged->get_future();
+        {
+            lock_guard<mutex> guard(lock);
+            tasks.emplace_back([packaged, done] {
+                (*packaged)();
+                if (done) {
+                    done();
+                }
+            });
+        }
+        available.notify_one();
+        return result;
+    }
+};
+
+// Tasks [0, count) dealt out as one contiguous range per worker. Each
+// worker takes tasks from the front of its own range; once that runs out
+// it steals the back half of another worker's range, so workers that
+// draw cheap tasks finish the rest of the slow ones' share.
+class StealingRanges {
+private:
+    // begin in the high half, end in the low half, so one CAS moves both
+    struct alignas(64) Range {
+        atomic<uint64_t> bounds;
+    };
+
+    unique_ptr<Range[]> ranges;
+    size_t workers;
+
+    static uint64_t pack(uint32_t begin, uint32_t end) {
+        return uint64_t(begin) << 32 | end;
+    }
+
+    bool takeFront(size_t worker, uint32_t& task) {
+        atomic<uint64_t>& bounds = ranges[worker].bounds;
+        uint64_t seen = bounds.load(memory_order_relaxed);
+        while (true) {
+            uint32_t begin = static_cast<uint32_t>(seen >> 32);
+            uint32_t end = static_cast<uint32_t>(seen);
+            if (begin >= end) {
+                return false;
+            }
+            if (bounds.compare_exchange_weak(seen, pack(begin + 1, end), memory_order_relaxed)) {
+                task = begin;
+                return true;
+            }
+        }
+    }
+
+    bool steal(size_t thief) {
+        for (size_t i = 1; i < workers; i++) {
+            atomic<uint64_t>& bounds = ranges[(thief + i) % workers].bounds;
+            uint64_t seen = bounds.load(memory_order_relaxed);
+            while (true) {
+                uint32_t begin = static_cast<uint32_t>(seen >> 32);
+                uint32_t end = static_cast<uint32_t>(seen);
+                if (begin >= end) {
+                    break;
+                }
+                uint32_t middle = end - (end - begin + 1) / 2;
+                if (bounds.compare_exchange_weak(seen, pack(begin, middle), memory_order_relaxed)) {
+                    // Only the owner refills its own range, and only once it is empty
+                    ranges[thief].bounds.store(pack(middle, end), memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+public:
+    StealingRanges(uint32_t count, size_t workerCount)
+        : ranges(new Range[max<size_t>(workerCount, 1)]), workers(max<size_t>(workerCount, 1)) {
+        for (size_t worker = 0; worker < workers; worker++) {
+            ranges[worker].bounds.store(pack(static_cast<uint32_t>(count * worker / workers),
+                                             static_cast<uint32_t>(count * (worker + 1) / workers)));
+        }
+    }
+
+    // The next task for worker, or false once there is none left to take
+    bool next(size_t worker, uint32_t& task) {
+        while (!takeFront(worker, task)) {
+            if (!steal(worker)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Password hashing and verification for CustomerDatabase. The expensive
+// hash runs on a dedicated worker pool so terminal threads can keep
+// serving while a login is checked; recent successes are cached.
+class CredentialService {
+private:
+    CredentialCache cache;
+    WorkerPool pool;
+    atomic<int> cost;
+
+    static size_t defaultThreads() {
+        return max<size_t>(2, thread::hardware_concurrency() / 2);
+    }
+
+public:
+    CredentialService() : pool(defaultThreads()), cost(PasswordHasher::DEFAULT_COST) {}
+
+    int hashCost() const {
+        return cost;
+    }
+
+    void setHashCost(int newCost) {
+        if (newCost < PasswordHasher::MIN_COST || newCost > PasswordHasher::MAX_COST) {
+            throw invalid_argument("Password hash cost out of range");
+        }
+        cost = newCost;
+    }
+
+    // Sets how many verified credentials are remembered; 0 disables the cache
+    void setCacheCapacity(size_t capacity) {
+        cache.resize(capacity);
+    }
+
+    // done is as for WorkerPool::submit, here and below. It is not called
+    // for a result that is ready on return.
+    future<string> hashAsync(const string& password, function<void()> done = nullptr) {
+        int hashCost = cost;
+        return pool.submit([password, hashCost] { return PasswordHasher::hash(password, hashCost); },
+                           std::move(done));
+    }
+
+    // settle, if given, turns the outcome into the status the future gets
+    future<Status> verifyAsync(uint32_t handle, const string& password, const string& stored,
+                               function<Status(Status)> settle = nullptr, function<void()> done = nullptr) {
+        uint64_t fingerprint = cache.fingerprint(handle, password);
+        uint64_t generation = cache.generation(handle);
+        if (cache.contains(handle, fingerprint)) {
+            promise<Status> hit;
+            hit.set_value(settle ? settle(Status::OK) : Status::OK);
+            return hit.get_future();
+        }
+        return pool.submit([this, handle, password, stored, fingerprint, generation, settle] {
+            Status status = Status::INVALID_CREDENTIALS;
+            if (PasswordHasher::verify(password, stored)) {
+                cache.remember(handle, fingerprint, generation);
+                status = Status::OK;
+            }
+            return settle ? settle(status) : status;
+        }, std::move(done));
+    }
+
+    void invalidate(uint32_t handle) {
+        cache.invalidate(handle);
+    }
+};
+
+// Handed out by a login (see CustomerDatabase::openSession) and passed
+// back with each later operation in place of the customer ID. Holders
+// should treat it as opaque.
+struct SessionToken {
+    uint64_t id = 0;        // slot and shard in the SessionTable
+    uint64_t nonce = 0;     // random, so stale and guessed tokens fail
+};
+
+// What a session may do
+enum SessionPermission : uint8_t {
+    SESSION_CHANGE_PASSWORD = 1,
+    SESSION_TRANSACT = 2    // balances, withdrawals and transfers
+};
+
+// Open sessions and the account each resolved to at login. Sessions are
+// sharded by account handle, so ending every session of one account only
+// searches its shard. A session expires once it goes unused for the idle
+// timeout; each use starts the timeout again. Expiry is kept on the coarse
+// monotonic clock, a few milliseconds out but far cheaper to read on
+// every use.
+class SessionTable {
+private:
+    static const size_t SHARDS = 64;
+
+    struct Session {
+        uint64_t nonce;         // 0 while the slot is free
+        uint32_t handle;
+        uint8_t permissions;
+        int64_t expires;        // monotonicNanoseconds
+    };
+
+    struct alignas(64) Shard {
+        mutex lock;
+        vector<Session> sessions;
+        vector<uint32_t> freeSlots;
+    };
+
+    Shard shards[SHARDS];
+    atomic<int64_t> idleNanoseconds;
+
+    static uint64_t newNonce() {
+        thread_local mt19937_64 random(random_device{}());
+        uint64_t nonce;
+        do {
+            nonce = random();
+        } while (nonce == 0);
+        return nonce;
+    }
+
+    // The live session token names, or null. The caller must hold the
+    // shard's lock; an expired session found here is freed.
+    Session* find(Shard& shard, const SessionToken& token, int64_t time) {
+        size_t slot = static_cast<size_t>(token.id / SHARDS);
+        if (slot >= shard.sessions.size() || token.nonce == 0 || shard.sessions[slot].nonce != token.nonce) {
+            return nullptr;
+        }
+        Session& session = shard.sessions[slot];
+        if (session.expires <= time) {
+            session.nonce = 0;
+            shard.freeSlots.push_back(static_cast<uint32_t>(slot));
+            return nullptr;
+        }
+        return &session;
+    }
+
+public:
+    explicit SessionTable(chrono::seconds idleTimeout = chrono::minutes(15)) {
+        setIdleTimeout(idleTimeout);
+    }
+
+    void setIdleTimeout(chrono::nanoseconds idleTimeout) {
+        idleNanoseconds = idleTimeout.count();
+    }
+
+    SessionToken open(uint32_t handle, uint8_t permissions) {
+        size_t index = handle % SHARDS;
+        Shard& shard = shards[index];
+        int64_t time = monotonicNanoseconds();
+        lock_guard<mutex> guard(shard.lock);
+        if (shard.freeSlots.empty() && shard.sessions.size() >= SHARDS &&
+            (shard.sessions.size() & (shard.sessions.size() - 1)) == 0) {
+            // Reclaim sessions abandoned without a close before the shard grows again
+            for (size_t slot = 0; slot < shard.sessions.size(); slot++) {
+                Session& session = shard.sessions[slot];
+                if (session.nonce != 0 && session.expires <= time) {
+                    session.nonce = 0;
+                    shard.freeSlots.push_back(static_cast<uint32_t>(slot));
+                }
+            }
+        }
+        size_t slot;
+        if (shard.freeSlots.empty()) {
+            slot = shard.sessions.size();
+            shard.sessions.emplace_back();
+        } else {
+            slot = shard.freeSlots.back();
+            shard.freeSlots.pop_back();
+        }
+        Session& session = shard.sessions[slot];
+        session.nonce = newNonce();
+        session.handle = handle;
+        session.permissions = permissions;
+        session.expires = time + idleNanoseconds.load(memory_order_relaxed);
+        SessionToken token;
+        token.id = uint64_t(slot) * SHARDS + index;
+        token.nonce = session.nonce;
+        return token;
+    }
+
+    // The account of a live session allowed everything in need, or
+    // CustomerIndex::NOT_FOUND
+    uint32_t resolve(const SessionToken& token, uint8_t need) {
+        Shard& shard = shards[token.id % SHARDS];
+        int64_t time = monotonicNanoseconds();
+        lock_guard<mutex> guard(shard.lock);
+        Session* session = find(shard, token, time);
+        if (!session || (session->permissions & need) != need) {
+            return CustomerIndex::NOT_FOUND;
+        }
+        session->expires = time + idleNanoseconds.load(memory_order_relaxed);
+        return session->handle;
+    }
+
+    void close(const SessionToken& token) {
+        Shard& shard = shards[token.id % SHARDS];
+        lock_guard<mutex> guard(shard.lock);
+        Session* session = find(shard, token, monotonicNanoseconds());
+        if (session) {
+            session->nonce = 0;
+            shard.freeSlots.push_back(static_cast<uint32_t>(token.id / SHARDS));
+        }
+    }
+
+    // Ends every session of handle except keep, if given, which is granted
+    // the permissions in grant
+    void revoke(uint32_t handle, const SessionToken* keep = nullptr, uint8_t grant = 0) {
+        Shard& shard = shards[handle % SHARDS];
+        lock_guard<mutex> guard(shard.lock);
+        for (size_t slot = 0; slot < shard.sessions.size(); slot++) {
+            Session& session = shard.sessions[slot];
+            if (session.nonce == 0 || session.handle != handle) {
+                continue;
+            }
+            if (keep && keep->id == uint64_t(slot) * SHARDS + handle % SHARDS && keep->nonce == session.nonce) {
+                session.permissions |= grant;
+            } else {
+                session.nonce = 0;
+                shard.freeSlots.push_back(static_cast<uint32_t>(slot));
+            }
+        }
+    }
+};
+
+// Striped per-account locks. Accounts hash onto a fixed set of mutexes;
+// operations touching two accounts always lock the lower stripe first, so
+// concurrent transfers cannot deadlock.
+class AccountLocks {
+public:
+    static const size_t STRIPES = 1024;
+
+private:
+    struct alignas(64) Stripe {
+        mutex lock;
+    };
+
+    Stripe stripes[STRIPES];
+
+public:
+    static size_t stripeOf(uint32_t handle) {
+        return handle & (STRIPES - 1);
+    }
+
+    unique_lock<mutex> lockOne(uint32_t handle) {
+        return unique_lock<mutex>(stripes[stripeOf(handle)].lock);
+    }
+
+    pair<unique_lock<mutex>, unique_lock<mutex>> lockPair(uint32_t first, uint32_t second) {
+        size_t a = stripeOf(first);
+        size_t b = stripeOf(second);
+        if (a == b) {
+            return {unique_lock<mutex>(stripes[a].lock), unique_lock<mutex>()};
+        }
+        if (a > b) {
+            swap(a, b);
+        }
+        unique_lock<mutex> low(stripes[a].lock);
+        unique_lock<mutex> high(stripes[b].lock);
+        return {std::move(low), std::move(high)};
+    }
+
+    // Every stripe, in order, for a moment in which no account can change
+    vector<unique_lock<mutex>> lockAll() {
+        vector<unique_lock<mutex>> held;
+        held.reserve(STRIPES);
+        for (Stripe& stripe : stripes) {
+            held.emplace_back(stripe.lock);
+        }
+        return held;
+    }
+};
+
+// Per-CPU credit slots for a few accounts that receive a large share of
+// all transfers, such as merchants. A credit to one is added to the slot
+// of the calling CPU instead of under the account's lock, so transfers
+// into it from different CPUs no longer queue on one stripe. Reading or
+// debiting the account first folds every slot into its balance.
+class HotCredits {
+public:
+    static const size_t MAX_ACCOUNTS = 64;
+    static const size_t SLOTS = 16;
+    static const size_t NONE = MAX_ACCOUNTS;
+
+private:
+    struct alignas(64) Slot {
+        mutex lock;
+        Paise credits[ACCOUNT_COLUMNS] = {};
+    };
+
+    struct Account {
+        Slot slots[SLOTS];
+    };
+
+    atomic<uint32_t> handles[MAX_ACCOUNTS];
+    atomic<size_t> count;
+    mutex addLock;
+    unique_ptr<Account[]> accounts;
+
+public:
+    // Every slot of one account, held from a merge until the merged
+    // balance has been logged
+    class Merge {
+    private:
+        Slot* slots;
+
+    public:
+        explicit Merge(Slot* held = nullptr) : slots(held) {}
+
+        Merge(Merge&& other) : slots(other.slots) {
+            other.slots = nullptr;
+        }
+
+        Merge& operator=(Merge&&) = delete;
+
+        ~Merge() {
+            if (slots) {
+                for (size_t i = 0; i < SLOTS; i++) {
+                    slots[i].lock.unlock();
+                }
+            }
+        }
+    };
+
+    HotCredits() : count(0), accounts(new Account[MAX_ACCOUNTS]) {}
+
+    // Index of handle among the hot accounts, or NONE
+    size_t find(uint32_t handle) const {
+        size_t n = count.load(memory_order_acquire);
+        for (size_t i = 0; i < n; i++) {
+            if (handles[i].load(memory_order_relaxed) == handle) {
+                return i;
+            }
+        }
+        return NONE;
+    }
+
+    size_t size() const {
+        return count.load(memory_order_acquire);
+    }
+
+    uint32_t handle(size_t account) const {
+        return handles[account].load(memory_order_relaxed);
+    }
+
+    // Returns false once MAX_ACCOUNTS accounts are hot
+    bool add(uint32_t handle) {
+        lock_guard<mutex> guard(addLock);
+        if (find(handle) != NONE) {
+            return true;
+        }
+        size_t n = count.load(memory_order_relaxed);
+        if (n == MAX_ACCOUNTS) {
+            return false;
+        }
+        handles[n].store(handle, memory_order_relaxed);
+        count.store(n + 1, memory_order_release);
+        return true;
+    }
+
+    // Adds amount to this CPU's slot of account and runs log while the
+    // slot is still held, so the record cannot overtake a merge
+    template <typename Log>
+    uint64_t credit(size_t account, AccountColumn column, Paise amount, Log log) {
+        int cpu = sched_getcpu();
+        Slot& slot = accounts[account].slots[static_cast<size_t>(max(cpu, 0)) % SLOTS];
+        lock_guard<mutex> guard(slot.lock);
+        slot.credits[column] += amount;
+        return log();
+    }
+
+    // Moves every slot of account into handle's balances, leaving the
+    // slots locked until the result is dropped
+    Merge merge(size_t account, BalanceStore& balances, uint32_t handle) {
+        Slot* slots = accounts[account].slots;
+        for (size_t i = 0; i < SLOTS; i++) {
+            slots[i].lock.lock();
+            for (size_t column = 0; column < ACCOUNT_COLUMNS; column++) {
+                balances.balance(handle, column) += slots[i].credits[column];
+                slots[i].credits[column] = 0;
+            }
+        }
+        return Merge(slots);
+    }
+};
+
+// Balances of the loaded accounts as they stood at one moment, kept while
+// live traffic goes on changing them. Opening an image records only how
+// many accounts there were; after that, accounts are handed over between
+// writers and the scan a word of 64 at a time, with no account lock on
+// the scan's side. The scan flags a word while it copies it (see
+// beginWord); a writer about to change an account whose word the scan has
+// not reached saves the old balances first (see preserve), and one whose
+// word is being copied waits for the copy to finish. Both sides flag
+// before they look at the other's flags, so at least one sees the other,
+// and the scan reads every account either through its saved copy or from
+// balances no writer has changed since that moment.
+class BalanceImage {
+public:
+    struct Saved {
+        Paise savings;
+        Paise current;
+        Paise salary;
+        AccrualState accrual;
+    };
+
+private:
+    enum WordScan : uint8_t { UNSCANNED, SCANNING, SCANNED };
+
+    uint32_t count;
+    uint32_t day;
+    size_t words;
+    unique_ptr<atomic<uint64_t>[]> marks;   // a bit per account, set once it is saved
+    unique_ptr<atomic<uint8_t>[]> scans;    // a WordScan per word
+    unique_ptr<atomic<Saved*>[]> pages;     // saved balances of each word, made on its first save
+
+    Saved* page(size_t word) {
+        Saved* found = pages[word].load(memory_order_acquire);
+        if (found) {
+            return found;
+        }
+        // Writers of two accounts in one word can race to make it
+        Saved* made = new Saved[64];
+        if (pages[word].compare_exchange_strong(found, made, memory_order_acq_rel)) {
+            return made;
+        }
+        delete[] made;
+        return found;
+    }
+
+public:
+    // Room for capacity accounts; the count is set when the image opens
+    explicit BalanceImage(size_t capacity)
+        : count(0), day(0), words(capacity / 64 + 1), marks(new atomic<uint64_t>[words]),
+          scans(new atomic<uint8_t>[words]), pages(new atomic<Saved*>[words]) {
+        for (size_t word = 0; word < words; word++) {
+            marks[word].store(0, memory_order_relaxed);
+            scans[word].store(UNSCANNED, memory_order_relaxed);
+            pages[word].store(nullptr, memory_order_relaxed);
+        }
+    }
+
+    ~BalanceImage() {
+        for (size_t word = 0; word < words; word++) {
+            delete[] pages[word].load(memory_order_relaxed);
+        }
+    }
+
+    BalanceImage(const BalanceImage&) = delete;
+    BalanceImage& operator=(const BalanceImage&) = delete;
+
+    // Fixes which accounts the image holds and the business day they are
+    // settled to. Called while no account can change.
+    void open(uint32_t accounts, uint32_t businessDay) {
+        count = accounts;
+        day = businessDay;
+    }
+
+    uint32_t size() const {
+        return count;
+    }
+
+    uint32_t businessDay() const {
+        return day;
+    }
+
+    // Called before handle's balances change, with its account lock held.
+    // Saves them unless the scan is already past the account, waiting out
+    // a scan that is copying its word.
+    void preserve(uint32_t handle, BalanceStore& balances) {
+        if (handle >= count) {
+            return;
+        }
+        size_t word = handle >> 6;
+        uint64_t bit = uint64_t(1) << (handle & 63);
+        // Set by an earlier change under the same lock
+        if (marks[word].load(memory_order_relaxed) & bit) {
+            return;
+        }
+        uint8_t scan = scans[word].load();
+        if (scan == UNSCANNED) {
+            page(word)[handle & 63] = Saved{balances.savings(handle), balances.current(handle),
+                                            balances.salary(handle), balances.accrual(handle)};
+            marks[word].fetch_or(bit);
+            scan = scans[word].load();
+        }
+        while (scan == SCANNING) {
+            this_thread::yield();
+            scan = scans[word].load();
+        }
+    }
+
+    // Starts the scan's copy of accounts [64 * word, 64 * word + 64) and
+    // returns which of them are saved. The others are read from the
+    // balances, which writers leave alone until finishWord.
+    uint64_t beginWord(size_t word) {
+        scans[word].store(SCANNING);
+        return marks[word].load();
+    }
+
+    void finishWord(size_t word) {
+        scans[word].store(SCANNED, memory_order_release);
+    }
+
+    // The saved balances of a handle beginWord reported saved
+    const Saved& saved(uint32_t handle) const {
+        return pages[handle >> 6].load(memory_order_acquire)[handle & 63];
+    }
+};
+
+// Little-endian field encoding shared by the write-ahead log and snapshots
+class RecordWriter {
+private:
+    string& out;
+
+public:
+    explicit RecordWriter(string& buffer) : out(buffer) {}
+
+    void put8(uint8_t value) {
+        out.push_back(static_cast<char>(value));
+    }
+
+    void put32(uint32_t value) {
+        for (int i = 0; i < 4; i++) {
+            out.push_back(static_cast<char>(value >> (8 * i)));
+        }
+    }
+
+    void put64(uint64_t value) {
+        for (int i = 0; i < 8; i++) {
+            out.push_back(static_cast<char>(value >> (8 * i)));
+        }
+    }
+
+    void putString(string_view value) {
+        put32(static_cast<uint32_t>(value.size()));
+        out.append(value);
+    }
+};
+
+class RecordReader {
+private:
+    const char* pos;
+    const char* end;
+
+public:
+    RecordReader(const char* data, size_t length) : pos(data), end(data + length) {}
+
+    bool done() const {
+        return pos == end;
+    }
+
+    bool get8(uint8_t& value) {
+        if (end - pos < 1) {
+            return false;
+        }
+        value = static_cast<uint8_t>(*pos++);
+        return true;
+    }
+
+    bool get32(uint32_t& value) {
+        if (end - pos < 4) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < 4; i++) {
+            value |= uint32_t(static_cast<uint8_t>(*pos++)) << (8 * i);
+        }
+        return true;
+    }
+
+    bool get64(uint64_t& value) {
+        if (end - pos < 8) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < 8; i++) {
+            value |= uint64_t(static_cast<uint8_t>(*pos++)) << (8 * i);
+        }
+        return true;
+    }
+
+    bool getString(string& value) {
+        uint32_t length;
+        if (!get32(length) || static_cast<size_t>(end - pos) < length) {
+            return false;
+        }
+        value.assign(pos, length);
+        pos += length;
+        return true;
+    }
+};
+
+inline uint32_t checksum32(const char* data, size_t length, uint32_t seed = 2166136261u) {
+    uint32_t h = seed;
+    for (size_t i = 0; i < length; i++) {
+        h = (h ^ static_cast<uint8_t>(data[i])) * 16777619u;
+    }
+    return h;
+}
+
+// Append-only binary write-ahead log with group commit. Each record is
+// framed as [length][checksum][payload]. Writers append into a shared
+// buffer and get back a sequence number; a single flusher thread gathers
+// everything appended within the group-commit window and makes it durable
+// with one write and one fdatasync, then wakes every writer it covered.
+class WriteAheadLog {
+public:
+    // Larger than any record the database writes; a length field above it
+    // can only be a torn or corrupt header
+    static const uint32_t MAX_RECORD_BYTES = uint32_t(1) << 24;
+
+private:
+    string path;
+    int fd;
+    chrono::microseconds groupWindow;
+
+    mutex lock;
+    condition_variable flushNeeded;
+    condition_variable flushed;
+    string pending;
+    uint64_t appendedSequence;
+    uint64_t durableSequence;
+    uint64_t bytesWritten;
+    bool stopping;
+    bool failed;
+    thread flusher;
+
+    static int openForAppend(const string& file) {
+        int descriptor = ::open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+        if (descriptor < 0) {
+            throw DatabaseException("Unable to open log file " + file);
+        }
+        return descriptor;
+    }
+
+    static bool writeAll(int descriptor, const string& data) {
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = ::write(descriptor, data.data() + done, data.size() - done);
+            if (n < 0) {
+                return false;
+            }
+            done += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    void flushLoop() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            flushNeeded.wait(guard, [this] { return stopping || !pending.empty(); });
+            if (pending.empty()) {
+                break;
+            }
+            if (groupWindow.count() > 0 && !stopping) {
+                // Give other writers the rest of the window to join this batch
+                flushNeeded.wait_for(guard, groupWindow, [this] { return stopping; });
+            }
+
+            string batch;
+            batch.swap(pending);
+            uint64_t upTo = appendedSequence;
+            guard.unlock();
+            bool ok = writeAll(fd, batch) && ::fdatasync(fd) == 0;
+            guard.lock();
+
+            failed = failed || !ok;
+            durableSequence = upTo;
+            bytesWritten += batch.size();
+            flushed.notify_all();
+        }
+    }
+
+public:
+    WriteAheadLog(const string& file, chrono::microseconds window)
+        : path(file), fd(openForAppend(file)), groupWindow(window),
+          appendedSequence(0), durableSequence(0), bytesWritten(0),
+          stopping(false), failed(false) {
+        off_t existing = ::lseek(fd, 0, SEEK_END);
+        bytesWritten = existing > 0 ? static_cast<uint64_t>(existing) : 0;
+        flusher = thread(&WriteAheadLog::flushLoop, this);
+    }
+
+    ~WriteAheadLog() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        flushNeeded.notify_all();
+        flusher.join();
+        ::close(fd);
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    static void frame(string& out, const string& payload) {
+        RecordWriter header(out);
+        header.put32(static_cast<uint32_t>(payload.size()));
+        header.put32(checksum32(payload.data(), payload.size()));
+        out.append(payload);
+    }
+
+    uint64_t append(const string& payload) {
+        if (payload.size() > MAX_RECORD_BYTES) {
+            throw DatabaseException("Log record is too large");
+        }
+        lock_guard<mutex> guard(lock);
+        frame(pending, payload);
+        flushNeeded.notify_one();
+        return ++appendedSequence;
+    }
+
+    // Blocks until the record with the given sequence number is on disk
+    void waitDurable(uint64_t sequence) {
+        unique_lock<mutex> guard(lock);
+        flushed.wait(guard, [this, sequence] { return durableSequence >= sequence; });
+        if (failed) {
+            throw DatabaseException("Write-ahead log I/O failure");
+        }
+    }
+
+    uint64_t size() {
+        lock_guard<mutex> guard(lock);
+        return bytesWritten + pending.size();
+    }
+
+    // Flushes everything appended so far, moves the current file aside to
+    // retiredPath and starts a fresh, empty log in its place
+    void rotate(const string& retiredPath) {
+        unique_lock<mutex> guard(lock);
+        flushNeeded.notify_one();
+        flushed.wait(guard, [this] { return durableSequence == appendedSequence; });
+        ::close(fd);
+        if (::rename(path.c_str(), retiredPath.c_str()) != 0) {
+            failed = true;
+            throw DatabaseException("Unable to rotate log file " + path);
+        }
+        fd = openForAppend(path);
+        bytesWritten = 0;
+    }
+
+    // Feeds each intact record of a log file to apply, in order. Stops at
+    // the first torn or corrupt record, which can only be an unfinished
+    // tail write, so at most one record is buffered beyond the read chunk. Returns the length of the intact prefix, or -1 if the
+    // file does not exist.
+    static int64_t replay(const string& file, const function<void(const string&)>& apply) {
+        int descriptor = ::open(file.c_str(), O_RDONLY);
+        if (descriptor < 0) {
+            return -1;
+        }
+        // Read in chunks so a log larger than memory replays in bounded space.
+        string contents;
+        size_t offset = 0;
+        int64_t intactBytes = 0;
+        bool intact = true;
+        while (intact) {
+            size_t filled = contents.size();
+            contents.resize(filled + (1 << 20));
+            ssize_t n = ::read(descriptor, contents.data() + filled, 1 << 20);
+            contents.resize(filled + static_cast<size_t>(max<ssize_t>(n, 0)));
+            if (n <= 0) {
+                break;
+            }
+            uint32_t length, checksum;
+            while (contents.size() - offset >= 8) {
+                RecordReader reader(contents.data() + offset, 8);
+                reader.get32(length);
+                reader.get32(checksum);
+                if (length > MAX_RECORD_BYTES) {
+                    intact = false;
+                    break;
+                }
+                if (contents.size() - offset - 8 < length) {
+                    break;
+                }
+                if (checksum32(contents.data() + offset + 8, length) != checksum) {
+                    intact = false;
+                    break;
+                }
+                apply(contents.substr(offset + 8, length));
+                offset += 8 + length;
+                intactBytes += 8 + length;
+            }
+            contents.erase(0, offset);
+            offset = 0;
+        }
+        ::close(descriptor);
+        return intactBytes;
+    }
+};
+
+// Snapshot file laid out so it can be mmap'ed and queried in place: a
+// header, a fixed-size record array, an open-addressing index over the
+// records and a blob holding every string. Records refer to their strings
+// by offset into the blob. Opening a snapshot only validates the header;
+// each record carries its own checksum, verified when it is first loaded.
+enum SnapshotField {
+    FIELD_ID,
+    FIELD_PASSWORD,
+    FIELD_NAME,
+    FIELD_EMAIL,
+    FIELD_ADDRESS,
+    FIELD_PHONE,
+    FIELD_COUNT
+};
+
+// Keys for the email and phone indexes: emails match regardless of case
+// and surrounding blanks, phone numbers by their digits alone. An empty
+// key is never indexed.
+inline string normalizeEmail(string_view email) {
+    size_t begin = 0, end = email.size();
+    while (begin < end && isspace(static_cast<unsigned char>(email[begin]))) {
+        begin++;
+    }
+    while (end > begin && isspace(static_cast<unsigned char>(email[end - 1]))) {
+        end--;
+    }
+    string key;
+    key.reserve(end - begin);
+    for (size_t i = begin; i < end; i++) {
+        key.push_back(static_cast<char>(tolower(static_cast<unsigned char>(email[i]))));
+    }
+    return key;
+}
+
+inline string normalizePhone(string_view phone) {
+    string key;
+    for (char c : phone) {
+        if (isdigit(static_cast<unsigned char>(c))) {
+            key.push_back(c);
+        }
+    }
+    return key;
+}
+
+inline string contactKey(SnapshotField field, string_view value) {
+    return field == FIELD_EMAIL ? normalizeEmail(value) : normalizePhone(value);
+}
+
+struct SnapshotStringRef {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t reserved;
+};
+
+struct SnapshotRecord {
+    uint64_t idHash;
+    SnapshotStringRef fields[FIELD_COUNT];
+    int64_t savings;
+    int64_t current;
+    int64_t salary;
+    int64_t interest;       // AccrualState
+    uint32_t accrualDay;
+    uint32_t flags;
+    uint32_t checksum;      // covers the bytes above plus the record's strings
+    uint32_t reserved;
+};
+
+struct SnapshotIndexSlot {
+    uint64_t hash;
+    uint64_t record;        // record number + 1, 0 marks an empty slot
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t checksum;      // covers the header with this field zeroed
+    uint64_t recordCount;
+    uint64_t indexSlots;        // shared by the ID, email and phone indexes
+    uint64_t recordsOffset;
+    uint64_t indexOffset;
+    uint64_t emailIndexOffset;  // contact slots hash the key from contactKey
+    uint64_t phoneIndexOffset;
+    uint64_t blobOffset;
+    uint64_t blobLength;
+    uint64_t fileLength;
+    uint64_t highestCustomerNumber; // see customerNumber
+    uint64_t businessDay;           // see CustomerDatabase::closeDay
+};
+
+static const char SNAPSHOT_MAGIC[8] = {'A', 'T', 'M', 'S', 'N', 'A', 'P', '\0'};
+static const uint32_t SNAPSHOT_VERSION = 5;
+static const uint32_t SNAPSHOT_FIRST_LOGIN = 1;
+
+inline uint32_t headerChecksum(SnapshotHeader header) {
+    header.checksum = 0;
+    return checksum32(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+inline uint32_t recordChecksum(const SnapshotRecord& record, const char* blob) {
+    uint32_t h = checksum32(reinterpret_cast<const char*>(&record),
+                            offsetof(SnapshotRecord, checksum));
+    for (int field = 0; field < FIELD_COUNT; field++) {
+        h = checksum32(blob + record.fields[field].offset, record.fields[field].length, h);
+    }
+    return h;
+}
+
+// Read-only view of a snapshot file mapped into memory
+class MappedSnapshot {
+private:
+    int fd;
+    const char* data;
+    size_t length;
+    const SnapshotHeader* header;
+    const SnapshotRecord* records;
+    const SnapshotIndexSlot* slots;
+    const SnapshotIndexSlot* emailSlots;
+    const SnapshotIndexSlot* phoneSlots;
+    const char* blob;
+
+    MappedSnapshot() : fd(-1), data(nullptr), length(0), header(nullptr),
+                       records(nullptr), slots(nullptr), emailSlots(nullptr),
+                       phoneSlots(nullptr), blob(nullptr) {}
+
+    bool fieldInBlob(const SnapshotStringRef& ref) const {
+        return ref.offset <= header->blobLength &&
+               ref.length <= header->blobLength - ref.offset;
+    }
+
+    template <typename Matches>
+    uint64_t probe(const SnapshotIndexSlot* table, uint64_t hash, Matches matches) const {
+        uint64_t mask = header->indexSlots - 1;
+        uint64_t pos = hash & mask;
+        for (uint64_t probes = 0; probes <= mask && table[pos].record != 0; probes++) {
+            uint64_t record = table[pos].record - 1;
+            if (table[pos].hash == hash && record < header->recordCount && matches(record)) {
+                return record;
+            }
+            pos = (pos + 1) & mask;
+        }
+        return NOT_FOUND;
+    }
+
+public:
+    static const uint64_t NOT_FOUND = ~uint64_t(0);
+
+    ~MappedSnapshot() {
+        if (data) {
+            ::munmap(const_cast<char*>(data), length);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    MappedSnapshot(const MappedSnapshot&) = delete;
+    MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+
+    // Maps the snapshot at path, or returns null if there is none. Throws
+    // DatabaseException if the file is not a valid snapshot.
+    static unique_ptr<MappedSnapshot> open(const string& path) {
+        unique_ptr<MappedSnapshot> snapshot(new MappedSnapshot());
+        snapshot->fd = ::open(path.c_str(), O_RDONLY);
+        if (snapshot->fd < 0) {
+            return nullptr;
+        }
+        struct stat info;
+        if (::fstat(snapshot->fd, &info) != 0 ||
+            static_cast<size_t>(info.st_size) < sizeof(SnapshotHeader)) {
+            throw DatabaseException("Snapshot " + path + " is truncated");
+        }
+        snapshot->length = static_cast<size_t>(info.st_size);
+        void* mapped = ::mmap(nullptr, snapshot->length, PROT_READ, MAP_SHARED, snapshot->fd, 0);
+        if (mapped == MAP_FAILED) {
+            throw DatabaseException("Unable to map snapshot " + path);
+        }
+        snapshot->data = static_cast<const char*>(mapped);
+
+        const SnapshotHeader* header = reinterpret_cast<const SnapshotHeader*>(snapshot->data);
+        if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+            throw DatabaseException("Snapshot " + path + " has an unknown format");
+        }
+        if (header->version != SNAPSHOT_VERSION) {
+            throw DatabaseException("Snapshot " + path + " has an unsupported version");
+        }
+        if (header->checksum != headerChecksum(*header) || header->fileLength != snapshot->length) {
+            throw DatabaseException("Snapshot " + path + " is corrupt");
+        }
+        uint64_t slots = header->indexSlots;
+        uint64_t indexBytes = slots * sizeof(SnapshotIndexSlot);
+        bool layoutOk = slots != 0 && (slots & (slots - 1)) == 0 &&
+                        header->recordCount <= CustomerIndex::NOT_FOUND &&
+                        header->recordsOffset % 8 == 0 && header->indexOffset % 8 == 0 &&
+                        header->emailIndexOffset % 8 == 0 && header->phoneIndexOffset % 8 == 0 &&
+                        header->recordsOffset + header->recordCount * sizeof(SnapshotRecord) <= header->indexOffset &&
+                        header->indexOffset + indexBytes <= header->emailIndexOffset &&
+                        header->emailIndexOffset + indexBytes <= header->phoneIndexOffset &&
+                        header->phoneIndexOffset + indexBytes <= header->blobOffset &&
+                        header->blobOffset + header->blobLength <= snapshot->length;
+        if (!layoutOk) {
+            throw DatabaseException("Snapshot " + path + " is corrupt");
+        }
+
+        snapshot->header = header;
+        snapshot->records = reinterpret_cast<const SnapshotRecord*>(snapshot->data + header->recordsOffset);
+        snapshot->slots = reinterpret_cast<const SnapshotIndexSlot*>(snapshot->data + header->indexOffset);
+        snapshot->emailSlots = reinterpret_cast<const SnapshotIndexSlot*>(snapshot->data + header->emailIndexOffset);
+        snapshot->phoneSlots = reinterpret_cast<const SnapshotIndexSlot*>(snapshot->data + header->phoneIndexOffset);
+        snapshot->blob = snapshot->data + header->blobOffset;
+        return snapshot;
+    }
+
+    uint64_t size() const {
+        return header->recordCount;
+    }
+
+    uint64_t highestCustomerNumber() const {
+        return header->highestCustomerNumber;
+    }
+
+    uint32_t businessDay() const {
+        return static_cast<uint32_t>(header->businessDay);
+    }
+
+    string_view field(uint64_t record, SnapshotField which) const {
+        const SnapshotStringRef& ref = records[record].fields[which];
+        if (!fieldInBlob(ref)) {
+            return string_view();
+        }
+        return string_view(blob + ref.offset, ref.length);
+    }
+
+    uint64_t find(const string& customerId, uint64_t hash) const {
+        return probe(slots, hash, [this, &customerId](uint64_t record) {
+            return field(record, FIELD_ID) == customerId;
+        });
+    }
+
+    // Finds a record by normalized email or phone (FIELD_EMAIL or
+    // FIELD_PHONE), with hash computed by CustomerIndex::hashId
+    uint64_t findContact(SnapshotField which, const string& key, uint64_t hash) const {
+        return probe(which == FIELD_EMAIL ? emailSlots : phoneSlots, hash,
+                     [this, which, &key](uint64_t record) {
+            return contactKey(which, field(record, which)) == key;
+        });
+    }
+
+    // Copies a record out of the mapping after checking its checksum
+    void read(uint64_t record, Customer& customer, Paise& savings, Paise& current, Paise& salary,
+              AccrualState& accrual) const {
+        const SnapshotRecord& entry = records[record];
+        for (int which = 0; which < FIELD_COUNT; which++) {
+            if (!fieldInBlob(entry.fields[which])) {
+                throw DatabaseException("Snapshot record is corrupt");
+            }
+        }
+        if (entry.checksum != recordChecksum(entry, blob)) {
+            throw DatabaseException("Snapshot record is corrupt");
+        }
+        customer.customerId = string(field(record, FIELD_ID));
+        customer.password = string(field(record, FIELD_PASSWORD));
+        customer.name = string(field(record, FIELD_NAME));
+        customer.email = string(field(record, FIELD_EMAIL));
+        customer.address = string(field(record, FIELD_ADDRESS));
+        customer.phone = string(field(record, FIELD_PHONE));
+        customer.isFirstLogin = (entry.flags & SNAPSHOT_FIRST_LOGIN) != 0;
+        savings = entry.savings;
+        current = entry.current;
+        salary = entry.salary;
+        accrual.day = entry.accrualDay;
+        accrual.interest = entry.interest;
+    }
+
+    // read for the balances alone, still checking the record's checksum
+    void readBalances(uint64_t record, Paise& savings, Paise& current, Paise& salary,
+                      AccrualState& accrual) const {
+        const SnapshotRecord& entry = records[record];
+        for (int which = 0; which < FIELD_COUNT; which++) {
+            if (!fieldInBlob(entry.fields[which])) {
+                throw DatabaseException("Snapshot record is corrupt");
+            }
+        }
+        if (entry.checksum != recordChecksum(entry, blob)) {
+            throw DatabaseException("Snapshot record is corrupt");
+        }
+        savings = entry.savings;
+        current = entry.current;
+        salary = entry.salary;
+        accrual.day = entry.accrualDay;
+        accrual.interest = entry.interest;
+    }
+};
+
+// Accumulates customers in memory and writes them out as a snapshot file.
+// Adding an ID that is already present replaces the earlier record.
+class SnapshotBuilder {
+private:
+    vector<SnapshotRecord> records;
+    string blob;
+    CustomerIndex ids;
+    uint64_t highestNumber = 0;
+    uint32_t businessDay = 0;
+
+    SnapshotStringRef store(const string& value) {
+        SnapshotStringRef ref = {blob.size(), static_cast<uint32_t>(value.size()), 0};
+        blob.append(value);
+        return ref;
+    }
+
+    static bool writeAll(int fd, const char* bytes, size_t count) {
+        while (count > 0) {
+            ssize_t n = ::write(fd, bytes, count);
+            if (n < 0) {
+                return false;
+            }
+            bytes += n;
+            count -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    // Makes a rename within path's directory durable
+    static bool syncDirectory(const string& path) {
+        size_t slash = path.rfind('/');
+        string directory = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = ::fsync(fd) == 0;
+        ::close(fd);
+        return ok;
+    }
+
+public:
+    void setBusinessDay(uint32_t day) {
+        businessDay = day;
+    }
+
+    void add(const Customer& customer, Paise savings, Paise current, Paise salary, AccrualState accrual) {
+        SnapshotRecord record;
+        memset(&record, 0, sizeof(record));
+        record.idHash = CustomerIndex::hashId(customer.customerId);
+        record.fields[FIELD_ID] = store(customer.customerId);
+        record.fields[FIELD_PASSWORD] = store(customer.password);
+        record.fields[FIELD_NAME] = store(customer.name);
+        record.fields[FIELD_EMAIL] = store(customer.email);
+        record.fields[FIELD_ADDRESS] = store(customer.address);
+        record.fields[FIELD_PHONE] = store(customer.phone);
+        record.savings = savings;
+        record.current = current;
+        record.salary = salary;
+        record.interest = accrual.interest;
+        record.accrualDay = accrual.day;
+        record.flags = customer.isFirstLogin ? SNAPSHOT_FIRST_LOGIN : 0;
+        highestNumber = max(highestNumber, customerNumber(customer.customerId));
+
+        uint32_t existing = ids.find(customer.customerId, record.idHash, [this](uint32_t number) {
+            const SnapshotStringRef& ref = records[number].fields[FIELD_ID];
+            return string_view(blob.data() + ref.offset, ref.length);
+        });
+        if (existing != CustomerIndex::NOT_FOUND) {
+            records[existing] = record;
+        } else {
+            ids.insert(record.idHash, static_cast<uint32_t>(records.size()));
+            records.push_back(record);
+        }
+    }
+
+    // Writes the snapshot to a temporary file and renames it over path.
+    // The rename is durable on return, so logs the snapshot covers may be
+    // removed.
+    void write(const string& path) {
+        uint64_t slotCount = 16;
+        while (slotCount < records.size() * 2) {
+            slotCount *= 2;
+        }
+        vector<SnapshotIndexSlot> slots(slotCount, SnapshotIndexSlot{0, 0});
+        vector<SnapshotIndexSlot> emailSlots(slotCount, SnapshotIndexSlot{0, 0});
+        vector<SnapshotIndexSlot> phoneSlots(slotCount, SnapshotIndexSlot{0, 0});
+        auto place = [slotCount](vector<SnapshotIndexSlot>& table, uint64_t hash, uint64_t number) {
+            uint64_t pos = hash & (slotCount - 1);
+            while (table[pos].record != 0) {
+                pos = (pos + 1) & (slotCount - 1);
+            }
+            table[pos] = SnapshotIndexSlot{hash, number + 1};
+        };
+        for (size_t number = 0; number < records.size(); number++) {
+            const SnapshotRecord& record = records[number];
+            records[number].checksum = recordChecksum(record, blob.data());
+            place(slots, record.idHash, number);
+            for (SnapshotField which : {FIELD_EMAIL, FIELD_PHONE}) {
+                const SnapshotStringRef& ref = record.fields[which];
+                string key = contactKey(which, string_view(blob.data() + ref.offset, ref.length));
+                if (!key.empty()) {
+                    place(which == FIELD_EMAIL ? emailSlots : phoneSlots, CustomerIndex::hashId(key), number);
+                }
+            }
+        }
+
+        SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header.version = SNAPSHOT_VERSION;
+        header.recordCount = records.size();
+        header.indexSlots = slotCount;
+        header.recordsOffset = sizeof(SnapshotHeader);
+        header.indexOffset = header.recordsOffset + records.size() * sizeof(SnapshotRecord);
+        header.emailIndexOffset = header.indexOffset + slotCount * sizeof(SnapshotIndexSlot);
+        header.phoneIndexOffset = header.emailIndexOffset + slotCount * sizeof(SnapshotIndexSlot);
+        header.blobOffset = header.phoneIndexOffset + slotCount * sizeof(SnapshotIndexSlot);
+        header.blobLength = blob.size();
+        header.fileLength = header.blobOffset + blob.size();
+        header.highestCustomerNumber = highestNumber;
+        header.businessDay = businessDay;
+        header.checksum = headerChecksum(header);
+
+        string tempPath = path + ".tmp";
+        int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+            throw DatabaseException("Unable to create snapshot " + tempPath);
+        }
+        bool ok = writeAll(fd, reinterpret_cast<const char*>(&header), sizeof(header)) &&
+                  writeAll(fd, reinterpret_cast<const char*>(records.data()),
+                           records.size() * sizeof(SnapshotRecord)) &&
+                  writeAll(fd, reinterpret_cast<const char*>(slots.data()),
+                           slots.size() * sizeof(SnapshotIndexSlot)) &&
+                  writeAll(fd, reinterpret_cast<const char*>(emailSlots.data()),
+                           emailSlots.size() * sizeof(SnapshotIndexSlot)) &&
+                  writeAll(fd, reinterpret_cast<const char*>(phoneSlots.data()),
+                           phoneSlots.size() * sizeof(SnapshotIndexSlot)) &&
+                  writeAll(fd, blob.data(), blob.size()) &&
+                  ::fsync(fd) == 0;
+        ::close(fd);
+        if (!ok || ::rename(tempPath.c_str(), path.c_str()) != 0) {
+            ::unlink(tempPath.c_str());
+            throw DatabaseException("Unable to write snapshot " + path);
+        }
+        if (!syncDirectory(path)) {
+            throw DatabaseException("Unable to write snapshot " + path);
+        }
+    }
+};
+
+// One customer for CustomerDatabase::importCustomers
+struct ImportRow {
+    Customer customer;
+    Paise savings;
+    Paise current;
+};
+
+// Penalties and monthly charges taken from accounts on one business day.
+// Monthly charges count on the day they are taken, which for accounts the
+// sweep reaches first is the day the month ends (see AccrualSweeper).
+struct DayRevenue {
+    uint32_t day = 0;
+    Paise penalties = 0;
+    Paise charges = 0;
+};
+
+// End-of-day totals over every account, as of one moment (see
+// CustomerDatabase::reconcile). Balances are settled to businessDay.
+struct ReconciliationReport {
+    uint32_t businessDay = 0;
+    uint64_t accounts = 0;
+    Paise savingsTotal = 0;
+    Paise currentTotal = 0;
+    Paise salaryTotal = 0;
+    uint64_t savingsBelowMinimum = 0;   // under SavingsPolicy::MIN_BALANCE
+    uint64_t currentBelowMinimum = 0;   // under CurrentPolicy::MIN_BALANCE
+    uint64_t salaryOverdrawn = 0;       // below zero, within SalaryPolicy::OVERDRAFT
+    Paise penaltyRevenue = 0;           // debit penalties charged on businessDay
+    Paise chargeRevenue = 0;            // monthly charges taken on businessDay
+    uint64_t changedDuringScan = 0;     // accounts read from their saved balances
+    double pauseSeconds = 0;            // writers held off while the image opened
+    double scanSeconds = 0;
+
+    // Totals can pass what a double holds to the paisa, so rupees are
+    // printed from the integer
+    static string rupees(Paise amount) {
+        Paise magnitude = amount < 0 ? -amount : amount;
+        char text[32];
+        snprintf(text, sizeof(text), "%s%" PRId64 ".%02" PRId64, amount < 0 ? "-" : "",
+                 magnitude / 100, magnitude % 100);
+        return text;
+    }
+
+    void print(ostream& out) const {
+        out << "Reconciliation for business day " << businessDay << "\n"
+            << "Accounts: " << accounts << "\n"
+            << "Savings deposits: Rs. " << rupees(savingsTotal) << "\n"
+            << "Current deposits: Rs. " << rupees(currentTotal) << "\n"
+            << "Salary deposits: Rs. " << rupees(salaryTotal) << "\n"
+            << "Savings below minimum: " << savingsBelowMinimum << "\n"
+            << "Current below minimum: " << currentBelowMinimum << "\n"
+            << "Salary overdrawn: " << salaryOverdrawn << "\n"
+            << "Penalty revenue: Rs. " << rupees(penaltyRevenue) << "\n"
+            << "Monthly charges: Rs. " << rupees(chargeRevenue) << "\n";
+    }
+};
+
+// Database management class. The table (records and index) is guarded by a
+// reader/writer lock; per-account state is guarded by AccountLocks.
+// Customers from a mapped snapshot are served from the mapping and only
+// copied into the table the first time they are looked up.
+// Emails and phone numbers are unique. They are indexed by the snapshot
+// for its own customers and by emailIndex and phoneIndex for those added
+// since, so copying a snapshot customer into the table leaves them alone.
+class CustomerDatabase {
+private:
+    // Records never move once stored, so CustomerProfile references stay
+    // valid while the table grows
+    ProfileStore customers;
+    BalanceStore balanceStore;
+    CustomerIndex index;
+    CustomerIndex emailIndex;
+    CustomerIndex phoneIndex;
+    AccountLocks accountLocks;
+    HotCredits hotCredits;
+    mutable shared_mutex tableMutex;
+    CredentialService credentials;
+    SessionTable sessions;
+    VelocityLimiter velocity;   // per customer, over each account's VelocityState
+    function<int64_t()> clock;  // see setClock
+
+    // The open business day's revenue, counted per account lock stripe and
+    // only changed under the stripe's lock. Counts left from an earlier
+    // day are stale and read as zero. Each change is logged, absolutely,
+    // with the balances it came out of (see logBalances).
+    struct alignas(64) StripeRevenue {
+        DayRevenue counts;
+        bool unlogged = false;
+    };
+
+    unique_ptr<StripeRevenue[]> revenue;
+    DayRevenue closedRevenue;   // of the last day closed, logged with every LOG_DAY
+    mutex dayLock;              // held while closedRevenue is changed or logged
+    // Set while reconcile scans; every change to an account first saves
+    // its balances there
+    atomic<BalanceImage*> image;
+    mutex reconcileLock;
+
+    // Types 2 and 4 are the balance records of logs written before salary
+    // accounts, whose accounts carry no salary balance. They are still
+    // replayed but no longer written.
+    enum LogRecordType : uint8_t {
+        LOG_ADD_CUSTOMER = 1,
+        LOG_BALANCES_BEFORE_SALARY = 2,
+        LOG_PASSWORD = 3,
+        LOG_HOT_CREDIT_BEFORE_SALARY = 4,
+        LOG_DAY = 5,
+        LOG_REVENUE = 6,
+        LOG_BALANCES = 7,
+        LOG_HOT_CREDIT = 8
+    };
+
+    // Every logged value is absolute, so replaying any stretch of history
+    // in order always ends in the state at its last record. The one
+    // exception is the credit in LOG_HOT_CREDIT; a hot account's slots stay
+    // locked from a merge until its absolute balance is logged, so each
+    // credit lands on the right side of every absolute record, and
+    // checkpoints log hot accounts absolutely before the snapshot counts.
+    // Accrual is only logged when it takes a monthly charge, which counts
+    // towards the day's revenue (see settle): otherwise balances are logged
+    // with their AccrualState and days are logged as they close, so
+    // recovery accrues the same amounts again when the accounts are next
+    // touched. Log records name
+    // customers by ID, since handles are assigned as snapshot records are
+    // loaded and differ from run to run.
+    unique_ptr<WriteAheadLog> wal;
+    unique_ptr<MappedSnapshot> baseSnapshot;
+    string walPath;
+    uint64_t checkpointBytes;
+    // Set from when a commit asks for a checkpoint until the checkpointer
+    // thread has run it, so the log crossing the limit asks only once
+    atomic<bool> checkpointing;
+    mutex checkpointLock;       // held for the whole of a checkpoint
+    mutex checkpointerLock;
+    condition_variable checkpointWanted;
+    bool stoppingCheckpointer;
+    exception_ptr checkpointFailure;
+    thread checkpointer;
+    atomic<uint64_t> highestNumber;
+    atomic<uint32_t> businessDay;
+    // Accounts credited by LOG_HOT_CREDIT records during recovery
+    unordered_set<uint32_t> replayedHotCredits;
+
+    // Runs the checkpoints commits ask for. A failure is kept for the next
+    // commit that asks, as the log keeps every change until one succeeds.
+    void checkpointLoop() {
+        unique_lock<mutex> guard(checkpointerLock);
+        while (true) {
+            checkpointWanted.wait(guard, [this] { return stoppingCheckpointer || checkpointing; });
+            if (stoppingCheckpointer) {
+                break;
+            }
+            guard.unlock();
+            exception_ptr failure;
+            try {
+                checkpoint();
+            } catch (...) {
+                failure = current_exception();
+            }
+            guard.lock();
+            checkpointFailure = failure;
+            checkpointing = false;
+        }
+    }
+
+    // Looks up a customer already loaded into the table. The caller must
+    // hold tableMutex.
+    uint32_t findLoaded(const string& customerId, uint64_t hash) const {
+        return index.find(customerId, hash, [this](uint32_t handle) {
+            return customers[handle].customerId.view();
+        });
+    }
+
+    // The caller must hold tableMutex exclusively
+    uint32_t insertLoaded(const Customer& customer, uint64_t hash, Paise savings, Paise current,
+                          Paise salary, AccrualState accrual) {
+        uint32_t handle = customers.append(customer);
+        balanceStore.append(savings, current, salary, accrual);
+        index.insert(hash, handle);
+        uint64_t number = customerNumber(customer.customerId);
+        if (number > highestNumber.load(memory_order_relaxed)) {
+            highestNumber.store(number, memory_order_relaxed);
+        }
+        return handle;
+    }
+
+    // New customers come with a hash from hashPassword, or with no
+    // password at all; only records from old logs and snapshots may hold
+    // plaintext
+    static bool passwordStorable(const string& password) {
+        return password.empty() || PasswordHasher::isHashed(password);
+    }
+
+    static string_view contactField(const Customer& customer, SnapshotField which) {
+        return which == FIELD_EMAIL ? customer.email : customer.phone;
+    }
+
+    static string_view contactField(const CustomerProfile& profile, SnapshotField which) {
+        return which == FIELD_EMAIL ? profile.email : profile.phone;
+    }
+
+    CustomerIndex& contactIndex(SnapshotField which) {
+        return which == FIELD_EMAIL ? emailIndex : phoneIndex;
+    }
+
+    // Looks up a normalized email or phone among customers added since the
+    // snapshot, then in the snapshot itself. Returns the owner's ID, or an
+    // empty string. The caller must hold tableMutex.
+    string findContact(SnapshotField which, const string& key, uint64_t hash) const {
+        const CustomerIndex& contacts = which == FIELD_EMAIL ? emailIndex : phoneIndex;
+        uint32_t handle = contacts.find(key, hash, [this, which](uint32_t candidate) {
+            return contactKey(which, contactField(customers[candidate], which));
+        });
+        if (handle != CustomerIndex::NOT_FOUND) {
+            return string(customers[handle].customerId.view());
+        }
+        if (baseSnapshot) {
+            uint64_t record = baseSnapshot->findContact(which, key, hash);
+            if (record != MappedSnapshot::NOT_FOUND) {
+                return string(baseSnapshot->field(record, FIELD_ID));
+            }
+        }
+        return string();
+    }
+
+    // Adds a customer that is not in the snapshot to the email and phone
+    // indexes. The caller must hold tableMutex exclusively.
+    void indexContacts(uint32_t handle) {
+        for (SnapshotField which : {FIELD_EMAIL, FIELD_PHONE}) {
+            string key = contactKey(which, contactField(customers[handle], which));
+            if (!key.empty()) {
+                contactIndex(which).insert(CustomerIndex::hashId(key), handle);
+            }
+        }
+    }
+
+    uint32_t findHandleByContact(SnapshotField which, const string& value) {
+        string key = contactKey(which, value);
+        if (key.empty()) {
+            return CustomerIndex::NOT_FOUND;
+        }
+        string customerId;
+        {
+            shared_lock<shared_mutex> guard(tableMutex);
+            customerId = findContact(which, key, CustomerIndex::hashId(key));
+        }
+        return customerId.empty() ? CustomerIndex::NOT_FOUND : findHandle(customerId);
+    }
+
+    // Splits [0, count) into one contiguous range per thread and runs body
+    // on the ranges concurrently
+    static void parallelFor(size_t count, size_t threads, const function<void(size_t, size_t)>& body) {
+        size_t step = max<size_t>(1, (count + threads - 1) / threads);
+        vector<thread> workers;
+        for (size_t begin = 0; begin < count; begin += step) {
+            workers.emplace_back(body, begin, min(count, begin + step));
+        }
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    static void encodeCustomer(string& payload, const Customer& customer,
+                               Paise savings, Paise current, AccrualState accrual) {
+        RecordWriter out(payload);
+        out.put8(LOG_ADD_CUSTOMER);
+        out.putString(customer.customerId);
+        out.putString(customer.password);
+        out.putString(customer.name);
+        out.putString(customer.email);
+        out.putString(customer.address);
+        out.putString(customer.phone);
+        out.put8(customer.isFirstLogin);
+        out.put64(static_cast<uint64_t>(savings));
+        out.put64(static_cast<uint64_t>(current));
+        out.put32(accrual.day);
+        out.put64(static_cast<uint64_t>(accrual.interest));
+    }
+
+    // Appends an account's ID, balances and accrual state to a log record.
+    // The caller must hold the account lock.
+    void putAccount(RecordWriter& out, uint32_t handle) {
+        const AccrualState& accrual = balanceStore.accrual(handle);
+        out.putString(customerAt(handle).customerId.view());
+        out.put64(static_cast<uint64_t>(balanceStore.savings(handle)));
+        out.put64(static_cast<uint64_t>(balanceStore.current(handle)));
+        out.put64(static_cast<uint64_t>(balanceStore.salary(handle)));
+        out.put32(accrual.day);
+        out.put64(static_cast<uint64_t>(accrual.interest));
+    }
+
+    // Replays what putAccount wrote, or without the salary balance what
+    // it wrote before salary accounts. Returns false on a short record.
+    bool applyAccount(RecordReader& in, bool withSalary) {
+        string customerId;
+        uint64_t savings, current, salary, interest;
+        uint32_t day;
+        if (!in.getString(customerId) || !in.get64(savings) || !in.get64(current) ||
+            (withSalary && !in.get64(salary)) || !in.get32(day) || !in.get64(interest)) {
+            return false;
+        }
+        uint32_t handle = findHandle(customerId);
+        if (handle != CustomerIndex::NOT_FOUND) {
+            balanceStore.savings(handle) = static_cast<Paise>(savings);
+            balanceStore.current(handle) = static_cast<Paise>(current);
+            if (withSalary) {
+                balanceStore.salary(handle) = static_cast<Paise>(salary);
+            }
+            balanceStore.accrual(handle) = AccrualState{day, static_cast<int64_t>(interest)};
+        }
+        return true;
+    }
+
+    // Appends the counts of handle's stripe to a log record if they have
+    // changed since they were last logged. The caller must hold the
+    // account lock.
+    void putRevenue(RecordWriter& out, uint32_t handle) {
+        size_t stripe = AccountLocks::stripeOf(handle);
+        StripeRevenue& counted = revenue[stripe];
+        if (!counted.unlogged) {
+            return;
+        }
+        out.put32(static_cast<uint32_t>(stripe));
+        out.put32(counted.counts.day);
+        out.put64(static_cast<uint64_t>(counted.counts.penalties));
+        out.put64(static_cast<uint64_t>(counted.counts.charges));
+        counted.unlogged = false;
+    }
+
+    // Replays what putRevenue wrote. Returns false on a short record.
+    bool applyRevenue(RecordReader& in) {
+        uint32_t stripe;
+        DayRevenue counts;
+        uint64_t penalties, charges;
+        if (!in.get32(stripe) || !in.get32(counts.day) || !in.get64(penalties) ||
+            !in.get64(charges) || stripe >= AccountLocks::STRIPES) {
+            return false;
+        }
+        counts.penalties = static_cast<Paise>(penalties);
+        counts.charges = static_cast<Paise>(charges);
+        revenue[stripe].counts = counts;
+        return true;
+    }
+
+    // Applies one log record during recovery, before the database is
+    // shared with other threads
+    void applyLogRecord(const string& payload) {
+        RecordReader in(payload.data(), payload.size());
+        uint8_t type;
+        if (!in.get8(type)) {
+            return;
+        }
+
+        if (type == LOG_ADD_CUSTOMER) {
+            Customer customer;
+            uint8_t firstLogin;
+            uint64_t savings, current, interest;
+            uint32_t day;
+            if (!in.getString(customer.customerId) || !in.getString(customer.password) ||
+                !in.getString(customer.name) || !in.getString(customer.email) ||
+                !in.getString(customer.address) || !in.getString(customer.phone) ||
+                !in.get8(firstLogin) || !in.get64(savings) || !in.get64(current) ||
+                !in.get32(day) || !in.get64(interest)) {
+                return;
+            }
+            AccrualState accrual = {day, static_cast<int64_t>(interest)};
+            customer.isFirstLogin = firstLogin != 0;
+            if (!CustomerKey::fits(customer.customerId)) {
+                return;
+            }
+            uint32_t handle = findHandle(customer.customerId);
+            if (handle == CustomerIndex::NOT_FOUND) {
+                unique_lock<shared_mutex> guard(tableMutex);
+                indexContacts(insertLoaded(customer, CustomerIndex::hashId(customer.customerId),
+                                           static_cast<Paise>(savings), static_cast<Paise>(current),
+                                           0, accrual));
+            } else {
+                unique_lock<shared_mutex> guard(tableMutex);
+                customers.assign(handle, customer);
+                balanceStore.savings(handle) = static_cast<Paise>(savings);
+                balanceStore.current(handle) = static_cast<Paise>(current);
+                balanceStore.salary(handle) = 0;
+                balanceStore.accrual(handle) = accrual;
+            }
+        } else if (type == LOG_BALANCES || type == LOG_BALANCES_BEFORE_SALARY) {
+            uint8_t count;
+            if (!in.get8(count)) {
+                return;
+            }
+            for (uint8_t i = 0; i < count; i++) {
+                if (!applyAccount(in, type == LOG_BALANCES)) {
+                    return;
+                }
+            }
+            while (!in.done() && applyRevenue(in)) {
+            }
+        } else if (type == LOG_PASSWORD) {
+            string customerId, password;
+            uint8_t firstLogin;
+            if (!in.getString(customerId) || !in.getString(password) || !in.get8(firstLogin)) {
+                return;
+            }
+            uint32_t handle = findHandle(customerId);
+            if (handle != CustomerIndex::NOT_FOUND) {
+                customerAt(handle).password = customers.store(password);
+                customerAt(handle).isFirstLogin = firstLogin != 0;
+            }
+        } else if (type == LOG_HOT_CREDIT || type == LOG_HOT_CREDIT_BEFORE_SALARY) {
+            string toId;
+            uint64_t amount;
+            uint8_t accountType;
+            if (!applyAccount(in, type == LOG_HOT_CREDIT) || !in.getString(toId) || !in.get8(accountType) ||
+                !in.get64(amount)) {
+                return;
+            }
+            uint32_t toHandle = findHandle(toId);
+            const AccountRules* rules = AccountRules::find(static_cast<char>(accountType));
+            if (toHandle != CustomerIndex::NOT_FOUND && rules) {
+                balanceStore.balance(toHandle, rules->column) += static_cast<Paise>(amount);
+                replayedHotCredits.insert(toHandle);
+            }
+            if (!in.done()) {
+                applyRevenue(in);
+            }
+        } else if (type == LOG_DAY) {
+            uint32_t day;
+            if (!in.get32(day)) {
+                return;
+            }
+            if (day > businessDay.load()) {
+                businessDay = day;
+            }
+            DayRevenue closed;
+            uint64_t penalties, charges;
+            if (!in.done() && in.get32(closed.day) && in.get64(penalties) && in.get64(charges) &&
+                closed.day >= closedRevenue.day) {
+                closed.penalties = static_cast<Paise>(penalties);
+                closed.charges = static_cast<Paise>(charges);
+                closedRevenue = closed;
+            }
+        } else if (type == LOG_REVENUE) {
+            applyRevenue(in);
+        }
+    }
+
+    // Writes every customer to a new snapshot at path: records still only
+    // in the mapped snapshot are copied straight across, loaded ones are
+    // copied under their account lock. The result is a fuzzy image that the
+    // log written alongside it brings up to date. Hot accounts are merged
+    // and logged as they are copied, and the snapshot is only written once
+    // those records are durable, so no credit already in the snapshot is
+    // replayed on top of it.
+    void writeSnapshot(const string& path) {
+        SnapshotBuilder builder;
+        Customer customer;
+        Paise savings, current, salary;
+        AccrualState accrual;
+        uint64_t hotSequence = 0;
+        builder.setBusinessDay(businessDay.load());
+
+        if (baseSnapshot) {
+            for (uint64_t record = 0; record < baseSnapshot->size(); record++) {
+                string customerId(baseSnapshot->field(record, FIELD_ID));
+                bool loaded;
+                {
+                    shared_lock<shared_mutex> guard(tableMutex);
+                    loaded = findLoaded(customerId, CustomerIndex::hashId(customerId)) !=
+                             CustomerIndex::NOT_FOUND;
+                }
+                if (!loaded) {
+                    baseSnapshot->read(record, customer, savings, current, salary, accrual);
+                    builder.add(customer, savings, current, salary, accrual);
+                }
+            }
+        }
+
+        size_t count = size();
+        for (uint32_t handle = 0; handle < count; handle++) {
+            CustomerProfile& record = customerAt(handle);
+            {
+                unique_lock<mutex> account = accountLocks.lockOne(handle);
+                HotCredits::Merge merged = settle(handle);
+                customer = record.toCustomer();
+                savings = balanceStore.savings(handle);
+                current = balanceStore.current(handle);
+                salary = balanceStore.salary(handle);
+                accrual = balanceStore.accrual(handle);
+                if (hotCredits.find(handle) != HotCredits::NONE) {
+                    hotSequence = max(hotSequence, logBalances(handle));
+                }
+            }
+            builder.add(customer, savings, current, salary, accrual);
+        }
+        if (hotSequence != 0) {
+            wal->waitDurable(hotSequence);
+        }
+        builder.write(path);
+    }
+
+    // Accounts per reconcile task; a multiple of 64 so every word of a
+    // BalanceImage's marks falls in one task, dividing the BalanceStore
+    // chunk size so no task spans two chunks
+    static const uint32_t RECONCILE_BLOCK = 1024;
+
+    static_assert(BalanceStore::CHUNK_SIZE % RECONCILE_BLOCK == 0 && RECONCILE_BLOCK % 64 == 0,
+                  "Reconcile blocks must tile chunks and mark words");
+
+    // Four balances at a time as GCC vector extensions: SSE2 pairs on a
+    // baseline build, one AVX2 register when built for it. The build does
+    // not vectorize reductions itself at -O2.
+    typedef Paise BalanceLanes __attribute__((vector_size(32)));
+    typedef uint64_t CountLanes __attribute__((vector_size(32)));
+
+    // Adds n settled accounts to totals. A balance is below a minimum when
+    // subtracting it leaves the sign bit set, a shift SSE2 has where it has
+    // no 64-bit compare; balances are far from where that could overflow.
+    static void sumBalances(const Paise* savings, const Paise* current, const Paise* salary, size_t n,
+                            ReconciliationReport& totals) {
+        static const size_t LANES = sizeof(BalanceLanes) / sizeof(Paise);
+        BalanceLanes savingsTotal = {}, currentTotal = {}, salaryTotal = {};
+        CountLanes savingsBelow = {}, currentBelow = {}, salaryBelow = {};
+        size_t i = 0;
+        for (; i + LANES <= n; i += LANES) {
+            BalanceLanes savingsLanes, currentLanes, salaryLanes;
+            memcpy(&savingsLanes, savings + i, sizeof(savingsLanes));
+            memcpy(&currentLanes, current + i, sizeof(currentLanes));
+            memcpy(&salaryLanes, salary + i, sizeof(salaryLanes));
+            savingsTotal += savingsLanes;
+            currentTotal += currentLanes;
+            salaryTotal += salaryLanes;
+            savingsBelow += (CountLanes)(savingsLanes - SavingsPolicy::MIN_BALANCE) >> 63;
+            currentBelow += (CountLanes)(currentLanes - CurrentPolicy::MIN_BALANCE) >> 63;
+            salaryBelow += (CountLanes)salaryLanes >> 63;
+        }
+        for (size_t lane = 0; lane < LANES; lane++) {
+            totals.savingsTotal += savingsTotal[lane];
+            totals.currentTotal += currentTotal[lane];
+            totals.salaryTotal += salaryTotal[lane];
+            totals.savingsBelowMinimum += savingsBelow[lane];
+            totals.currentBelowMinimum += currentBelow[lane];
+            totals.salaryOverdrawn += salaryBelow[lane];
+        }
+        for (; i < n; i++) {
+            totals.savingsTotal += savings[i];
+            totals.currentTotal += current[i];
+            totals.salaryTotal += salary[i];
+            totals.savingsBelowMinimum += savings[i] < SavingsPolicy::MIN_BALANCE;
+            totals.currentBelowMinimum += current[i] < CurrentPolicy::MIN_BALANCE;
+            totals.salaryOverdrawn += salary[i] < 0;
+        }
+        totals.accounts += n;
+    }
+
+    // Adds loaded accounts [begin, end) of scan, which lie in one chunk,
+    // to totals. They are copied a word of the image at a time without
+    // their locks: from the image if they have changed since it opened,
+    // and otherwise from the store, where a writer waits for at most one
+    // word's copy.
+    void reconcileLoaded(BalanceImage& scan, uint32_t begin, uint32_t end,
+                         ReconciliationReport& totals) {
+        Paise savings[RECONCILE_BLOCK];
+        Paise current[RECONCILE_BLOCK];
+        Paise salary[RECONCILE_BLOCK];
+        AccrualState accrual[RECONCILE_BLOCK];
+        size_t n = end - begin;
+        for (uint32_t first = begin; first < end; first += 64) {
+            uint64_t saved = scan.beginWord(first >> 6);
+            for (uint32_t handle = first; handle < min(end, first + 64); handle++) {
+                size_t i = handle - begin;
+                if (saved & (uint64_t(1) << (handle & 63))) {
+                    const BalanceImage::Saved& copy = scan.saved(handle);
+                    savings[i] = copy.savings;
+                    current[i] = copy.current;
+                    salary[i] = copy.salary;
+                    accrual[i] = copy.accrual;
+                    totals.changedDuringScan++;
+                } else {
+                    savings[i] = balanceStore.savings(handle);
+                    current[i] = balanceStore.current(handle);
+                    salary[i] = balanceStore.salary(handle);
+                    accrual[i] = balanceStore.accrual(handle);
+                }
+            }
+            scan.finishWord(first >> 6);
+        }
+        uint32_t day = scan.businessDay();
+        for (size_t i = 0; i < n; i++) {
+            InterestAccrual::accrue(savings[i], current[i], accrual[i], day);
+        }
+        sumBalances(savings, current, salary, n, totals);
+    }
+
+    // Adds the records in [begin, end) of the mapped snapshot that were
+    // not loaded when scan opened to totals. Those still hold the balances
+    // they had then, even if loaded since.
+    void reconcileSnapshot(const BalanceImage& scan, uint64_t begin, uint64_t end,
+                           ReconciliationReport& totals) {
+        Paise savings[RECONCILE_BLOCK];
+        Paise current[RECONCILE_BLOCK];
+        Paise salary[RECONCILE_BLOCK];
+        bool loaded[RECONCILE_BLOCK];
+        {
+            shared_lock<shared_mutex> guard(tableMutex);
+            for (uint64_t record = begin; record < end; record++) {
+                string customerId(baseSnapshot->field(record, FIELD_ID));
+                uint32_t handle = findLoaded(customerId, CustomerIndex::hashId(customerId));
+                loaded[record - begin] = handle != CustomerIndex::NOT_FOUND && handle < scan.size();
+            }
+        }
+        size_t n = 0;
+        uint32_t day = scan.businessDay();
+        for (uint64_t record = begin; record < end; record++) {
+            if (loaded[record - begin]) {
+                continue;
+            }
+            AccrualState accrual;
+            baseSnapshot->readBalances(record, savings[n], current[n], salary[n], accrual);
+            InterestAccrual::accrue(savings[n], current[n], accrual, day);
+            n++;
+        }
+        sumBalances(savings, current, salary, n, totals);
+    }
+
+public:
+    static const uint8_t MAX_FAILED_LOGINS = 5;
+    static const uint32_t LOCKOUT_SECONDS = 15 * 60;
+
+    CustomerDatabase() : clock(monotonicNanoseconds), revenue(new StripeRevenue[AccountLocks::STRIPES]),
+                         image(nullptr), checkpointBytes(0), checkpointing(false),
+                         stoppingCheckpointer(false), highestNumber(0),
+                         businessDay(InterestAccrual::today()) {}
+
+    ~CustomerDatabase() {
+        if (checkpointer.joinable()) {
+            {
+                lock_guard<mutex> guard(checkpointerLock);
+                stoppingCheckpointer = true;
+            }
+            checkpointWanted.notify_one();
+            checkpointer.join();
+        }
+    }
+
+    CustomerDatabase(const CustomerDatabase&) = delete;
+    CustomerDatabase& operator=(const CustomerDatabase&) = delete;
+
+    // Recovers state from the snapshot and logs under path, then logs every
+    // later change there. Records appended within groupWindow of each other
+    // share one fsync; once the log grows past checkpointLimit bytes it is
+    // folded into a fresh snapshot.
+    void open(const string& path,
+              chrono::microseconds groupWindow = chrono::microseconds(200),
+              uint64_t checkpointLimit = uint64_t(64) << 20) {
+        if (wal) {
+            throw DatabaseException("Database is already open");
+        }
+        string snapshotPath = path + ".snapshot";
+        string retiredPath = path + ".prev";
+        auto apply = [this](const string& payload) { applyLogRecord(payload); };
+
+        baseSnapshot = MappedSnapshot::open(snapshotPath);
+        uint32_t createdDay = businessDay;
+        businessDay = 0;
+        if (baseSnapshot) {
+            highestNumber = baseSnapshot->highestCustomerNumber();
+            businessDay = baseSnapshot->businessDay();
+        }
+        bool interrupted = WriteAheadLog::replay(retiredPath, apply) >= 0;
+        int64_t intactBytes = WriteAheadLog::replay(path, apply);
+
+        if (businessDay == 0) {
+            // A new database starts on the day it was created
+            businessDay = createdDay;
+        }
+
+        // Cut off a torn tail first: records appended behind it would be
+        // lost at the next recovery, which stops there
+        struct stat info;
+        if (intactBytes >= 0 && ::stat(path.c_str(), &info) == 0 && info.st_size != intactBytes &&
+            ::truncate(path.c_str(), static_cast<off_t>(intactBytes)) != 0) {
+            throw DatabaseException("Unable to repair log file " + path);
+        }
+        walPath = path;
+        checkpointBytes = checkpointLimit;
+        wal.reset(new WriteAheadLog(path, groupWindow));
+        checkpointer = thread(&CustomerDatabase::checkpointLoop, this);
+
+        // The day's revenue may only be in a retired log, removed below
+        uint64_t sequence = logRevenue();
+        if (interrupted) {
+            // A checkpoint did not finish; fold both logs into a new
+            // snapshot. Either log can outlive the snapshot if this is cut
+            // short too, so every account they credited as hot is first
+            // logged absolutely at the end of the live one, as a running
+            // checkpoint does: a credit replayed on top of the snapshot is
+            // then overwritten by a record that comes after it.
+            for (uint32_t handle : replayedHotCredits) {
+                sequence = max(sequence, logBalances(handle));
+            }
+            if (sequence != 0) {
+                wal->waitDurable(sequence);
+            }
+            writeSnapshot(snapshotPath);
+            ::unlink(retiredPath.c_str());
+        }
+        replayedHotCredits.clear();
+    }
+
+    // Logs the current balances of one or two accounts as a single record.
+    // The caller must hold the account locks; returns the sequence number
+    // to pass to commit, or 0 when no log is attached.
+    uint64_t logBalances(uint32_t first, uint32_t second = CustomerIndex::NOT_FOUND) {
+        if (!wal) {
+            return 0;
+        }
+        string payload;
+        RecordWriter out(payload);
+        bool both = second != CustomerIndex::NOT_FOUND && second != first;
+        out.put8(LOG_BALANCES);
+        out.put8(both ? 2 : 1);
+        putAccount(out, first);
+        if (both) {
+            putAccount(out, second);
+        }
+        putRevenue(out, first);
+        if (both) {
+            putRevenue(out, second);
+        }
+        return wal->append(payload);
+    }
+
+    // Logs the business day and the revenue of the last one closed
+    uint64_t logDay() {
+        if (!wal) {
+            return 0;
+        }
+        lock_guard<mutex> guard(dayLock);
+        string payload;
+        RecordWriter out(payload);
+        out.put8(LOG_DAY);
+        out.put32(businessDay.load());
+        if (closedRevenue.day != 0) {
+            out.put32(closedRevenue.day);
+            out.put64(static_cast<uint64_t>(closedRevenue.penalties));
+            out.put64(static_cast<uint64_t>(closedRevenue.charges));
+        }
+        return wal->append(payload);
+    }
+
+    // Logs the day and every stripe's counts for it, each under its
+    // stripe's lock, so they outlive a log about to be retired
+    uint64_t logRevenue() {
+        if (!wal) {
+            return 0;
+        }
+        uint64_t sequence = logDay();
+        for (uint32_t stripe = 0; stripe < AccountLocks::STRIPES; stripe++) {
+            unique_lock<mutex> account = accountLocks.lockOne(stripe);
+            const DayRevenue& counts = revenue[stripe].counts;
+            if (counts.day != businessDay.load() || (counts.penalties == 0 && counts.charges == 0)) {
+                continue;
+            }
+            string payload;
+            RecordWriter out(payload);
+            out.put8(LOG_REVENUE);
+            revenue[stripe].unlogged = true;
+            putRevenue(out, stripe);
+            sequence = wal->append(payload);
+        }
+        return sequence;
+    }
+
+    // Debits made to fromHandle and a credit of amount to hot account
+    // toHandle, logged as one record. The caller must hold fromHandle's
+    // account lock; toHandle's lock is not needed. hot is toHandle's index
+    // from hotIndex.
+    uint64_t creditHot(size_t hot, uint32_t fromHandle, uint32_t toHandle, const AccountRules& toRules,
+                       Paise amount) {
+        return hotCredits.credit(hot, toRules.column, amount, [&]() -> uint64_t {
+            if (!wal) {
+                return 0;
+            }
+            string payload;
+            RecordWriter out(payload);
+            out.put8(LOG_HOT_CREDIT);
+            putAccount(out, fromHandle);
+            out.putString(customerAt(toHandle).customerId.view());
+            out.put8(static_cast<uint8_t>(toRules.code));
+            out.put64(static_cast<uint64_t>(amount));
+            putRevenue(out, fromHandle);
+            return wal->append(payload);
+        });
+    }
+
+    // Brings an account's balances up to date before they are read or
+    // changed: posts the credits pending in a hot account's slots, then
+    // accrues interest and charges for the days closed since its last
+    // touch. While reconcile runs, the balances are first saved to its
+    // image. The caller must hold the account lock and, for a hot account,
+    // keep the result until the new balances are logged.
+    HotCredits::Merge settle(uint32_t handle) {
+        BalanceImage* scanning = image.load(memory_order_acquire);
+        if (scanning) {
+            scanning->preserve(handle, balanceStore);
+        }
+        size_t hot = hotCredits.find(handle);
+        HotCredits::Merge merged = hot != HotCredits::NONE ? hotCredits.merge(hot, balanceStore, handle)
+                                                           : HotCredits::Merge();
+        Paise charged = 0;
+        InterestAccrual::accrue(balanceStore.savings(handle), balanceStore.current(handle),
+                                balanceStore.accrual(handle),
+                                businessDay.load(memory_order_relaxed), &charged);
+        if (charged != 0) {
+            // Logged now, since not every caller logs what it settles
+            openRevenue(handle).charges += charged;
+            logBalances(handle);
+        }
+        return merged;
+    }
+
+    // settle for both accounts of a transfer, lower handle first
+    pair<HotCredits::Merge, HotCredits::Merge> settle(uint32_t first, uint32_t second) {
+        if (first == second) {
+            return {settle(first), HotCredits::Merge()};
+        }
+        if (first > second) {
+            swap(first, second);
+        }
+        HotCredits::Merge low = settle(first);
+        HotCredits::Merge high = settle(second);
+        return {std::move(low), std::move(high)};
+    }
+
+    // handle's stripe's counts for the open day, to be changed and then
+    // logged with handle's balances. The caller must hold the account lock.
+    DayRevenue& openRevenue(uint32_t handle) {
+        StripeRevenue& counted = revenue[AccountLocks::stripeOf(handle)];
+        uint32_t today = businessDay.load(memory_order_relaxed);
+        if (counted.counts.day != today) {
+            counted.counts = DayRevenue();
+            counted.counts.day = today;
+        }
+        counted.unlogged = true;
+        return counted.counts;
+    }
+
+    // Counts a debit penalty towards the day's revenue; it is logged with
+    // handle's next balances. The caller must hold handle's account lock.
+    void chargePenalty(uint32_t handle, Paise amount) {
+        openRevenue(handle).penalties += amount;
+    }
+
+    // Limits on what each customer may withdraw and transfer out (see
+    // ATM); none by default. Set before transactions start.
+    void setVelocityLimits(const VelocityLimits& limits) {
+        velocity.setLimits(limits);
+    }
+
+    const VelocityLimiter& velocityLimiter() const {
+        return velocity;
+    }
+
+    // The clock velocity limits and login lockouts run on,
+    // monotonicNanoseconds unless replaced (see CaptureReplay). Set before
+    // transactions start.
+    void setClock(function<int64_t()> now) {
+        clock = std::move(now);
+    }
+
+    int64_t now() const {
+        return clock();
+    }
+
+    // Waits until the logged change is durable. Call after releasing any
+    // account locks so the fsync wait does not hold them.
+    void commit(uint64_t sequence) {
+        if (!wal || sequence == 0) {
+            return;
+        }
+        OperationTimer timer(METRIC_COMMIT);
+        wal->waitDurable(sequence);
+        if (wal->size() > checkpointBytes && !checkpointing.exchange(true)) {
+            exception_ptr failure;
+            {
+                lock_guard<mutex> guard(checkpointerLock);
+                failure = checkpointFailure;
+                checkpointFailure = nullptr;
+            }
+            checkpointWanted.notify_one();
+            if (failure) {
+                rethrow_exception(failure);
+            }
+        }
+    }
+
+    // Rotates the log aside, writes a fresh snapshot and drops the rotated
+    // log. Live traffic keeps running; changes made meanwhile go to the new
+    // log and are replayed over the snapshot on recovery. Commits that
+    // push the log past its limit hand this to a background thread, so no
+    // transaction waits for a snapshot to be written.
+    void checkpoint() {
+        if (!wal) {
+            return;
+        }
+        // One at a time: a second rotation would overwrite the log the
+        // first is still folding into its snapshot
+        lock_guard<mutex> guard(checkpointLock);
+        OperationTimer timer(METRIC_CHECKPOINT);
+        string retiredPath = walPath + ".prev";
+        wal->rotate(retiredPath);
+        wal->waitDurable(logRevenue());
+        writeSnapshot(walPath + ".snapshot");
+        ::unlink(retiredPath.c_str());
+    }
+
+    // Writes the current state to a snapshot at path, apart from the log
+    void saveSnapshot(const string& path) {
+        writeSnapshot(path);
+    }
+
+    // Checksum of every customer's details and settled balances, the same
+    // whichever order customers were loaded in. Password hashes are left
+    // out: they are salted afresh each time, so equal passwords differ.
+    // Hot accounts are settled and logged as writeSnapshot does.
+    uint64_t stateChecksum() {
+        uint32_t day = businessDay.load();
+        uint64_t sum = 0;
+        auto add = [&sum](const Customer& customer, Paise savings, Paise current, Paise salary,
+                          const AccrualState& accrual) {
+            string fields;
+            RecordWriter out(fields);
+            for (const string* field : {&customer.customerId, &customer.name, &customer.email,
+                                        &customer.address, &customer.phone}) {
+                out.putString(*field);
+            }
+            out.put8(customer.isFirstLogin ? 1 : 0);
+            out.put64(static_cast<uint64_t>(savings));
+            out.put64(static_cast<uint64_t>(current));
+            out.put64(static_cast<uint64_t>(salary));
+            out.put64(static_cast<uint64_t>(accrual.interest));
+            sum += CustomerIndex::hashId(fields);
+        };
+
+        Customer customer;
+        Paise savings, current, salary;
+        AccrualState accrual;
+        if (baseSnapshot) {
+            for (uint64_t record = 0; record < baseSnapshot->size(); record++) {
+                string customerId(baseSnapshot->field(record, FIELD_ID));
+                bool loaded;
+                {
+                    shared_lock<shared_mutex> guard(tableMutex);
+                    loaded = findLoaded(customerId, CustomerIndex::hashId(customerId)) !=
+                             CustomerIndex::NOT_FOUND;
+                }
+                if (loaded) {
+                    continue;
+                }
+                baseSnapshot->read(record, customer, savings, current, salary, accrual);
+                InterestAccrual::accrue(savings, current, accrual, day);
+                add(customer, savings, current, salary, accrual);
+            }
+        }
+        size_t count = size();
+        uint64_t hotSequence = 0;
+        for (uint32_t handle = 0; handle < count; handle++) {
+            CustomerProfile& record = customerAt(handle);
+            {
+                unique_lock<mutex> account = accountLocks.lockOne(handle);
+                HotCredits::Merge merged = settle(handle);
+                customer = record.toCustomer();
+                savings = balanceStore.savings(handle);
+                current = balanceStore.current(handle);
+                salary = balanceStore.salary(handle);
+                accrual = balanceStore.accrual(handle);
+                if (hotCredits.find(handle) != HotCredits::NONE) {
+                    hotSequence = max(hotSequence, logBalances(handle));
+                }
+            }
+            add(customer, savings, current, salary, accrual);
+        }
+        commit(hotSequence);
+        return sum;
+    }
+
+    // End-of-day totals over every account as of one moment, taken while
+    // traffic goes on. Writers are held off only while the moment is
+    // fixed: every account lock is taken, hot accounts are merged, and a
+    // BalanceImage is opened that saves each account's balances on its
+    // first change after that. threads workers then scan the loaded
+    // accounts and the records still only in the mapped snapshot in blocks
+    // shared out by StealingRanges. One reconcile runs at a time.
+    ReconciliationReport reconcile(size_t threads = 0) {
+        lock_guard<mutex> one(reconcileLock);
+        if (threads == 0) {
+            threads = max<size_t>(1, thread::hardware_concurrency());
+        }
+        ReconciliationReport report;
+        unique_ptr<BalanceImage> opened;
+        uint64_t hotSequence = 0;
+        while (!opened) {
+            // Sized before the locks are taken; tried again if more
+            // customers than that arrive before they are all held
+            size_t capacity = size() + RECONCILE_BLOCK;
+            unique_ptr<BalanceImage> candidate(new BalanceImage(capacity));
+            auto paused = chrono::steady_clock::now();
+            vector<unique_lock<mutex>> accounts = accountLocks.lockAll();
+            size_t count = size();
+            if (count > capacity) {
+                continue;
+            }
+            vector<HotCredits::Merge> merged;
+            merged.reserve(hotCredits.size());
+            for (size_t hot = 0; hot < hotCredits.size(); hot++) {
+                uint32_t handle = hotCredits.handle(hot);
+                merged.push_back(settle(handle));
+                hotSequence = max(hotSequence, logBalances(handle));
+            }
+            report.businessDay = businessDay.load();
+            for (size_t stripe = 0; stripe < AccountLocks::STRIPES; stripe++) {
+                const DayRevenue& counts = revenue[stripe].counts;
+                if (counts.day == report.businessDay) {
+                    report.penaltyRevenue += counts.penalties;
+                    report.chargeRevenue += counts.charges;
+                }
+            }
+            candidate->open(static_cast<uint32_t>(count), report.businessDay);
+            image.store(candidate.get(), memory_order_release);
+            opened = std::move(candidate);
+            merged.clear();
+            report.pauseSeconds = chrono::duration<double>(chrono::steady_clock::now() - paused).count();
+        }
+        commit(hotSequence);
+
+        auto started = chrono::steady_clock::now();
+        uint32_t count = opened->size();
+        uint32_t loadedBlocks = (count + RECONCILE_BLOCK - 1) / RECONCILE_BLOCK;
+        uint64_t records = baseSnapshot ? baseSnapshot->size() : 0;
+        uint32_t recordBlocks = static_cast<uint32_t>((records + RECONCILE_BLOCK - 1) / RECONCILE_BLOCK);
+        StealingRanges blocks(loadedBlocks + recordBlocks, threads);
+        vector<ReconciliationReport> totals(threads);
+        vector<exception_ptr> failures(threads);
+        parallelFor(threads, threads, [&](size_t first, size_t last) {
+            for (size_t worker = first; worker < last; worker++) {
+                try {
+                    uint32_t block;
+                    while (blocks.next(worker, block)) {
+                        if (block < loadedBlocks) {
+                            uint32_t begin = block * RECONCILE_BLOCK;
+                            reconcileLoaded(*opened, begin, min<uint32_t>(count, begin + RECONCILE_BLOCK),
+                                            totals[worker]);
+                        } else {
+                            uint64_t begin = uint64_t(block - loadedBlocks) * RECONCILE_BLOCK;
+                            reconcileSnapshot(*opened, begin, min<uint64_t>(records, begin + RECONCILE_BLOCK),
+                                              totals[worker]);
+                        }
+                    }
+                } catch (...) {
+                    failures[worker] = current_exception();
+                }
+            }
+        });
+
+        // Writers that found the image hold their account's stripe while
+        // they use it, so once each stripe has been taken none is left
+        image.store(nullptr, memory_order_release);
+        for (uint32_t stripe = 0; stripe < AccountLocks::STRIPES; stripe++) {
+            accountLocks.lockOne(stripe);
+        }
+        for (const exception_ptr& failure : failures) {
+            if (failure) {
+                rethrow_exception(failure);
+            }
+        }
+
+        for (const ReconciliationReport& part : totals) {
+            report.accounts += part.accounts;
+            report.savingsTotal += part.savingsTotal;
+            report.currentTotal += part.currentTotal;
+            report.salaryTotal += part.salaryTotal;
+            report.savingsBelowMinimum += part.savingsBelowMinimum;
+            report.currentBelowMinimum += part.currentBelowMinimum;
+            report.salaryOverdrawn += part.salaryOverdrawn;
+            report.changedDuringScan += part.changedDuringScan;
+        }
+        report.scanSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        return report;
+    }
+
+    // Ends the business day and returns the new one. The closed day's
+    // revenue is totalled while every account lock is held, so no penalty
+    // or charge falls between it and the new day, and logged with it.
+    // Accounts accrue the closed day when next touched or swept (see
+    // accrueRange); hot accounts are settled here so the credits waiting
+    // in their slots are posted on the day they arrived.
+    uint32_t closeDay() {
+        uint32_t day;
+        uint64_t sequence;
+        {
+            vector<unique_lock<mutex>> accounts = accountLocks.lockAll();
+            DayRevenue closed;
+            closed.day = businessDay.load();
+            for (size_t stripe = 0; stripe < AccountLocks::STRIPES; stripe++) {
+                const DayRevenue& counts = revenue[stripe].counts;
+                if (counts.day == closed.day) {
+                    closed.penalties += counts.penalties;
+                    closed.charges += counts.charges;
+                }
+            }
+            {
+                lock_guard<mutex> guard(dayLock);
+                closedRevenue = closed;
+                day = closed.day + 1;
+                businessDay = day;
+            }
+            sequence = logDay();
+        }
+        for (size_t hot = 0; hot < hotCredits.size(); hot++) {
+            uint32_t handle = hotCredits.handle(hot);
+            unique_lock<mutex> account = accountLocks.lockOne(handle);
+            HotCredits::Merge merged = settle(handle);
+            sequence = max(sequence, logBalances(handle));
+        }
+        commit(sequence);
+        return day;
+    }
+
+    uint32_t currentDay() const {
+        return businessDay.load();
+    }
+
+    // Penalties and monthly charges of the last business day closed
+    DayRevenue closedDayRevenue() {
+        lock_guard<mutex> guard(dayLock);
+        return closedRevenue;
+    }
+
+    // Settles the loaded accounts in [begin, end), locking one at a time.
+    // Returns how many had days to accrue.
+    size_t accrueRange(uint32_t begin, uint32_t end) {
+        uint32_t today = businessDay.load();
+        size_t accrued = 0;
+        for (uint32_t handle = begin; handle < end; handle++) {
+            unique_lock<mutex> account = accountLocks.lockOne(handle);
+            accrued += balanceStore.accrual(handle).day < today;
+            settle(handle);
+        }
+        return accrued;
+    }
+
+    size_t size() const {
+        shared_lock<shared_mutex> guard(tableMutex);
+        return customers.size();
+    }
+
+    // Highest number among IDs of the form CUSTnnn, including customers
+    // still only in the mapped snapshot
+    uint64_t highestCustomerNumber() const {
+        return highestNumber.load();
+    }
+
+    void reserve(size_t count) {
+        unique_lock<shared_mutex> guard(tableMutex);
+        index.reserve(count);
+    }
+
+    // Resolves a customer ID to its handle, loading the customer from the
+    // mapped snapshot on first use
+    uint32_t findHandle(const string& customerId) {
+        OperationTimer timer(METRIC_FIND_CUSTOMER);
+        uint64_t hash = CustomerIndex::hashId(customerId);
+        uint64_t record;
+        {
+            shared_lock<shared_mutex> guard(tableMutex);
+            uint32_t handle = findLoaded(customerId, hash);
+            if (handle != CustomerIndex::NOT_FOUND || !baseSnapshot) {
+                return handle;
+            }
+            record = baseSnapshot->find(customerId, hash);
+            if (record == MappedSnapshot::NOT_FOUND) {
+                return CustomerIndex::NOT_FOUND;
+            }
+        }
+
+        unique_lock<shared_mutex> guard(tableMutex);
+        uint32_t handle = findLoaded(customerId, hash);
+        if (handle == CustomerIndex::NOT_FOUND) {
+            Customer customer;
+            Paise savings, current, salary;
+            AccrualState accrual;
+            baseSnapshot->read(record, customer, savings, current, salary, accrual);
+            handle = insertLoaded(customer, hash, savings, current, salary, accrual);
+        }
+        return handle;
+    }
+
+    CustomerProfile& customerAt(uint32_t handle) {
+        shared_lock<shared_mutex> guard(tableMutex);
+        return customers[handle];
+    }
+
+    BalanceStore& balances() {
+        return balanceStore;
+    }
+
+    AccountLocks& locks() {
+        return accountLocks;
+    }
+
+    // Sends credits to customerId through per-CPU slots from now on (see
+    // HotCredits). Returns false if there is no such customer or too many
+    // accounts are hot already.
+    bool markHot(const string& customerId) {
+        uint32_t handle = findHandle(customerId);
+        return handle != CustomerIndex::NOT_FOUND && hotCredits.add(handle);
+    }
+
+    // Index of handle among the hot accounts, or HotCredits::NONE
+    size_t hotIndex(uint32_t handle) const {
+        return hotCredits.find(handle);
+    }
+
+    void addCustomer(const Customer& customer, Paise savings, Paise current) {
+        OperationTimer timer(METRIC_ADD_CUSTOMER);
+        try {
+            uint64_t sequence = 0;
+            {
+                unique_lock<shared_mutex> guard(tableMutex);
+                if (customers.size() >= CustomerIndex::NOT_FOUND) {
+                    throw DatabaseException("Maximum customer limit reached");
+                }
+                if (!CustomerKey::fits(customer.customerId)) {
+                    throw DatabaseException("Customer ID is too long");
+                }
+                if (!passwordStorable(customer.password)) {
+                    throw DatabaseException("Password must be hashed with hashPassword");
+                }
+                uint64_t hash = CustomerIndex::hashId(customer.customerId);
+                if (findLoaded(customer.customerId, hash) != CustomerIndex::NOT_FOUND ||
+                    (baseSnapshot && baseSnapshot->find(customer.customerId, hash) != MappedSnapshot::NOT_FOUND)) {
+                    throw DatabaseException("Customer ID already exists");
+                }
+                for (SnapshotField which : {FIELD_EMAIL, FIELD_PHONE}) {
+                    string key = contactKey(which, contactField(customer, which));
+                    if (!key.empty() && !findContact(which, key, CustomerIndex::hashId(key)).empty()) {
+                        throw DatabaseException(which == FIELD_EMAIL ? "Email is already registered"
+                                                                     : "Phone number is already registered");
+                    }
+                }
+                AccrualState accrual = {businessDay.load(), 0};
+                indexContacts(insertLoaded(customer, hash, savings, current, 0, accrual));
+                if (wal) {
+                    string payload;
+                    encodeCustomer(payload, customer, savings, current, accrual);
+                    sequence = wal->append(payload);
+                }
+            }
+            commit(sequence);
+        } catch (const DatabaseException& e) {
+            throw;
+        } catch (...) {
+            throw DatabaseException("Unknown error while adding customer");
+        }
+    }
+
+    // Adds many customers in one pass instead of one addCustomer call per
+    // row. Keys are hashed and checked in parallel over slices of rows, then
+    // the ID, email and phone indexes are filled side by side while the
+    // rows are moved into the table. Throws DatabaseException and adds
+    // nothing if any row repeats an ID, email or phone already in use or
+    // used by another row.
+    void importCustomers(vector<ImportRow>&& rows, size_t threads = 0) {
+        OperationTimer timer(METRIC_IMPORT_CUSTOMERS);
+        enum { KEY_ID, KEY_EMAIL, KEY_PHONE, KEY_COUNT };
+        static const SnapshotField keyFields[KEY_COUNT] = {FIELD_ID, FIELD_EMAIL, FIELD_PHONE};
+        size_t count = rows.size();
+        if (count == 0) {
+            return;
+        }
+        if (threads == 0) {
+            threads = max<size_t>(1, thread::hardware_concurrency());
+        }
+
+        auto keyOf = [&rows](size_t row, int key) {
+            const Customer& customer = rows[row].customer;
+            return key == KEY_ID ? customer.customerId
+                                 : contactKey(keyFields[key], contactField(customer, keyFields[key]));
+        };
+
+        uint64_t sequence = 0;
+        {
+            unique_lock<shared_mutex> guard(tableMutex);
+            uint32_t base = static_cast<uint32_t>(customers.size());
+            if (customers.size() + count >= CustomerIndex::NOT_FOUND) {
+                throw DatabaseException("Maximum customer limit reached");
+            }
+            for (size_t row = 0; row < count; row++) {
+                if (!CustomerKey::fits(rows[row].customer.customerId)) {
+                    throw DatabaseException("Import row " + to_string(row) + " has an ID that is too long");
+                }
+                if (!passwordStorable(rows[row].customer.password)) {
+                    throw DatabaseException("Import row " + to_string(row) + " has a password that is not hashed");
+                }
+            }
+
+            // Hash every key and check it against the customers already stored
+            vector<uint64_t> hashes[KEY_COUNT];
+            vector<uint8_t> hasKey[KEY_COUNT];
+            for (int key = 0; key < KEY_COUNT; key++) {
+                hashes[key].resize(count);
+                hasKey[key].resize(count);
+            }
+            atomic<size_t> firstConflict(count);
+            atomic<uint64_t> highestImported(0);
+            auto conflict = [&firstConflict](size_t row) {
+                size_t seen = firstConflict.load();
+                while (row < seen && !firstConflict.compare_exchange_weak(seen, row)) {
+                }
+            };
+            parallelFor(count, threads, [&](size_t begin, size_t end) {
+                uint64_t highest = 0;
+                for (size_t row = begin; row < end; row++) {
+                    const string& customerId = rows[row].customer.customerId;
+                    uint64_t idHash = CustomerIndex::hashId(customerId);
+                    hashes[KEY_ID][row] = idHash;
+                    hasKey[KEY_ID][row] = 1;
+                    if (findLoaded(customerId, idHash) != CustomerIndex::NOT_FOUND ||
+                        (baseSnapshot && baseSnapshot->find(customerId, idHash) != MappedSnapshot::NOT_FOUND)) {
+                        conflict(row);
+                    }
+                    for (int key = KEY_EMAIL; key < KEY_COUNT; key++) {
+                        string value = keyOf(row, key);
+                        if (value.empty()) {
+                            continue;
+                        }
+                        hashes[key][row] = CustomerIndex::hashId(value);
+                        hasKey[key][row] = 1;
+                        if (!findContact(keyFields[key], value, hashes[key][row]).empty()) {
+                            conflict(row);
+                        }
+                    }
+                    highest = max(highest, customerNumber(customerId));
+                }
+                uint64_t seen = highestImported.load();
+                while (highest > seen && !highestImported.compare_exchange_weak(seen, highest)) {
+                }
+            });
+
+            // Rows repeating each other's keys end up next to each other
+            // once each key column is sorted by hash
+            auto findRepeats = [&](int key) {
+                vector<pair<uint64_t, uint32_t>> sorted;
+                sorted.reserve(count);
+                for (size_t row = 0; row < count; row++) {
+                    if (hasKey[key][row]) {
+                        sorted.emplace_back(hashes[key][row], static_cast<uint32_t>(row));
+                    }
+                }
+                sort(sorted.begin(), sorted.end());
+                for (size_t first = 0; first < sorted.size();) {
+                    size_t last = first + 1;
+                    while (last < sorted.size() && sorted[last].first == sorted[first].first) {
+                        last++;
+                    }
+                    for (size_t i = first; i < last; i++) {
+                        for (size_t j = i + 1; j < last; j++) {
+                            if (keyOf(sorted[i].second, key) == keyOf(sorted[j].second, key)) {
+                                conflict(sorted[j].second);
+                            }
+                        }
+                    }
+                    first = last;
+                }
+            };
+            vector<thread> workers;
+            for (int key = 0; key < KEY_COUNT; key++) {
+                workers.emplace_back(findRepeats, key);
+            }
+            for (thread& worker : workers) {
+                worker.join();
+            }
+            workers.clear();
+            if (firstConflict < count) {
+                throw DatabaseException("Import row " + to_string(firstConflict.load()) +
+                                        " repeats an ID, email or phone already in use");
+            }
+
+            // Each index is filled on its own thread from the hashes alone,
+            // while this one logs the rows and moves them into the table
+            index.reserve(customers.size() + count);
+            emailIndex.reserve(customers.size() + count);
+            phoneIndex.reserve(customers.size() + count);
+            CustomerIndex* targets[KEY_COUNT] = {&index, &emailIndex, &phoneIndex};
+            for (int key = 0; key < KEY_COUNT; key++) {
+                workers.emplace_back([&, key] {
+                    for (size_t row = 0; row < count; row++) {
+                        if (hasKey[key][row]) {
+                            targets[key]->insert(hashes[key][row], base + static_cast<uint32_t>(row));
+                        }
+                    }
+                });
+            }
+            AccrualState accrual = {businessDay.load(), 0};
+            if (wal) {
+                string payload;
+                for (const ImportRow& row : rows) {
+                    payload.clear();
+                    encodeCustomer(payload, row.customer, row.savings, row.current, accrual);
+                    sequence = wal->append(payload);
+                }
+            }
+            for (ImportRow& row : rows) {
+                customers.append(row.customer);
+                balanceStore.append(row.savings, row.current, 0, accrual);
+            }
+            for (thread& worker : workers) {
+                worker.join();
+            }
+            if (highestImported > highestNumber) {
+                highestNumber = highestImported.load();
+            }
+        }
+        commit(sequence);
+    }
+
+    // Resolves an email address or phone number to the handle of the
+    // customer who registered it, or NOT_FOUND
+    uint32_t findHandleByEmail(const string& email) {
+        return findHandleByContact(FIELD_EMAIL, email);
+    }
+
+    uint32_t findHandleByPhone(const string& phone) {
+        return findHandleByContact(FIELD_PHONE, phone);
+    }
+
+    // Returns null when the customer does not exist
+    CustomerProfile* findCustomer(const string& customerId) {
+        uint32_t handle = findHandle(customerId);
+        return handle == CustomerIndex::NOT_FOUND ? nullptr : &customerAt(handle);
+    }
+
+    CredentialService& credentialService() {
+        return credentials;
+    }
+
+    // Hashes a password for storage at the current cost setting
+    string hashPassword(const string& password) {
+        return credentials.hashAsync(password).get();
+    }
+
+    // Starts checking a login on the credential worker pool. The
+    // MAX_FAILED_LOGINS-th failure in a row locks the account for
+    // LOCKOUT_SECONDS. Outcomes are settled one at a time under the account
+    // lock, and any that settles while it is locked is refused, so guesses
+    // already on the pool when it locks cannot get in either. done is as
+    // for CredentialService::verifyAsync.
+    future<Status> validateCredentialsAsync(const string& customerId, const string& password,
+                                            function<void()> done = nullptr) {
+        uint32_t handle = findHandle(customerId);
+        if (handle == CustomerIndex::NOT_FOUND) {
+            promise<Status> unknown;
+            unknown.set_value(Status::INVALID_CREDENTIALS);
+            return unknown.get_future();
+        }
+        CustomerProfile& customer = customerAt(handle);
+        string stored;
+        {
+            unique_lock<mutex> account = accountLocks.lockOne(handle);
+            if (customer.lockedUntil > monotonicSeconds()) {
+                promise<Status> locked;
+                locked.set_value(Status::ACCOUNT_LOCKED);
+                return locked.get_future();
+            }
+            stored = customer.password;
+        }
+        return credentials.verifyAsync(handle, password, stored,
+                                       [this, &customer, handle, password, stored](Status status) {
+            {
+                unique_lock<mutex> account = accountLocks.lockOne(handle);
+                uint32_t second = monotonicSeconds();
+                if (customer.lockedUntil > second) {
+                    return Status::ACCOUNT_LOCKED;
+                }
+                if (status == Status::OK) {
+                    customer.failedLogins = 0;
+                } else if (++customer.failedLogins >= MAX_FAILED_LOGINS) {
+                    customer.failedLogins = 0;
+                    customer.lockedUntil = second + LOCKOUT_SECONDS;
+                }
+            }
+            if (status == Status::OK && !PasswordHasher::isHashed(stored)) {
+                upgradePasswordHash(handle, stored, password);
+            }
+            return status;
+        }, std::move(done));
+    }
+
+    Status validateCredentials(const string& customerId, const string& password) {
+        OperationTimer timer(METRIC_VALIDATE_CREDENTIALS);
+        return timer.finish(validateCredentialsAsync(customerId, password).get());
+    }
+
+    bool changePassword(const string& customerId, const string& newPassword) {
+        if (findHandle(customerId) == CustomerIndex::NOT_FOUND) {
+            return false;
+        }
+        return storePasswordHash(customerId, hashPassword(newPassword));
+    }
+
+    // Second half of changePassword, for callers that hashed the password
+    // themselves (see CredentialService::hashAsync). Ends every session of
+    // the customer.
+    bool storePasswordHash(const string& customerId, const string& hashed) {
+        OperationTimer timer(METRIC_CHANGE_PASSWORD);
+        return storePasswordHashAt(findHandle(customerId), hashed, nullptr);
+    }
+
+    // changePassword for the customer of session. Their other sessions
+    // end; this one stays open and may now transact.
+    bool changePassword(const SessionToken& session, const string& newPassword) {
+        if (sessionHandle(session, SESSION_CHANGE_PASSWORD) == CustomerIndex::NOT_FOUND) {
+            return false;
+        }
+        return storePasswordHash(session, hashPassword(newPassword));
+    }
+
+    bool storePasswordHash(const SessionToken& session, const string& hashed) {
+        OperationTimer timer(METRIC_CHANGE_PASSWORD);
+        return storePasswordHashAt(sessionHandle(session, SESSION_CHANGE_PASSWORD), hashed, &session);
+    }
+
+    // Checks a login and opens a session for it. A customer still on the
+    // password given out at sign-up may only change it.
+    Status openSession(const string& customerId, const string& password, SessionToken& token) {
+        Status status = validateCredentials(customerId, password);
+        if (status == Status::OK) {
+            token = openVerifiedSession(customerId);
+        }
+        return status;
+    }
+
+    // Second half of openSession, for callers that checked the password
+    // themselves (see validateCredentialsAsync)
+    SessionToken openVerifiedSession(const string& customerId) {
+        uint32_t handle = findHandle(customerId);
+        if (handle == CustomerIndex::NOT_FOUND) {
+            throw DatabaseException("Customer not found");
+        }
+        bool firstLogin;
+        {
+            unique_lock<mutex> account = accountLocks.lockOne(handle);
+            firstLogin = customerAt(handle).isFirstLogin;
+        }
+        return sessions.open(handle, firstLogin ? SESSION_CHANGE_PASSWORD
+                                                : SESSION_CHANGE_PASSWORD | SESSION_TRANSACT);
+    }
+
+    // The account session resolved to at login, or CustomerIndex::NOT_FOUND
+    // once it has expired or been closed, or if it lacks a permission in need
+    uint32_t sessionHandle(const SessionToken& session, uint8_t need = SESSION_TRANSACT) {
+        return sessions.resolve(session, need);
+    }
+
+    void closeSession(const SessionToken& session) {
+        sessions.close(session);
+    }
+
+    SessionTable& sessionTable() {
+        return sessions;
+    }
+
+private:
+    // The clock CustomerProfile::lockedUntil counts in
+    uint32_t monotonicSeconds() const {
+        return static_cast<uint32_t>(now() / 1000000000);
+    }
+
+    // Replaces a legacy plaintext password with its hash once a login has
+    // proved it. The password itself is unchanged, so sessions and cached
+    // logins stay valid. Does nothing if the password changed meanwhile.
+    // Runs on a credential worker, which is already on the slow path.
+    void upgradePasswordHash(uint32_t handle, const string& legacy, const string& password) {
+        string hashed = PasswordHasher::hash(password, credentials.hashCost());
+        CustomerProfile& customer = customerAt(handle);
+        string_view stored = customers.store(hashed);
+        uint64_t sequence = 0;
+        {
+            unique_lock<mutex> account = accountLocks.lockOne(handle);
+            if (customer.password != legacy) {
+                return;
+            }
+            customer.password = stored;
+            if (wal) {
+                string payload;
+                RecordWriter out(payload);
+                out.put8(LOG_PASSWORD);
+                out.putString(customer.customerId.view());
+                out.putString(hashed);
+                out.put8(customer.isFirstLogin ? 1 : 0);
+                sequence = wal->append(payload);
+            }
+        }
+        commit(sequence);
+    }
+
+    bool storePasswordHashAt(uint32_t handle, const string& hashed, const SessionToken* keep) {
+        try {
+            if (handle == CustomerIndex::NOT_FOUND) {
+                return false;
+            }
+            if (!PasswordHasher::isHashed(hashed)) {
+                throw DatabaseException("Password must be hashed with hashPassword");
+            }
+            CustomerProfile& customer = customerAt(handle);
+            string_view stored = customers.store(hashed);
+            uint64_t sequence = 0;
+            {
+                unique_lock<mutex> account = accountLocks.lockOne(handle);
+                customer.password = stored;
+                customer.isFirstLogin = false;
+                if (wal) {
+                    string payload;
+                    RecordWriter out(payload);
+                    out.put8(LOG_PASSWORD);
+                    out.putString(customer.customerId.view());
+                    out.putString(hashed);
+                    out.put8(0);
+                    sequence = wal->append(payload);
+                }
+            }
+            credentials.invalidate(handle);
+            sessions.revoke(handle, keep, SESSION_TRANSACT);
+            commit(sequence);
+            return true;
+        } catch (...) {
+            throw DatabaseException("Error while changing password");
+        }
+    }
+};
+
+// Accrues every loaded account in the background after each day closes,
+// SLICE accounts at a time with a yield in between, so transactions keep
+// their CPU and no lock is held for more than one account. Accounts that
+// were touched before the sweep reaches them have already accrued and are
+// passed over. Customers still only in the mapped snapshot are left to
+// accrue when they are first loaded.
+class AccrualSweeper {
+public:
+    static const uint32_t SLICE = 4096;
+
+private:
+    CustomerDatabase& db;
+    mutex lock;
+    condition_variable wake;
+    condition_variable swept;
+    uint32_t sweptDay;
+    atomic<bool> stopping;
+    atomic<uint64_t> accrued;
+    double lastSweepSeconds;
+    thread worker;
+
+    void run() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [this] { return stopping || db.currentDay() != sweptDay; });
+            if (stopping) {
+                return;
+            }
+            uint32_t day = db.currentDay();
+            guard.unlock();
+
+            auto started = chrono::steady_clock::now();
+            uint32_t count = static_cast<uint32_t>(db.size());
+            for (uint32_t begin = 0; begin < count && !stopping; begin += min(SLICE, count - begin)) {
+                accrued += db.accrueRange(begin, begin + min(SLICE, count - begin));
+                this_thread::yield();
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+            guard.lock();
+            sweptDay = day;
+            lastSweepSeconds = seconds;
+            swept.notify_all();
+        }
+    }
+
+public:
+    explicit AccrualSweeper(CustomerDatabase& database)
+        : db(database), sweptDay(database.currentDay()), stopping(false), accrued(0),
+          lastSweepSeconds(0) {
+        worker = thread(&AccrualSweeper::run, this);
+    }
+
+    ~AccrualSweeper() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    AccrualSweeper(const AccrualSweeper&) = delete;
+    AccrualSweeper& operator=(const AccrualSweeper&) = delete;
+
+    // Closes the business day and starts a sweep
+    uint32_t closeDay() {
+        uint32_t day = db.closeDay();
+        {
+            // The new day must not slip in between run's check and its wait
+            lock_guard<mutex> guard(lock);
+        }
+        wake.notify_one();
+        return day;
+    }
+
+    // Waits until the current day has been swept and returns how long the
+    // sweep took
+    double waitSwept() {
+        unique_lock<mutex> guard(lock);
+        swept.wait(guard, [this] { return sweptDay == db.currentDay(); });
+        return lastSweepSeconds;
+    }
+
+    // Accounts accrued by sweeps so far, not counting ones touched first
+    uint64_t accruedAccounts() const {
+        return accrued.load();
+    }
+};
+
+// Bounded lock-free multi-producer/multi-consumer ring of session handles.
+// Each cell carries a sequence number that tells producers and consumers
+// whose turn it is, so neither side ever takes a lock. Slots are claimed
+// in ticket order, which keeps admission first-come first-served; when the
+// ring is full new sessions are turned away instead of blocking.
+class SessionQueue {
+private:
+    struct alignas(64) Cell {
+        atomic<size_t> sequence;
+        atomic<uint32_t> handle;
+    };
+
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> enqueuePos;
+    alignas(64) atomic<size_t> dequeuePos;
+
+public:
+    explicit SessionQueue(size_t capacity = 1024)
+        : cells(new Cell[capacity]), mask(capacity - 1), enqueuePos(0), dequeuePos(0) {
+        if (capacity < 2 || (capacity & mask) != 0) {
+            throw invalid_argument("Session queue capacity must be a power of two");
+        }
+        for (size_t i = 0; i < capacity; i++) {
+            cells[i].sequence.store(i, memory_order_relaxed);
+            cells[i].handle.store(0, memory_order_relaxed);
+        }
+    }
+
+    bool tryPush(uint32_t handle) {
+        size_t pos = enqueuePos.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    cell.handle.store(handle, memory_order_relaxed);
+                    cell.sequence.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueuePos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    bool tryPop(uint32_t& handle) {
+        size_t pos = dequeuePos.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    handle = cell.handle.load(memory_order_relaxed);
+                    cell.sequence.store(pos + mask + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeuePos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // Reads the session at the head without removing it
+    bool front(uint32_t& handle) const {
+        size_t pos = dequeuePos.load(memory_order_acquire);
+        const Cell& cell = cells[pos & mask];
+        if (cell.sequence.load(memory_order_acquire) != pos + 1) {
+            return false;
+        }
+        handle = cell.handle.load(memory_order_relaxed);
+        return true;
+    }
+};
+
+enum class TransactionKind : uint8_t {
+    WITHDRAWAL,
+    TRANSFER
+};
+
+// One entry of a settlement batch. Customers are referenced by handle;
+// toHandle and toAccountType are ignored for withdrawals.
+struct TransactionRecord {
+    TransactionKind kind;
+    char fromAccountType;
+    char toAccountType;
+    uint32_t fromHandle;
+    uint32_t toHandle;
+    Paise amount;
+};
+
+// Record of a completed withdrawal or transfer. Balances are the source
+// account's balances right after the operation.
+struct Receipt {
+    TransactionKind kind;
+    Status status;
+    char fromAccountType;
+    char toAccountType;
+    uint32_t fromHandle;
+    uint32_t toHandle;
+    Paise amount;
+    Paise penalty;
+    Paise savingsAfter;
+    Paise currentAfter;
+    Paise salaryAfter;
+    int64_t timestamp;      // nanoseconds since the epoch
+};
+
+// Destination for receipts published by ATM. Sinks do the formatting and
+// I/O, so none of it runs on the transaction path itself.
+class ReceiptSink {
+public:
+    virtual ~ReceiptSink() {}
+    virtual void publish(const Receipt& receipt) = 0;
+    virtual void flush() {}
+};
+
+class NullReceiptSink : public ReceiptSink {
+public:
+    void publish(const Receipt&) override {}
+};
+
+// Formats receipts the way the interactive terminal shows them
+class ConsoleReceiptSink : public ReceiptSink {
+private:
+    ostream& out;
+    CustomerDatabase& db;
+
+public:
+    ConsoleReceiptSink(ostream& stream, CustomerDatabase& database) : out(stream), db(database) {}
+
+    void publish(const Receipt& receipt) override {
+        out << fixed << setprecision(2);
+        if (receipt.status == Status::OK_WITH_PENALTY) {
+            out << "Service charge of Rs. " << toRupees(receipt.penalty) << " applied\n";
+        }
+        out << (receipt.kind == TransactionKind::WITHDRAWAL ? "Withdrawal" : "Transfer")
+            << " successful\n";
+        out << "\nAccount Balances for " << db.customerAt(receipt.fromHandle).name << ":\n";
+        out << "Savings Account: Rs. " << toRupees(receipt.savingsAfter) << "\n";
+        out << "Current Account: Rs. " << toRupees(receipt.currentAfter) << "\n";
+        out << "Salary Account: Rs. " << toRupees(receipt.salaryAfter) << endl;
+    }
+
+    void flush() override {
+        out.flush();
+    }
+};
+
+// Appends one CSV line per receipt to a file through a large stdio buffer
+class BufferedFileReceiptSink : public ReceiptSink {
+private:
+    FILE* file;
+    CustomerDatabase& db;
+
+public:
+    BufferedFileReceiptSink(const string& path, CustomerDatabase& database,
+                            size_t bufferSize = size_t(1) << 20)
+        : file(fopen(path.c_str(), "a")), db(database) {
+        if (!file) {
+            throw DatabaseException("Unable to open receipt file " + path);
+        }
+        setvbuf(file, nullptr, _IOFBF, bufferSize);
+    }
+
+    ~BufferedFileReceiptSink() {
+        fclose(file);
+    }
+
+    BufferedFileReceiptSink(const BufferedFileReceiptSink&) = delete;
+    BufferedFileReceiptSink& operator=(const BufferedFileReceiptSink&) = delete;
+
+    void publish(const Receipt& receipt) override {
+        bool isTransfer = receipt.kind == TransactionKind::TRANSFER;
+        fprintf(file,
+                "%" PRId64 ",%s,%s,%c,%s,%c,%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 "\n",
+                receipt.timestamp, isTransfer ? "TRANSFER" : "WITHDRAWAL",
+                db.customerAt(receipt.fromHandle).customerId.c_str(), receipt.fromAccountType,
+                isTransfer ? db.customerAt(receipt.toHandle).customerId.c_str() : "",
+                isTransfer ? receipt.toAccountType : '-',
+                receipt.amount, receipt.penalty, receipt.savingsAfter, receipt.currentAfter,
+                receipt.salaryAfter);
+    }
+
+    void flush() override {
+        fflush(file);
+    }
+};
+
+// Hands receipts to a worker thread that forwards them to another sink in
+// batches, so publishing costs only a short critical section
+class AsyncReceiptSink : public ReceiptSink {
+private:
+    ReceiptSink& target;
+    mutex lock;
+    condition_variable wakeUp;
+    condition_variable drained;
+    vector<Receipt> pending;
+    bool busy;
+    bool stopping;
+    thread worker;
+
+    void run() {
+        vector<Receipt> batch;
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wakeUp.wait(guard, [this] { return stopping || !pending.empty(); });
+            if (pending.empty()) {
+                break;
+            }
+            batch.swap(pending);
+            busy = true;
+            guard.unlock();
+            for (const Receipt& receipt : batch) {
+                target.publish(receipt);
+            }
+            target.flush();
+            batch.clear();
+            guard.lock();
+            busy = false;
+            drained.notify_all();
+        }
+    }
+
+public:
+    explicit AsyncReceiptSink(ReceiptSink& sink)
+        : target(sink), busy(false), stopping(false) {
+        worker = thread(&AsyncReceiptSink::run, this);
+    }
+
+    ~AsyncReceiptSink() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wakeUp.notify_one();
+        worker.join();
+    }
+
+    void publish(const Receipt& receipt) override {
+        lock_guard<mutex> guard(lock);
+        pending.push_back(receipt);
+        if (pending.size() == 1) {
+            wakeUp.notify_one();
+        }
+    }
+
+    // Waits until everything published so far has reached the target
+    void flush() override {
+        unique_lock<mutex> guard(lock);
+        drained.wait(guard, [this] { return pending.empty() && !busy; });
+    }
+};
+
+// One transaction as the ledger records it. Customers are ledger account
+// numbers (see TransactionLedger::registerAccount), which unlike handles
+// stay the same from run to run.
+struct LedgerEntry {
+    uint64_t row;           // position in the ledger, assigned by append
+    int64_t timestamp;      // nanoseconds since the epoch
+    TransactionKind kind;
+    Status status;          // OK or OK_WITH_PENALTY, as in a Receipt
+    char fromAccountType;
+    char toAccountType;     // 0 for withdrawals
+    uint32_t fromAccount;
+    uint32_t toAccount;     // TransactionLedger::NO_ACCOUNT for withdrawals
+    Paise amount;
+    Paise penalty;
+    Paise savingsAfter;
+    Paise currentAfter;
+    Paise salaryAfter;
+};
+
+// Append-only transaction ledger kept in three files next to path:
+//   .blocks    rows in time order, BLOCK_ROWS to a block, read back through
+//              one memory mapping
+//   .accounts  the customer ID of each ledger account number
+//   .index     the header of every block and each account's latest row,
+//              rewritten by flush so opening reads neither blocks nor rows
+// Each block stores every field as its own column of varints. An index
+// entry per GROUP_ROWS rows gives the column offsets, first timestamp and
+// largest amount of the group, so a single row decodes without the rest
+// of its block, and blocks and groups serve as zone maps for queries over
+// time and amount.
+//
+// Every row also points back to the previous row of its source and of its
+// destination account. Starting from the account's head, the last N
+// transactions of an account take N row lookups. Rows in the open block
+// are only in memory until it fills or flush seals it, so a crash loses
+// them; the balances they describe are safe in the database's log.
+class TransactionLedger {
+public:
+    static const uint32_t NO_ACCOUNT = ~uint32_t(0);
+    static const uint64_t NO_ROW = ~uint64_t(0);
+    static const uint32_t BLOCK_ROWS = 65536;
+    static const uint32_t GROUP_ROWS = 32;
+
+private:
+    // TO and PREVIOUS_TO only hold values for transfers, PENALTY only for
+    // rows flagged with one. Previous rows are stored as the distance
+    // back, 0 meaning none.
+    enum Column {
+        COL_TIMESTAMP,      // delta from the previous row of the group
+        COL_FROM,
+        COL_TO,
+        COL_AMOUNT,
+        COL_PENALTY,
+        COL_SAVINGS,        // zigzag
+        COL_CURRENT,        // zigzag
+        COL_SALARY,         // zigzag
+        COL_PREVIOUS_FROM,
+        COL_PREVIOUS_TO,
+        COLUMN_COUNT
+    };
+
+    // Savings accounts have neither account flag
+    enum RowFlag : uint8_t {
+        FLAG_TRANSFER = 1,
+        FLAG_FROM_CURRENT = 2,
+        FLAG_TO_CURRENT = 4,
+        FLAG_PENALTY = 8,
+        FLAG_FROM_SALARY = 16,
+        FLAG_TO_SALARY = 32
+    };
+
+    static const uint32_t BLOCK_MAGIC = 0x324b424c;    // "LBK2"
+    static const uint32_t BLOCK_MAGIC_BEFORE_SALARY = 0x4b4c424c;   // "LBLK", without COL_SALARY
+    static const uint64_t INDEX_MAGIC = 0x3258444948474c4cull;
+    static const size_t MAP_RESERVE = size_t(1) << 38;      // 256 GiB of blocks
+
+    // Blocks are padded to 8 bytes, so headers and groups read from the
+    // mapping are aligned
+    struct BlockHeader {
+        uint32_t magic;
+        uint32_t rows;
+        uint64_t firstRow;
+        int64_t minTimestamp;
+        int64_t maxTimestamp;
+        int64_t maxAmount;
+        uint64_t length;                        // whole block, header included
+        uint32_t flagsOffset;                   // from the block start
+        uint32_t columnOffsets[COLUMN_COUNT];
+        uint64_t bodyChecksum;                  // see bodyChecksum
+        uint32_t checksum;                      // the header with this field zeroed
+        uint32_t reserved;
+    };
+
+    struct SealedBlock {
+        BlockHeader header;                     // a copy, so searches need not touch the mapping
+        const char* data;
+    };
+
+    struct Group {
+        int64_t firstTimestamp;
+        int64_t maxAmount;
+        uint32_t offsets[COLUMN_COUNT];         // from each column's start
+        uint32_t reserved;
+    };
+
+    static char accountType(uint8_t rowFlags, RowFlag current, RowFlag salary) {
+        return (rowFlags & salary) ? SalaryPolicy::CODE : (rowFlags & current) ? CurrentPolicy::CODE
+                                                                               : SavingsPolicy::CODE;
+    }
+
+    static uint8_t accountFlag(char accountType, RowFlag current, RowFlag salary) {
+        return accountType == CurrentPolicy::CODE ? current : accountType == SalaryPolicy::CODE ? salary : 0;
+    }
+
+    // Walks the rows of one group, decoding every column
+    class GroupReader {
+    private:
+        const uint8_t* flags;
+        const uint8_t* columns[COLUMN_COUNT];
+        uint64_t row;
+        int64_t timestamp;
+
+    public:
+        GroupReader(const SealedBlock& block, uint32_t group) {
+            const BlockHeader& header = block.header;
+            const Group& entry = reinterpret_cast<const Group*>(block.data + sizeof(BlockHeader))[group];
+            flags = reinterpret_cast<const uint8_t*>(block.data + header.flagsOffset) + group * GROUP_ROWS;
+            for (int column = 0; column < COLUMN_COUNT; column++) {
+                columns[column] = reinterpret_cast<const uint8_t*>(block.data + header.columnOffsets[column]) +
+                                  entry.offsets[column];
+            }
+            row = header.firstRow + uint64_t(group) * GROUP_ROWS;
+            timestamp = entry.firstTimestamp;
+        }
+
+        void next(LedgerEntry& entry, uint64_t& previousFrom, uint64_t& previousTo) {
+            uint8_t rowFlags = *flags++;
+            bool transfer = (rowFlags & FLAG_TRANSFER) != 0;
+            timestamp += static_cast<int64_t>(getVarint(columns[COL_TIMESTAMP]));
+            entry.row = row;
+            entry.timestamp = timestamp;
+            entry.kind = transfer ? TransactionKind::TRANSFER : TransactionKind::WITHDRAWAL;
+            entry.fromAccountType = accountType(rowFlags, FLAG_FROM_CURRENT, FLAG_FROM_SALARY);
+            entry.fromAccount = static_cast<uint32_t>(getVarint(columns[COL_FROM]));
+            entry.amount = static_cast<Paise>(getVarint(columns[COL_AMOUNT]));
+            entry.status = (rowFlags & FLAG_PENALTY) ? Status::OK_WITH_PENALTY : Status::OK;
+            entry.penalty = (rowFlags & FLAG_PENALTY) ? static_cast<Paise>(getVarint(columns[COL_PENALTY])) : 0;
+            entry.savingsAfter = unzigzag(getVarint(columns[COL_SAVINGS]));
+            entry.currentAfter = unzigzag(getVarint(columns[COL_CURRENT]));
+            entry.salaryAfter = unzigzag(getVarint(columns[COL_SALARY]));
+            uint64_t back = getVarint(columns[COL_PREVIOUS_FROM]);
+            previousFrom = back == 0 ? NO_ROW : row - back;
+            if (transfer) {
+                entry.toAccountType = accountType(rowFlags, FLAG_TO_CURRENT, FLAG_TO_SALARY);
+                entry.toAccount = static_cast<uint32_t>(getVarint(columns[COL_TO]));
+                back = getVarint(columns[COL_PREVIOUS_TO]);
+                previousTo = back == 0 ? NO_ROW : row - back;
+            } else {
+                entry.toAccountType = 0;
+                entry.toAccount = NO_ACCOUNT;
+                previousTo = NO_ROW;
+            }
+            row++;
+        }
+    };
+
+    struct OpenRow {
+        LedgerEntry entry;
+        uint64_t previousFrom;
+        uint64_t previousTo;
+    };
+
+    string path;
+    int blocksFd;
+    int accountsFd;
+    const char* mapping;
+    uint64_t blocksLength;
+    vector<SealedBlock> blocks;
+    vector<OpenRow> openRows;
+    uint64_t nextRow;
+    int64_t lastTimestamp;
+
+    vector<CustomerKey> accountIds;
+    CustomerIndex accountIndex;
+    string pendingAccounts;         // registered since the last seal
+    vector<uint64_t> heads;
+
+    mutable shared_mutex lock;
+
+    static void putVarint(string& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    static uint64_t getVarint(const uint8_t*& in) {
+        uint64_t value = 0;
+        int shift = 0;
+        while (*in & 0x80) {
+            value |= uint64_t(*in++ & 0x7f) << shift;
+            shift += 7;
+        }
+        return value | (uint64_t(*in++) << shift);
+    }
+
+    static uint64_t zigzag(int64_t value) {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    static int64_t unzigzag(uint64_t value) {
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    // A word at a time; checksum32 would cost more than encoding the block
+    static uint64_t bodyChecksum(const char* data, size_t length) {
+        uint64_t h = 0x9e3779b97f4a7c15ull;
+        size_t i = 0;
+        for (; i + 8 <= length; i += 8) {
+            uint64_t word;
+            memcpy(&word, data + i, 8);
+            h = (h ^ word) * 0xff51afd7ed558ccdull;
+            h ^= h >> 32;
+        }
+        for (; i < length; i++) {
+            h = (h ^ static_cast<uint8_t>(data[i])) * 0xff51afd7ed558ccdull;
+        }
+        return h;
+    }
+
+    static uint32_t headerChecksum(BlockHeader header) {
+        header.checksum = 0;
+        return checksum32(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+
+    static bool writeAll(int fd, const char* bytes, size_t count) {
+        while (count > 0) {
+            ssize_t n = ::write(fd, bytes, count);
+            if (n < 0) {
+                return false;
+            }
+            bytes += n;
+            count -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    static bool readAll(int fd, char* bytes, size_t count) {
+        while (count > 0) {
+            ssize_t n = ::read(fd, bytes, count);
+            if (n <= 0) {
+                return false;
+            }
+            bytes += n;
+            count -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    static uint8_t flagsOf(const LedgerEntry& entry) {
+        uint8_t flags = 0;
+        if (entry.kind == TransactionKind::TRANSFER) {
+            flags |= FLAG_TRANSFER;
+            flags |= accountFlag(entry.toAccountType, FLAG_TO_CURRENT, FLAG_TO_SALARY);
+        }
+        flags |= accountFlag(entry.fromAccountType, FLAG_FROM_CURRENT, FLAG_FROM_SALARY);
+        flags |= entry.status == Status::OK_WITH_PENALTY ? FLAG_PENALTY : 0;
+        return flags;
+    }
+
+    // The sealed block holding row
+    const SealedBlock& blockOf(uint64_t row) const {
+        auto after = upper_bound(blocks.begin(), blocks.end(), row,
+                                 [](uint64_t target, const SealedBlock& block) {
+            return target < block.header.firstRow;
+        });
+        return *(after - 1);
+    }
+
+    // Decodes one row. The caller must hold lock.
+    LedgerEntry readRow(uint64_t row, uint64_t& previousFrom, uint64_t& previousTo) const {
+        uint64_t openFirst = nextRow - openRows.size();
+        if (row >= openFirst) {
+            const OpenRow& open = openRows[row - openFirst];
+            previousFrom = open.previousFrom;
+            previousTo = open.previousTo;
+            return open.entry;
+        }
+        const SealedBlock& block = blockOf(row);
+        uint32_t index = static_cast<uint32_t>(row - block.header.firstRow);
+        GroupReader reader(block, index / GROUP_ROWS);
+        LedgerEntry entry;
+        for (uint32_t skip = index % GROUP_ROWS; ; skip--) {
+            reader.next(entry, previousFrom, previousTo);
+            if (skip == 0) {
+                return entry;
+            }
+        }
+    }
+
+    void recordHead(uint32_t account, uint64_t row) {
+        if (account >= heads.size()) {
+            uint64_t none = NO_ROW;
+            heads.resize(account + 1, none);
+        }
+        heads[account] = row;
+    }
+
+    // Encodes the open block and appends it to the blocks file. The caller
+    // must hold lock exclusively.
+    void seal() {
+        if (openRows.empty()) {
+            return;
+        }
+        if (!pendingAccounts.empty()) {
+            // Account numbers reach the disk before any block using them
+            if (!writeAll(accountsFd, pendingAccounts.data(), pendingAccounts.size())) {
+                throw DatabaseException("Unable to write ledger accounts");
+            }
+            pendingAccounts.clear();
+        }
+
+        uint32_t rows = static_cast<uint32_t>(openRows.size());
+        uint32_t groupCount = (rows + GROUP_ROWS - 1) / GROUP_ROWS;
+        vector<Group> groups(groupCount);
+        string columns[COLUMN_COUNT];
+        string flags(rows, '\0');
+        BlockHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = BLOCK_MAGIC;
+        header.rows = rows;
+        header.firstRow = openRows.front().entry.row;
+        header.minTimestamp = openRows.front().entry.timestamp;
+        header.maxTimestamp = openRows.back().entry.timestamp;
+
+        int64_t previousTimestamp = 0;
+        for (uint32_t i = 0; i < rows; i++) {
+            const LedgerEntry& entry = openRows[i].entry;
+            Group& group = groups[i / GROUP_ROWS];
+            if (i % GROUP_ROWS == 0) {
+                memset(&group, 0, sizeof(group));
+                group.firstTimestamp = entry.timestamp;
+                for (int column = 0; column < COLUMN_COUNT; column++) {
+                    group.offsets[column] = static_cast<uint32_t>(columns[column].size());
+                }
+                previousTimestamp = entry.timestamp;
+            }
+            group.maxAmount = max(group.maxAmount, entry.amount);
+            uint8_t rowFlags = flagsOf(entry);
+            flags[i] = static_cast<char>(rowFlags);
+            putVarint(columns[COL_TIMESTAMP], static_cast<uint64_t>(entry.timestamp - previousTimestamp));
+            previousTimestamp = entry.timestamp;
+            putVarint(columns[COL_FROM], entry.fromAccount);
+            putVarint(columns[COL_AMOUNT], static_cast<uint64_t>(entry.amount));
+            if (rowFlags & FLAG_PENALTY) {
+                putVarint(columns[COL_PENALTY], static_cast<uint64_t>(entry.penalty));
+            }
+            putVarint(columns[COL_SAVINGS], zigzag(entry.savingsAfter));
+            putVarint(columns[COL_CURRENT], zigzag(entry.currentAfter));
+            putVarint(columns[COL_SALARY], zigzag(entry.salaryAfter));
+            uint64_t previous = openRows[i].previousFrom;
+            putVarint(columns[COL_PREVIOUS_FROM], previous == NO_ROW ? 0 : entry.row - previous);
+            if (rowFlags & FLAG_TRANSFER) {
+                putVarint(columns[COL_TO], entry.toAccount);
+                previous = openRows[i].previousTo;
+                putVarint(columns[COL_PREVIOUS_TO], previous == NO_ROW ? 0 : entry.row - previous);
+            }
+            header.maxAmount = max(header.maxAmount, entry.amount);
+        }
+
+        string block(sizeof(BlockHeader), '\0');
+        block.append(reinterpret_cast<const char*>(groups.data()), groupCount * sizeof(Group));
+        header.flagsOffset = static_cast<uint32_t>(block.size());
+        block.append(flags);
+        for (int column = 0; column < COLUMN_COUNT; column++) {
+            header.columnOffsets[column] = static_cast<uint32_t>(block.size());
+            block.append(columns[column]);
+        }
+        block.resize((block.size() + 7) & ~size_t(7), '\0');
+        header.length = block.size();
+        header.bodyChecksum = bodyChecksum(block.data() + sizeof(BlockHeader),
+                                           block.size() - sizeof(BlockHeader));
+        header.checksum = headerChecksum(header);
+        memcpy(&block[0], &header, sizeof(header));
+
+        if (blocksLength + block.size() > MAP_RESERVE || !writeAll(blocksFd, block.data(), block.size())) {
+            throw DatabaseException("Unable to write ledger block");
+        }
+        blocks.push_back(SealedBlock{header, mapping + blocksLength});
+        blocksLength += block.size();
+        openRows.clear();
+    }
+
+    // Loads the account dictionary, dropping a torn last record
+    void loadAccounts() {
+        struct stat info;
+        if (::fstat(accountsFd, &info) != 0) {
+            throw DatabaseException("Unable to read ledger accounts");
+        }
+        size_t count = static_cast<size_t>(info.st_size) / sizeof(CustomerKey);
+        accountIds.resize(count);
+        if (count > 0 && !readAll(accountsFd, reinterpret_cast<char*>(accountIds.data()),
+                                  count * sizeof(CustomerKey))) {
+            throw DatabaseException("Unable to read ledger accounts");
+        }
+        if (::ftruncate(accountsFd, static_cast<off_t>(count * sizeof(CustomerKey))) != 0) {
+            throw DatabaseException("Unable to repair ledger accounts");
+        }
+        accountIndex.reserve(count);
+        for (uint32_t number = 0; number < count; number++) {
+            accountIndex.insert(CustomerIndex::hashId(string(accountIds[number].view())), number);
+        }
+    }
+
+    // Reads the index written by the last flush, whose blocks must all be
+    // within the first fileLength bytes. Returns how many rows it covers,
+    // or 0 if it is missing or unusable.
+    uint64_t loadIndex(uint64_t fileLength) {
+        int fd = ::open((path + ".index").c_str(), O_RDONLY);
+        if (fd < 0) {
+            return 0;
+        }
+        uint64_t fields[4];
+        bool valid = readAll(fd, reinterpret_cast<char*>(fields), sizeof(fields)) &&
+                     fields[0] == INDEX_MAGIC && fields[3] <= accountIds.size() &&
+                     fields[2] <= fileLength / sizeof(BlockHeader);
+        vector<BlockHeader> headers;
+        if (valid) {
+            headers.resize(fields[2]);
+            heads.resize(fields[3]);
+            valid = readAll(fd, reinterpret_cast<char*>(headers.data()), headers.size() * sizeof(BlockHeader)) &&
+                    readAll(fd, reinterpret_cast<char*>(heads.data()), heads.size() * sizeof(uint64_t));
+        }
+        ::close(fd);
+        for (const BlockHeader& header : headers) {
+            if (!valid) {
+                break;
+            }
+            valid = header.magic == BLOCK_MAGIC && header.checksum == headerChecksum(header) &&
+                    header.firstRow == nextRow && header.length <= fileLength - blocksLength;
+            blocks.push_back(SealedBlock{header, mapping + blocksLength});
+            blocksLength += header.length;
+            nextRow += header.rows;
+            lastTimestamp = header.maxTimestamp;
+        }
+        if (!valid || nextRow != fields[1]) {
+            blocks.clear();
+            heads.clear();
+            blocksLength = 0;
+            nextRow = 0;
+            lastTimestamp = numeric_limits<int64_t>::min();
+        }
+        return nextRow;
+    }
+
+    // Finds the valid blocks, truncating a torn tail, and brings the heads
+    // up to date with blocks sealed after the index was last written
+    void loadBlocks() {
+        struct stat info;
+        if (::fstat(blocksFd, &info) != 0) {
+            throw DatabaseException("Unable to read ledger blocks");
+        }
+        uint64_t fileLength = static_cast<uint64_t>(info.st_size);
+        if (fileLength > MAP_RESERVE) {
+            throw DatabaseException("Ledger " + path + " is too large to map");
+        }
+        // Refused rather than having its blocks taken for torn ones and
+        // truncated below
+        uint32_t firstMagic = 0;
+        if (fileLength >= sizeof(firstMagic)) {
+            memcpy(&firstMagic, mapping, sizeof(firstMagic));
+        }
+        if (firstMagic == BLOCK_MAGIC_BEFORE_SALARY) {
+            throw DatabaseException("Ledger " + path + " has an unsupported version");
+        }
+        uint64_t covered = loadIndex(fileLength);
+        while (blocksLength + sizeof(BlockHeader) <= fileLength) {
+            // Sealed after the last flush, so it may not have reached the disk whole
+            BlockHeader header;
+            memcpy(&header, mapping + blocksLength, sizeof(header));
+            bool valid = header.magic == BLOCK_MAGIC && header.checksum == headerChecksum(header) &&
+                         header.firstRow == nextRow && header.rows > 0 &&
+                         header.length <= fileLength - blocksLength &&
+                         header.bodyChecksum == bodyChecksum(mapping + blocksLength + sizeof(BlockHeader),
+                                                             header.length - sizeof(BlockHeader));
+            if (!valid) {
+                break;
+            }
+            blocks.push_back(SealedBlock{header, mapping + blocksLength});
+            blocksLength += header.length;
+            nextRow += header.rows;
+            lastTimestamp = header.maxTimestamp;
+        }
+        if (blocksLength != fileLength && ::ftruncate(blocksFd, static_cast<off_t>(blocksLength)) != 0) {
+            throw DatabaseException("Unable to repair ledger " + path);
+        }
+
+        size_t first = blocks.size();
+        while (first > 0 && blocks[first - 1].header.firstRow >= covered) {
+            first--;
+        }
+        for (size_t index = first; index < blocks.size(); index++) {
+            const SealedBlock& block = blocks[index];
+            uint64_t previousFrom, previousTo;
+            LedgerEntry entry;
+            for (uint32_t group = 0; group * GROUP_ROWS < block.header.rows; group++) {
+                GroupReader reader(block, group);
+                uint32_t end = min(block.header.rows, (group + 1) * GROUP_ROWS);
+                for (uint32_t i = group * GROUP_ROWS; i < end; i++) {
+                    reader.next(entry, previousFrom, previousTo);
+                    recordHead(entry.fromAccount, entry.row);
+                    if (entry.toAccount != NO_ACCOUNT) {
+                        recordHead(entry.toAccount, entry.row);
+                    }
+                }
+            }
+        }
+        uint64_t none = NO_ROW;
+        heads.resize(accountIds.size(), none);
+    }
+
+public:
+    // Opens the ledger at path, creating it if needed
+    explicit TransactionLedger(const string& ledgerPath)
+        : path(ledgerPath), blocksFd(-1), accountsFd(-1), mapping(nullptr), blocksLength(0),
+          nextRow(0), lastTimestamp(numeric_limits<int64_t>::min()) {
+        blocksFd = ::open((path + ".blocks").c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+        accountsFd = ::open((path + ".accounts").c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+        void* mapped = blocksFd < 0 ? MAP_FAILED
+                                    : ::mmap(nullptr, MAP_RESERVE, PROT_READ, MAP_SHARED, blocksFd, 0);
+        if (accountsFd < 0 || mapped == MAP_FAILED) {
+            if (blocksFd >= 0) {
+                ::close(blocksFd);
+            }
+            if (accountsFd >= 0) {
+                ::close(accountsFd);
+            }
+            throw DatabaseException("Unable to open ledger " + path);
+        }
+        mapping = static_cast<const char*>(mapped);
+        try {
+            loadAccounts();
+            loadBlocks();
+        } catch (...) {
+            ::munmap(const_cast<char*>(mapping), MAP_RESERVE);
+            ::close(blocksFd);
+            ::close(accountsFd);
+            throw;
+        }
+        openRows.reserve(BLOCK_ROWS);
+    }
+
+    ~TransactionLedger() {
+        try {
+            flush();
+        } catch (...) {
+            // The next open recovers from the blocks themselves
+        }
+        ::munmap(const_cast<char*>(mapping), MAP_RESERVE);
+        ::close(blocksFd);
+        ::close(accountsFd);
+    }
+
+    TransactionLedger(const TransactionLedger&) = delete;
+    TransactionLedger& operator=(const TransactionLedger&) = delete;
+
+    // Returns the account number of customerId, adding it if it is new
+    uint32_t registerAccount(const string& customerId) {
+        uint64_t hash = CustomerIndex::hashId(customerId);
+        unique_lock<shared_mutex> guard(lock);
+        uint32_t number = accountIndex.find(customerId, hash, [this](uint32_t candidate) {
+            return accountIds[candidate].view();
+        });
+        if (number != CustomerIndex::NOT_FOUND) {
+            return number;
+        }
+        if (!CustomerKey::fits(customerId)) {
+            throw DatabaseException("Customer ID is too long");
+        }
+        number = static_cast<uint32_t>(accountIds.size());
+        accountIds.emplace_back();
+        accountIds.back().assign(customerId);
+        accountIndex.insert(hash, number);
+        pendingAccounts.append(reinterpret_cast<const char*>(&accountIds.back()), sizeof(CustomerKey));
+        uint64_t none = NO_ROW;
+        heads.push_back(none);
+        return number;
+    }
+
+    // NO_ACCOUNT if customerId has no transactions recorded
+    uint32_t accountNumber(const string& customerId) const {
+        shared_lock<shared_mutex> guard(lock);
+        return accountIndex.find(customerId, CustomerIndex::hashId(customerId), [this](uint32_t candidate) {
+            return accountIds[candidate].view();
+        });
+    }
+
+    string customerId(uint32_t account) const {
+        shared_lock<shared_mutex> guard(lock);
+        return account < accountIds.size() ? string(accountIds[account].view()) : string();
+    }
+
+    // Appends entry and returns its row. Timestamps never go backwards: an
+    // entry older than the last one is stamped with the last one's time.
+    uint64_t append(LedgerEntry entry) {
+        unique_lock<shared_mutex> guard(lock);
+        if (entry.fromAccount >= accountIds.size() ||
+            (entry.kind == TransactionKind::TRANSFER && entry.toAccount >= accountIds.size())) {
+            throw DatabaseException("Ledger entry names an unregistered account");
+        }
+        if (entry.kind != TransactionKind::TRANSFER) {
+            entry.toAccount = NO_ACCOUNT;
+            entry.toAccountType = 0;
+        }
+        entry.row = nextRow++;
+        entry.timestamp = max(entry.timestamp, lastTimestamp);
+        lastTimestamp = entry.timestamp;
+
+        OpenRow open;
+        open.entry = entry;
+        open.previousFrom = heads[entry.fromAccount];
+        open.previousTo = entry.kind == TransactionKind::TRANSFER ? heads[entry.toAccount] : NO_ROW;
+        heads[entry.fromAccount] = entry.row;
+        if (entry.kind == TransactionKind::TRANSFER) {
+            heads[entry.toAccount] = entry.row;
+        }
+        openRows.push_back(open);
+        if (openRows.size() == BLOCK_ROWS) {
+            seal();
+        }
+        return entry.row;
+    }
+
+    // Seals the open block, even if it is not full, and makes everything
+    // appended so far durable
+    void flush() {
+        unique_lock<shared_mutex> guard(lock);
+        seal();
+        if (::fsync(blocksFd) != 0 || ::fsync(accountsFd) != 0) {
+            throw DatabaseException("Unable to sync ledger " + path);
+        }
+        string indexPath = path + ".index";
+        string tempPath = indexPath + ".tmp";
+        int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+            throw DatabaseException("Unable to write ledger index");
+        }
+        string index;
+        uint64_t fields[4] = {INDEX_MAGIC, nextRow, blocks.size(), heads.size()};
+        index.append(reinterpret_cast<const char*>(fields), sizeof(fields));
+        for (const SealedBlock& block : blocks) {
+            index.append(reinterpret_cast<const char*>(&block.header), sizeof(BlockHeader));
+        }
+        index.append(reinterpret_cast<const char*>(heads.data()), heads.size() * sizeof(uint64_t));
+        bool ok = writeAll(fd, index.data(), index.size()) && ::fsync(fd) == 0;
+        ::close(fd);
+        if (!ok || ::rename(tempPath.c_str(), indexPath.c_str()) != 0) {
+            ::unlink(tempPath.c_str());
+            throw DatabaseException("Unable to write ledger index");
+        }
+    }
+
+    uint64_t size() const {
+        shared_lock<shared_mutex> guard(lock);
+        return nextRow;
+    }
+
+    // Bytes of sealed blocks on disk
+    uint64_t storedBytes() const {
+        shared_lock<shared_mutex> guard(lock);
+        return blocksLength;
+    }
+
+    // Up to count of the account's transactions, newest first
+    vector<LedgerEntry> lastTransactions(uint32_t account, size_t count) const {
+        shared_lock<shared_mutex> guard(lock);
+        vector<LedgerEntry> entries;
+        uint64_t row = account < heads.size() ? heads[account] : NO_ROW;
+        while (row != NO_ROW && entries.size() < count) {
+            uint64_t previousFrom, previousTo;
+            entries.push_back(readRow(row, previousFrom, previousTo));
+            row = entries.back().fromAccount == account ? previousFrom : previousTo;
+        }
+        return entries;
+    }
+
+    // Transactions of kind larger than over with timestamps in [since,
+    // until), oldest first. Only groups whose time range and largest
+    // amount could match are decoded.
+    vector<LedgerEntry> findTransactions(TransactionKind kind, Paise over, int64_t since, int64_t until) const {
+        shared_lock<shared_mutex> guard(lock);
+        vector<LedgerEntry> entries;
+        auto matches = [&](const LedgerEntry& entry) {
+            return entry.kind == kind && entry.amount > over &&
+                   entry.timestamp >= since && entry.timestamp < until;
+        };
+        auto first = lower_bound(blocks.begin(), blocks.end(), since,
+                                 [](const SealedBlock& block, int64_t target) {
+            return block.header.maxTimestamp < target;
+        });
+        for (auto it = first; it != blocks.end() && it->header.minTimestamp < until; ++it) {
+            const BlockHeader& header = it->header;
+            if (header.maxAmount <= over) {
+                continue;
+            }
+            const Group* groups = reinterpret_cast<const Group*>(it->data + sizeof(BlockHeader));
+            uint32_t groupCount = (header.rows + GROUP_ROWS - 1) / GROUP_ROWS;
+            for (uint32_t group = 0; group < groupCount; group++) {
+                int64_t groupEnd = group + 1 < groupCount ? groups[group + 1].firstTimestamp
+                                                          : header.maxTimestamp;
+                if (groups[group].maxAmount <= over || groupEnd < since ||
+                    groups[group].firstTimestamp >= until) {
+                    continue;
+                }
+                GroupReader reader(*it, group);
+                uint32_t end = min(header.rows, (group + 1) * GROUP_ROWS);
+                uint64_t previousFrom, previousTo;
+                LedgerEntry entry;
+                for (uint32_t i = group * GROUP_ROWS; i < end; i++) {
+                    reader.next(entry, previousFrom, previousTo);
+                    if (matches(entry)) {
+                        entries.push_back(entry);
+                    }
+                }
+            }
+        }
+        for (const OpenRow& open : openRows) {
+            if (matches(open.entry)) {
+                entries.push_back(open.entry);
+            }
+        }
+        return entries;
+    }
+};
+
+// Records every receipt in a TransactionLedger under the customer's
+// ledger account number
+class LedgerReceiptSink : public ReceiptSink {
+private:
+    TransactionLedger& ledger;
+    CustomerDatabase& db;
+    mutex lock;
+    vector<uint32_t> accounts;      // ledger account number by handle
+
+    uint32_t accountOf(uint32_t handle) {
+        if (handle >= accounts.size()) {
+            uint32_t none = TransactionLedger::NO_ACCOUNT;
+            accounts.resize(handle + 1, none);
+        }
+        if (accounts[handle] == TransactionLedger::NO_ACCOUNT) {
+            accounts[handle] = ledger.registerAccount(string(db.customerAt(handle).customerId.view()));
+        }
+        return accounts[handle];
+    }
+
+public:
+    LedgerReceiptSink(TransactionLedger& target, CustomerDatabase& database)
+        : ledger(target), db(database) {}
+
+    void publish(const Receipt& receipt) override {
+        lock_guard<mutex> guard(lock);
+        LedgerEntry entry;
+        entry.timestamp = receipt.timestamp;
+        entry.kind = receipt.kind;
+        entry.status = receipt.status;
+        entry.fromAccountType = receipt.fromAccountType;
+        entry.toAccountType = receipt.toAccountType;
+        entry.fromAccount = accountOf(receipt.fromHandle);
+        entry.toAccount = receipt.kind == TransactionKind::TRANSFER ? accountOf(receipt.toHandle)
+                                                                    : TransactionLedger::NO_ACCOUNT;
+        entry.amount = receipt.amount;
+        entry.penalty = receipt.penalty;
+        entry.savingsAfter = receipt.savingsAfter;
+        entry.currentAfter = receipt.currentAfter;
+        entry.salaryAfter = receipt.salaryAfter;
+        ledger.append(entry);
+    }
+};
+
+// ATM operations class
+class ATM {
+private:
+    CustomerDatabase& db;
+    SessionQueue accessQueue;
+    NullReceiptSink nullSink;
+    ReceiptSink* receiptSink;
+    VelocityLimiter terminalLimits;
+    VelocityState ownTerminal;
+    VelocityState* terminal;    // the terminal debits are counted against
+
+    // rules.debit of handle's balance within the customer's and the
+    // terminal's velocity limits, counting it against both and any penalty
+    // with the database. With apply false the debit is only checked. The
+    // caller must hold the account lock.
+    Status debitAccount(const AccountRules& rules, uint32_t handle, Paise& balance, Paise amount,
+                        bool apply = true) {
+        const VelocityLimiter& customerLimits = db.velocityLimiter();
+        bool limited = customerLimits.enforced() || terminalLimits.enforced();
+        int64_t time = 0;
+        if (limited) {
+            time = db.now();
+            if (!customerLimits.allows(db.balances().velocity(handle), amount, time) ||
+                !terminalLimits.allows(*terminal, amount, time)) {
+                return Status::VELOCITY_LIMIT;
+            }
+        }
+        Paise scratch = balance;
+        Status status = rules.debit(apply ? balance : scratch, amount);
+        if (!apply || !succeeded(status)) {
+            return status;
+        }
+        if (limited) {
+            customerLimits.charge(db.balances().velocity(handle), amount, time);
+            terminalLimits.charge(*terminal, amount, time);
+        }
+        if (status == Status::OK_WITH_PENALTY) {
+            db.chargePenalty(handle, rules.penalty);
+        }
+        return status;
+    }
+
+    // Fills in a receipt for a successful operation. The caller must hold
+    // the source account's lock.
+    Receipt makeReceipt(TransactionKind kind, Status status, uint32_t fromHandle,
+                        char fromAccountType, uint32_t toHandle, char toAccountType,
+                        Paise amount, Paise penalty) {
+        Receipt receipt;
+        receipt.kind = kind;
+        receipt.status = status;
+        receipt.fromAccountType = fromAccountType;
+        receipt.toAccountType = toAccountType;
+        receipt.fromHandle = fromHandle;
+        receipt.toHandle = toHandle;
+        receipt.amount = amount;
+        receipt.penalty = status == Status::OK_WITH_PENALTY ? penalty : 0;
+        receipt.savingsAfter = db.balances().savings(fromHandle);
+        receipt.currentAfter = db.balances().current(fromHandle);
+        receipt.salaryAfter = db.balances().salary(fromHandle);
+        receipt.timestamp = chrono::duration_cast<chrono::nanoseconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
+        return receipt;
+    }
+
+    // withdraw and transfer once their customers are resolved to handles
+    Status withdrawAt(uint32_t handle, char accountType, double rupees, Receipt* receipt) {
+        Paise amount = toPaise(rupees);
+        if (amount <= 0) {
+            return Status::INVALID_AMOUNT;
+        }
+        const AccountRules* rules = AccountRules::find(accountType);
+        if (!rules) {
+            return Status::INVALID_ACCOUNT_TYPE;
+        }
+        return withdrawFrom(*rules, handle, amount, receipt);
+    }
+
+    Status transferAt(uint32_t fromHandle, uint32_t toHandle, char fromAccountType, char toAccountType,
+                      double rupees, Receipt* receipt) {
+        Paise amount = toPaise(rupees);
+        if (amount <= 0) {
+            return Status::INVALID_AMOUNT;
+        }
+        const AccountRules* fromRules = AccountRules::find(fromAccountType);
+        const AccountRules* toRules = AccountRules::find(toAccountType);
+        if (!fromRules || !toRules) {
+            return Status::INVALID_ACCOUNT_TYPE;
+        }
+        return transferFrom(*fromRules, fromHandle, toHandle, *toRules, amount, receipt);
+    }
+
+    void printBalance(uint32_t handle, ostream& out) {
+        BalanceStore& balances = db.balances();
+        Paise savings, current, salary;
+        {
+            unique_lock<mutex> account = db.locks().lockOne(handle);
+            HotCredits::Merge merged = db.settle(handle);
+            savings = balances.savings(handle);
+            current = balances.current(handle);
+            salary = balances.salary(handle);
+        }
+
+        out << "\nAccount Balances for " << db.customerAt(handle).name << ":" << endl;
+        out << "Savings Account: Rs. " << fixed << setprecision(2) 
+            << toRupees(savings) << endl;
+        out << "Current Account: Rs. " << toRupees(current) << endl;
+        out << "Salary Account: Rs. " << toRupees(salary) << endl;
+    }
+
+    // The bodies of withdraw, transfer and transferOut, given the rules
+    // of the account debited
+    Status withdrawFrom(const AccountRules& rules, uint32_t handle, Paise amount, Receipt* receipt) {
+        if (handle == CustomerIndex::NOT_FOUND) {
+            return Status::CUSTOMER_NOT_FOUND;
+        }
+
+        Paise& balance = db.balances().balance(handle, rules.column);
+        // The velocity check is then no cache miss of its own under the lock
+        __builtin_prefetch(&db.balances().velocity(handle), 1);
+        Status status;
+        Receipt result;
+        uint64_t sequence = 0;
+        {
+            unique_lock<mutex> account = db.locks().lockOne(handle);
+            HotCredits::Merge merged = db.settle(handle);
+            status = debitAccount(rules, handle, balance, amount);
+            if (!succeeded(status)) {
+                return status;
+            }
+            sequence = db.logBalances(handle);
+            result = makeReceipt(TransactionKind::WITHDRAWAL, status, handle, rules.code,
+                                 CustomerIndex::NOT_FOUND, 0, amount, rules.penalty);
+        }
+        db.commit(sequence);
+
+        receiptSink->publish(result);
+        if (receipt) {
+            *receipt = result;
+        }
+        return status;
+    }
+
+    Status transferFrom(const AccountRules& rules, uint32_t fromHandle, uint32_t toHandle,
+                        const AccountRules& toRules, Paise amount, Receipt* receipt) {
+        if (fromHandle == CustomerIndex::NOT_FOUND || toHandle == CustomerIndex::NOT_FOUND) {
+            return Status::CUSTOMER_NOT_FOUND;
+        }
+
+        BalanceStore& balances = db.balances();
+        Paise& fromBalance = balances.balance(fromHandle, rules.column);
+        __builtin_prefetch(&balances.velocity(fromHandle), 1);     // see withdrawFrom
+        Paise& toBalance = balances.balance(toHandle, toRules.column);
+
+        Status status;
+        Receipt result;
+        uint64_t sequence = 0;
+        size_t hot = db.hotIndex(toHandle);
+        if (hot != HotCredits::NONE && fromHandle != toHandle &&
+            db.hotIndex(fromHandle) == HotCredits::NONE) {
+            // Only the source is locked; the credit goes to this CPU's slot.
+            // The source may have turned hot since the check, so its merge
+            // is held until the credit record logs its balances.
+            unique_lock<mutex> account = db.locks().lockOne(fromHandle);
+            HotCredits::Merge merged = db.settle(fromHandle);
+            status = debitAccount(rules, fromHandle, fromBalance, amount);
+            if (!succeeded(status)) {
+                return status;
+            }
+            sequence = db.creditHot(hot, fromHandle, toHandle, toRules, amount);
+            result = makeReceipt(TransactionKind::TRANSFER, status, fromHandle, rules.code,
+                                 toHandle, toRules.code, amount, rules.penalty);
+        } else {
+            auto accounts = db.locks().lockPair(fromHandle, toHandle);
+            auto merged = db.settle(fromHandle, toHandle);
+            status = debitAccount(rules, fromHandle, fromBalance, amount);
+            if (!succeeded(status)) {
+                return status;
+            }
+            toBalance += amount;
+            sequence = db.logBalances(fromHandle, toHandle);
+            result = makeReceipt(TransactionKind::TRANSFER, status, fromHandle, rules.code,
+                                 toHandle, toRules.code, amount, rules.penalty);
+        }
+        db.commit(sequence);
+
+        receiptSink->publish(result);
+        if (receipt) {
+            *receipt = result;
+        }
+        return status;
+    }
+
+    Status debitLeg(const AccountRules& rules, const string& customerId, Paise amount, bool apply) {
+        uint32_t handle = db.findHandle(customerId);
+        if (handle == CustomerIndex::NOT_FOUND) {
+            return Status::CUSTOMER_NOT_FOUND;
+        }
+
+        Paise& balance = db.balances().balance(handle, rules.column);
+        Status status;
+        uint64_t sequence = 0;
+        {
+            unique_lock<mutex> account = db.locks().lockOne(handle);
+            HotCredits::Merge merged = db.settle(handle);
+            status = debitAccount(rules, handle, balance, amount, apply);
+            if (apply && succeeded(status)) {
+                sequence = db.logBalances(handle);
+            }
+        }
+        db.commit(sequence);
+        return status;
+    }
+
+public:
+    ATM(CustomerDatabase& database)
+        : db(database), receiptSink(&nullSink), ownTerminal{0, 0}, terminal(&ownTerminal) {}
+
+    // Receipts for successful withdrawals and transfers go to sink. The
+    // sink must outlive the ATM or be replaced first.
+    void setReceiptSink(ReceiptSink& sink) {
+        receiptSink = &sink;
+    }
+
+    // Limits on everything debited through the terminal, as well as the
+    // customer's own (see CustomerDatabase::setVelocityLimits); none by
+    // default. Set before transactions start.
+    void setTerminalLimits(const VelocityLimits& limits) {
+        terminalLimits.setLimits(limits);
+    }
+
+    // Counts later debits against state rather than this ATM's own, for
+    // callers that run several terminals through one ATM. The state must
+    // outlive the ATM's use of it or be replaced first.
+    void setTerminal(VelocityState& state) {
+        terminal = &state;
+    }
+
+    void addToQueue(const string& customerId) {
+        try {
+            uint32_t handle = db.findHandle(customerId);
+            if (handle == CustomerIndex::NOT_FOUND) {
+                throw ValidationException("Customer not found");
+            }
+            if (!accessQueue.tryPush(handle)) {
+                throw ValidationException("All terminals are busy, please try again later");
+            }
+        } catch (const ValidationException& e) {
+            throw;
+        } catch (...) {
+            throw runtime_error("Error adding customer to queue");
+        }
+    }
+
+    bool isNextInQueue(const string& customerId) {
+        try {
+            uint32_t head;
+            return accessQueue.front(head) && head == db.findHandle(customerId);
+        } catch (...) {
+            throw runtime_error("Error checking queue status");
+        }
+    }
+
+    // isNextInQueue for the customer of session; false once it has expired
+    bool isNextInQueue(const SessionToken& session) {
+        uint32_t head;
+        return accessQueue.front(head) && head == db.sessionHandle(session, 0);
+    }
+
+    void removeFromQueue() {
+        try {
+            uint32_t handle;
+            accessQueue.tryPop(handle);
+        } catch (...) {
+            throw runtime_error("Error removing customer from queue");
+        }
+    }
+
+    void checkBalance(const string& customerId, ostream& out = cout) {
+        OperationTimer timer(METRIC_CHECK_BALANCE);
+        try {
+            uint32_t handle = db.findHandle(customerId);
+            if (handle == CustomerIndex::NOT_FOUND) {
+                throw ValidationException("Customer not found");
+            }
+            printBalance(handle, out);
+        } catch (const ValidationException& e) {
+            throw;
+        } catch (...) {
+            throw runtime_error("Error checking balance");
+        }
+    }
+
+    // checkBalance for the customer of session
+    void checkBalance(const SessionToken& session, ostream& out = cout) {
+        OperationTimer timer(METRIC_CHECK_BALANCE);
+        try {
+            uint32_t handle = db.sessionHandle(session);
+            if (handle == CustomerIndex::NOT_FOUND) {
+                throw ValidationException(statusMessage(Status::SESSION_EXPIRED));
+            }
+            printBalance(handle, out);
+        } catch (const ValidationException& e) {
+            throw;
+        } catch (...) {
+            throw runtime_error("Error checking balance");
+        }
+    }
+
+    Status withdraw(const string& customerId, char accountType, double rupees,
+                    Receipt* receipt = nullptr) {
+        OperationTimer timer(METRIC_WITHDRAW);
+        return timer.finish(withdrawAt(db.findHandle(customerId), accountType, rupees, receipt));
+    }
+
+    // withdraw for the customer of session
+    Status withdraw(const SessionToken& session, char accountType, double rupees,
+                    Receipt* receipt = nullptr) {
+        OperationTimer timer(METRIC_WITHDRAW);
+        uint32_t handle = db.sessionHandle(session);
+        if (handle == CustomerIndex::NOT_FOUND) {
+            return timer.finish(Status::SESSION_EXPIRED);
+        }
+        return timer.finish(withdrawAt(handle, accountType, rupees, receipt));
+    }
+
+    Status transfer(const string& fromId, const string& toId, 
+                    char fromAccountType, char toAccountType, double rupees,
+                    Receipt* receipt = nullptr) {
+        OperationTimer timer(METRIC_TRANSFER);
+        return timer.finish(transferAt(db.findHandle(fromId), db.findHandle(toId), fromAccountType,
+                                       toAccountType, rupees, receipt));
+    }
+
+    // transfer from the customer of session to toId
+    Status transfer(const SessionToken& session, const string& toId,
+                    char fromAccountType, char toAccountType, double rupees,
+                    Receipt* receipt = nullptr) {
+        OperationTimer timer(METRIC_TRANSFER);
+        uint32_t handle = db.sessionHandle(session);
+        if (handle == CustomerIndex::NOT_FOUND) {
+            return timer.finish(Status::SESSION_EXPIRED);
+        }
+        return timer.finish(transferAt(handle, db.findHandle(toId), fromAccountType, toAccountType,
+                                       rupees, receipt));
+    }
+
+    // transfer between the accounts of the customer of session
+    Status transfer(const SessionToken& session, char fromAccountType, char toAccountType,
+                    double rupees, Receipt* receipt = nullptr) {
+        OperationTimer timer(METRIC_TRANSFER);
+        uint32_t handle = db.sessionHandle(session);
+        if (handle == CustomerIndex::NOT_FOUND) {
+            return timer.finish(Status::SESSION_EXPIRED);
+        }
+        return timer.finish(transferAt(handle, handle, fromAccountType, toAccountType, rupees, receipt));
+    }
+
+    // One side of a transfer whose other account lives on another shard
+    // (see Shard). With apply false the leg is only checked; the shard holds
+    // the account until the leg is applied, so the check still stands.
+    Status transferOut(const string& customerId, char accountType, Paise amount, bool apply) {
+        OperationTimer timer(METRIC_TRANSFER_LEG);
+        if (amount <= 0) {
+            return timer.finish(Status::INVALID_AMOUNT);
+        }
+        const AccountRules* rules = AccountRules::find(accountType);
+        if (!rules) {
+            return timer.finish(Status::INVALID_ACCOUNT_TYPE);
+        }
+        return timer.finish(debitLeg(*rules, customerId, amount, apply));
+    }
+
+    Status transferIn(const string& customerId, char accountType, Paise amount, bool apply) {
+        OperationTimer timer(METRIC_TRANSFER_LEG);
+        if (amount <= 0) {
+            return timer.finish(Status::INVALID_AMOUNT);
+        }
+        const AccountRules* rules = AccountRules::find(accountType);
+        if (!rules) {
+            return timer.finish(Status::INVALID_ACCOUNT_TYPE);
+        }
+        uint32_t handle = db.findHandle(customerId);
+        if (handle == CustomerIndex::NOT_FOUND) {
+            return timer.finish(Status::CUSTOMER_NOT_FOUND);
+        }
+        if (apply) {
+            uint64_t sequence;
+            {
+                unique_lock<mutex> account = db.locks().lockOne(handle);
+                HotCredits::Merge merged = db.settle(handle);
+                db.balances().balance(handle, rules->column) += amount;
+                sequence = db.logBalances(handle);
+            }
+            db.commit(sequence);
+        }
+        return timer.finish(Status::OK);
+    }
+
+    // Hands back a leg debited with transferOut when its transfer is
+    // abandoned: amount, plus the penalty if status says one was charged.
+    // Velocity limits still count the debit.
+    Status refundLeg(const string& customerId, char accountType, Paise amount, Status status) {
+        OperationTimer timer(METRIC_TRANSFER_LEG);
+        const AccountRules* rules = AccountRules::find(accountType);
+        if (!rules) {
+            return timer.finish(Status::INVALID_ACCOUNT_TYPE);
+        }
+        uint32_t handle = db.findHandle(customerId);
+        if (handle == CustomerIndex::NOT_FOUND) {
+            return timer.finish(Status::CUSTOMER_NOT_FOUND);
+        }
+        Paise penalty = status == Status::OK_WITH_PENALTY ? rules->penalty : 0;
+        uint64_t sequence;
+        {
+            unique_lock<mutex> account = db.locks().lockOne(handle);
+            HotCredits::Merge merged = db.settle(handle);
+            db.balances().balance(handle, rules->column) += amount + penalty;
+            if (penalty != 0) {
+                db.chargePenalty(handle, -penalty);
+            }
+            sequence = db.logBalances(handle);
+        }
+        db.commit(sequence);
+        return timer.finish(Status::OK);
+    }
+
+    // Validates and applies a batch of transactions, writing one status per
+    // record instead of throwing. Validation runs over the whole batch first
+    // as straight-line selects the compiler can vectorize; records that pass
+    // are then applied in order under their account locks. Returns the
+    // number of records applied.
+    size_t applyBatch(const TransactionRecord* records, size_t count, Status* statuses) {
+        OperationTimer timer(METRIC_APPLY_BATCH);
+        const uint32_t customerCount = static_cast<uint32_t>(db.size());
+
+        for (size_t i = 0; i < count; i++) {
+            const TransactionRecord& record = records[i];
+            bool isTransfer = record.kind == TransactionKind::TRANSFER;
+            bool badAmount = record.amount <= 0;
+            bool badCustomer = (record.fromHandle >= customerCount) |
+                               (isTransfer & (record.toHandle >= customerCount));
+            bool badType = (ACCOUNT_RULE_ROWS[static_cast<uint8_t>(record.fromAccountType)] < 0) |
+                           (isTransfer & (ACCOUNT_RULE_ROWS[static_cast<uint8_t>(record.toAccountType)] < 0));
+            Status status = badType ? Status::INVALID_ACCOUNT_TYPE : Status::OK;
+            status = badCustomer ? Status::CUSTOMER_NOT_FOUND : status;
+            status = badAmount ? Status::INVALID_AMOUNT : status;
+            statuses[i] = status;
+        }
+
+        BalanceStore& balances = db.balances();
+        size_t applied = 0;
+        uint64_t lastSequence = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            if (statuses[i] != Status::OK) {
+                continue;
+            }
+            const TransactionRecord& record = records[i];
+            const AccountRules& rules = *AccountRules::find(record.fromAccountType);
+            Paise& fromBalance = balances.balance(record.fromHandle, rules.column);
+            if (record.kind == TransactionKind::WITHDRAWAL) {
+                unique_lock<mutex> account = db.locks().lockOne(record.fromHandle);
+                HotCredits::Merge merged = db.settle(record.fromHandle);
+                statuses[i] = debitAccount(rules, record.fromHandle, fromBalance, record.amount);
+                if (succeeded(statuses[i])) {
+                    lastSequence = db.logBalances(record.fromHandle);
+                }
+            } else {
+                Paise& toBalance = balances.balance(record.toHandle,
+                                                    AccountRules::find(record.toAccountType)->column);
+                auto accounts = db.locks().lockPair(record.fromHandle, record.toHandle);
+                auto merged = db.settle(record.fromHandle, record.toHandle);
+                statuses[i] = debitAccount(rules, record.fromHandle, fromBalance, record.amount);
+                if (succeeded(statuses[i])) {
+                    toBalance += record.amount;
+                    lastSequence = db.logBalances(record.fromHandle, record.toHandle);
+                }
+            }
+            applied += succeeded(statuses[i]);
+        }
+        // One durability wait covers the whole batch
+        db.commit(lastSequence);
+        return applied;
+    }
+};
+
+// Requests a shard worker executes. PREPARE_DEBIT, PREPARE_CREDIT, COMMIT
+// and ABORT carry the two phases of a transfer between shards.
+enum class ShardOp : uint8_t {
+    WITHDRAW = 1,
+    TRANSFER,
+    PREPARE_DEBIT,
+    PREPARE_CREDIT,
+    COMMIT,
+    ABORT
+};
+
+struct ShardMessage {
+    uint64_t requestId;         // echoed in the reply
+    uint64_t transactionId;     // names a prepared transfer leg
+    ShardOp op;
+    string customerId;
+    string otherId;             // destination of a same-shard TRANSFER
+    char accountType;
+    char otherAccountType;
+    Paise amount;
+
+    ShardMessage() : requestId(0), transactionId(0), op(ShardOp::WITHDRAW),
+                     accountType(0), otherAccountType(0), amount(0) {}
+
+    void encode(string& payload) const {
+        RecordWriter out(payload);
+        out.put64(requestId);
+        out.put64(transactionId);
+        out.put8(static_cast<uint8_t>(op));
+        out.putString(customerId);
+        out.putString(otherId);
+        out.put8(static_cast<uint8_t>(accountType));
+        out.put8(static_cast<uint8_t>(otherAccountType));
+        out.put64(static_cast<uint64_t>(amount));
+    }
+
+    bool decode(const string& payload) {
+        RecordReader in(payload.data(), payload.size());
+        uint8_t opCode, type, otherType;
+        uint64_t value;
+        if (!in.get64(requestId) || !in.get64(transactionId) || !in.get8(opCode) ||
+            !in.getString(customerId) || !in.getString(otherId) ||
+            !in.get8(type) || !in.get8(otherType) || !in.get64(value)) {
+            return false;
+        }
+        op = static_cast<ShardOp>(opCode);
+        accountType = static_cast<char>(type);
+        otherAccountType = static_cast<char>(otherType);
+        amount = static_cast<Paise>(value);
+        return true;
+    }
+};
+
+// Carries opaque payloads between numbered endpoints: one per shard plus
+// one for replies to the router. Each endpoint has a single reader.
+class ShardTransport {
+public:
+    virtual ~ShardTransport() {}
+
+    virtual size_t endpoints() const = 0;
+
+    virtual void send(size_t endpoint, const string& payload) = 0;
+
+    // Blocks for the next payload sent to endpoint. Returns false once the
+    // endpoint is closed and everything sent before that was received.
+    virtual bool receive(size_t endpoint, string& payload) = 0;
+
+    // Stops further sends to endpoint; later ones are dropped
+    virtual void close(size_t endpoint) = 0;
+};
+
+// Endpoints as in-process queues
+class LocalTransport : public ShardTransport {
+private:
+    struct Inbox {
+        mutex lock;
+        condition_variable ready;
+        deque<string> payloads;
+        bool closed = false;
+    };
+
+    vector<unique_ptr<Inbox>> inboxes;
+
+public:
+    explicit LocalTransport(size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            inboxes.emplace_back(new Inbox());
+        }
+    }
+
+    size_t endpoints() const override {
+        return inboxes.size();
+    }
+
+    void send(size_t endpoint, const string& payload) override {
+        Inbox& inbox = *inboxes[endpoint];
+        {
+            lock_guard<mutex> guard(inbox.lock);
+            if (inbox.closed) {
+                return;
+            }
+            inbox.payloads.push_back(payload);
+        }
+        inbox.ready.notify_one();
+    }
+
+    bool receive(size_t endpoint, string& payload) override {
+        Inbox& inbox = *inboxes[endpoint];
+        unique_lock<mutex> guard(inbox.lock);
+        inbox.ready.wait(guard, [&inbox] { return inbox.closed || !inbox.payloads.empty(); });
+        if (inbox.payloads.empty()) {
+            return false;
+        }
+        payload = std::move(inbox.payloads.front());
+        inbox.payloads.pop_front();
+        return true;
+    }
+
+    void close(size_t endpoint) override {
+        Inbox& inbox = *inboxes[endpoint];
+        {
+            lock_guard<mutex> guard(inbox.lock);
+            inbox.closed = true;
+        }
+        inbox.ready.notify_all();
+    }
+};
+
+// Endpoints as local stream sockets, standing in for the network between
+// processes. Payloads are framed like log records, so a damaged frame is
+// detected rather than misread.
+class SocketTransport : public ShardTransport {
+private:
+    struct Channel {
+        int writeEnd = -1;
+        int readEnd = -1;
+        mutex writeLock;
+        bool closed = false;
+        string buffered;
+    };
+
+    vector<unique_ptr<Channel>> channels;
+
+    static bool readExactly(int fd, char* bytes, size_t count) {
+        while (count > 0) {
+            ssize_t n = ::read(fd, bytes, count);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            bytes += n;
+            count -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+public:
+    explicit SocketTransport(size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            unique_ptr<Channel> channel(new Channel());
+            int ends[2];
+            if (::socketpair(AF_UNIX, SOCK_STREAM, 0, ends) != 0) {
+                throw runtime_error("Unable to create shard socket");
+            }
+            channel->writeEnd = ends[0];
+            channel->readEnd = ends[1];
+            channels.push_back(std::move(channel));
+        }
+    }
+
+    ~SocketTransport() {
+        for (unique_ptr<Channel>& channel : channels) {
+            ::close(channel->writeEnd);
+            ::close(channel->readEnd);
+        }
+    }
+
+    SocketTransport(const SocketTransport&) = delete;
+    SocketTransport& operator=(const SocketTransport&) = delete;
+
+    size_t endpoints() const override {
+        return channels.size();
+    }
+
+    void send(size_t endpoint, const string& payload) override {
+        Channel& channel = *channels[endpoint];
+        lock_guard<mutex> guard(channel.writeLock);
+        if (channel.closed) {
+            return;
+        }
+        channel.buffered.clear();
+        WriteAheadLog::frame(channel.buffered, payload);
+        const char* bytes = channel.buffered.data();
+        size_t remaining = channel.buffered.size();
+        while (remaining > 0) {
+            ssize_t n = ::send(channel.writeEnd, bytes, remaining, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw runtime_error("Shard socket write failed");
+            }
+            bytes += n;
+            remaining -= static_cast<size_t>(n);
+        }
+    }
+
+    bool receive(size_t endpoint, string& payload) override {
+        Channel& channel = *channels[endpoint];
+        char header[8];
+        if (!readExactly(channel.readEnd, header, sizeof(header))) {
+            return false;
+        }
+        RecordReader in(header, sizeof(header));
+        uint32_t length, checksum;
+        in.get32(length);
+        in.get32(checksum);
+        payload.resize(length);
+        if (!readExactly(channel.readEnd, &payload[0], length) ||
+            checksum32(payload.data(), length) != checksum) {
+            throw runtime_error("Corrupt frame on shard socket");
+        }
+        return true;
+    }
+
+    void close(size_t endpoint) override {
+        Channel& channel = *channels[endpoint];
+        lock_guard<mutex> guard(channel.writeLock);
+        if (!channel.closed) {
+            channel.closed = true;
+            ::shutdown(channel.writeEnd, SHUT_WR);
+        }
+    }
+};
+
+// One partition of the account space: its own database, an ATM applying
+// the banking rules to it, and a worker thread executing every request
+// for the partition in arrival order. The database can equally be used
+// directly, e.g. to load customers.
+//
+// A prepared transfer leg holds its account until COMMIT or ABORT. Other
+// requests for a held account wait, in order, until it is released; a
+// second prepare is refused with ACCOUNT_BUSY instead, so two transfers
+// can never wait on each other across shards. A debit leg is taken from
+// the balance when it is prepared, so its COMMIT cannot fail whatever
+// happens to the account meanwhile (a day closing, say); ABORT refunds it.
+class Shard {
+private:
+    struct PreparedLeg {
+        string customerId;
+        char accountType;
+        Paise amount;
+        bool isDebit;
+        Status status;          // what the debit returned when it was taken
+    };
+
+    size_t endpoint;
+    size_t replyEndpoint;
+    ShardTransport& transport;
+    CustomerDatabase db;
+    ATM atm;
+    unordered_map<uint64_t, PreparedLeg> prepared;
+    unordered_set<string> held;
+    deque<ShardMessage> waiting;
+    thread worker;
+
+    bool mustWait(const ShardMessage& message) const {
+        if (message.op != ShardOp::WITHDRAW && message.op != ShardOp::TRANSFER) {
+            return false;
+        }
+        return held.count(message.customerId) != 0 ||
+               (message.op == ShardOp::TRANSFER && held.count(message.otherId) != 0);
+    }
+
+    Status prepare(const ShardMessage& message, bool isDebit) {
+        if (held.count(message.customerId) != 0) {
+            return Status::ACCOUNT_BUSY;
+        }
+        Status status = isDebit
+            ? atm.transferOut(message.customerId, message.accountType, message.amount, true)
+            : atm.transferIn(message.customerId, message.accountType, message.amount, false);
+        if (succeeded(status)) {
+            prepared[message.transactionId] =
+                PreparedLeg{message.customerId, message.accountType, message.amount, isDebit, status};
+            held.insert(message.customerId);
+        }
+        return status;
+    }
+
+    // Completes (COMMIT) or undoes (ABORT) a prepared leg and releases its
+    // account. Only a credit leg has anything left to apply on COMMIT.
+    Status finish(uint64_t transactionId, bool apply) {
+        auto found = prepared.find(transactionId);
+        if (found == prepared.end()) {
+            return Status::OK;
+        }
+        PreparedLeg leg = found->second;
+        prepared.erase(found);
+        held.erase(leg.customerId);
+        if (leg.isDebit) {
+            return apply ? leg.status
+                         : atm.refundLeg(leg.customerId, leg.accountType, leg.amount, leg.status);
+        }
+        return apply ? atm.transferIn(leg.customerId, leg.accountType, leg.amount, true) : Status::OK;
+    }
+
+    Status execute(const ShardMessage& message) {
+        switch (message.op) {
+            case ShardOp::WITHDRAW:
+                return atm.withdraw(message.customerId, message.accountType, toRupees(message.amount));
+            case ShardOp::TRANSFER:
+                return atm.transfer(message.customerId, message.otherId, message.accountType,
+                                    message.otherAccountType, toRupees(message.amount));
+            case ShardOp::PREPARE_DEBIT:
+                return prepare(message, true);
+            case ShardOp::PREPARE_CREDIT:
+                return prepare(message, false);
+            case ShardOp::COMMIT:
+                return finish(message.transactionId, true);
+            case ShardOp::ABORT:
+                return finish(message.transactionId, false);
+        }
+        return Status::INVALID_AMOUNT;
+    }
+
+    void handle(const ShardMessage& message) {
+        if (mustWait(message)) {
+            waiting.push_back(message);
+            return;
+        }
+        Status status = execute(message);
+
+        string reply;
+        RecordWriter out(reply);
+        out.put64(message.requestId);
+        out.put8(static_cast<uint8_t>(status));
+        transport.send(replyEndpoint, reply);
+
+        if ((message.op == ShardOp::COMMIT || message.op == ShardOp::ABORT) && !waiting.empty()) {
+            // Retry everything that was waiting; whatever is still blocked
+            // goes back on the list in its original order
+            deque<ShardMessage> retry;
+            retry.swap(waiting);
+            for (const ShardMessage& next : retry) {
+                handle(next);
+            }
+        }
+    }
+
+    void run() {
+        string payload;
+        while (transport.receive(endpoint, payload)) {
+            ShardMessage message;
+            if (message.decode(payload)) {
+                handle(message);
+            }
+        }
+    }
+
+public:
+    Shard(size_t shardEndpoint, size_t routerEndpoint, ShardTransport& shardTransport,
+          const string& logPath)
+        : endpoint(shardEndpoint), replyEndpoint(routerEndpoint), transport(shardTransport),
+          atm(db) {
+        if (!logPath.empty()) {
+            db.open(logPath);
+        }
+        worker = thread(&Shard::run, this);
+    }
+
+    // The worker exits once the shard's endpoint is closed
+    ~Shard() {
+        worker.join();
+    }
+
+    Shard(const Shard&) = delete;
+    Shard& operator=(const Shard&) = delete;
+
+    CustomerDatabase& database() {
+        return db;
+    }
+};
+
+// Front end for an account space hash-partitioned across shards. Requests
+// travel to the owning shard over a ShardTransport and come back as status
+// replies. A transfer between two shards runs as a two-phase commit: both
+// shards prepare their leg, checking and holding the account, then both
+// commit, or both abort if either refused. A refusal because an account
+// is held by another transfer is retried a bounded number of times.
+// Prepared legs live only in the shards' memory, so a crash before COMMIT
+// reaches both shards can apply one leg without the other; recovering
+// such transfers needs a coordinator log, left for when shards move out
+// of process.
+class ShardRouter {
+private:
+    static const int BUSY_RETRIES = 1000;
+
+    unique_ptr<ShardTransport> transport;
+    vector<unique_ptr<Shard>> shards;
+    size_t replyEndpoint;
+    mutex pendingLock;
+    unordered_map<uint64_t, promise<Status>> pending;
+    atomic<uint64_t> nextRequest;
+    atomic<uint64_t> nextTransaction;
+    thread replies;
+
+    void collectReplies() {
+        string payload;
+        while (transport->receive(replyEndpoint, payload)) {
+            RecordReader in(payload.data(), payload.size());
+            uint64_t requestId;
+            uint8_t status;
+            if (!in.get64(requestId) || !in.get8(status)) {
+                continue;
+            }
+            promise<Status> waiter;
+            {
+                lock_guard<mutex> guard(pendingLock);
+                auto found = pending.find(requestId);
+                if (found == pending.end()) {
+                    continue;
+                }
+                waiter = std::move(found->second);
+                pending.erase(found);
+            }
+            waiter.set_value(static_cast<Status>(status));
+        }
+    }
+
+    future<Status> call(size_t shard, ShardMessage& message) {
+        message.requestId = ++nextRequest;
+        future<Status> result;
+        {
+            lock_guard<mutex> guard(pendingLock);
+            result = pending[message.requestId].get_future();
+        }
+        string payload;
+        message.encode(payload);
+        transport->send(shard, payload);
+        return result;
+    }
+
+    static bool validType(char accountType) {
+        return AccountRules::find(accountType) != nullptr;
+    }
+
+public:
+    // The transport needs one endpoint per shard plus one for replies. With
+    // a logPath, shard i keeps its log and snapshot under logPath.shard<i>.
+    ShardRouter(size_t shardCount, unique_ptr<ShardTransport> shardTransport,
+                const string& logPath = "")
+        : transport(std::move(shardTransport)), replyEndpoint(shardCount),
+          nextRequest(0), nextTransaction(0) {
+        if (shardCount == 0 || transport->endpoints() < shardCount + 1) {
+            throw invalid_argument("Transport has too few endpoints for the shards");
+        }
+        try {
+            for (size_t i = 0; i < shardCount; i++) {
+                string path = logPath.empty() ? logPath : logPath + ".shard" + to_string(i);
+                shards.emplace_back(new Shard(i, replyEndpoint, *transport, path));
+            }
+        } catch (...) {
+            for (size_t i = 0; i < shardCount; i++) {
+                transport->close(i);
+            }
+            throw;
+        }
+        replies = thread(&ShardRouter::collectReplies, this);
+    }
+
+    ~ShardRouter() {
+        for (size_t i = 0; i < shards.size(); i++) {
+            transport->close(i);
+        }
+        shards.clear();
+        transport->close(replyEndpoint);
+        replies.join();
+    }
+
+    ShardRouter(const ShardRouter&) = delete;
+    ShardRouter& operator=(const ShardRouter&) = delete;
+
+    size_t shardCount() const {
+        return shards.size();
+    }
+
+    size_t shardOf(const string& customerId) const {
+        return CustomerIndex::hashId(customerId) % shards.size();
+    }
+
+    CustomerDatabase& shardDatabase(size_t shard) {
+        return shards[shard]->database();
+    }
+
+    void addCustomer(const Customer& customer, Paise savings, Paise current) {
+        shardDatabase(shardOf(customer.customerId)).addCustomer(customer, savings, current);
+    }
+
+    Status withdraw(const string& customerId, char accountType, double rupees) {
+        ShardMessage message;
+        message.op = ShardOp::WITHDRAW;
+        message.customerId = customerId;
+        message.accountType = accountType;
+        message.amount = toPaise(rupees);
+        return call(shardOf(customerId), message).get();
+    }
+
+    Status transfer(const string& fromId, const string& toId,
+                    char fromAccountType, char toAccountType, double rupees) {
+        Paise amount = toPaise(rupees);
+        if (amount <= 0) {
+            return Status::INVALID_AMOUNT;
+        }
+        if (!validType(fromAccountType) || !validType(toAccountType)) {
+            return Status::INVALID_ACCOUNT_TYPE;
+        }
+        size_t fromShard = shardOf(fromId);
+        size_t toShard = shardOf(toId);
+
+        ShardMessage debit;
+        debit.customerId = fromId;
+        debit.accountType = fromAccountType;
+        debit.amount = amount;
+        if (fromShard == toShard) {
+            debit.op = ShardOp::TRANSFER;
+            debit.otherId = toId;
+            debit.otherAccountType = toAccountType;
+            return call(fromShard, debit).get();
+        }
+
+        ShardMessage credit;
+        credit.customerId = toId;
+        credit.accountType = toAccountType;
+        credit.amount = amount;
+        for (int attempt = 0;; attempt++) {
+            uint64_t transactionId = ++nextTransaction;
+            debit.op = ShardOp::PREPARE_DEBIT;
+            debit.transactionId = transactionId;
+            credit.op = ShardOp::PREPARE_CREDIT;
+            credit.transactionId = transactionId;
+            future<Status> debitVote = call(fromShard, debit);
+            future<Status> creditVote = call(toShard, credit);
+            Status debitStatus = debitVote.get();
+            Status creditStatus = creditVote.get();
+
+            if (succeeded(debitStatus) && succeeded(creditStatus)) {
+                // The debit is already taken; it is kept only once the
+                // credit has landed, and refunded if the credit fails
+                credit.op = ShardOp::COMMIT;
+                Status credited = call(toShard, credit).get();
+                debit.op = succeeded(credited) ? ShardOp::COMMIT : ShardOp::ABORT;
+                Status debited = call(fromShard, debit).get();
+                return succeeded(credited) ? debited : credited;
+            }
+            debit.op = credit.op = ShardOp::ABORT;
+            future<Status> debitDone, creditDone;
+            if (succeeded(debitStatus)) {
+                debitDone = call(fromShard, debit);
+            }
+            if (succeeded(creditStatus)) {
+                creditDone = call(toShard, credit);
+            }
+            Status refunded = debitDone.valid() ? debitDone.get() : Status::OK;
+            Status released = creditDone.valid() ? creditDone.get() : Status::OK;
+            if (!succeeded(refunded) || !succeeded(released)) {
+                return succeeded(refunded) ? released : refunded;
+            }
+
+            bool busy = debitStatus == Status::ACCOUNT_BUSY || creditStatus == Status::ACCOUNT_BUSY;
+            if (busy && attempt < BUSY_RETRIES) {
+                this_thread::yield();
+                continue;
+            }
+            return succeeded(debitStatus) ? creditStatus : debitStatus;
+        }
+    }
+};
+
+// Menus and input rules of the terminal. The console (BankApplication)
+// and network sessions (SessionServer) both use them, so users see the
+// same flows whichever way they connect.
+class Terminal {
+public:
+    static bool isBlank(const string& str) {
+        return str.empty() || str.find_first_not_of(" \t\n\r") == string::npos;
+    }
+
+    static void printWelcomeMenu(ostream& out) {
+        out << "\n=== Bank ATM System ===" << endl;
+        out << "1. Login" << endl;
+        out << "2. Sign Up" << endl;
+        out << "3. Exit" << endl;
+        out << "Choose an option: ";
+    }
+
+    static void printMainMenu(ostream& out) {
+        out << "\n=== Main Menu ===" << endl;
+        out << "1. Check Balance" << endl;
+        out << "2. Withdraw" << endl;
+        out << "3. Transfer" << endl;
+        out << "4. Change Password" << endl;
+        out << "5. Logout" << endl;
+        out << "Choose an option: ";
+    }
+
+    static void printTransferOptions(ostream& out) {
+        out << "\nTransfer Options:" << endl;
+        out << "1. Between own accounts" << endl;
+        out << "2. To another customer" << endl;
+    }
+
+    // Returns 'S', 'C' or 'L'; anything else throws with message
+    static char parseAccountType(const string& input, const char* message) {
+        char accountType = toupper(input[0]);
+        if (!AccountRules::find(accountType)) {
+            throw ValidationException(message);
+        }
+        return accountType;
+    }
+
+    static double parseAmount(const string& input) {
+        try {
+            double amount = stod(input);
+            if (amount <= 0) {
+                throw ValidationException("Amount must be greater than zero");
+            }
+            return amount;
+        } catch (const invalid_argument&) {
+            throw ValidationException("Invalid amount format");
+        }
+    }
+
+    static void checkName(const string& name) {
+        if (name.length() < 2) {
+            throw ValidationException("Name must be at least 2 characters long");
+        }
+    }
+
+    static void checkEmail(CustomerDatabase& db, const string& email) {
+        if (email.find('@') == string::npos || email.find('.') == string::npos) {
+            throw ValidationException("Invalid email format");
+        }
+        if (db.findHandleByEmail(email) != CustomerIndex::NOT_FOUND) {
+            throw ValidationException("This email is already registered");
+        }
+    }
+
+    static void checkAddress(const string& address) {
+        if (address.length() < 5) {
+            throw ValidationException("Address must be at least 5 characters long");
+        }
+    }
+
+    static void checkPhone(CustomerDatabase& db, const string& phone) {
+        if (phone.length() != 10 || !all_of(phone.begin(), phone.end(), ::isdigit)) {
+            throw ValidationException("Phone number must be exactly 10 digits");
+        }
+        if (db.findHandleByPhone(phone) != CustomerIndex::NOT_FOUND) {
+            throw ValidationException("This phone number is already registered");
+        }
+    }
+
+    static void checkNewPassword(const string& password) {
+        if (password.length() < 6) {
+            throw ValidationException("Password must be at least 6 characters long");
+        }
+    }
+
+    static void printRegistration(ostream& out, const string& customerId, const string& password) {
+        out << "\nRegistration successful!" << endl;
+        out << "Your assigned credentials:" << endl;
+        out << "Customer ID: " << customerId << endl;
+        out << "Default Password: " << password << endl;
+        out << "\nYou will be required to change your password upon first login." << endl;
+    }
+};
+
+// Operations as they reached CustomerDatabase and ATM from a terminal, in
+// order, for CaptureReplay to run again. The capture starts with a
+// snapshot of the database at path.snapshot. Records are framed like the
+// write-ahead log's, so a capture cut short replays up to its last whole
+// record. Passwords are stored as typed, so a capture must be guarded
+// like the credentials it holds. Logins, withdrawals and transfers also
+// record the database clock they ran at (see CustomerDatabase::setClock),
+// so lockouts and velocity limits decide the same way on replay at any
+// pace.
+class OperationCapture {
+public:
+    enum Operation : uint8_t {
+        CAPTURE_BEGIN = 1,      // version, wall-clock start
+        CAPTURE_LOGIN = 2,
+        CAPTURE_SIGN_UP = 3,
+        CAPTURE_WITHDRAW = 4,
+        CAPTURE_TRANSFER = 5,
+        CAPTURE_CHANGE_PASSWORD = 6,
+        CAPTURE_END = 7         // state checksum when the capture closed
+    };
+
+    static const uint32_t VERSION = 2;
+
+private:
+    unique_ptr<WriteAheadLog> log;
+    chrono::steady_clock::time_point started;
+
+    // Every record after CAPTURE_BEGIN starts with its operation and its
+    // time in nanoseconds since the capture started
+    string startRecord(Operation operation) {
+        string payload;
+        RecordWriter out(payload);
+        out.put8(operation);
+        out.put64(static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - started).count()));
+        return payload;
+    }
+
+    static void putRupees(RecordWriter& out, double rupees) {
+        uint64_t bits;
+        memcpy(&bits, &rupees, sizeof(bits));
+        out.put64(bits);
+    }
+
+public:
+    // Replaces any capture at path
+    OperationCapture(const string& path, CustomerDatabase& db) : started(chrono::steady_clock::now()) {
+        db.saveSnapshot(path + ".snapshot");
+        ::unlink(path.c_str());
+        log.reset(new WriteAheadLog(path, chrono::microseconds(200)));
+        string payload;
+        RecordWriter out(payload);
+        out.put8(CAPTURE_BEGIN);
+        out.put32(VERSION);
+        out.put64(static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(
+            chrono::system_clock::now().time_since_epoch()).count()));
+        log->append(payload);
+    }
+
+    void login(const string& customerId, const string& password, Status status, int64_t clock) {
+        string payload = startRecord(CAPTURE_LOGIN);
+        RecordWriter out(payload);
+        out.put64(static_cast<uint64_t>(clock));
+        out.putString(customerId);
+        out.putString(password);
+        out.put8(static_cast<uint8_t>(status));
+        log->append(payload);
+    }
+
+    // customer.password is ignored; password is the one given out
+    void signUp(const Customer& customer, const string& password, Paise savings, Paise current) {
+        string payload = startRecord(CAPTURE_SIGN_UP);
+        RecordWriter out(payload);
+        out.putString(customer.customerId);
+        out.putString(password);
+        out.putString(customer.name);
+        out.putString(customer.email);
+        out.putString(customer.address);
+        out.putString(customer.phone);
+        out.put64(static_cast<uint64_t>(savings));
+        out.put64(static_cast<uint64_t>(current));
+        log->append(payload);
+    }
+
+    void withdraw(const string& customerId, char accountType, double rupees, Status status,
+                  int64_t clock) {
+        string payload = startRecord(CAPTURE_WITHDRAW);
+        RecordWriter out(payload);
+        out.put64(static_cast<uint64_t>(clock));
+        out.putString(customerId);
+        out.put8(static_cast<uint8_t>(accountType));
+        putRupees(out, rupees);
+        out.put8(static_cast<uint8_t>(status));
+        log->append(payload);
+    }
+
+    void transfer(const string& fromId, const string& toId, char fromAccountType, char toAccountType,
+                  double rupees, Status status, int64_t clock) {
+        string payload = startRecord(CAPTURE_TRANSFER);
+        RecordWriter out(payload);
+        out.put64(static_cast<uint64_t>(clock));
+        out.putString(fromId);
+        out.putString(toId);
+        out.put8(static_cast<uint8_t>(fromAccountType));
+        out.put8(static_cast<uint8_t>(toAccountType));
+        putRupees(out, rupees);
+        out.put8(static_cast<uint8_t>(status));
+        log->append(payload);
+    }
+
+    void changePassword(const string& customerId, const string& newPassword, bool changed) {
+        string payload = startRecord(CAPTURE_CHANGE_PASSWORD);
+        RecordWriter out(payload);
+        out.putString(customerId);
+        out.putString(newPassword);
+        out.put8(changed ? 1 : 0);
+        log->append(payload);
+    }
+
+    void end(uint64_t checksum) {
+        string payload = startRecord(CAPTURE_END);
+        RecordWriter out(payload);
+        out.put64(checksum);
+        log->waitDurable(log->append(payload));
+    }
+};
+
+// Main application class
+class BankApplication {
+private:
+    istream& in;
+    ostream& out;
+    CustomerDatabase db;
+    CredentialAllocator credentialAllocator;
+    ATM atm;
+    ConsoleReceiptSink receipts;
+    string currentUserId;
+    SessionToken session;
+    unique_ptr<OperationCapture> capture;
+    int64_t clockRead;          // the database clock as last read, for capture
+
+    string getValidInput(const string& prompt, bool allowSpaces = true) {
+        string input;
+        bool valid = false;
+        
+        do {
+            if (!in) {
+                throw runtime_error("Input stream closed");
+            }
+            try {
+                out << prompt;
+                if (allowSpaces) {
+                    in.ignore(numeric_limits<streamsize>::max(), '\n');
+                    getline(in, input);
+                } else {
+                    in >> input;
+                    in.ignore(numeric_limits<streamsize>::max(), '\n');
+                }
+
+                if (Terminal::isBlank(input)) {
+                    throw ValidationException("Input cannot be empty or only whitespace");
+                }
+                valid = true;
+            } catch (const ValidationException& e) {
+                out << "Error: " << e.what() << ". Please try again." << endl;
+            } catch (...) {
+                out << "Error reading input. Please try again." << endl;
+            }
+        } while (!valid);
+
+        return input;
+    }
+
+public:
+    // Reads choices from input and writes the terminal to output. Changes
+    // are logged under logPath; an empty path keeps everything in memory.
+    // Debits are held to customerLimits per customer and terminalLimits
+    // across the terminal, by default the bank's own.
+    BankApplication(istream& input = cin, ostream& output = cout,
+                    const string& logPath = "atm.wal",
+                    const VelocityLimits& customerLimits = VelocityLimits::perCustomer(),
+                    const VelocityLimits& terminalLimits = VelocityLimits::perTerminal())
+        : in(input), out(output), atm(db), receipts(output, db), currentUserId(""), clockRead(0) {
+        if (!logPath.empty()) {
+            db.open(logPath);
+        }
+        credentialAllocator.reserveThrough(db.highestCustomerNumber());
+        db.setVelocityLimits(customerLimits);
+        atm.setReceiptSink(receipts);
+        atm.setTerminalLimits(terminalLimits);
+    }
+
+    ~BankApplication() {
+        if (capture) {
+            try {
+                capture->end(db.stateChecksum());
+            } catch (...) {
+                // The capture still replays; it just has no checksum to compare
+            }
+        }
+    }
+
+    CustomerDatabase& database() {
+        return db;
+    }
+
+    // Records every operation from here on to a capture at path (see
+    // OperationCapture)
+    void startCapture(const string& path) {
+        capture.reset(new OperationCapture(path, db));
+        db.setClock([this] {
+            clockRead = monotonicNanoseconds();
+            return clockRead;
+        });
+    }
+
+    void run() {
+        while (step()) {
+        }
+    }
+
+    // Handles one choice from the top-level menu. Returns false once the
+    // user exits or the input runs out.
+    bool step() {
+        if (!in) {
+            return false;
+        }
+        try {
+            Terminal::printWelcomeMenu(out);
+
+            string choice = getValidInput("", false);
+            
+            switch (stoi(choice)) {
+                case 1:
+                    login();
+                    break;
+                case 2:
+                    signUp();
+                    break;
+                case 3:
+                    out << "Thank you for using our services!" << endl;
+                    return false;
+                default:
+                    throw ValidationException("Invalid option");
+            }
+        } catch (const ValidationException& e) {
+            out << "Error: " << e.what() << endl;
+        } catch (const exception& e) {
+            out << "An error occurred: " << e.what() << endl;
+        } catch (...) {
+            out << "An unexpected error occurred" << endl;
+        }
+        return true;
+    }
+
+private:
+    void login() {
+        try {
+            out << "\n=== Login ===" << endl;
+            string customerId = getValidInput("Enter Customer ID: ", false);
+            string password = getValidInput("Enter Password: ", false);
+
+            Status status = db.openSession(customerId, password, session);
+            if (capture) {
+                capture->login(customerId, password, status, clockRead);
+            }
+            if (status == Status::OK) {
+                currentUserId = customerId;
+                atm.addToQueue(currentUserId);
+                out << "Login successful!" << endl;
+                
+                CustomerProfile* customer = db.findCustomer(customerId);
+                if (customer && customer->isFirstLogin) {
+                    out << "\nThis is your first login. You must change your password." << endl;
+                    changePassword(true);
+                }
+                
+                showMainMenu();
+            } else {
+                out << "Login failed: " << statusMessage(status) << endl;
+            }
+        } catch (const ValidationException& e) {
+            out << "Login failed: " << e.what() << endl;
+        } catch (...) {
+            out << "An error occurred during login" << endl;
+        }
+    }
+
+    void signUp() {
+        try {
+            Customer newCustomer;
+            out << "\n=== New Customer Registration ===" << endl;
+            
+            newCustomer.name = getValidInput("Enter Name: ");
+            Terminal::checkName(newCustomer.name);
+
+            newCustomer.email = getValidInput("Enter Email: ");
+            Terminal::checkEmail(db, newCustomer.email);
+
+            newCustomer.address = getValidInput("Enter Address: ");
+            Terminal::checkAddress(newCustomer.address);
+
+            newCustomer.phone = getValidInput("Enter Phone: ", false);
+            Terminal::checkPhone(db, newCustomer.phone);
+
+            newCustomer.isFirstLogin = true;
+
+            pair<string, string> defaultCred = credentialAllocator.getNextCredential();
+            newCustomer.customerId = defaultCred.first;
+            newCustomer.password = db.hashPassword(defaultCred.second);
+
+            db.addCustomer(newCustomer, toPaise(10000), toPaise(25000));
+            if (capture) {
+                capture->signUp(newCustomer, defaultCred.second, toPaise(10000), toPaise(25000));
+            }
+
+            Terminal::printRegistration(out, newCustomer.customerId, defaultCred.second);
+
+        } catch (const ValidationException& e) {
+            out << "Registration failed: " << e.what() << endl;
+        } catch (const DatabaseException& e) {
+            out << "Database error: " << e.what() << endl;
+        } catch (...) {
+            out << "An unexpected error occurred during registration" << endl;
+        }
     }
 void changePassword(bool isFirstTime = false) {
         try {
-            string newPassword, confirmPassword;
-            bool valid = false;
-            
-            do {
-                newPassword = getValidInput("Enter new password: ", false);
-                
-                if (newPassword.length() < 6) {
-                    throw ValidationException("Password must be at least 6 characters long");
+            string newPassword, confirmPassword;
+            bool valid = false;
+            
+            do {
+                newPassword = getValidInput("Enter new password: ", false);
+                Terminal::checkNewPassword(newPassword);
+
+                confirmPassword = getValidInput("Confirm new password: ", false);
+
+                if (newPassword != confirmPassword) {
+                    throw ValidationException("Passwords do not match");
+                }
+                valid = true;
+            } while (!valid);
+
+            bool changed = db.changePassword(session, newPassword);
+            if (capture) {
+                capture->changePassword(currentUserId, newPassword, changed);
+            }
+            if (!changed) {
+                throw DatabaseException("Failed to update password");
+            }
+            out << "Password changed successfully!" << endl;
+        } catch (const ValidationException& e) {
+            out << "Password change failed: " << e.what() << endl;
+            if (isFirstTime) {
+                out << "You must change your password before continuing. Please try again." << endl;
+                changePassword(true);
+            }
+        } catch (const DatabaseException& e) {
+            out << "Database error: " << e.what() << endl;
+        } catch (...) {
+            out << "An unexpected error occurred while changing password" << endl;
+        }
+    }
+
+    void showMainMenu() {
+        while (true && atm.isNextInQueue(session)) {
+            if (!in) {
+                logout();
+                return;
+            }
+            try {
+                Terminal::printMainMenu(out);
+
+                string choice = getValidInput("", false);
+                int option = stoi(choice);
+
+                switch (option) {
+                    case 1:
+                        atm.checkBalance(session, out);
+                        break;
+                    case 2:
+                        handleWithdrawal();
+                        break;
+                    case 3:
+                        handleTransfer();
+                        break;
+                    case 4:
+                        changePassword();
+                        break;
+                    case 5:
+                        logout();
+                        return;
+                    default:
+                        throw ValidationException("Invalid option");
+                }
+            } catch (const ValidationException& e) {
+                out << "Error: " << e.what() << endl;
+            } catch (const exception& e) {
+                out << "An error occurred: " << e.what() << endl;
+            } catch (...) {
+                out << "An unexpected error occurred" << endl;
+            }
+        }
+        if (db.sessionHandle(session, 0) == CustomerIndex::NOT_FOUND) {
+            out << statusMessage(Status::SESSION_EXPIRED) << endl;
+            logout();
+        }
+    }
+
+    void handleWithdrawal() {
+        try {
+            char accountType;
+            double amount;
+
+            string input = getValidInput("Select account (S for Savings, C for Current, L for Salary): ",
+                                         false);
+            accountType = Terminal::parseAccountType(input, "Invalid account type. Please enter S, C or L");
+
+            amount = Terminal::parseAmount(getValidInput("Enter amount to withdraw: ", false));
+
+            Status status = atm.withdraw(session, accountType, amount);
+            if (capture) {
+                capture->withdraw(currentUserId, accountType, amount, status, clockRead);
+            }
+            if (!succeeded(status)) {
+                out << "Withdrawal failed: " << statusMessage(status) << endl;
+            }
+
+        } catch (const ValidationException& e) {
+            out << "Withdrawal failed: " << e.what() << endl;
+        } catch (...) {
+            out << "An unexpected error occurred during withdrawal" << endl;
+        }
+    }
+
+    void handleTransfer() {
+        try {
+            Terminal::printTransferOptions(out);
+
+            string choiceStr = getValidInput("Select option: ", false);
+            int choice = stoi(choiceStr);
+
+            if (choice != 1 && choice != 2) {
+                throw ValidationException("Invalid transfer option");
+            }
+
+            char fromAccount, toAccount;
+            string toCustomerId;
+            double amount;
+
+            // Get source account type
+            fromAccount = Terminal::parseAccountType(getValidInput("From account (S/C/L): ", false),
+                                                     "Invalid source account type");
+
+            if (choice == 1) {
+                toCustomerId = currentUserId;
+                toAccount = Terminal::parseAccountType(getValidInput("To account (S/C/L): ", false),
+                                                       "Invalid destination account type");
+            } else {
+                toCustomerId = getValidInput("Enter recipient's Customer ID: ", false);
+                toAccount = Terminal::parseAccountType(
+                    getValidInput("To recipient's account (S/C/L): ", false),
+                    "Invalid destination account type");
+            }
+
+            amount = Terminal::parseAmount(getValidInput("Enter amount to transfer: ", false));
+
+            Status status = choice == 1
+                ? atm.transfer(session, fromAccount, toAccount, amount)
+                : atm.transfer(session, toCustomerId, fromAccount, toAccount, amount);
+            if (capture) {
+                capture->transfer(currentUserId, toCustomerId, fromAccount, toAccount, amount, status,
+                                  clockRead);
+            }
+            if (!succeeded(status)) {
+                out << "Transfer failed: " << statusMessage(status) << endl;
+            }
+
+        } catch (const ValidationException& e) {
+            out << "Transfer failed: " << e.what() << endl;
+        } catch (const DatabaseException& e) {
+            out << "Database error: " << e.what() << endl;
+        } catch (...) {
+            out << "An unexpected error occurred during transfer" << endl;
+        }
+    }
+
+    void logout() {
+        try {
+            atm.removeFromQueue();
+            db.closeSession(session);
+            session = SessionToken();
+            currentUserId = "";
+            out << "Logged out successfully" << endl;
+        } catch (...) {
+            out << "Error during logout" << endl;
+        }
+    }
+};
+
+struct ReplayConfig {
+    string capture;
+    string snapshot;                // starting state; capture.snapshot if empty
+    string log;                     // scratch log, removed afterwards; capture.replay if empty
+    bool paced = false;             // keep the recorded gaps between operations
+    string metrics;                 // as WorkloadConfig::metrics
+};
+
+// Runs an OperationCapture again against its starting snapshot, as fast
+// as it will go or at the pace it was recorded. The database logs to a
+// scratch log as it would in service. Reports throughput, operations
+// whose outcome differs from the recorded one, and the final
+// stateChecksum, which two builds replaying the same capture should agree
+// on, as should the checksum recorded when the capture closed.
+class CaptureReplay {
+private:
+    struct Step {
+        OperationCapture::Operation operation;
+        uint64_t offset;            // nanoseconds since the capture started
+        int64_t clock;              // the database clock it ran at
+        Customer customer;          // customerId and, for sign-ups, the rest
+        string password;            // typed at login, given out or chosen
+        string toId;
+        char fromAccountType;
+        char toAccountType;
+        double rupees;
+        Paise savings;
+        Paise current;
+        uint8_t outcome;            // Status, or whether the password changed
+    };
+
+    static const int OPERATION_COUNT = OperationCapture::CAPTURE_END + 1;
+
+    ReplayConfig config;
+    CustomerDatabase db;
+    ATM atm;
+    vector<Step> steps;
+    int64_t clock;              // what the database clock reads, see run
+    bool recordedEnd;
+    uint64_t recordedChecksum;
+    size_t counts[OPERATION_COUNT];
+    size_t mismatches;
+    double elapsedSeconds;
+    uint64_t checksum;
+
+    static bool getRupees(RecordReader& in, double& rupees) {
+        uint64_t bits;
+        if (!in.get64(bits)) {
+            return false;
+        }
+        memcpy(&rupees, &bits, sizeof(rupees));
+        return true;
+    }
+
+    // Decodes one capture record; false if it is malformed
+    bool parse(const string& payload, Step& step) {
+        RecordReader in(payload.data(), payload.size());
+        uint8_t operation, fromType = 0, toType = 0;
+        uint64_t savings = 0, current = 0;
+        uint64_t clock = 0;
+        step.outcome = 0;
+        step.rupees = 0;
+        if (!in.get8(operation) || !in.get64(step.offset)) {
+            return false;
+        }
+        step.operation = static_cast<OperationCapture::Operation>(operation);
+        bool ok;
+        switch (step.operation) {
+            case OperationCapture::CAPTURE_LOGIN:
+                ok = in.get64(clock) && in.getString(step.customer.customerId) &&
+                     in.getString(step.password) && in.get8(step.outcome);
+                break;
+            case OperationCapture::CAPTURE_CHANGE_PASSWORD:
+                ok = in.getString(step.customer.customerId) && in.getString(step.password) &&
+                     in.get8(step.outcome);
+                break;
+            case OperationCapture::CAPTURE_SIGN_UP:
+                ok = in.getString(step.customer.customerId) && in.getString(step.password) &&
+                     in.getString(step.customer.name) && in.getString(step.customer.email) &&
+                     in.getString(step.customer.address) && in.getString(step.customer.phone) &&
+                     in.get64(savings) && in.get64(current);
+                break;
+            case OperationCapture::CAPTURE_WITHDRAW:
+                ok = in.get64(clock) && in.getString(step.customer.customerId) &&
+                     in.get8(fromType) && getRupees(in, step.rupees) && in.get8(step.outcome);
+                break;
+            case OperationCapture::CAPTURE_TRANSFER:
+                ok = in.get64(clock) && in.getString(step.customer.customerId) &&
+                     in.getString(step.toId) && in.get8(fromType) && in.get8(toType) &&
+                     getRupees(in, step.rupees) && in.get8(step.outcome);
+                break;
+            case OperationCapture::CAPTURE_END:
+                ok = in.get64(recordedChecksum);
+                recordedEnd = ok;
+                break;
+            default:
+                ok = false;
+        }
+        step.clock = static_cast<int64_t>(clock);
+        step.fromAccountType = static_cast<char>(fromType);
+        step.toAccountType = static_cast<char>(toType);
+        step.savings = static_cast<Paise>(savings);
+        step.current = static_cast<Paise>(current);
+        return ok && in.done();
+    }
+
+    void load() {
+        bool begun = false;
+        bool malformed = false;
+        int64_t length = WriteAheadLog::replay(config.capture, [&](const string& payload) {
+            if (malformed) {
+                return;
+            }
+            if (!begun) {
+                RecordReader in(payload.data(), payload.size());
+                uint8_t operation;
+                uint32_t version;
+                begun = in.get8(operation) && operation == OperationCapture::CAPTURE_BEGIN &&
+                        in.get32(version) && version == OperationCapture::VERSION;
+                malformed = !begun;
+                return;
+            }
+            Step step;
+            if (!parse(payload, step)) {
+                malformed = true;
+            } else if (step.operation != OperationCapture::CAPTURE_END) {
+                steps.push_back(std::move(step));
+            }
+        });
+        if (length < 0 || !begun) {
+            throw DatabaseException("Unable to read capture " + config.capture);
+        }
+        if (malformed) {
+            throw DatabaseException("Capture " + config.capture + " has a malformed record");
+        }
+    }
+
+    void removeScratch() {
+        for (const char* suffix : {"", ".snapshot", ".prev"}) {
+            ::unlink((config.log + suffix).c_str());
+        }
+    }
+
+    // Runs one step and returns whether its outcome matched the capture
+    bool execute(const Step& step) {
+        const string& customerId = step.customer.customerId;
+        switch (step.operation) {
+            case OperationCapture::CAPTURE_LOGIN:
+                return db.validateCredentials(customerId, step.password) == static_cast<Status>(step.outcome);
+            case OperationCapture::CAPTURE_SIGN_UP: {
+                Customer customer = step.customer;
+                customer.password = db.hashPassword(step.password);
+                customer.isFirstLogin = true;
+                try {
+                    db.addCustomer(customer, step.savings, step.current);
+                } catch (const DatabaseException&) {
+                    return false;
+                }
+                return true;
+            }
+            case OperationCapture::CAPTURE_WITHDRAW:
+                return atm.withdraw(customerId, step.fromAccountType, step.rupees) ==
+                       static_cast<Status>(step.outcome);
+            case OperationCapture::CAPTURE_TRANSFER:
+                return atm.transfer(customerId, step.toId, step.fromAccountType, step.toAccountType,
+                                    step.rupees) == static_cast<Status>(step.outcome);
+            case OperationCapture::CAPTURE_CHANGE_PASSWORD:
+                return db.changePassword(customerId, step.password) == (step.outcome != 0);
+            default:
+                return false;
+        }
+    }
+
+public:
+    explicit CaptureReplay(const ReplayConfig& replay)
+        : config(replay), atm(db), clock(0), recordedEnd(false), recordedChecksum(0), mismatches(0),
+          elapsedSeconds(0), checksum(0) {
+        if (config.snapshot.empty()) {
+            config.snapshot = config.capture + ".snapshot";
+        }
+        if (config.log.empty()) {
+            config.log = config.capture + ".replay";
+        }
+        // As the console that made the capture. The limits and lockouts run
+        // on the clock each operation recorded rather than the replay's
+        // own, so they decide alike however fast the replay goes.
+        db.setVelocityLimits(VelocityLimits::perCustomer());
+        atm.setTerminalLimits(VelocityLimits::perTerminal());
+        db.setClock([this] { return clock; });
+        fill(begin(counts), end(counts), 0);
+    }
+
+    ~CaptureReplay() {
+        removeScratch();
+    }
+
+    void run() {
+        load();
+        // The database replaces its snapshot by renaming over it, so a
+        // link leaves the capture's own copy untouched
+        removeScratch();
+        if (::link(config.snapshot.c_str(), (config.log + ".snapshot").c_str()) != 0) {
+            throw DatabaseException("Unable to use snapshot " + config.snapshot);
+        }
+        db.open(config.log);
+
+        auto started = chrono::steady_clock::now();
+        for (const Step& step : steps) {
+            if (config.paced) {
+                this_thread::sleep_until(started + chrono::nanoseconds(step.offset));
+            }
+            counts[step.operation]++;
+            clock = step.clock;
+            if (!execute(step)) {
+                mismatches++;
+            }
+        }
+        elapsedSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        checksum = db.stateChecksum();
+    }
+
+    void report(ostream& out) {
+        static const char* names[OPERATION_COUNT] = {
+            nullptr, nullptr, "logins", "sign-ups", "withdrawals", "transfers", "password changes", nullptr
+        };
+        out << "capture=" << config.capture << " operations=" << steps.size()
+            << (config.paced ? " paced" : " unpaced") << "\n";
+        for (int operation = 0; operation < OPERATION_COUNT; operation++) {
+            if (names[operation]) {
+                out << "  " << left << setw(18) << names[operation] << right << counts[operation] << "\n";
+            }
+        }
+        out << fixed << setprecision(3) << "elapsed: " << elapsedSeconds << " s ("
+            << setprecision(0) << steps.size() / max(elapsedSeconds, 1e-9) << " operations/s)\n"
+            << "outcome mismatches: " << mismatches << "\n"
+            << "state checksum: " << hex << setw(16) << setfill('0') << checksum;
+        if (recordedEnd && checksum == recordedChecksum) {
+            out << " (matches capture)";
+        } else if (recordedEnd) {
+            out << " (capture recorded " << setw(16) << recordedChecksum << ")";
+        }
+        out << dec << setfill(' ') << "\n";
+    }
+};
+
+#ifdef __cpp_impl_coroutine
+
+// One step of a network session's menus, run as a coroutine. A flow
+// starts suspended and runs when its caller awaits it; when it finishes
+// it resumes the caller directly, so a session is a chain of flows that
+// its event loop resumes wherever the innermost one stopped.
+class SessionFlow {
+public:
+    struct promise_type {
+        coroutine_handle<> caller;
+        exception_ptr failure;
+
+        // Hands control back to the awaiting flow, if there is one
+        struct Return {
+            bool await_ready() noexcept {
+                return false;
+            }
+
+            coroutine_handle<> await_suspend(coroutine_handle<promise_type> flow) noexcept {
+                coroutine_handle<> caller = flow.promise().caller;
+                return caller ? caller : noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        SessionFlow get_return_object() {
+            return SessionFlow(coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        Return final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception() {
+            failure = current_exception();
+        }
+    };
+
+private:
+    coroutine_handle<promise_type> handle;
+
+    explicit SessionFlow(coroutine_handle<promise_type> flow) : handle(flow) {}
+
+public:
+    SessionFlow() : handle(nullptr) {}
+
+    // Destroying a suspended flow destroys the flows it is awaiting too
+    ~SessionFlow() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    SessionFlow(SessionFlow&& other) noexcept : handle(other.handle) {
+        other.handle = nullptr;
+    }
+
+    SessionFlow& operator=(SessionFlow&& other) noexcept {
+        swap(handle, other.handle);
+        return *this;
+    }
+
+    // Runs a top-level flow until it first suspends
+    void start() {
+        handle.resume();
+    }
+
+    bool done() const {
+        return !handle || handle.done();
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    coroutine_handle<> await_suspend(coroutine_handle<> caller) noexcept {
+        handle.promise().caller = caller;
+        return handle;
+    }
+
+    void await_resume() {
+        if (handle.promise().failure) {
+            rethrow_exception(handle.promise().failure);
+        }
+    }
+};
+
+// Serves terminal sessions over a local stream socket, one line of input
+// per prompt. Each connection runs the terminal's menus (see Terminal) as
+// SessionFlows that suspend whenever they need input or are waiting on
+// the credential workers, so one event loop multiplexes thousands of
+// sessions. Every loop thread has its own epoll set, watches the listening
+// socket, and keeps the connections it accepts; a loop thread also owns
+// an ATM whose receipts go to whichever session is running.
+//
+// Network sessions take no place in the ATM's access queue. That queue
+// orders users of the single console terminal, whereas here every
+// connection is a terminal of its own; account locks keep concurrent
+// operations consistent.
+class SessionServer {
+public:
+    static const size_t MAX_LINE = 4096;    // longer input drops the connection
+
+private:
+    struct Loop;
+
+    struct Session {
+        // Suspends the flow until a line answering the prompt arrives. The
+        // answer is kept on the session, so the awaiter itself owns
+        // nothing; GCC 12 can destroy co_await temporaries twice.
+        struct Prompt {
+            Session& session;
+            const char* text;
+            bool allowSpaces;
+
+            bool await_ready() {
+                session.out << text;
+                return session.takeInput(*this);
+            }
+
+            void await_suspend(coroutine_handle<> flow) {
+                session.waiting = flow;
+                session.prompt = this;
+            }
+
+            string await_resume() {
+                return std::move(session.input);
+            }
+        };
+
+        // Suspends the flow until a credential worker has the result,
+        // started with the loop's notifier so the loop wakes when it is
+        // ready. Keep it in a named variable rather than awaiting a
+        // temporary (see Prompt).
+        template <typename Result>
+        struct Work {
+            Session& session;
+            future<Result> result;
+
+            bool await_ready() const {
+                return result.wait_for(chrono::seconds(0)) == future_status::ready;
+            }
+
+            void await_suspend(coroutine_handle<> flow) {
+                session.waiting = flow;
+                session.isReady = [this] { return await_ready(); };
+                session.loop.park(session);
+            }
+
+            Result await_resume() {
+                return result.get();
+            }
+        };
+
+        Loop& loop;
+        CustomerDatabase& db;
+        ostream& out;           // the loop's output, see Loop::flush
+        int fd;
+        string inbox;
+        size_t inboxPos;
+        string outbox;
+        size_t outboxPos;
+        bool watchingWrites;
+        bool inputClosed;
+        bool finished;          // close once outbox is written
+        coroutine_handle<> waiting;
+        Prompt* prompt;
+        string input;           // answer to the last prompt
+        function<bool()> isReady;
+        string currentUserId;
+        SessionToken token;     // of the logged in customer
+        VelocityState terminal; // debits through this connection, see ATM::setTerminal
+        SessionFlow flow;       // last, so it is destroyed first
+
+        Session(Loop& owner, int socket)
+            : loop(owner), db(owner.server.db), out(owner.output), fd(socket), inboxPos(0),
+              outboxPos(0), watchingWrites(false), inputClosed(false), finished(false),
+              waiting(nullptr), prompt(nullptr), terminal{0, 0} {}
+
+        ~Session() {
+            db.closeSession(token);
+        }
+
+        Prompt getValidInput(const char* text, bool allowSpaces = true) {
+            return Prompt{*this, text, allowSpaces};
+        }
+
+        // Consumes input lines until one answers prompt. Blank lines are
+        // skipped for one-word prompts, as the console's >> does, and
+        // rejected for free-text ones.
+        bool takeInput(Prompt& current) {
+            while (true) {
+                size_t end = inbox.find('\n', inboxPos);
+                if (end == string::npos) {
+                    inbox.erase(0, inboxPos);
+                    inboxPos = 0;
+                    return false;
+                }
+                string line = inbox.substr(inboxPos, end - inboxPos);
+                inboxPos = end + 1;
+                if (!current.allowSpaces) {
+                    size_t first = line.find_first_not_of(" \t\r");
+                    if (first == string::npos) {
+                        continue;
+                    }
+                    line = line.substr(first, line.find_first_of(" \t\r", first) - first);
+                } else if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                if (Terminal::isBlank(line)) {
+                    out << "Error: Input cannot be empty or only whitespace. Please try again." << endl;
+                    out << current.text;
+                    continue;
+                }
+                input = std::move(line);
+                return true;
+            }
+        }
+
+        SessionFlow run() {
+            while (true) {
+                try {
+                    Terminal::printWelcomeMenu(out);
+                    string choice = co_await getValidInput("", false);
+
+                    switch (stoi(choice)) {
+                        case 1:
+                            co_await login();
+                            break;
+                        case 2:
+                            co_await signUp();
+                            break;
+                        case 3:
+                            out << "Thank you for using our services!" << endl;
+                            co_return;
+                        default:
+                            throw ValidationException("Invalid option");
+                    }
+                } catch (const ValidationException& e) {
+                    out << "Error: " << e.what() << endl;
+                } catch (const exception& e) {
+                    out << "An error occurred: " << e.what() << endl;
+                } catch (...) {
+                    out << "An unexpected error occurred" << endl;
+                }
+            }
+        }
+
+        SessionFlow login() {
+            try {
+                out << "\n=== Login ===" << endl;
+                string customerId = co_await getValidInput("Enter Customer ID: ", false);
+                string password = co_await getValidInput("Enter Password: ", false);
+
+                OperationTimer timer(METRIC_VALIDATE_CREDENTIALS);
+                Work<Status> check{*this, db.validateCredentialsAsync(customerId, password, loop.notifier())};
+                Status status = timer.finish(co_await check);
+                if (status == Status::OK) {
+                    currentUserId = customerId;
+                    token = db.openVerifiedSession(customerId);
+                    out << "Login successful!" << endl;
+
+                    CustomerProfile* customer = db.findCustomer(customerId);
+                    if (customer && customer->isFirstLogin) {
+                        out << "\nThis is your first login. You must change your password." << endl;
+                        co_await changePassword(true);
+                    }
+
+                    co_await showMainMenu();
+                } else {
+                    out << "Login failed: " << statusMessage(status) << endl;
+                }
+            } catch (const ValidationException& e) {
+                out << "Login failed: " << e.what() << endl;
+            } catch (...) {
+                out << "An error occurred during login" << endl;
+            }
+        }
+
+        SessionFlow signUp() {
+            try {
+                Customer newCustomer;
+                out << "\n=== New Customer Registration ===" << endl;
+
+                newCustomer.name = co_await getValidInput("Enter Name: ");
+                Terminal::checkName(newCustomer.name);
+
+                newCustomer.email = co_await getValidInput("Enter Email: ");
+                Terminal::checkEmail(db, newCustomer.email);
+
+                newCustomer.address = co_await getValidInput("Enter Address: ");
+                Terminal::checkAddress(newCustomer.address);
+
+                newCustomer.phone = co_await getValidInput("Enter Phone: ", false);
+                Terminal::checkPhone(db, newCustomer.phone);
+
+                newCustomer.isFirstLogin = true;
+
+                pair<string, string> defaultCred = loop.server.credentialAllocator.getNextCredential();
+                newCustomer.customerId = defaultCred.first;
+                Work<string> hashing{*this, db.credentialService().hashAsync(defaultCred.second,
+                                                                             loop.notifier())};
+                newCustomer.password = co_await hashing;
+
+                db.addCustomer(newCustomer, toPaise(10000), toPaise(25000));
+
+                Terminal::printRegistration(out, newCustomer.customerId, defaultCred.second);
+            } catch (const ValidationException& e) {
+                out << "Registration failed: " << e.what() << endl;
+            } catch (const DatabaseException& e) {
+                out << "Database error: " << e.what() << endl;
+            } catch (...) {
+                out << "An unexpected error occurred during registration" << endl;
+            }
+        }
+
+        SessionFlow changePassword(bool isFirstTime = false) {
+            while (true) {
+                try {
+                    string newPassword = co_await getValidInput("Enter new password: ", false);
+                    Terminal::checkNewPassword(newPassword);
+
+                    string confirmPassword = co_await getValidInput("Confirm new password: ", false);
+                    if (newPassword != confirmPassword) {
+                        throw ValidationException("Passwords do not match");
+                    }
+
+                    Work<string> hashing{*this, db.credentialService().hashAsync(newPassword, loop.notifier())};
+                    if (!db.storePasswordHash(token, co_await hashing)) {
+                        throw DatabaseException("Failed to update password");
+                    }
+                    out << "Password changed successfully!" << endl;
+                    co_return;
+                } catch (const ValidationException& e) {
+                    out << "Password change failed: " << e.what() << endl;
+                    if (!isFirstTime) {
+                        co_return;
+                    }
+                    out << "You must change your password before continuing. Please try again." << endl;
+                } catch (const DatabaseException& e) {
+                    out << "Database error: " << e.what() << endl;
+                    co_return;
+                } catch (...) {
+                    out << "An unexpected error occurred while changing password" << endl;
+                    co_return;
+                }
+            }
+        }
+
+        SessionFlow showMainMenu() {
+            while (true) {
+                if (db.sessionHandle(token, 0) == CustomerIndex::NOT_FOUND) {
+                    out << statusMessage(Status::SESSION_EXPIRED) << endl;
+                    currentUserId = "";
+                    co_return;
+                }
+                try {
+                    Terminal::printMainMenu(out);
+                    string choice = co_await getValidInput("", false);
+
+                    switch (stoi(choice)) {
+                        case 1:
+                            loop.atm.checkBalance(token, out);
+                            break;
+                        case 2:
+                            co_await handleWithdrawal();
+                            break;
+                        case 3:
+                            co_await handleTransfer();
+                            break;
+                        case 4:
+                            co_await changePassword();
+                            break;
+                        case 5:
+                            db.closeSession(token);
+                            token = SessionToken();
+                            currentUserId = "";
+                            out << "Logged out successfully" << endl;
+                            co_return;
+                        default:
+                            throw ValidationException("Invalid option");
+                    }
+                } catch (const ValidationException& e) {
+                    out << "Error: " << e.what() << endl;
+                } catch (const exception& e) {
+                    out << "An error occurred: " << e.what() << endl;
+                } catch (...) {
+                    out << "An unexpected error occurred" << endl;
+                }
+            }
+        }
+
+        SessionFlow handleWithdrawal() {
+            try {
+                char accountType = Terminal::parseAccountType(
+                    co_await getValidInput("Select account (S for Savings, C for Current, L for Salary): ",
+                                           false),
+                    "Invalid account type. Please enter S, C or L");
+                double amount = Terminal::parseAmount(
+                    co_await getValidInput("Enter amount to withdraw: ", false));
+
+                Status status = loop.atm.withdraw(token, accountType, amount);
+                if (!succeeded(status)) {
+                    out << "Withdrawal failed: " << statusMessage(status) << endl;
+                }
+            } catch (const ValidationException& e) {
+                out << "Withdrawal failed: " << e.what() << endl;
+            } catch (...) {
+                out << "An unexpected error occurred during withdrawal" << endl;
+            }
+        }
+
+        SessionFlow handleTransfer() {
+            try {
+                Terminal::printTransferOptions(out);
+                int choice = stoi(co_await getValidInput("Select option: ", false));
+                if (choice != 1 && choice != 2) {
+                    throw ValidationException("Invalid transfer option");
+                }
+
+                char fromAccount = Terminal::parseAccountType(
+                    co_await getValidInput("From account (S/C/L): ", false),
+                    "Invalid source account type");
+                char toAccount;
+                string toCustomerId;
+                if (choice == 1) {
+                    toCustomerId = currentUserId;
+                    toAccount = Terminal::parseAccountType(
+                        co_await getValidInput("To account (S/C/L): ", false),
+                        "Invalid destination account type");
+                } else {
+                    toCustomerId = co_await getValidInput("Enter recipient's Customer ID: ", false);
+                    toAccount = Terminal::parseAccountType(
+                        co_await getValidInput("To recipient's account (S/C/L): ", false),
+                        "Invalid destination account type");
+                }
+                double amount = Terminal::parseAmount(
+                    co_await getValidInput("Enter amount to transfer: ", false));
+
+                Status status = choice == 1
+                    ? loop.atm.transfer(token, fromAccount, toAccount, amount)
+                    : loop.atm.transfer(token, toCustomerId, fromAccount, toAccount, amount);
+                if (!succeeded(status)) {
+                    out << "Transfer failed: " << statusMessage(status) << endl;
+                }
+            } catch (const ValidationException& e) {
+                out << "Transfer failed: " << e.what() << endl;
+            } catch (const DatabaseException& e) {
+                out << "Database error: " << e.what() << endl;
+            } catch (...) {
+                out << "An unexpected error occurred during transfer" << endl;
+            }
+        }
+    };
+
+    // The eventfd a loop sleeps on. Credential workers hold a reference
+    // while their task is pending, so one finishing after its loop is gone
+    // still writes to a live descriptor.
+    class Wakeup {
+        int fd;
+
+    public:
+        Wakeup() : fd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+            if (fd < 0) {
+                throw runtime_error("Unable to create session loop");
+            }
+        }
+
+        ~Wakeup() {
+            ::close(fd);
+        }
+
+        Wakeup(const Wakeup&) = delete;
+        Wakeup& operator=(const Wakeup&) = delete;
+
+        int descriptor() const {
+            return fd;
+        }
+
+        bool signal() {
+            uint64_t one = 1;
+            return ::write(fd, &one, sizeof(one)) == sizeof(one);
+        }
+
+        void drain() {
+            uint64_t count;
+            (void)::read(fd, &count, sizeof(count));
+        }
+    };
+
+    struct Loop {
+        SessionServer& server;
+        int epollFd;
+        shared_ptr<Wakeup> wakeup;
+        atomic<bool> stopping;
+        ostringstream output;
+        ATM atm;
+        ConsoleReceiptSink receipts;
+        unordered_map<int, unique_ptr<Session>> sessions;
+        vector<Session*> parked;    // waiting on credential workers
+        double cpuSeconds;
+        thread worker;
+
+        explicit Loop(SessionServer& owner)
+            : server(owner), epollFd(::epoll_create1(EPOLL_CLOEXEC)),
+              wakeup(make_shared<Wakeup>()), stopping(false), atm(owner.db),
+              receipts(output, owner.db), cpuSeconds(0) {
+            if (epollFd < 0) {
+                throw runtime_error("Unable to create session loop");
+            }
+            atm.setReceiptSink(receipts);
+            atm.setTerminalLimits(owner.terminalLimits);
+            watch(wakeup->descriptor(), EPOLLIN, EPOLL_CTL_ADD);
+            watch(server.listenFd, EPOLLIN | EPOLLEXCLUSIVE, EPOLL_CTL_ADD);
+        }
+
+        ~Loop() {
+            sessions.clear();
+            ::close(epollFd);
+        }
+
+        void watch(int fd, uint32_t events, int operation) {
+            epoll_event event = {};
+            event.events = events;
+            event.data.fd = fd;
+            if (::epoll_ctl(epollFd, operation, fd, &event) != 0) {
+                throw runtime_error("Unable to watch session socket");
+            }
+        }
+
+        void updateWatch(Session& session) {
+            uint32_t events = session.inputClosed ? 0u : uint32_t(EPOLLIN);
+            if (session.watchingWrites) {
+                events |= EPOLLOUT;
+            }
+            watch(session.fd, events, EPOLL_CTL_MOD);
+        }
+
+        void park(Session& session) {
+            parked.push_back(&session);
+        }
+
+        // For credential work a session will park on: wakes this loop once
+        // the result is ready
+        function<void()> notifier() {
+            shared_ptr<Wakeup> target = wakeup;
+            return [target] { target->signal(); };
+        }
+
+        void accept() {
+            int fd = ::accept4(server.listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                return;     // another loop took it, or the client gave up
+            }
+            int on = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));    // fails harmlessly on unix sockets
+            watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+            Session& session = *(sessions[fd] = unique_ptr<Session>(new Session(*this, fd)));
+            session.flow = session.run();
+            session.flow.start();
+            flush(session);
+        }
+
+        void close(Session& session) {
+            ::close(session.fd);    // also drops it from the epoll set
+            parked.erase(remove(parked.begin(), parked.end(), &session), parked.end());
+            sessions.erase(session.fd);
+        }
+
+        void resume(Session& session) {
+            coroutine_handle<> flow = session.waiting;
+            session.waiting = nullptr;
+            atm.setTerminal(session.terminal);
+            flow.resume();
+            if (session.flow.done()) {
+                session.finished = true;
+            }
+        }
+
+        // Moves what the running flow printed into the session's outbox
+        // and writes as much of it as the socket takes. Returns false if
+        // the session was closed.
+        bool flush(Session& session) {
+            if (output.tellp() > 0) {
+                session.outbox += output.str();
+                output.str("");
+            }
+            while (session.outboxPos < session.outbox.size()) {
+                ssize_t n = ::send(session.fd, session.outbox.data() + session.outboxPos,
+                                   session.outbox.size() - session.outboxPos, MSG_NOSIGNAL);
+                if (n >= 0) {
+                    session.outboxPos += static_cast<size_t>(n);
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    if (!session.watchingWrites) {
+                        session.watchingWrites = true;
+                        updateWatch(session);
+                    }
+                    return true;
+                } else if (errno != EINTR) {
+                    close(session);
+                    return false;
+                }
+            }
+            session.outbox.clear();
+            session.outboxPos = 0;
+            if (session.watchingWrites) {
+                session.watchingWrites = false;
+                updateWatch(session);
+            }
+            if (session.finished || (session.inputClosed && session.prompt)) {
+                close(session);
+                return false;
+            }
+            return true;
+        }
+
+        bool receive(Session& session) {
+            char buffer[4096];
+            while (!session.inputClosed) {
+                ssize_t n = ::read(session.fd, buffer, sizeof(buffer));
+                if (n > 0) {
+                    session.inbox.append(buffer, static_cast<size_t>(n));
+                    if (static_cast<size_t>(n) < sizeof(buffer)) {
+                        break;
+                    }
+                } else if (n == 0) {
+                    // Whatever is already buffered still runs
+                    session.inputClosed = true;
+                    updateWatch(session);
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                } else if (errno != EINTR) {
+                    close(session);
+                    return false;
+                }
+            }
+            if (session.prompt && session.takeInput(*session.prompt)) {
+                session.prompt = nullptr;
+                resume(session);
+            }
+            if (session.inbox.size() - session.inboxPos > MAX_LINE) {
+                close(session);
+                return false;
+            }
+            return flush(session);
+        }
+
+        void resumeParked() {
+            for (size_t i = 0; i < parked.size();) {
+                Session* session = parked[i];
+                if (!session->isReady()) {
+                    i++;
+                    continue;
+                }
+                parked[i] = parked.back();
+                parked.pop_back();
+                session->isReady = nullptr;
+                resume(*session);
+                flush(*session);
+            }
+        }
+
+        void run() {
+            epoll_event events[64];
+            while (true) {
+                // Workers signal the wakeup as results come in, so parked
+                // sessions need no timeout
+                int count = ::epoll_wait(epollFd, events, 64, -1);
+                if (count < 0 && errno != EINTR) {
+                    break;
+                }
+                for (int i = 0; i < count; i++) {
+                    int fd = events[i].data.fd;
+                    if (fd == wakeup->descriptor()) {
+                        wakeup->drain();
+                        if (!stopping) {
+                            continue;   // a worker finished; resumeParked picks it up
+                        }
+                        timespec used;
+                        ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &used);
+                        cpuSeconds = used.tv_sec + used.tv_nsec / 1e9;
+                        return;
+                    }
+                    if (fd == server.listenFd) {
+                        accept();
+                        continue;
+                    }
+                    auto found = sessions.find(fd);
+                    if (found == sessions.end()) {
+                        continue;
+                    }
+                    Session& session = *found->second;
+                    if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                        close(session);     // the client is gone both ways
+                    } else if ((events[i].events & EPOLLOUT) && !flush(session)) {
+                        continue;
+                    } else if (events[i].events & EPOLLIN) {
+                        receive(session);
+                    }
+                }
+                resumeParked();
+            }
+        }
+    };
+
+    CustomerDatabase& db;
+    CredentialAllocator credentialAllocator;
+    VelocityLimits terminalLimits;
+    int listenFd;
+    string boundAddress;
+    string socketPath;          // unlinked again on shutdown
+    vector<unique_ptr<Loop>> loops;
+    bool stopped;
+
+    void listenOn(const string& address) {
+        if (address.compare(0, 5, "unix:") == 0) {
+            sockaddr_un local = {};
+            local.sun_family = AF_UNIX;
+            socketPath = address.substr(5);
+            if (socketPath.empty() || socketPath.size() >= sizeof(local.sun_path)) {
+                throw invalid_argument("Bad socket path " + socketPath);
+            }
+            memcpy(local.sun_path, socketPath.c_str(), socketPath.size() + 1);
+            listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            ::unlink(socketPath.c_str());
+            if (listenFd < 0 || ::bind(listenFd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0 ||
+                ::listen(listenFd, SOMAXCONN) != 0) {
+                throw runtime_error("Unable to listen on " + address);
+            }
+            boundAddress = address;
+        } else if (address.compare(0, 4, "tcp:") == 0) {
+            sockaddr_in local = {};
+            local.sin_family = AF_INET;
+            local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            local.sin_port = htons(static_cast<uint16_t>(stoi(address.substr(4))));
+            listenFd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int on = 1;
+            socklen_t length = sizeof(local);
+            if (listenFd < 0 || ::setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+                ::bind(listenFd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0 ||
+                ::listen(listenFd, SOMAXCONN) != 0 ||
+                ::getsockname(listenFd, reinterpret_cast<sockaddr*>(&local), &length) != 0) {
+                throw runtime_error("Unable to listen on " + address);
+            }
+            boundAddress = "tcp:" + to_string(ntohs(local.sin_port));
+        } else {
+            throw invalid_argument("Listen address must be unix:PATH or tcp:PORT, not " + address);
+        }
+    }
+
+public:
+    // address is unix:PATH or tcp:PORT, the latter on the loopback
+    // interface only; port 0 picks a free one (see address())
+    // Each connection is held to limits (see ATM::setTerminalLimits)
+    SessionServer(CustomerDatabase& database, const string& address, size_t threads,
+                  const VelocityLimits& limits = VelocityLimits::none())
+        : db(database), terminalLimits(limits), listenFd(-1), stopped(false) {
+        credentialAllocator.reserveThrough(db.highestCustomerNumber());
+        try {
+            listenOn(address);
+            for (size_t i = 0; i < max<size_t>(threads, 1); i++) {
+                loops.emplace_back(new Loop(*this));
+            }
+        } catch (...) {
+            loops.clear();
+            if (listenFd >= 0) {
+                ::close(listenFd);
+            }
+            throw;
+        }
+        for (unique_ptr<Loop>& loop : loops) {
+            loop->worker = thread(&Loop::run, loop.get());
+        }
+    }
+
+    ~SessionServer() {
+        stop();
+        loops.clear();
+        ::close(listenFd);
+        if (!socketPath.empty()) {
+            ::unlink(socketPath.c_str());
+        }
+    }
+
+    SessionServer(const SessionServer&) = delete;
+    SessionServer& operator=(const SessionServer&) = delete;
+
+    // The address clients connect to, with the port actually bound
+    const string& address() const {
+        return boundAddress;
+    }
+
+    size_t threads() const {
+        return loops.size();
+    }
+
+    // Stops every loop; open sessions are dropped when the server goes away
+    void stop() {
+        if (stopped) {
+            return;
+        }
+        stopped = true;
+        for (unique_ptr<Loop>& loop : loops) {
+            loop->stopping = true;
+            if (!loop->wakeup->signal()) {
+                throw runtime_error("Unable to stop session loop");
+            }
+        }
+        for (unique_ptr<Loop>& loop : loops) {
+            loop->worker.join();
+        }
+    }
+
+    // CPU time the loop threads used; complete once stop() returns
+    double cpuSeconds() const {
+        double total = 0;
+        for (const unique_ptr<Loop>& loop : loops) {
+            total += loop->cpuSeconds;
+        }
+        return total;
+    }
+
+    // Opens a blocking connection to a server at address
+    static int connectTo(const string& address) {
+        int fd;
+        int result;
+        if (address.compare(0, 5, "unix:") == 0) {
+            sockaddr_un remote = {};
+            remote.sun_family = AF_UNIX;
+            string path = address.substr(5);
+            if (path.size() >= sizeof(remote.sun_path)) {
+                throw invalid_argument("Bad socket path " + path);
+            }
+            memcpy(remote.sun_path, path.c_str(), path.size() + 1);
+            fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            result = fd < 0 ? -1 : ::connect(fd, reinterpret_cast<sockaddr*>(&remote), sizeof(remote));
+        } else {
+            sockaddr_in remote = {};
+            remote.sin_family = AF_INET;
+            remote.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            remote.sin_port = htons(static_cast<uint16_t>(stoi(address.substr(4))));
+            fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            int on = 1;
+            result = fd < 0 ? -1 : ::connect(fd, reinterpret_cast<sockaddr*>(&remote), sizeof(remote));
+            if (result == 0) {
+                ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+        }
+        if (result != 0) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            throw runtime_error("Unable to connect to " + address);
+        }
+        return fd;
+    }
+};
+
+#endif
+
+// Shape of a synthetic workload for LoadDriver
+struct WorkloadConfig {
+    size_t accounts = 10000;
+    size_t sessions = 100000;
+    double readRatio = 0.2;         // share of sessions that only check balances
+    double transferRatio = 0.5;     // share of the remaining sessions that transfer
+    double skew = 0.99;             // Zipf theta for picking accounts, 0 is uniform
+    uint64_t seed = 42;
+    string logPath;                 // empty keeps the database in memory
+    int hashCost = PasswordHasher::DEFAULT_COST;
+    size_t credentialCache = 65536; // 0 makes every login pay for the hash
+    string metrics;                 // text or json dumps Metrics after the report, off disables them
+};
+
+// Draws ranks in [0, n) with Zipfian skew theta in [0, 1), following the
+// generator from Gray et al., "Quickly Generating Billion-Record Synthetic
+// Databases". Rank 0 is the hottest.
+class ZipfGenerator {
+private:
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetaN;
+    double eta;
+    double halfPowTheta;
+
+    static double zeta(uint64_t count, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= count; i++) {
+            sum += 1.0 / pow(static_cast<double>(i), theta);
+        }
+        return sum;
+    }
+
+public:
+    ZipfGenerator(uint64_t count, double skew) : n(count), theta(skew) {
+        if (count == 0 || skew < 0 || skew >= 1) {
+            throw invalid_argument("Zipf generator needs count > 0 and 0 <= skew < 1");
+        }
+        alpha = 1.0 / (1.0 - theta);
+        zetaN = zeta(n, theta);
+        double zeta2 = zeta(2, theta);
+        eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetaN);
+        halfPowTheta = pow(0.5, theta);
+    }
+
+    template <typename Random>
+    uint64_t next(Random& random) {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(random);
+        double uz = u * zetaN;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < 1.0 + halfPowTheta) {
+            return 1 % n;
+        }
+        uint64_t rank = static_cast<uint64_t>(n * pow(eta * u - eta + 1.0, alpha));
+        return rank < n ? rank : n - 1;
+    }
+};
+
+// Drives BankApplication without a console. Each session is scripted as
+// the keystrokes a customer would type (log in, one action, log out) and
+// fed through the same menu flows; latency is timed per session and
+// grouped by the action it performed. Velocity limits are off, since a
+// few synthetic accounts take far more debits than any customer could.
+class LoadDriver {
+public:
+    enum Operation {
+        OP_BALANCE,
+        OP_WITHDRAW,
+        OP_TRANSFER,
+        OP_COUNT
+    };
+
+private:
+    WorkloadConfig config;
+    istringstream script;
+    ostream discard;
+    BankApplication app;
+    vector<int64_t> latencies[OP_COUNT];
+    double elapsedSeconds;
+    size_t importedRows;
+    double importSeconds;
+
+public:
+    static const char* PASSWORD;
+
+    static string accountId(uint64_t number) {
+        char id[32];
+        snprintf(id, sizeof(id), "LOAD%07" PRIu64, number);
+        return id;
+    }
+
+    static int64_t percentile(const vector<int64_t>& sorted, double fraction) {
+        if (sorted.empty()) {
+            return 0;
+        }
+        size_t rank = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+        return sorted[rank];
+    }
+
+    // Adds the synthetic accounts 0..accounts-1 that are not in db yet,
+    // all with PASSWORD, and returns how many were added
+    static size_t importAccounts(CustomerDatabase& db, size_t accounts) {
+        ImportRow row;
+        // One hash shared by every synthetic account keeps setup fast
+        row.customer.password = db.hashPassword(PASSWORD);
+        row.customer.name = "Load Test";
+        row.customer.address = "Synthetic Street";
+        row.customer.isFirstLogin = false;
+        row.savings = toPaise(1e9);
+        row.current = toPaise(1e9);
+        vector<ImportRow> rows;
+        for (uint64_t number = 0; number < accounts; number++) {
+            row.customer.customerId = accountId(number);
+            if (!db.findCustomer(row.customer.customerId)) {
+                char phone[32];
+                snprintf(phone, sizeof(phone), "9%09" PRIu64, number);
+                row.customer.email = row.customer.customerId + "@example.com";
+                row.customer.phone = phone;
+                rows.push_back(row);
+            }
+        }
+        size_t count = rows.size();
+        db.importCustomers(std::move(rows));
+        return count;
+    }
+
+    explicit LoadDriver(const WorkloadConfig& workload)
+        : config(workload), discard(nullptr),
+          app(script, discard, workload.logPath, VelocityLimits::none(), VelocityLimits::none()),
+          elapsedSeconds(0), importedRows(0), importSeconds(0) {
+        CustomerDatabase& db = app.database();
+        db.credentialService().setHashCost(config.hashCost);
+        db.credentialService().setCacheCapacity(config.credentialCache);
+        auto started = chrono::steady_clock::now();
+        importedRows = importAccounts(db, config.accounts);
+        importSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    }
+
+    void run() {
+        mt19937_64 random(config.seed);
+        ZipfGenerator accounts(config.accounts, config.skew);
+        uniform_real_distribution<double> mix(0.0, 1.0);
+        uniform_int_distribution<int> rupees(100, 5000);
+
+        auto started = chrono::steady_clock::now();
+        for (size_t session = 0; session < config.sessions; session++) {
+            string id = accountId(accounts.next(random));
+            string keys = "1\n" + id + "\n" + PASSWORD + "\n";
+            Operation operation;
+            if (mix(random) < config.readRatio) {
+                operation = OP_BALANCE;
+                keys += "1\n";
+            } else if (mix(random) < config.transferRatio) {
+                operation = OP_TRANSFER;
+                keys += "3\n2\nC\n" + accountId(accounts.next(random)) + "\nS\n" +
+                        to_string(rupees(random)) + "\n";
+            } else {
+                operation = OP_WITHDRAW;
+                keys += "2\nS\n" + to_string(rupees(random)) + "\n";
+            }
+            keys += "5\n";
+
+            script.clear();
+            script.str(keys);
+            auto begin = chrono::steady_clock::now();
+            app.step();
+            auto end = chrono::steady_clock::now();
+            latencies[operation].push_back(
+                chrono::duration_cast<chrono::nanoseconds>(end - begin).count());
+        }
+        elapsedSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    }
+
+    void report(ostream& out) {
+        static const char* names[OP_COUNT] = {"balance", "withdraw", "transfer"};
+        out << "accounts=" << config.accounts << " sessions=" << config.sessions
+            << " read=" << config.readRatio << " transfer=" << config.transferRatio
+            << " skew=" << config.skew << " hash-cost=" << config.hashCost
+            << " credential-cache=" << config.credentialCache << "\n";
+        out << fixed << setprecision(3)
+            << "setup: imported " << importedRows << " accounts in " << importSeconds << " s\n";
+        out << setprecision(0)
+            << "total throughput: " << config.sessions / elapsedSeconds << " sessions/s\n";
+        out << left << setw(10) << "operation" << right << setw(10) << "count"
+            << setw(12) << "p50 (ns)" << setw(12) << "p99 (ns)" << setw(12) << "p999 (ns)" << "\n";
+        for (int operation = 0; operation < OP_COUNT; operation++) {
+            vector<int64_t>& samples = latencies[operation];
+            sort(samples.begin(), samples.end());
+            out << left << setw(10) << names[operation] << right << setw(10) << samples.size()
+                << setw(12) << percentile(samples, 0.50)
+                << setw(12) << percentile(samples, 0.99)
+                << setw(12) << percentile(samples, 0.999) << "\n";
+        }
+    }
+};
+
+const char* LoadDriver::PASSWORD = "loadpass";
+
+struct LookupBenchConfig {
+    vector<size_t> sizes = {1000, 100000, 10000000};
+    size_t lookups = 1000000;       // per size, half hits and half misses
+    size_t scanLimit = 100000;      // largest size also timed with a linear scan
+    uint64_t seed = 42;
+};
+
+// Times findHandle against tables of each size, on IDs that exist and on
+// IDs that do not. Sizes up to scanLimit are also timed with a linear scan
+// over Customer records, the way findCustomer worked before the index.
+class LookupBenchmark {
+private:
+    struct Run {
+        size_t size;
+        double importSeconds;
+        double hitNanoseconds;
+        double missNanoseconds;
+        double scanNanoseconds;     // 0 when not timed
+    };
+
+    LookupBenchConfig config;
+    vector<Run> runs;
+
+    static double nanosecondsEach(chrono::steady_clock::time_point started, size_t count) {
+        return chrono::duration<double, nano>(chrono::steady_clock::now() - started).count() /
+               max<size_t>(count, 1);
+    }
+
+    Run measure(size_t size) {
+        Run result = {size, 0, 0, 0, 0};
+        CustomerDatabase db;
+        auto started = chrono::steady_clock::now();
+        importSynthetic(db, size, "Lookup Test");
+        result.importSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        mt19937_64 random(config.seed);
+        vector<string> hits, misses;
+        for (size_t i = 0; i < config.lookups / 2; i++) {
+            hits.push_back(LoadDriver::accountId(random() % size));
+            char id[32];
+            snprintf(id, sizeof(id), "MISS%07" PRIu64, static_cast<uint64_t>(random() % size));
+            misses.push_back(id);
+        }
+
+        size_t found = 0;
+        started = chrono::steady_clock::now();
+        for (const string& id : hits) {
+            found += db.findHandle(id) != CustomerIndex::NOT_FOUND;
+        }
+        result.hitNanoseconds = nanosecondsEach(started, hits.size());
+        started = chrono::steady_clock::now();
+        for (const string& id : misses) {
+            found += db.findHandle(id) != CustomerIndex::NOT_FOUND;
+        }
+        result.missNanoseconds = nanosecondsEach(started, misses.size());
+        if (found != hits.size()) {
+            throw runtime_error("Lookup benchmark found the wrong customers");
+        }
+
+        if (size <= config.scanLimit) {
+            vector<Customer> records(size);
+            for (size_t number = 0; number < size; number++) {
+                records[number].customerId = LoadDriver::accountId(number);
+                records[number].name = "Lookup Test";
+            }
+            // A linear scan costs O(size) a lookup, so fewer are timed
+            size_t count = min(hits.size(), max<size_t>(1, 100000000 / size));
+            size_t scanned = 0;
+            started = chrono::steady_clock::now();
+            for (size_t i = 0; i < count; i++) {
+                const string& id = i % 2 == 0 ? hits[i] : misses[i];
+                for (const Customer& record : records) {
+                    if (record.customerId == id) {
+                        scanned++;
+                        break;
+                    }
+                }
+            }
+            result.scanNanoseconds = nanosecondsEach(started, count);
+            if (scanned != (count + 1) / 2) {
+                throw runtime_error("Lookup benchmark scan found the wrong customers");
+            }
+        }
+        return result;
+    }
+
+public:
+    // Adds customers LoadDriver::accountId(0..count-1) to db with no
+    // contact details or password, a million rows at a time
+    static void importSynthetic(CustomerDatabase& db, size_t count, const string& name) {
+        static const size_t IMPORT_BATCH = 1000000;
+        ImportRow row;
+        row.customer.name = name;
+        row.customer.isFirstLogin = false;
+        row.savings = toPaise(1e9);
+        row.current = toPaise(1e9);
+        db.reserve(db.size() + count);
+        for (size_t first = 0; first < count; first += IMPORT_BATCH) {
+            vector<ImportRow> rows;
+            rows.reserve(min(IMPORT_BATCH, count - first));
+            for (size_t number = first; number < min(count, first + IMPORT_BATCH); number++) {
+                row.customer.customerId = LoadDriver::accountId(number);
+                rows.push_back(row);
+            }
+            db.importCustomers(std::move(rows));
+        }
+    }
+
+    // Parses a comma-separated list of counts such as 1000,100000
+    static vector<size_t> parseSizes(const string& list) {
+        vector<size_t> sizes;
+        stringstream in(list);
+        string item;
+        while (getline(in, item, ',')) {
+            sizes.push_back(stoull(item));
+        }
+        return sizes;
+    }
+
+    explicit LookupBenchmark(const LookupBenchConfig& benchmark) : config(benchmark) {
+        if (config.sizes.empty() || config.lookups < 2 ||
+            find(config.sizes.begin(), config.sizes.end(), size_t(0)) != config.sizes.end()) {
+            throw invalid_argument("Need non-empty tables and at least two lookups");
+        }
+    }
+
+    void run() {
+        for (size_t size : config.sizes) {
+            runs.push_back(measure(size));
+        }
+    }
+
+    void report(ostream& out) {
+        out << "lookups=" << config.lookups << " scan-limit=" << config.scanLimit << "\n";
+        out << right << setw(10) << "customers" << setw(12) << "import (s)" << setw(12) << "hit (ns)"
+            << setw(12) << "miss (ns)" << setw(12) << "scan (ns)" << "\n";
+        for (const Run& result : runs) {
+            out << setw(10) << result.size << fixed << setprecision(3) << setw(12) << result.importSeconds
+                << setprecision(1) << setw(12) << result.hitNanoseconds << setw(12) << result.missNanoseconds;
+            if (result.scanNanoseconds > 0) {
+                out << setw(12) << result.scanNanoseconds << "\n";
+            } else {
+                out << setw(12) << "-" << "\n";
+            }
+        }
+    }
+};
+
+struct SumBenchConfig {
+    size_t accounts = 10000000;
+    size_t rounds = 5;              // passes over each layout; the best is kept
+    uint64_t seed = 42;
+};
+
+// Sums every balance once over Customer-like records that hold their
+// balances as doubles next to six strings, the layout before BalanceStore,
+// and once over BalanceStore's int64 paise columns
+class BalanceSumBenchmark {
+private:
+    // Customer as it was before balances moved into BalanceStore
+    struct LegacyCustomer {
+        string customerId;
+        string password;
+        string name;
+        string email;
+        string address;
+        string phone;
+        double savingsBalance;
+        double currentBalance;
+        bool isFirstLogin;
+    };
+
+    SumBenchConfig config;
+    double aosSeconds;
+    double soaSeconds;
+    double aosTotal;
+    Paise soaTotal;
+
+public:
+    explicit BalanceSumBenchmark(const SumBenchConfig& benchmark)
+        : config(benchmark), aosSeconds(0), soaSeconds(0), aosTotal(0), soaTotal(0) {
+        if (config.accounts == 0) {
+            throw invalid_argument("Need at least one account");
+        }
+        config.rounds = max<size_t>(config.rounds, 1);
+    }
+
+    void run() {
+        mt19937_64 random(config.seed);
+        uniform_int_distribution<Paise> pickBalance(0, toPaise(1e6));
+        vector<LegacyCustomer> records(config.accounts);
+        BalanceStore balances;
+        for (LegacyCustomer& record : records) {
+            Paise savings = pickBalance(random);
+            Paise current = pickBalance(random);
+            record.savingsBalance = toRupees(savings);
+            record.currentBalance = toRupees(current);
+            record.isFirstLogin = false;
+            balances.append(savings, current, 0, AccrualState{0, 0});
+        }
+
+        for (size_t round = 0; round < config.rounds; round++) {
+            auto started = chrono::steady_clock::now();
+            double sum = 0;
+            for (const LegacyCustomer& record : records) {
+                sum += record.savingsBalance + record.currentBalance;
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            aosSeconds = round == 0 ? seconds : min(aosSeconds, seconds);
+            aosTotal = sum;
+
+            started = chrono::steady_clock::now();
+            soaTotal = balances.total();
+            seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            soaSeconds = round == 0 ? seconds : min(soaSeconds, seconds);
+        }
+        if (llabs(toPaise(aosTotal) - soaTotal) > static_cast<Paise>(config.accounts)) {
+            throw runtime_error("Balance sum benchmark layouts disagree");
+        }
+    }
+
+    void report(ostream& out) {
+        out << "accounts=" << config.accounts << " rounds=" << config.rounds << "\n";
+        out << left << setw(26) << "layout" << right << setw(12) << "bytes/acct"
+            << setw(12) << "pass (ms)" << setw(14) << "accounts/s" << "\n";
+        out << fixed << setprecision(2)
+            << left << setw(26) << "AoS Customer, double" << right << setw(12) << sizeof(LegacyCustomer)
+            << setw(12) << aosSeconds * 1e3 << setprecision(0) << setw(14) << config.accounts / aosSeconds
+            << "\n" << setprecision(2)
+            << left << setw(26) << "SoA BalanceStore, paise" << right << setw(12)
+            << ACCOUNT_COLUMNS * sizeof(Paise)
+            << setw(12) << soaSeconds * 1e3 << setprecision(0) << setw(14) << config.accounts / soaSeconds
+            << "\n" << setprecision(2) << "speedup: " << aosSeconds / soaSeconds << "x\n"
+            << "total: Rs. " << toRupees(soaTotal) << "\n";
+    }
+};
+
+struct StressBenchConfig {
+    size_t accounts = 10000;
+    size_t transfers = 200000;      // per thread count
+    size_t threads = 64;            // runs with 1, 2, 4, ... up to this many
+    uint64_t seed = 42;
+};
+
+// Random transfers between random accounts and account types, each thread
+// on an ATM of its own, run with 1, 2, 4, ... threads. Balances start far
+// above any minimum, so no transfer is charged a penalty and money must be
+// conserved exactly: BalanceStore::total may not change across a run.
+class StressBenchmark {
+private:
+    struct Run {
+        size_t threads;
+        double rate;
+    };
+
+    StressBenchConfig config;
+    CustomerDatabase db;
+    vector<string> accountIds;
+    vector<Run> runs;
+    size_t failures;
+
+    double measure(size_t threads) {
+        Paise before = db.balances().total();
+        atomic<size_t> failed(0);
+        vector<thread> workers;
+        auto started = chrono::steady_clock::now();
+        for (size_t worker = 0; worker < threads; worker++) {
+            size_t share = config.transfers / threads + (worker < config.transfers % threads ? 1 : 0);
+            workers.emplace_back([this, threads, worker, share, &failed] {
+                ATM atm(db);
+                mt19937_64 random(config.seed + threads * 1000 + worker);
+                uniform_int_distribution<size_t> pickAccount(0, accountIds.size() - 1);
+                uniform_int_distribution<int> rupees(1, 20000);
+                size_t count = 0;
+                for (size_t i = 0; i < share; i++) {
+                    const string& fromId = accountIds[pickAccount(random)];
+                    const string& toId = accountIds[pickAccount(random)];
+                    char fromType = random() & 1 ? 'S' : 'C';
+                    char toType = random() & 1 ? 'S' : 'C';
+                    count += !succeeded(atm.transfer(fromId, toId, fromType, toType, rupees(random)));
+                }
+                failed += count;
+            });
+        }
+        for (thread& worker : workers) {
+            worker.join();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        if (db.balances().total() != before) {
+            throw runtime_error("Stress benchmark lost money with " + to_string(threads) + " threads");
+        }
+        failures += failed;
+        return config.transfers / seconds;
+    }
+
+public:
+    explicit StressBenchmark(const StressBenchConfig& benchmark) : config(benchmark), failures(0) {
+        if (config.accounts < 2 || config.threads == 0) {
+            throw invalid_argument("Need at least two accounts and a thread");
+        }
+        LookupBenchmark::importSynthetic(db, config.accounts, "Stress Test");
+        for (size_t number = 0; number < config.accounts; number++) {
+            accountIds.push_back(LoadDriver::accountId(number));
+        }
+    }
+
+    void run() {
+        for (size_t threads = 1; threads <= config.threads; threads *= 2) {
+            runs.push_back(Run{threads, measure(threads)});
+        }
+    }
+
+    void report(ostream& out) {
+        out << "accounts=" << config.accounts << " transfers=" << config.transfers
+            << " cpus=" << thread::hardware_concurrency() << "\n";
+        out << right << setw(8) << "threads" << setw(14) << "transfers/s" << setw(10) << "scaling" << "\n";
+        for (const Run& result : runs) {
+            out << setw(8) << result.threads << fixed << setprecision(0) << setw(14) << result.rate
+                << setprecision(2) << setw(9) << result.rate / runs.front().rate << "x\n";
+        }
+        out << "failed transfers: " << failures << "\n"
+            << "money conserved after every run\n";
+    }
+};
+
+struct QueueBenchConfig {
+    size_t producers = 32;
+    size_t consumers = 4;
+    size_t operations = 1000000;    // sessions pushed and popped per queue
+    size_t capacity = 1024;
+};
+
+// Producers push session handles and consumers pop them, timing every
+// successful call, once through SessionQueue and once through a
+// std::deque<string> of customer IDs under a mutex, as ATM::accessQueue
+// was before it. A call that finds the queue full or empty yields and is
+// tried again; only the call that succeeds is timed.
+class QueueBenchmark {
+private:
+    // The queue SessionQueue replaced, behind the same interface
+    class LockedQueue {
+    private:
+        mutex lock;
+        deque<string> items;
+        size_t capacity;
+
+    public:
+        explicit LockedQueue(size_t limit) : capacity(limit) {}
+
+        bool tryPush(uint32_t handle) {
+            string customerId = LoadDriver::accountId(handle);
+            lock_guard<mutex> guard(lock);
+            if (items.size() >= capacity) {
+                return false;
+            }
+            items.push_back(std::move(customerId));
+            return true;
+        }
+
+        bool tryPop(uint32_t& handle) {
+            lock_guard<mutex> guard(lock);
+            if (items.empty()) {
+                return false;
+            }
+            items.pop_front();
+            handle = 0;
+            return true;
+        }
+    };
+
+    struct Result {
+        double seconds;
+        vector<int64_t> push;
+        vector<int64_t> pop;
+    };
+
+    QueueBenchConfig config;
+    Result lockFree;
+    Result locked;
+
+    template <typename Queue>
+    Result measure(Queue& queue) {
+        Result result;
+        mutex merge;
+        atomic<size_t> popped(0);
+        vector<thread> threads;
+        auto record = [&merge](vector<int64_t>& into, vector<int64_t>& samples) {
+            lock_guard<mutex> guard(merge);
+            into.insert(into.end(), samples.begin(), samples.end());
+        };
+        auto started = chrono::steady_clock::now();
+        for (size_t producer = 0; producer < config.producers; producer++) {
+            size_t share = config.operations / config.producers +
+                           (producer < config.operations % config.producers ? 1 : 0);
+            threads.emplace_back([&, producer, share] {
+                vector<int64_t> samples;
+                samples.reserve(share);
+                for (size_t i = 0; i < share; i++) {
+                    uint32_t handle = static_cast<uint32_t>(producer * share + i);
+                    while (true) {
+                        auto begin = chrono::steady_clock::now();
+                        bool pushed = queue.tryPush(handle);
+                        auto end = chrono::steady_clock::now();
+                        if (pushed) {
+                            samples.push_back(chrono::duration_cast<chrono::nanoseconds>(end - begin).count());
+                            break;
+                        }
+                        this_thread::yield();
+                    }
+                }
+                record(result.push, samples);
+            });
+        }
+        for (size_t consumer = 0; consumer < config.consumers; consumer++) {
+            threads.emplace_back([&] {
+                vector<int64_t> samples;
+                uint32_t handle;
+                while (popped.load(memory_order_relaxed) < config.operations) {
+                    auto begin = chrono::steady_clock::now();
+                    bool taken = queue.tryPop(handle);
+                    auto end = chrono::steady_clock::now();
+                    if (taken) {
+                        samples.push_back(chrono::duration_cast<chrono::nanoseconds>(end - begin).count());
+                        popped.fetch_add(1, memory_order_relaxed);
+                    } else {
+                        this_thread::yield();
+                    }
+                }
+                record(result.pop, samples);
+            });
+        }
+        for (thread& worker : threads) {
+            worker.join();
+        }
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        if (result.push.size() != config.operations || result.pop.size() != config.operations) {
+            throw runtime_error("Queue benchmark lost sessions");
+        }
+        sort(result.push.begin(), result.push.end());
+        sort(result.pop.begin(), result.pop.end());
+        return result;
+    }
+
+    static void reportRow(ostream& out, const char* name, const char* operation,
+                          const vector<int64_t>& samples) {
+        out << left << setw(18) << name << setw(6) << operation << right
+            << setw(10) << LoadDriver::percentile(samples, 0.50)
+            << setw(10) << LoadDriver::percentile(samples, 0.99)
+            << setw(11) << LoadDriver::percentile(samples, 0.999)
+            << setw(12) << samples.back() << "\n";
+    }
+
+public:
+    explicit QueueBenchmark(const QueueBenchConfig& benchmark) : config(benchmark) {
+        if (config.producers == 0 || config.consumers == 0 || config.operations == 0) {
+            throw invalid_argument("Need a producer, a consumer and an operation");
+        }
+    }
+
+    void run() {
+        SessionQueue ring(config.capacity);
+        lockFree = measure(ring);
+        LockedQueue queue(config.capacity);
+        locked = measure(queue);
+    }
+
+    void report(ostream& out) {
+        out << "producers=" << config.producers << " consumers=" << config.consumers
+            << " operations=" << config.operations << " capacity=" << config.capacity
+            << " cpus=" << thread::hardware_concurrency() << "\n";
+        out << left << setw(18) << "queue" << setw(6) << "op" << right << setw(10) << "p50 (ns)"
+            << setw(10) << "p99 (ns)" << setw(11) << "p999 (ns)" << setw(12) << "max (ns)" << "\n";
+        reportRow(out, "SessionQueue", "push", lockFree.push);
+        reportRow(out, "SessionQueue", "pop", lockFree.pop);
+        reportRow(out, "mutex deque", "push", locked.push);
+        reportRow(out, "mutex deque", "pop", locked.pop);
+        out << fixed << setprecision(0)
+            << "throughput: SessionQueue " << config.operations / lockFree.seconds << " /s, mutex deque "
+            << config.operations / locked.seconds << " /s\n";
+    }
+};
+
+struct BatchBenchConfig {
+    size_t accounts = 100000;
+    size_t records = 1000000;
+    size_t batch = 4096;            // records per applyBatch call
+    double transferRatio = 0.5;     // the rest are withdrawals
+    uint64_t seed = 42;
+};
+
+// Applies the same settlement records to two copies of the same accounts,
+// once through ATM::applyBatch and once one call at a time through
+// ATM::withdraw and ATM::transfer, and checks both end with the same
+// balances. Balances start low enough that some debits are declined or
+// charged a penalty.
+class BatchBenchmark {
+private:
+    BatchBenchConfig config;
+    vector<TransactionRecord> records;
+    vector<string> accountIds;
+    double batchSeconds;
+    double singleSeconds;
+    size_t batchApplied;
+    size_t singleApplied;
+
+    static void populate(CustomerDatabase& db, size_t accounts) {
+        ImportRow row;
+        row.customer.name = "Batch Test";
+        row.customer.isFirstLogin = false;
+        row.savings = toPaise(20000);
+        row.current = toPaise(50000);
+        vector<ImportRow> rows;
+        for (size_t number = 0; number < accounts; number++) {
+            row.customer.customerId = LoadDriver::accountId(number);
+            rows.push_back(row);
+        }
+        db.importCustomers(std::move(rows));
+    }
+
+public:
+    explicit BatchBenchmark(const BatchBenchConfig& benchmark)
+        : config(benchmark), batchSeconds(0), singleSeconds(0), batchApplied(0), singleApplied(0) {
+        if (config.accounts < 2 || config.batch == 0) {
+            throw invalid_argument("Need at least two accounts and a batch size");
+        }
+        mt19937_64 random(config.seed);
+        uniform_int_distribution<uint32_t> pickAccount(0, static_cast<uint32_t>(config.accounts - 1));
+        uniform_int_distribution<Paise> pickAmount(toPaise(1), toPaise(5000));
+        uniform_real_distribution<double> mix(0.0, 1.0);
+        for (size_t i = 0; i < config.records; i++) {
+            TransactionRecord record;
+            record.kind = mix(random) < config.transferRatio ? TransactionKind::TRANSFER
+                                                             : TransactionKind::WITHDRAWAL;
+            record.fromAccountType = ACCOUNT_RULES[random() % ACCOUNT_COLUMNS].code;
+            record.toAccountType = ACCOUNT_RULES[random() % ACCOUNT_COLUMNS].code;
+            record.fromHandle = pickAccount(random);
+            record.toHandle = pickAccount(random);
+            record.amount = pickAmount(random);
+            records.push_back(record);
+        }
+        for (size_t number = 0; number < config.accounts; number++) {
+            accountIds.push_back(LoadDriver::accountId(number));
+        }
+    }
+
+    void run() {
+        // Imported in order, so handle n is account n in both databases
+        CustomerDatabase batched;
+        populate(batched, config.accounts);
+        ATM batchAtm(batched);
+        vector<Status> statuses(config.batch);
+        auto started = chrono::steady_clock::now();
+        for (size_t first = 0; first < records.size(); first += config.batch) {
+            size_t count = min(config.batch, records.size() - first);
+            batchApplied += batchAtm.applyBatch(&records[first], count, statuses.data());
+        }
+        batchSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        CustomerDatabase single;
+        populate(single, config.accounts);
+        ATM singleAtm(single);
+        started = chrono::steady_clock::now();
+        for (const TransactionRecord& record : records) {
+            double rupees = toRupees(record.amount);
+            const string& fromId = accountIds[record.fromHandle];
+            Status status = record.kind == TransactionKind::WITHDRAWAL
+                ? singleAtm.withdraw(fromId, record.fromAccountType, rupees)
+                : singleAtm.transfer(fromId, accountIds[record.toHandle], record.fromAccountType,
+                                     record.toAccountType, rupees);
+            singleApplied += succeeded(status);
+        }
+        singleSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        if (batchApplied != singleApplied || batched.stateChecksum() != single.stateChecksum()) {
+            throw runtime_error("Batch and per-call paths ended in different states");
+        }
+    }
+
+    void report(ostream& out) {
+        out << "accounts=" << config.accounts << " records=" << config.records
+            << " batch=" << config.batch << " transfer=" << config.transferRatio << "\n";
+        out << fixed << setprecision(0)
+            << "applyBatch:      " << records.size() / batchSeconds << " records/s\n"
+            << "one call each:   " << records.size() / singleSeconds << " records/s\n"
+            << setprecision(2) << "speedup: " << singleSeconds / batchSeconds << "x\n"
+            << "applied: " << batchApplied << " of " << records.size() << " (same state on both paths)\n";
+    }
+};
+
+struct WalBenchConfig {
+    string path = "walbench.log";   // removed again after the run
+    size_t accounts = 100000;
+    size_t clients = 8;             // threads issuing withdrawals
+    size_t transactions = 20000;    // per client, per window
+    vector<size_t> windows = {0, 50, 200, 1000};   // group-commit windows in microseconds
+    size_t recoveryAccounts = 10000000;
+    size_t recoveryRecords = 100000000;             // log records, imports included
+    uint64_t seed = 42;
+};
+
+// Commit latency and throughput of durable withdrawals at each
+// group-commit window, then the time CustomerDatabase::open takes to
+// recover a log of recoveryRecords records with no snapshot to start from
+class WalBenchmark {
+private:
+    struct WindowResult {
+        size_t window;
+        double seconds;
+        vector<int64_t> samples;    // nanoseconds per withdrawal
+    };
+
+    WalBenchConfig config;
+    vector<WindowResult> windowResults;
+    uint64_t logBytes;
+    double writeSeconds;
+    double recoverySeconds;
+    size_t recoveredCustomers;
+
+    void removeLog() const {
+        for (const char* suffix : {"", ".snapshot", ".prev"}) {
+            ::unlink((config.path + suffix).c_str());
+        }
+    }
+
+    void runWindow(size_t window) {
+        removeLog();
+        CustomerDatabase db;
+        db.open(config.path, chrono::microseconds(window));
+        LookupBenchmark::importSynthetic(db, config.accounts, "WAL Test");
+
+        vector<vector<int64_t>> perClient(config.clients);
+        vector<thread> clients;
+        auto started = chrono::steady_clock::now();
+        for (size_t client = 0; client < config.clients; client++) {
+            clients.emplace_back([this, &db, &perClient, client] {
+                ATM atm(db);
+                mt19937_64 random(config.seed + client);
+                uniform_int_distribution<size_t> pickAccount(0, config.accounts - 1);
+                vector<int64_t>& samples = perClient[client];
+                samples.reserve(config.transactions);
+                for (size_t i = 0; i < config.transactions; i++) {
+                    string id = LoadDriver::accountId(pickAccount(random));
+                    auto issued = chrono::steady_clock::now();
+                    atm.withdraw(id, 'S', 1);
+                    samples.push_back(chrono::duration_cast<chrono::nanoseconds>(
+                        chrono::steady_clock::now() - issued).count());
+                }
+            });
+        }
+        for (thread& client : clients) {
+            client.join();
+        }
+        WindowResult result{window, chrono::duration<double>(chrono::steady_clock::now() - started).count(), {}};
+        for (const vector<int64_t>& samples : perClient) {
+            result.samples.insert(result.samples.end(), samples.begin(), samples.end());
+        }
+        sort(result.samples.begin(), result.samples.end());
+        windowResults.push_back(std::move(result));
+    }
+
+    // Writes the recovery log through applyBatch, one commit per batch,
+    // with checkpoints held off so every record stays in the log
+    void writeRecoveryLog() {
+        static const size_t BATCH = 65536;
+        removeLog();
+        auto started = chrono::steady_clock::now();
+        {
+            CustomerDatabase db;
+            db.open(config.path, chrono::microseconds(1000), UINT64_MAX);
+            LookupBenchmark::importSynthetic(db, config.recoveryAccounts, "Recovery Test");
+            ATM atm(db);
+            mt19937_64 random(config.seed);
+            uniform_int_distribution<uint32_t> pickAccount(
+                0, static_cast<uint32_t>(config.recoveryAccounts - 1));
+            vector<TransactionRecord> records(BATCH);
+            vector<Status> statuses(BATCH);
+            size_t remaining = config.recoveryRecords - config.recoveryAccounts;
+            while (remaining > 0) {
+                size_t count = min(BATCH, remaining);
+                for (size_t i = 0; i < count; i++) {
+                    records[i].kind = TransactionKind::WITHDRAWAL;
+                    records[i].fromAccountType = random() & 1 ? 'S' : 'C';
+                    records[i].fromHandle = pickAccount(random);
+                    records[i].amount = toPaise(1);
+                }
+                atm.applyBatch(records.data(), count, statuses.data());
+                remaining -= count;
+            }
+        }
+        writeSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        struct stat info;
+        logBytes = ::stat(config.path.c_str(), &info) == 0 ? static_cast<uint64_t>(info.st_size) : 0;
+    }
+
+public:
+    explicit WalBenchmark(const WalBenchConfig& benchmark)
+        : config(benchmark), logBytes(0), writeSeconds(0), recoverySeconds(0), recoveredCustomers(0) {
+        if (config.accounts == 0 || config.clients == 0 || config.transactions == 0 ||
+            config.recoveryAccounts == 0 || config.recoveryRecords < config.recoveryAccounts) {
+            throw invalid_argument("Need accounts, clients, transactions and at least one record per recovery account");
+        }
+    }
+
+    void run() {
+        for (size_t window : config.windows) {
+            runWindow(window);
+        }
+        writeRecoveryLog();
+        {
+            CustomerDatabase db;
+            auto started = chrono::steady_clock::now();
+            db.open(config.path);
+            recoverySeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            recoveredCustomers = db.size();
+        }
+        removeLog();
+        if (recoveredCustomers != config.recoveryAccounts) {
+            throw runtime_error("Recovery lost customers");
+        }
+    }
+
+    void report(ostream& out) {
+        out << "accounts=" << config.accounts << " clients=" << config.clients
+            << " transactions=" << config.transactions << " per client\n";
+        out << left << setw(12) << "window(us)" << right << setw(14) << "commits/s"
+            << setw(12) << "p50(ns)" << setw(12) << "p99(ns)" << setw(12) << "p99.9(ns)" << "\n";
+        for (const WindowResult& result : windowResults) {
+            out << left << setw(12) << result.window << right << fixed << setprecision(0)
+                << setw(14) << result.samples.size() / result.seconds
+                << setw(12) << LoadDriver::percentile(result.samples, 0.50)
+                << setw(12) << LoadDriver::percentile(result.samples, 0.99)
+                << setw(12) << LoadDriver::percentile(result.samples, 0.999) << "\n";
+        }
+        out << "recovery: " << config.recoveryAccounts << " accounts, " << config.recoveryRecords
+            << " records, " << logBytes / (1 << 20) << " MB log (written in "
+            << setprecision(1) << writeSeconds << " s)\n"
+            << "open: " << setprecision(2) << recoverySeconds << " s, "
+            << setprecision(0) << config.recoveryRecords / recoverySeconds << " records/s\n";
+    }
+};
+
+struct SnapshotBenchConfig {
+    string path = "snapshotbench.log";          // removed again after the run
+    vector<size_t> sizes = {1000000, 10000000};
+};
+
+// Startup cost at each size: loading customers one addCustomer call at a
+// time, against opening a database whose snapshot already holds them and
+// answering its first lookup
+class SnapshotBenchmark {
+private:
+    struct SizeResult {
+        size_t customers;
+        double addSeconds;
+        double openSeconds;
+        double firstLookupSeconds;
+        uint64_t snapshotBytes;
+    };
+
+    SnapshotBenchConfig config;
+    vector<SizeResult> results;
+
+    void removeFiles() const {
+        for (const char* suffix : {"", ".snapshot", ".prev"}) {
+            ::unlink((config.path + suffix).c_str());
+        }
+    }
+
+    SizeResult runSize(size_t customers) {
+        SizeResult result{customers, 0, 0, 0, 0};
+        removeFiles();
+        string snapshotPath = config.path + ".snapshot";
+        {
+            CustomerDatabase db;
+            db.reserve(customers);
+            Customer customer;
+            customer.name = "Snapshot Test";
+            customer.address = "1 Bank Street";
+            customer.isFirstLogin = false;
+            auto started = chrono::steady_clock::now();
+            for (size_t number = 0; number < customers; number++) {
+                customer.customerId = LoadDriver::accountId(number);
+                customer.email = "load" + to_string(number) + "@bank.example";
+                customer.phone = to_string(9000000000ull + number);
+                db.addCustomer(customer, toPaise(1000), toPaise(1000));
+            }
+            result.addSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            db.saveSnapshot(snapshotPath);
+        }
+        struct stat info;
+        result.snapshotBytes = ::stat(snapshotPath.c_str(), &info) == 0 ? static_cast<uint64_t>(info.st_size) : 0;
+        {
+            CustomerDatabase db;
+            auto started = chrono::steady_clock::now();
+            db.open(config.path);
+            auto opened = chrono::steady_clock::now();
+            bool found = db.findCustomer(LoadDriver::accountId(customers - 1)) != nullptr;
+            auto answered = chrono::steady_clock::now();
+            result.openSeconds = chrono::duration<double>(opened - started).count();
+            result.firstLookupSeconds = chrono::duration<double>(answered - opened).count();
+            if (!found) {
+                throw runtime_error("Snapshot lost the last customer");
+            }
+        }
+        removeFiles();
+        return result;
+    }
+
+public:
+    explicit SnapshotBenchmark(const SnapshotBenchConfig& benchmark) : config(benchmark) {
+        if (config.sizes.empty() ||
+            find(config.sizes.begin(), config.sizes.end(), size_t(0)) != config.sizes.end()) {
+            throw invalid_argument("Need at least one non-empty size");
+        }
+    }
+
+    void run() {
+        for (size_t customers : config.sizes) {
+            results.push_back(runSize(customers));
+        }
+    }
+
+    void report(ostream& out) {
+        out << left << setw(12) << "customers" << right << setw(16) << "addCustomer(s)"
+            << setw(14) << "open(ms)" << setw(18) << "first lookup(us)" << setw(16) << "snapshot(MB)" << "\n";
+        for (const SizeResult& result : results) {
+            out << left << setw(12) << result.customers << right << fixed
+                << setprecision(2) << setw(16) << result.addSeconds
+                << setw(14) << result.openSeconds * 1e3
+                << setprecision(1) << setw(18) << result.firstLookupSeconds * 1e6
+                << setw(16) << result.snapshotBytes / double(1 << 20) << "\n";
+        }
+    }
+};
+
+struct DeclineBenchConfig {
+    size_t accounts = 100000;
+    size_t declines = 1000000;      // per thread, per path and kind
+    size_t threads = 1;
+    uint64_t seed = 42;
+};
+
+// Cost of a declined withdrawal as ATM::withdraw returns it, against the
+// same decline turned into a thrown exception carrying its message,
+// rethrown once and caught at the caller as the old ATM methods did.
+// Measured for both a short balance and an unknown customer.
+class DeclineBenchmark {
+private:
+    enum class Path { STATUS, EXCEPTION };
+
+    struct Result {
+        const char* kind;
+        double statusNanoseconds;
+        double exceptionNanoseconds;
+    };
+
+    DeclineBenchConfig config;
+    CustomerDatabase db;
+    vector<string> knownIds;
+    vector<string> unknownIds;
+    vector<Result> results;
+
+    // The old shape: a decline throws with an allocated message, is
+    // caught and rethrown inside the method, then caught by the caller
+    static void withdrawOrThrow(ATM& atm, const string& id, double rupees) {
+        try {
+            Status status = atm.withdraw(id, 'S', rupees);
+            if (!succeeded(status)) {
+                throw ValidationException(statusMessage(status));
+            }
+        } catch (const ValidationException&) {
+            throw;
+        } catch (...) {
+            throw runtime_error("Error processing withdrawal");
+        }
+    }
+
+    double measure(const vector<string>& ids, Path path) {
+        atomic<size_t> declined(0);
+        vector<thread> workers;
+        auto started = chrono::steady_clock::now();
+        for (size_t worker = 0; worker < config.threads; worker++) {
+            workers.emplace_back([this, &ids, &declined, path, worker] {
+                ATM atm(db);
+                mt19937_64 random(config.seed + worker);
+                uniform_int_distribution<size_t> pick(0, ids.size() - 1);
+                size_t count = 0;
+                for (size_t i = 0; i < config.declines; i++) {
+                    const string& id = ids[pick(random)];
+                    if (path == Path::STATUS) {
+                        count += !succeeded(atm.withdraw(id, 'S', 1e7));
+                    } else {
+                        try {
+                            withdrawOrThrow(atm, id, 1e7);
+                        } catch (const ValidationException&) {
+                            count++;
+                        }
+                    }
+                }
+                declined += count;
+            });
+        }
+        for (thread& worker : workers) {
+            worker.join();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        if (declined != config.declines * config.threads) {
+            throw runtime_error("A withdrawal that should be declined went through");
+        }
+        return seconds * 1e9 / (config.declines * config.threads);
+    }
+
+public:
+    explicit DeclineBenchmark(const DeclineBenchConfig& benchmark) : config(benchmark) {
+        if (config.accounts == 0 || config.declines == 0 || config.threads == 0) {
+            throw invalid_argument("Need accounts, declines and threads");
+        }
+        ImportRow row;
+        row.customer.name = "Decline Test";
+        row.customer.isFirstLogin = false;
+        row.savings = toPaise(1000);
+        row.current = toPaise(1000);
+        vector<ImportRow> rows;
+        for (size_t number = 0; number < config.accounts; number++) {
+            row.customer.customerId = LoadDriver::accountId(number);
+            rows.push_back(row);
+            knownIds.push_back(row.customer.customerId);
+            unknownIds.push_back(LoadDriver::accountId(config.accounts + number));
+        }
+        db.importCustomers(std::move(rows));
+    }
+
+    void run() {
+        results.push_back({"insufficient funds", measure(knownIds, Path::STATUS),
+                           measure(knownIds, Path::EXCEPTION)});
+        results.push_back({"customer not found", measure(unknownIds, Path::STATUS),
+                           measure(unknownIds, Path::EXCEPTION)});
+    }
+
+    void report(ostream& out) {
+        out << "accounts=" << config.accounts << " threads=" << config.threads
+            << " declines=" << config.declines << " per thread\n";
+        out << left << setw(22) << "decline" << right << setw(14) << "status(ns)"
+            << setw(16) << "exception(ns)" << setw(10) << "ratio" << "\n";
+        for (const Result& result : results) {
+            out << left << setw(22) << result.kind << right << fixed << setprecision(1)
+                << setw(14) << result.statusNanoseconds << setw(16) << result.exceptionNanoseconds
+                << setw(9) << result.exceptionNanoseconds / result.statusNanoseconds << "x\n";
+        }
+    }
+};
+
+struct ReceiptBenchConfig {
+    size_t accounts = 100000;
+    size_t transactions = 200000;   // per sink
+    string console = "/dev/null";   // where the console sink writes
+    string file = "receiptbench.csv";   // removed again after the run
+    uint64_t seed = 42;
+};
+
+// Per-transaction latency of withdrawals with each receipt sink attached:
+// none, console formatting (flushed per receipt, as on the terminal), a
+// buffered CSV file, and the same file behind an AsyncReceiptSink
+class ReceiptBenchmark {
+private:
+    struct SinkResult {
+        string sink;
+        double seconds;             // including the final flush
+        vector<int64_t> samples;
+    };
+
+    ReceiptBenchConfig config;
+    CustomerDatabase db;
+    vector<string> accountIds;
+    vector<SinkResult> results;
+
+    void measure(const string& name, ReceiptSink& sink) {
+        ATM atm(db);
+        atm.setReceiptSink(sink);
+        mt19937_64 random(config.seed);
+        uniform_int_distribution<size_t> pick(0, accountIds.size() - 1);
+        SinkResult result{name, 0, {}};
+        result.samples.reserve(config.transactions);
+        auto started = chrono::steady_clock::now();
+        for (size_t i = 0; i < config.transactions; i++) {
+            const string& id = accountIds[pick(random)];
+            auto issued = chrono::steady_clock::now();
+            atm.withdraw(id, 'S', 1);
+            result.samples.push_back(chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now() - issued).count());
+        }
+        sink.flush();
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        sort(result.samples.begin(), result.samples.end());
+        results.push_back(std::move(result));
+    }
+
+public:
+    explicit ReceiptBenchmark(const ReceiptBenchConfig& benchmark) : config(benchmark) {
+        if (config.accounts == 0 || config.transactions == 0) {
+            throw invalid_argument("Need accounts and transactions");
+        }
+        LookupBenchmark::importSynthetic(db, config.accounts, "Receipt Test");
+        for (size_t number = 0; number < config.accounts; number++) {
+            accountIds.push_back(LoadDriver::accountId(number));
+        }
+    }
+
+    void run() {
+        NullReceiptSink none;
+        measure("null", none);
+        {
+            ofstream stream(config.console);
+            if (!stream) {
+                throw runtime_error("Unable to open " + config.console);
+            }
+            ConsoleReceiptSink console(stream, db);
+            measure("console", console);
+        }
+        ::unlink(config.file.c_str());
+        {
+            BufferedFileReceiptSink file(config.file, db);
+            measure("buffered file", file);
+        }
+        ::unlink(config.file.c_str());
+        {
+            BufferedFileReceiptSink file(config.file, db);
+            AsyncReceiptSink async(file);
+            measure("async file", async);
+        }
+        ::unlink(config.file.c_str());
+    }
+
+    void report(ostream& out) {
+        out << "accounts=" << config.accounts << " transactions=" << config.transactions
+            << " console=" << config.console << "\n";
+        out << left << setw(16) << "sink" << right << setw(14) << "txn/s"
+            << setw(12) << "p50(ns)" << setw(12) << "p99(ns)" << setw(12) << "p99.9(ns)" << "\n";
+        for (const SinkResult& result : results) {
+            out << left << setw(16) << result.sink << right << fixed << setprecision(0)
+                << setw(14) << result.samples.size() / result.seconds
+                << setw(12) << LoadDriver::percentile(result.samples, 0.50)
+                << setw(12) << LoadDriver::percentile(result.samples, 0.99)
+                << setw(12) << LoadDriver::percentile(result.samples, 0.999) << "\n";
+        }
+    }
+};
+
+struct SignupBenchConfig {
+    size_t signups = 100000;        // per thread count, split across the threads
+    size_t threads = 64;            // runs with 1, 2, 4, ... up to this many
+    int hashCost = 0;               // password hash cost; 0 leaves hashing out
+};
+
+// Concurrent sign-up throughput at each thread count. Times
+// CredentialAllocator alone, the same IDs and passwords handed out under
+// one global mutex as the old credential stack did, and full sign-ups that
+// also add each customer to a shared CustomerDatabase.
+class SignupBenchmark {
+private:
+    struct Result {
+        size_t threads;
+        double allocatorRate;
+        double mutexRate;
+        double signupRate;
+    };
+
+    SignupBenchConfig config;
+    vector<Result> results;
+
+    // Runs body(thread, count) on threads threads, splitting signups
+    // between them; returns operations per second
+    double measure(size_t threads, const function<void(size_t, size_t)>& body) {
+        vector<thread> workers;
+        auto started = chrono::steady_clock::now();
+        for (size_t worker = 0; worker < threads; worker++) {
+            size_t count = config.signups / threads + (worker < config.signups % threads);
+            workers.emplace_back(body, worker, count);
+        }
+        for (thread& worker : workers) {
+            worker.join();
+        }
+        return config.signups / chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    }
+
+public:
+    explicit SignupBenchmark(const SignupBenchConfig& benchmark) : config(benchmark) {
+        if (config.signups == 0 || config.threads == 0) {
+            throw invalid_argument("Need sign-ups and threads");
+        }
+        if (config.hashCost != 0 &&
+            (config.hashCost < PasswordHasher::MIN_COST || config.hashCost > PasswordHasher::MAX_COST)) {
+            throw invalid_argument("Password hash cost out of range");
+        }
+    }
+
+    void run() {
+        for (size_t threads = 1; threads <= config.threads; threads *= 2) {
+            Result result{threads, 0, 0, 0};
+
+            CredentialAllocator allocator;
+            atomic<size_t> issued(0);
+            result.allocatorRate = measure(threads, [&](size_t, size_t count) {
+                for (size_t i = 0; i < count; i++) {
+                    issued += !allocator.getNextCredential().first.empty();
+                }
+            });
+
+            mutex lock;
+            uint64_t nextNumber = 1;
+            result.mutexRate = measure(threads, [&](size_t, size_t count) {
+                for (size_t i = 0; i < count; i++) {
+                    lock_guard<mutex> guard(lock);
+                    issued += !CredentialAllocator::formatId(nextNumber++).empty() &&
+                              !CredentialAllocator::generatePassword().empty();
+                }
+            });
+
+            CustomerDatabase db;
+            if (config.hashCost != 0) {
+                db.credentialService().setHashCost(config.hashCost);
+            }
+            db.reserve(config.signups);
+            CredentialAllocator signups;
+            result.signupRate = measure(threads, [&](size_t worker, size_t count) {
+                Customer customer;
+                customer.name = "Signup Test";
+                customer.address = "1 Bank Street";
+                customer.isFirstLogin = true;
+                for (size_t i = 0; i < count; i++) {
+                    pair<string, string> credential = signups.getNextCredential();
+                    customer.customerId = credential.first;
+                    customer.email = credential.first + "@bank.example";
+                    customer.phone = to_string(9000000000ull + worker * config.signups + i);
+                    if (config.hashCost != 0) {
+                        customer.password = db.hashPassword(credential.second);
+                    }
+                    db.addCustomer(customer, toPaise(10000), toPaise(25000));
+                }
+            });
+            if (issued != 2 * config.signups || db.size() != config.signups) {
+                throw runtime_error("Sign-ups went missing");
+            }
+            results.push_back(result);
+        }
+    }
+
+    void report(ostream& out) {
+        out << "signups=" << config.signups << " per thread count, hash cost "
+            << (config.hashCost == 0 ? string("off") : to_string(config.hashCost)) << "\n";
+        out << left << setw(10) << "threads" << right << setw(16) << "allocator/s"
+            << setw(16) << "global mutex/s" << setw(16) << "sign-ups/s" << "\n";
+        for (const Result& result : results) {
+            out << left << setw(10) << result.threads << right << fixed << setprecision(0)
+                << setw(16) << result.allocatorRate << setw(16) << result.mutexRate
+                << setw(16) << result.signupRate << "\n";
+        }
+    }
+};
+
+struct ProfileBenchConfig {
+    size_t customers = 1000000;
+};
+
+// Memory and heap allocations for customers' profiles: a growing vector of
+// records with a std::string per field, as the table used to be, against
+// ProfileStore's chunked records and string pool. Every customer has a
+// password hash, name, email, address and phone of realistic length.
+class ProfileBenchmark {
+private:
+    struct AllocationCounter {
+        size_t allocations = 0;
+        size_t liveBytes = 0;
+    };
+
+    // Counts what a container and its strings take from the heap
+    template <typename T>
+    struct CountingAllocator {
+        using value_type = T;
+        AllocationCounter* counter;
+
+        explicit CountingAllocator(AllocationCounter* target) : counter(target) {}
+
+        template <typename U>
+        CountingAllocator(const CountingAllocator<U>& other) : counter(other.counter) {}
+
+        T* allocate(size_t n) {
+            counter->allocations++;
+            counter->liveBytes += n * sizeof(T);
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T* pointer, size_t n) {
+            counter->liveBytes -= n * sizeof(T);
+            ::operator delete(pointer);
+        }
+
+        template <typename U>
+        bool operator==(const CountingAllocator<U>& other) const {
+            return counter == other.counter;
+        }
+    };
+
+    using CountedString = basic_string<char, char_traits<char>, CountingAllocator<char>>;
+
+    struct StringCustomer {
+        CountedString customerId;
+        CountedString password;
+        CountedString name;
+        CountedString email;
+        CountedString address;
+        CountedString phone;
+        bool isFirstLogin;
+    };
+
+    struct Result {
+        size_t allocations;
+        size_t bytes;
+        double seconds;
+    };
+
+    ProfileBenchConfig config;
+    Result strings;
+    Result arena;
+
+    static Customer makeCustomer(size_t number) {
+        Customer customer;
+        customer.customerId = CredentialAllocator::formatId(number + 1);
+        customer.password = "$rmx$14$" + string(32, 'a') + "$" + string(64, 'b');
+        customer.name = "Customer " + to_string(number);
+        customer.email = "customer" + to_string(number) + "@bank.example";
+        customer.address = to_string(number % 1000) + " Long Street, Springfield";
+        customer.phone = to_string(9000000000ull + number);
+        customer.isFirstLogin = false;
+        return customer;
+    }
+
+public:
+    explicit ProfileBenchmark(const ProfileBenchConfig& benchmark)
+        : config(benchmark), strings{0, 0, 0}, arena{0, 0, 0} {
+        if (config.customers == 0) {
+            throw invalid_argument("Need at least one customer");
+        }
+    }
+
+    void run() {
+        {
+            AllocationCounter counter;
+            CountingAllocator<char> allocator(&counter);
+            vector<StringCustomer, CountingAllocator<StringCustomer>> table(allocator);
+            auto started = chrono::steady_clock::now();
+            for (size_t number = 0; number < config.customers; number++) {
+                Customer customer = makeCustomer(number);
+                table.push_back(StringCustomer{
+                    CountedString(customer.customerId, allocator), CountedString(customer.password, allocator),
+                    CountedString(customer.name, allocator), CountedString(customer.email, allocator),
+                    CountedString(customer.address, allocator), CountedString(customer.phone, allocator),
+                    customer.isFirstLogin});
+            }
+            strings = {counter.allocations, counter.liveBytes,
+                       chrono::duration<double>(chrono::steady_clock::now() - started).count()};
+        }
+        {
+            ProfileStore store;
+            auto started = chrono::steady_clock::now();
+            for (size_t number = 0; number < config.customers; number++) {
+                store.append(makeCustomer(number));
+            }
+            arena = {store.allocations(), store.bytesReserved(),
+                     chrono::duration<double>(chrono::steady_clock::now() - started).count()};
+            if (store[static_cast<uint32_t>(config.customers - 1)].customerId.view() !=
+                CredentialAllocator::formatId(config.customers)) {
+                throw runtime_error("ProfileStore lost a customer");
+            }
+        }
+    }
+
+    void report(ostream& out) {
+        out << "customers=" << config.customers << "\n";
+        out << left << setw(16) << "layout" << right << setw(14) << "allocations"
+            << setw(14) << "bytes" << setw(16) << "bytes/customer" << setw(12) << "load(ms)" << "\n";
+        for (const auto& [layout, result] : {pair<const char*, Result>{"std::string", strings},
+                                             pair<const char*, Result>{"ProfileStore", arena}}) {
+            out << left << setw(16) << layout << right << setw(14) << result.allocations
+                << setw(14) << result.bytes << fixed << setprecision(1)
+                << setw(16) << double(result.bytes) / config.customers
+                << setw(12) << result.seconds * 1e3 << "\n";
+        }
+    }
+};
+
+struct ImportBenchConfig {
+    size_t rows = 5000000;
+    size_t threads = 0;         // for importCustomers; 0 for one per core
+};
+
+// Loading a batch of new customers into an empty database: one
+// addCustomer call per row against a single importCustomers call. Rows
+// carry an ID, email and phone, so all three indexes are filled; both
+// databases are in memory only and reserved for every row up front, and
+// the rows are built before the clock starts.
+class ImportBenchmark {
+private:
+    ImportBenchConfig config;
+    double perRowSeconds;
+    double importSeconds;
+
+    vector<ImportRow> makeRows() const {
+        vector<ImportRow> rows(config.rows);
+        for (size_t number = 0; number < config.rows; number++) {
+            Customer& customer = rows[number].customer;
+            customer.customerId = CredentialAllocator::formatId(number + 1);
+            customer.name = "Customer " + to_string(number);
+            customer.email = "customer" + to_string(number) + "@bank.example";
+            customer.phone = to_string(9000000000ull + number);
+            customer.isFirstLogin = false;
+            rows[number].savings = toPaise(1000);
+            rows[number].current = toPaise(5000);
+        }
+        return rows;
+    }
+
+    void expectLoaded(CustomerDatabase& db, const char* method) const {
+        if (db.size() != config.rows || !db.findCustomer(CredentialAllocator::formatId(config.rows))) {
+            throw runtime_error(string(method) + " did not load every row");
+        }
+    }
+
+public:
+    explicit ImportBenchmark(const ImportBenchConfig& benchmark)
+        : config(benchmark), perRowSeconds(0), importSeconds(0) {
+        if (config.rows == 0) {
+            throw invalid_argument("Need at least one row");
+        }
+    }
+
+    void run() {
+        {
+            vector<ImportRow> rows = makeRows();
+            CustomerDatabase db;
+            db.reserve(rows.size());
+            auto started = chrono::steady_clock::now();
+            for (const ImportRow& row : rows) {
+                db.addCustomer(row.customer, row.savings, row.current);
+            }
+            perRowSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            expectLoaded(db, "addCustomer");
+        }
+        {
+            vector<ImportRow> rows = makeRows();
+            CustomerDatabase db;
+            db.reserve(rows.size());
+            auto started = chrono::steady_clock::now();
+            db.importCustomers(std::move(rows), config.threads);
+            importSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            expectLoaded(db, "importCustomers");
+        }
+    }
+
+    void report(ostream& out) {
+        out << "rows=" << config.rows << " cores=" << thread::hardware_concurrency() << "\n";
+        out << left << setw(18) << "method" << right << setw(12) << "time (s)" << setw(14) << "rows/s"
+            << setw(14) << "ns/row" << "\n";
+        for (const auto& [method, seconds] : {pair<const char*, double>{"addCustomer", perRowSeconds},
+                                              pair<const char*, double>{"importCustomers", importSeconds}}) {
+            out << left << setw(18) << method << right << fixed << setprecision(3) << setw(12) << seconds
+                << setprecision(0) << setw(14) << config.rows / seconds
+                << setprecision(1) << setw(14) << seconds * 1e9 / config.rows << "\n";
+        }
+        out << "importCustomers speedup: " << setprecision(2) << perRowSeconds / importSeconds << "x\n";
+    }
+};
+
+struct MetricsBenchConfig {
+    size_t calls = 50000000;    // per setting
+};
+
+// What OperationTimer adds to a call: a trivial out-of-line operation run
+// bare and then timed under each metrics setting, from switched off to
+// timing every call. Each is the fastest of ROUNDS runs, to shed noise
+// from other tenants; the settings are put back as they were afterwards.
+class MetricsBenchmark {
+private:
+    enum Setting { BARE, OFF, COUNTED, SAMPLED, EVERY, SETTING_COUNT };
+    static const int ROUNDS = 3;
+
+    MetricsBenchConfig config;
+    double nanosPerCall[SETTING_COUNT];
+    uint64_t sink;
+
+    __attribute__((noinline)) static Status bare(uint64_t& counter) {
+        counter++;
+        return Status::OK;
+    }
+
+    __attribute__((noinline)) static Status timed(uint64_t& counter) {
+        OperationTimer timer(METRIC_CHECK_BALANCE);
+        counter++;
+        return timer.finish(Status::OK);
+    }
+
+    template <typename Operation>
+    double measure(Operation operation) {
+        double fastest = numeric_limits<double>::max();
+        for (int round = 0; round < ROUNDS; round++) {
+            auto started = chrono::steady_clock::now();
+            for (size_t call = 0; call < config.calls; call++) {
+                operation(sink);
+            }
+            fastest = min(fastest, chrono::duration<double, nano>(chrono::steady_clock::now() - started).count());
+        }
+        return fastest / config.calls;
+    }
+
+public:
+    explicit MetricsBenchmark(const MetricsBenchConfig& benchmark)
+        : config(benchmark), nanosPerCall{}, sink(0) {
+        if (config.calls == 0) {
+            throw invalid_argument("Need at least one call");
+        }
+    }
+
+    void run() {
+        Metrics& metrics = Metrics::global();
+        bool wasEnabled = metrics.isEnabled();
+        nanosPerCall[BARE] = measure(bare);
+        metrics.setEnabled(false);
+        nanosPerCall[OFF] = measure(timed);
+        metrics.setEnabled(true);
+        metrics.setSamplePeriod(numeric_limits<uint32_t>::max());
+        nanosPerCall[COUNTED] = measure(timed);
+        metrics.setSamplePeriod(Metrics::SAMPLE_PERIOD);
+        nanosPerCall[SAMPLED] = measure(timed);
+        metrics.setSamplePeriod(1);
+        nanosPerCall[EVERY] = measure(timed);
+        metrics.setSamplePeriod(Metrics::SAMPLE_PERIOD);
+        metrics.setEnabled(wasEnabled);
+        if (sink != config.calls * SETTING_COUNT * ROUNDS) {
+            throw runtime_error("Calls went missing");
+        }
+    }
+
+    void report(ostream& out) {
+        static const char* names[SETTING_COUNT] = {"bare", "metrics off", "counted only",
+                                                   "default (1/16)", "every call"};
+        out << "calls=" << config.calls << " per setting, sample period " << Metrics::SAMPLE_PERIOD << "\n";
+        out << left << setw(16) << "setting" << right << setw(12) << "ns/call" << setw(14) << "over bare" << "\n";
+        out << fixed << setprecision(2);
+        for (int setting = 0; setting < SETTING_COUNT; setting++) {
+            out << left << setw(16) << names[setting] << right << setw(12) << nanosPerCall[setting]
+                << setw(14) << nanosPerCall[setting] - nanosPerCall[BARE] << "\n";
+        }
+    }
+};
+
+struct PolicyBenchConfig {
+    size_t accounts = 65536;        // per balance column, for the debit kernels
+    size_t operations = 262144;     // debits per pass; balances are reset between passes
+    size_t passes = 40;
+    size_t batchAccounts = 100000;  // for the applyBatch runs
+    size_t records = 1000000;
+    uint64_t seed = 42;
+};
+
+// Cost of picking the debit rules for an account type, with the types
+// coming in runs and mixed at random. Three debit kernels run the same
+// stream: the selects on the type code that ATM used before the policies
+// existed, a switch to code specialized per policy as withPolicy did,
+// and the ACCOUNT_RULES lookup ATM uses now. All three must end with the
+// same balances and statuses. Then ATM::applyBatch runs withdrawals in
+// both orders end to end. Each figure is the fastest of ROUNDS runs.
+class PolicyBenchmark {
+private:
+    enum Kernel { OLD_SELECTS, SPECIALIZED, TABLE, KERNEL_COUNT };
+    enum Order { RUNS, MIXED, ORDER_COUNT };
+    static const int ROUNDS = 3;
+
+    struct Debit {
+        uint32_t account;
+        char accountType;
+        Paise amount;
+    };
+
+    PolicyBenchConfig config;
+    vector<Debit> debits[ORDER_COUNT];
+    vector<Paise> opening[ACCOUNT_COLUMNS];
+    double nanosPerDebit[ORDER_COUNT][KERNEL_COUNT];
+    double nanosPerRecord[ORDER_COUNT];
+
+    // ATM's debit before the policies: both rules picked by selects on
+    // the type, then one branch on the balance
+    static Status oldDebit(Paise& balance, Paise amount, Paise minBalance, Paise penalty) {
+        if (balance - amount >= minBalance) {
+            balance -= amount;
+            return Status::OK;
+        }
+        if (balance - amount - penalty < 0) {
+            return Status::INSUFFICIENT_FUNDS;
+        }
+        balance -= (amount + penalty);
+        return Status::OK_WITH_PENALTY;
+    }
+
+    template <typename Policy>
+    static Status specializedDebit(Paise& balance, Paise amount) {
+        Paise after = balance - amount;
+        Paise charge = after < Policy::MIN_BALANCE ? Policy::PENALTY : 0;
+        if (after - charge < -Policy::OVERDRAFT) {
+            return Status::INSUFFICIENT_FUNDS;
+        }
+        balance = after - charge;
+        return charge != 0 ? Status::OK_WITH_PENALTY : Status::OK;
+    }
+
+    // Each kernel returns the sum of its statuses, to compare the paths
+    __attribute__((noinline)) static uint64_t runOldSelects(const vector<Debit>& stream, Paise* savings,
+                                                            Paise* current) {
+        uint64_t sum = 0;
+        for (const Debit& debit : stream) {
+            Paise& balance = debit.accountType == 'S' ? savings[debit.account] : current[debit.account];
+            Paise minBalance = debit.accountType == 'S' ? SavingsPolicy::MIN_BALANCE : CurrentPolicy::MIN_BALANCE;
+            Paise penalty = debit.accountType == 'S' ? SavingsPolicy::PENALTY : CurrentPolicy::PENALTY;
+            sum += static_cast<uint64_t>(oldDebit(balance, debit.amount, minBalance, penalty));
+        }
+        return sum;
+    }
+
+    __attribute__((noinline)) static uint64_t runSpecialized(const vector<Debit>& stream, Paise* savings,
+                                                             Paise* current) {
+        uint64_t sum = 0;
+        for (const Debit& debit : stream) {
+            Status status = Status::INVALID_ACCOUNT_TYPE;
+            switch (debit.accountType) {
+                case SavingsPolicy::CODE:
+                    status = specializedDebit<SavingsPolicy>(savings[debit.account], debit.amount);
+                    break;
+                case CurrentPolicy::CODE:
+                    status = specializedDebit<CurrentPolicy>(current[debit.account], debit.amount);
+                    break;
+            }
+            sum += static_cast<uint64_t>(status);
+        }
+        return sum;
+    }
+
+    __attribute__((noinline)) static uint64_t runTable(const vector<Debit>& stream, Paise* savings,
+                                                       Paise* current) {
+        // The old selects know only these two, so the streams hold no salary debits
+        Paise* columns[ACCOUNT_COLUMNS] = {savings, current};
+        uint64_t sum = 0;
+        for (const Debit& debit : stream) {
+            const AccountRules* rules = AccountRules::find(debit.accountType);
+            Status status = rules ? rules->debit(columns[rules->column][debit.account], debit.amount)
+                                  : Status::INVALID_ACCOUNT_TYPE;
+            sum += static_cast<uint64_t>(status);
+        }
+        return sum;
+    }
+
+    // Runs kernel over every pass of stream from the opening balances,
+    // returning the fastest round in nanoseconds per debit and leaving the
+    // last round's status sum and final balances in the out parameters
+    template <typename Run>
+    double measure(Run kernel, const vector<Debit>& stream, uint64_t& sum, vector<Paise>* balances) {
+        double fastest = numeric_limits<double>::max();
+        for (int round = 0; round < ROUNDS; round++) {
+            sum = 0;
+            double nanos = 0;
+            for (size_t pass = 0; pass < config.passes; pass++) {
+                for (size_t column = 0; column < ACCOUNT_COLUMNS; column++) {
+                    balances[column] = opening[column];
+                }
+                auto started = chrono::steady_clock::now();
+                sum += kernel(stream, balances[COLUMN_SAVINGS].data(), balances[COLUMN_CURRENT].data());
+                nanos += chrono::duration<double, nano>(chrono::steady_clock::now() - started).count();
+            }
+            fastest = min(fastest, nanos);
+        }
+        return fastest / (stream.size() * config.passes);
+    }
+
+    double applyBatch(const vector<TransactionRecord>& records) {
+        static const size_t BATCH = 4096;
+        double fastest = numeric_limits<double>::max();
+        vector<Status> statuses(BATCH);
+        for (int round = 0; round < ROUNDS; round++) {
+            CustomerDatabase db;
+            LookupBenchmark::importSynthetic(db, config.batchAccounts, "Policy Test");
+            ATM atm(db);
+            auto started = chrono::steady_clock::now();
+            for (size_t first = 0; first < records.size(); first += BATCH) {
+                atm.applyBatch(&records[first], min(BATCH, records.size() - first), statuses.data());
+            }
+            fastest = min(fastest, chrono::duration<double, nano>(chrono::steady_clock::now() - started).count());
+        }
+        return fastest / records.size();
+    }
+
+    static bool savingsFirst(char a, char b) {
+        return (a == 'S') > (b == 'S');
+    }
+
+public:
+    explicit PolicyBenchmark(const PolicyBenchConfig& benchmark)
+        : config(benchmark), nanosPerDebit{}, nanosPerRecord{} {
+        if (config.accounts == 0 || config.operations == 0 || config.passes == 0 ||
+            config.batchAccounts == 0 || config.records == 0) {
+            throw invalid_argument("Need at least one account, debit, pass and record");
+        }
+        if (config.accounts > numeric_limits<uint32_t>::max() ||
+            config.batchAccounts > numeric_limits<uint32_t>::max()) {
+            throw invalid_argument("Too many accounts");
+        }
+        mt19937_64 random(config.seed);
+        uniform_int_distribution<uint32_t> pickAccount(0, static_cast<uint32_t>(config.accounts - 1));
+        uniform_int_distribution<Paise> pickAmount(toPaise(1), toPaise(2000));
+        uniform_int_distribution<Paise> pickSavings(0, 3 * SavingsPolicy::MIN_BALANCE);
+        uniform_int_distribution<Paise> pickCurrent(0, 3 * CurrentPolicy::MIN_BALANCE);
+        for (size_t account = 0; account < config.accounts; account++) {
+            opening[COLUMN_SAVINGS].push_back(pickSavings(random));
+            opening[COLUMN_CURRENT].push_back(pickCurrent(random));
+        }
+        for (size_t i = 0; i < config.operations; i++) {
+            debits[MIXED].push_back({pickAccount(random), random() & 1 ? 'S' : 'C', pickAmount(random)});
+        }
+        // The same debits, savings first, in their order within each type
+        debits[RUNS] = debits[MIXED];
+        stable_sort(debits[RUNS].begin(), debits[RUNS].end(), [](const Debit& a, const Debit& b) {
+            return savingsFirst(a.accountType, b.accountType);
+        });
+    }
+
+    void run() {
+        for (int order = 0; order < ORDER_COUNT; order++) {
+            uint64_t sums[KERNEL_COUNT];
+            vector<Paise> balances[KERNEL_COUNT][ACCOUNT_COLUMNS];
+            nanosPerDebit[order][OLD_SELECTS] = measure(runOldSelects, debits[order], sums[OLD_SELECTS],
+                                                        balances[OLD_SELECTS]);
+            nanosPerDebit[order][SPECIALIZED] = measure(runSpecialized, debits[order], sums[SPECIALIZED],
+                                                        balances[SPECIALIZED]);
+            nanosPerDebit[order][TABLE] = measure(runTable, debits[order], sums[TABLE], balances[TABLE]);
+            for (int kernel = 1; kernel < KERNEL_COUNT; kernel++) {
+                if (sums[kernel] != sums[OLD_SELECTS] ||
+                    balances[kernel][COLUMN_SAVINGS] != balances[OLD_SELECTS][COLUMN_SAVINGS] ||
+                    balances[kernel][COLUMN_CURRENT] != balances[OLD_SELECTS][COLUMN_CURRENT]) {
+                    throw runtime_error("Debit kernels disagree");
+                }
+            }
+        }
+
+        mt19937_64 random(config.seed);
+        uniform_int_distribution<uint32_t> pickAccount(0, static_cast<uint32_t>(config.batchAccounts - 1));
+        vector<TransactionRecord> records[ORDER_COUNT];
+        for (size_t i = 0; i < config.records; i++) {
+            TransactionRecord record;
+            record.kind = TransactionKind::WITHDRAWAL;
+            record.fromAccountType = random() & 1 ? 'S' : 'C';
+            record.fromHandle = pickAccount(random);
+            record.amount = toPaise(1);
+            records[MIXED].push_back(record);
+        }
+        records[RUNS] = records[MIXED];
+        stable_sort(records[RUNS].begin(), records[RUNS].end(),
+                    [](const TransactionRecord& a, const TransactionRecord& b) {
+                        return savingsFirst(a.fromAccountType, b.fromAccountType);
+                    });
+        for (int order = 0; order < ORDER_COUNT; order++) {
+            nanosPerRecord[order] = applyBatch(records[order]);
+        }
+    }
+
+    void report(ostream& out) {
+        static const char* kernels[KERNEL_COUNT] = {"old selects", "specialized", "rules table"};
+        static const char* orders[ORDER_COUNT] = {"types in runs", "types mixed"};
+        out << "accounts=" << config.accounts << " debits=" << config.operations << " x " << config.passes
+            << " passes; applyBatch accounts=" << config.batchAccounts << " records=" << config.records << "\n";
+        out << left << setw(16) << "debit (ns)";
+        for (const char* order : orders) {
+            out << right << setw(16) << order;
+        }
+        out << "\n" << fixed << setprecision(2);
+        for (int kernel = 0; kernel < KERNEL_COUNT; kernel++) {
+            out << left << setw(16) << kernels[kernel];
+            for (int order = 0; order < ORDER_COUNT; order++) {
+                out << right << setw(16) << nanosPerDebit[order][kernel];
+            }
+            out << "\n";
+        }
+        out << left << setw(16) << "applyBatch (ns)";
+        for (int order = 0; order < ORDER_COUNT; order++) {
+            out << right << setw(16) << nanosPerRecord[order];
+        }
+        out << "\n(same balances and statuses from every debit kernel)\n";
+    }
+};
+
+struct LoginBenchConfig {
+    vector<size_t> costs = {4, 6, 8, 10, 12, 14};   // password hash costs to sweep
+    size_t accounts = 128;
+    size_t clients = 4;
+    double seconds = 1;             // each cost is timed this long with and without the cache
+    size_t cache = 65536;           // credential cache capacity for the cached runs
+    uint64_t seed = 42;
+};
+
+// Logins per second through CustomerDatabase::validateCredentials at each
+// hash cost, with the credential cache off and on. Clients log into
+// random accounts with the right password. The cached runs start after
+// one login per account, so every timed login is a hit; the uncached runs
+// pay for a hash on each. Every account shares one stored hash, which
+// keeps setup short at high costs and does not change the work a login
+// does.
+class LoginBenchmark {
+private:
+    struct Result {
+        size_t cost;
+        double uncachedRate;
+        double cachedRate;
+    };
+
+    LoginBenchConfig config;
+    vector<Result> results;
+
+    // Logs clients into random accounts for config.seconds; returns logins
+    // per second
+    double measure(CustomerDatabase& db, const vector<string>& ids, const string& password) {
+        atomic<size_t> logins(0);
+        atomic<size_t> failures(0);
+        vector<thread> clients;
+        auto started = chrono::steady_clock::now();
+        auto deadline = started + chrono::duration<double>(config.seconds);
+        for (size_t client = 0; client < config.clients; client++) {
+            clients.emplace_back([&, client] {
+                mt19937_64 random(config.seed + client);
+                size_t done = 0;
+                while (chrono::steady_clock::now() < deadline) {
+                    if (db.validateCredentials(ids[random() % ids.size()], password) != Status::OK) {
+                        failures++;
+                    }
+                    done++;
+                }
+                logins += done;
+            });
+        }
+        for (thread& client : clients) {
+            client.join();
+        }
+        if (failures != 0) {
+            throw runtime_error("Logins with the right password failed");
+        }
+        return logins / chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    }
+
+public:
+    explicit LoginBenchmark(const LoginBenchConfig& benchmark) : config(benchmark) {
+        if (config.costs.empty() || config.accounts == 0 || config.clients == 0 || config.seconds <= 0) {
+            throw invalid_argument("Need costs, accounts, clients and a duration");
+        }
+        for (size_t cost : config.costs) {
+            if (cost < size_t(PasswordHasher::MIN_COST) || cost > size_t(PasswordHasher::MAX_COST)) {
+                throw invalid_argument("Password hash cost out of range");
+            }
+        }
+        if (config.cache < config.accounts) {
+            throw invalid_argument("Cache must hold every account");
+        }
+    }
+
+    void run() {
+        for (size_t cost : config.costs) {
+            CustomerDatabase db;
+            db.reserve(config.accounts);
+            db.credentialService().setHashCost(int(cost));
+            CredentialAllocator allocator;
+            string password = allocator.getNextCredential().second;
+            Customer customer;
+            customer.name = "Login Test";
+            customer.address = "1 Bank Street";
+            customer.password = db.hashPassword(password);
+            customer.isFirstLogin = false;
+            vector<string> ids;
+            for (size_t i = 0; i < config.accounts; i++) {
+                customer.customerId = allocator.getNextCredential().first;
+                customer.email = customer.customerId + "@bank.example";
+                customer.phone = to_string(9000000000ull + i);
+                db.addCustomer(customer, toPaise(10000), toPaise(25000));
+                ids.push_back(customer.customerId);
+            }
+
+            Result result{cost, 0, 0};
+            db.credentialService().setCacheCapacity(0);
+            result.uncachedRate = measure(db, ids, password);
+            db.credentialService().setCacheCapacity(config.cache);
+            for (const string& id : ids) {
+                if (db.validateCredentials(id, password) != Status::OK) {
+                    throw runtime_error("Logins with the right password failed");
+                }
+            }
+            result.cachedRate = measure(db, ids, password);
+            results.push_back(result);
+        }
+    }
+
+    void report(ostream& out) {
+        out << "accounts=" << config.accounts << " clients=" << config.clients
+            << " seconds=" << config.seconds << " per run, cache=" << config.cache << "\n";
+        out << left << setw(8) << "cost" << right << setw(16) << "uncached/s"
+            << setw(16) << "cached/s" << setw(12) << "speedup" << "\n";
+        for (const Result& result : results) {
+            out << left << setw(8) << result.cost << right << fixed << setprecision(0)
+                << setw(16) << result.uncachedRate << setw(16) << result.cachedRate
+                << setprecision(1) << setw(11) << result.cachedRate / result.uncachedRate << "x\n";
+        }
+    }
+};
+
+struct CrashTestConfig {
+    string path = "crashtest.log";  // removed again after the run
+};
+
+// Crash and reopen sequences against CustomerDatabase::open, each checked
+// for customers whose addCustomer returned and then went missing. Throws
+// on the first failure.
+class CrashRecoveryTest {
+private:
+    CrashTestConfig config;
+    vector<string> passed;
+
+    void removeFiles() const {
+        for (const char* suffix : {"", ".snapshot", ".prev"}) {
+            ::unlink((config.path + suffix).c_str());
+        }
+    }
+
+    static Customer makeCustomer(uint64_t number) {
+        Customer customer;
+        customer.customerId = CredentialAllocator::formatId(number);
+        customer.name = "Crash Test";
+        customer.isFirstLogin = false;
+        return customer;
+    }
+
+    void addCustomer(uint64_t number) {
+        CustomerDatabase db;
+        db.open(config.path);
+        db.addCustomer(makeCustomer(number), toPaise(1000), toPaise(1000));
+    }
+
+    // What a write cut short leaves at the end of the log
+    void appendBytes(const string& bytes) {
+        int descriptor = ::open(config.path.c_str(), O_WRONLY | O_APPEND);
+        if (descriptor < 0 || ::write(descriptor, bytes.data(), bytes.size()) != ssize_t(bytes.size())) {
+            throw runtime_error("Unable to damage " + config.path);
+        }
+        ::close(descriptor);
+    }
+
+    void expectCustomers(uint64_t through, const string& test) {
+        CustomerDatabase db;
+        db.open(config.path);
+        for (uint64_t number = 1; number <= through; number++) {
+            if (!db.findCustomer(CredentialAllocator::formatId(number))) {
+                throw runtime_error(test + ": lost " + CredentialAllocator::formatId(number));
+            }
+        }
+        passed.push_back(test);
+    }
+
+    void tornTail() {
+        removeFiles();
+        addCustomer(1);
+        appendBytes(string(6, '\x5a'));
+        addCustomer(2);
+        expectCustomers(2, "records after a torn tail");
+    }
+
+    // A header whose length field reads as far more than the rest of the file
+    void corruptLength() {
+        removeFiles();
+        addCustomer(1);
+        appendBytes(string("\xf0\xff\xff\xff\0\0\0\0", 8) + string(1 << 20, '\0'));
+        addCustomer(2);
+        expectCustomers(2, "records after a corrupt length");
+    }
+
+    // Every commit pushes the log past a tiny limit, so checkpoints run in
+    // the background alongside the adds and a manual one
+    void backgroundCheckpoints() {
+        removeFiles();
+        {
+            CustomerDatabase db;
+            db.open(config.path, chrono::microseconds(0), 1);
+            for (uint64_t number = 1; number <= 200; number++) {
+                db.addCustomer(makeCustomer(number), toPaise(1000), toPaise(1000));
+                if (number == 100) {
+                    db.checkpoint();
+                }
+            }
+        }
+        struct stat info;
+        if (::stat((config.path + ".snapshot").c_str(), &info) != 0) {
+            throw runtime_error("background checkpoints: no snapshot written");
+        }
+        expectCustomers(200, "background checkpoints");
+    }
+
+    // A snapshot from before passwords were hashed: the first good login
+    // rehashes the plaintext, and the hash is what the next recovery sees
+    void legacyPassword() {
+        removeFiles();
+        Customer customer = makeCustomer(1);
+        customer.password = "Legacy123";
+        SnapshotBuilder builder;
+        builder.add(customer, toPaise(1000), toPaise(1000), 0, AccrualState{InterestAccrual::today(), 0});
+        builder.write(config.path + ".snapshot");
+        for (int reopen = 0; reopen < 2; reopen++) {
+            CustomerDatabase db;
+            db.credentialService().setHashCost(PasswordHasher::MIN_COST);
+            db.open(config.path);
+            bool hashed = PasswordHasher::isHashed(string(db.findCustomer(customer.customerId)->password));
+            if (hashed != (reopen == 1)) {
+                throw runtime_error("legacy password: rehash was not recovered");
+            }
+            if (db.validateCredentials(customer.customerId, "Legacy12") == Status::OK ||
+                db.validateCredentials(customer.customerId, "Legacy123") != Status::OK) {
+                throw runtime_error("legacy password: wrong login outcome");
+            }
+            if (!PasswordHasher::isHashed(string(db.findCustomer(customer.customerId)->password))) {
+                throw runtime_error("legacy password: still plaintext after login");
+            }
+            db.addCustomer(makeCustomer(10 + reopen), toPaise(1000), toPaise(1000));
+            bool refused = false;
+            try {
+                Customer plaintext = makeCustomer(20 + reopen);
+                plaintext.password = "Plain123";
+                db.addCustomer(plaintext, toPaise(1000), toPaise(1000));
+            } catch (const DatabaseException&) {
+                refused = true;
+            }
+            if (!refused) {
+                throw runtime_error("legacy password: addCustomer stored plaintext");
+            }
+        }
+        passed.push_back("legacy password rehashed on login");
+    }
+
+    void expectRevenue(const DayRevenue& found, Paise penalties, Paise charges, const string& test) {
+        if (found.penalties != penalties || found.charges != charges) {
+            throw runtime_error(test + ": revenue is Rs. " + ReconciliationReport::rupees(found.penalties) +
+                                " + " + ReconciliationReport::rupees(found.charges));
+        }
+    }
+
+    // A customer 40 days behind on accrual, with Rs. 100 in current: the
+    // month end crossed on the first touch charges all of it, and the
+    // withdrawal that touches it takes savings below the minimum. The
+    // day's figures outlive a restart, a checkpoint and the day's close.
+    void dayRevenue() {
+        removeFiles();
+        uint32_t today = InterestAccrual::today();
+        SnapshotBuilder builder;
+        builder.add(makeCustomer(1), toPaise(5000), toPaise(100), 0, AccrualState{today - 40, 0});
+        builder.write(config.path + ".snapshot");
+        Paise penalty = SavingsPolicy::PENALTY;
+        Paise charge = toPaise(100);
+        auto openDay = [](CustomerDatabase& db) {
+            ReconciliationReport report = db.reconcile(1);
+            DayRevenue counts;
+            counts.penalties = report.penaltyRevenue;
+            counts.charges = report.chargeRevenue;
+            return counts;
+        };
+        {
+            CustomerDatabase db;
+            db.open(config.path);
+            ATM atm(db);
+            if (atm.withdraw(makeCustomer(1).customerId, SavingsPolicy::CODE, 4500) != Status::OK_WITH_PENALTY) {
+                throw runtime_error("day revenue: withdrawal was not penalized");
+            }
+            expectRevenue(openDay(db), penalty, charge, "day revenue");
+        }
+        for (int reopen = 0; reopen < 2; reopen++) {
+            CustomerDatabase db;
+            db.open(config.path);
+            expectRevenue(openDay(db), penalty, charge, "day revenue after restart");
+            db.checkpoint();
+        }
+        uint32_t closed;
+        {
+            CustomerDatabase db;
+            db.open(config.path);
+            closed = db.currentDay();
+            db.closeDay();
+        }
+        CustomerDatabase db;
+        db.open(config.path);
+        DayRevenue last = db.closedDayRevenue();
+        if (last.day != closed || db.currentDay() != closed + 1) {
+            throw runtime_error("day revenue: close was not recovered");
+        }
+        expectRevenue(last, penalty, charge, "closed day revenue");
+        expectRevenue(openDay(db), 0, 0, "next day revenue");
+        passed.push_back("day revenue recovered and closed");
+    }
+
+    // Customer 1 starts from a balance record as logged before salary
+    // accounts, then overdraws salary and moves money between salary and
+    // the other accounts, one credit landing in a hot account's slots and
+    // one debit taking current below its minimum. The
+    // salary balances outlive a restart from the log and one from a
+    // checkpoint's snapshot, and reconcile counts them.
+    void salaryAccounts() {
+        removeFiles();
+        addCustomer(1);
+        addCustomer(2);
+        {
+            WriteAheadLog log(config.path, chrono::microseconds(0));
+            string payload;
+            RecordWriter out(payload);
+            out.put8(2);        // CustomerDatabase's LOG_BALANCES_BEFORE_SALARY
+            out.put8(1);
+            out.putString(makeCustomer(1).customerId);
+            out.put64(static_cast<uint64_t>(toPaise(7000)));
+            out.put64(static_cast<uint64_t>(toPaise(1000)));
+            out.put32(InterestAccrual::today());
+            out.put64(0);
+            log.waitDurable(log.append(payload));
+        }
+        string first = makeCustomer(1).customerId;
+        string second = makeCustomer(2).customerId;
+        auto expectBalances = [](CustomerDatabase& db, const string& customerId, Paise savings,
+                                 Paise current, Paise salary, const string& test) {
+            // Settles the account first, posting credits left in hot slots
+            ostringstream shown;
+            ATM(db).checkBalance(customerId, shown);
+            uint32_t handle = db.findHandle(customerId);
+            BalanceStore& balances = db.balances();
+            if (balances.savings(handle) != savings || balances.current(handle) != current ||
+                balances.salary(handle) != salary) {
+                throw runtime_error(test + ": " + customerId + " has the wrong balances");
+            }
+        };
+        auto expectAll = [&](CustomerDatabase& db, const string& test) {
+            expectBalances(db, first, toPaise(6800), toPaise(1000), toPaise(-2000), test);
+            expectBalances(db, second, toPaise(1000), toPaise(250), toPaise(200), test);
+            ReconciliationReport report = db.reconcile(1);
+            if (report.salaryTotal != toPaise(-1800) || report.salaryOverdrawn != 1) {
+                throw runtime_error(test + ": reconcile found salary of Rs. " +
+                                    ReconciliationReport::rupees(report.salaryTotal));
+            }
+        };
+        {
+            CustomerDatabase db;
+            db.open(config.path);
+            expectBalances(db, first, toPaise(7000), toPaise(1000), 0, "salary accounts before salary");
+            db.markHot(second);
+            ATM atm(db);
+            char salary = SalaryPolicy::CODE;
+            bool applied = atm.withdraw(first, salary, 2500) == Status::OK &&
+                           atm.withdraw(first, salary, 9000) == Status::INSUFFICIENT_FUNDS &&
+                           atm.transfer(first, second, SavingsPolicy::CODE, salary, 200) == Status::OK &&
+                           atm.transfer(second, first, CurrentPolicy::CODE, salary, 500) == Status::OK_WITH_PENALTY;
+            if (!applied) {
+                throw runtime_error("salary accounts: overdraft rules not applied");
+            }
+            expectAll(db, "salary accounts");
+        }
+        {
+            CustomerDatabase db;
+            db.open(config.path);
+            expectAll(db, "salary accounts after restart");
+            db.checkpoint();
+        }
+        CustomerDatabase db;
+        db.open(config.path);
+        expectAll(db, "salary accounts after checkpoint");
+        passed.push_back("salary accounts recovered");
+    }
+
+public:
+    explicit CrashRecoveryTest(const CrashTestConfig& test) : config(test) {}
+
+    void run() {
+        tornTail();
+        corruptLength();
+        backgroundCheckpoints();
+        legacyPassword();
+        dayRevenue();
+        salaryAccounts();
+        removeFiles();
+    }
+
+    void report(ostream& out) {
+        for (const string& test : passed) {
+            out << "ok: " << test << "\n";
+        }
+    }
+};
+
+struct ShardBenchConfig {
+    size_t shards = 4;
+    size_t accounts = 10000;
+    size_t transfers = 100000;      // per run
+    size_t clients = 8;             // threads issuing transfers
+    bool sockets = false;           // local sockets instead of in-process queues
+    uint64_t seed = 42;
+    string metrics;                 // as WorkloadConfig::metrics
+};
+
+// Applies a --metrics setting before a run (off) or after its report
+inline void applyMetricsOption(const string& setting, ostream* out) {
+    if (setting == "off" && !out) {
+        Metrics::global().setEnabled(false);
+    } else if (setting == "text" && out) {
+        Metrics::global().dumpText(*out);
+    } else if (setting == "json" && out) {
+        Metrics::global().dumpJson(*out);
+    }
+}
+
+// Transfer throughput through a ShardRouter, measured once with both
+// accounts of every transfer on the same shard and once on two shards
+class ShardBenchmark {
+private:
+    ShardBenchConfig config;
+    ShardRouter router;
+    vector<vector<string>> accountsByShard;
+    double sameShardRate;
+    double crossShardRate;
+    size_t failures;
+
+    static unique_ptr<ShardTransport> makeTransport(const ShardBenchConfig& config) {
+        if (config.sockets) {
+            return unique_ptr<ShardTransport>(new SocketTransport(config.shards + 1));
+        }
+        return unique_ptr<ShardTransport>(new LocalTransport(config.shards + 1));
+    }
+
+    double measure(bool crossShard) {
+        atomic<size_t> failed(0);
+        vector<thread> clients;
+        auto started = chrono::steady_clock::now();
+        for (size_t client = 0; client < config.clients; client++) {
+            size_t share = config.transfers / config.clients +
+                           (client < config.transfers % config.clients ? 1 : 0);
+            clients.emplace_back([this, client, share, crossShard, &failed] {
+                mt19937_64 random(config.seed + client);
+                uniform_int_distribution<size_t> pickShard(0, config.shards - 1);
+                for (size_t i = 0; i < share; i++) {
+                    size_t from = pickShard(random);
+                    size_t to = from;
+                    while (crossShard && to == from) {
+                        to = pickShard(random);
+                    }
+                    const vector<string>& fromAccounts = accountsByShard[from];
+                    const vector<string>& toAccounts = accountsByShard[to];
+                    const string& fromId = fromAccounts[random() % fromAccounts.size()];
+                    const string& toId = toAccounts[random() % toAccounts.size()];
+                    if (&fromId == &toId) {
+                        continue;
+                    }
+                    if (!succeeded(router.transfer(fromId, toId, 'S', 'C', 1))) {
+                        failed++;
+                    }
+                }
+            });
+        }
+        for (thread& client : clients) {
+            client.join();
+        }
+        failures += failed;
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        return config.transfers / seconds;
+    }
+
+public:
+    explicit ShardBenchmark(const ShardBenchConfig& benchmark)
+        : config(benchmark), router(benchmark.shards, makeTransport(benchmark)),
+          accountsByShard(benchmark.shards), sameShardRate(0), crossShardRate(0), failures(0) {
+        if (config.clients == 0 || config.accounts < config.shards * 2) {
+            throw invalid_argument("Need a client and at least two accounts per shard");
+        }
+        Customer customer;
+        customer.name = "Shard Test";
+        customer.isFirstLogin = false;
+        for (size_t number = 0; number < config.accounts; number++) {
+            char id[32];
+            snprintf(id, sizeof(id), "SHRD%07zu", number);
+            customer.customerId = id;
+            router.addCustomer(customer, toPaise(1e9), toPaise(1e9));
+            accountsByShard[router.shardOf(id)].push_back(id);
+        }
+        for (const vector<string>& accounts : accountsByShard) {
+            if (accounts.empty()) {
+                throw invalid_argument("Too few accounts to populate every shard");
+            }
+        }
+    }
+
+    // Money across every shard; transfers between them must not change it
+    Paise total() {
+        Paise sum = 0;
+        for (size_t shard = 0; shard < router.shardCount(); shard++) {
+            sum += router.shardDatabase(shard).balances().total();
+        }
+        return sum;
+    }
+
+    void run() {
+        Paise before = total();
+        sameShardRate = measure(false);
+        if (config.shards > 1) {
+            crossShardRate = measure(true);
+        }
+        if (total() != before) {
+            throw runtime_error("Transfers between shards changed the total held");
+        }
+    }
+
+    void report(ostream& out) {
+        out << "shards=" << config.shards << " accounts=" << config.accounts
+            << " transfers=" << config.transfers << " clients=" << config.clients
+            << " transport=" << (config.sockets ? "socket" : "local") << "\n";
+        out << fixed << setprecision(0)
+            << "same-shard transfers:  " << sameShardRate << " /s\n";
+        if (config.shards > 1) {
+            out << "cross-shard transfers: " << crossShardRate << " /s\n";
+        }
+        out << "failed transfers: " << failures << " (total held unchanged)\n";
+    }
+};
+
+struct HotBenchConfig {
+    size_t accounts = 10000;
+    size_t transfers = 200000;      // per run
+    size_t threads = 8;             // runs with 1, 2, 4, ... up to this many
+    size_t hot = 4;                 // hottest destinations given credit slots
+    double skew = 0.99;             // Zipf theta for picking destinations
+    uint64_t seed = 42;
+    string metrics;                 // as WorkloadConfig::metrics
+};
+
+// Transfers from uniformly chosen accounts to Zipf-chosen destinations,
+// so a handful of merchant accounts receive most of the credits. Each
+// thread count is run once with plain locking and once with the hottest
+// destinations marked hot (see HotCredits); money is checked to be
+// conserved after every run.
+class HotAccountBenchmark {
+private:
+    struct Run {
+        size_t threads;
+        double plainRate;
+        double hotRate;
+    };
+
+    HotBenchConfig config;
+    vector<string> accountIds;
+    vector<Run> runs;
+    size_t failures;
+
+    double measure(size_t threads, bool hot) {
+        CustomerDatabase db;
+        db.reserve(config.accounts);
+        Customer customer;
+        customer.name = "Hot Test";
+        customer.isFirstLogin = false;
+        for (const string& id : accountIds) {
+            customer.customerId = id;
+            db.addCustomer(customer, toPaise(1e9), toPaise(1e9));
+        }
+        for (size_t rank = 0; hot && rank < config.hot; rank++) {
+            db.markHot(accountIds[rank]);
+        }
+        Paise before = db.balances().total();
+
+        // Destinations are drawn up front so the generator stays out of
+        // the timed loop
+        ZipfGenerator destinations(config.accounts, config.skew);
+        vector<vector<pair<uint32_t, uint32_t>>> work(threads);
+        for (size_t worker = 0; worker < threads; worker++) {
+            mt19937_64 random(config.seed + worker);
+            uniform_int_distribution<uint32_t> pickSource(config.hot, config.accounts - 1);
+            size_t share = config.transfers / threads + (worker < config.transfers % threads ? 1 : 0);
+            for (size_t i = 0; i < share; i++) {
+                uint32_t to = static_cast<uint32_t>(destinations.next(random));
+                uint32_t from = pickSource(random);
+                if (from != to) {
+                    work[worker].push_back({from, to});
+                }
+            }
+        }
+
+        atomic<size_t> failed(0);
+        vector<thread> workers;
+        auto started = chrono::steady_clock::now();
+        for (size_t worker = 0; worker < threads; worker++) {
+            workers.emplace_back([this, &db, &work, &failed, worker] {
+                ATM atm(db);
+                for (const pair<uint32_t, uint32_t>& transfer : work[worker]) {
+                    if (!succeeded(atm.transfer(accountIds[transfer.first], accountIds[transfer.second],
+                                                'S', 'C', 1))) {
+                        failed++;
+                    }
+                }
+            });
+        }
+        for (thread& worker : workers) {
+            worker.join();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        for (size_t rank = 0; rank < config.hot; rank++) {
+            uint32_t handle = db.findHandle(accountIds[rank]);
+            unique_lock<mutex> account = db.locks().lockOne(handle);
+            HotCredits::Merge merged = db.settle(handle);
+        }
+        if (db.balances().total() != before) {
+            throw runtime_error("Hot account benchmark lost money");
+        }
+        failures += failed;
+        size_t done = 0;
+        for (const vector<pair<uint32_t, uint32_t>>& transfers : work) {
+            done += transfers.size();
+        }
+        return done / seconds;
+    }
+
+public:
+    explicit HotAccountBenchmark(const HotBenchConfig& benchmark) : config(benchmark), failures(0) {
+        if (config.threads == 0 || config.accounts <= config.hot ||
+            config.hot > HotCredits::MAX_ACCOUNTS) {
+            throw invalid_argument("Need a thread, more accounts than hot ones and at most " +
+                                   to_string(HotCredits::MAX_ACCOUNTS) + " hot accounts");
+        }
+        for (size_t number = 0; number < config.accounts; number++) {
+            char id[32];
+            snprintf(id, sizeof(id), "HOTB%07zu", number);
+            accountIds.push_back(id);
+        }
+    }
+
+    void run() {
+        for (size_t threads = 1; threads <= config.threads; threads *= 2) {
+            Run result;
+            result.threads = threads;
+            result.plainRate = measure(threads, false);
+            result.hotRate = measure(threads, true);
+            runs.push_back(result);
+        }
+    }
+
+    void report(ostream& out) {
+        out << "accounts=" << config.accounts << " transfers=" << config.transfers
+            << " hot=" << config.hot << " skew=" << config.skew
+            << " cpus=" << thread::hardware_concurrency() << "\n";
+        out << right << setw(8) << "threads" << setw(14) << "plain (/s)"
+            << setw(14) << "hot (/s)" << setw(10) << "speedup" << "\n";
+        for (const Run& result : runs) {
+            out << setw(8) << result.threads << fixed << setprecision(0)
+                << setw(14) << result.plainRate << setw(14) << result.hotRate
+                << setprecision(2) << setw(9) << result.hotRate / result.plainRate << "x\n";
+        }
+        out << "failed transfers: " << failures << "\n";
+    }
+};
+
+struct AccrualBenchConfig {
+    size_t accounts = 1000000;
+    size_t clients = 2;             // threads issuing transfers
+    size_t transfers = 100000;      // per client without a sweep running
+    uint64_t seed = 42;
+    string metrics;                 // as WorkloadConfig::metrics
+};
+
+// Times a full AccrualSweeper pass over every loaded account, then
+// measures transfer latency with no sweep running and again while one
+// sweeps, with the clients running until that sweep ends
+class AccrualBenchmark {
+private:
+    enum Phase {
+        PHASE_IDLE,
+        PHASE_SWEEP,
+        PHASE_COUNT
+    };
+
+    AccrualBenchConfig config;
+    CustomerDatabase db;
+    vector<int64_t> latencies[PHASE_COUNT];
+    double importSeconds;
+    double idleSweepSeconds;
+    double loadedSweepSeconds;
+    uint64_t idleAccrued;
+
+    void runClients(Phase phase, const atomic<bool>* sweeping) {
+        vector<vector<int64_t>> samples(config.clients);
+        vector<thread> clients;
+        for (size_t client = 0; client < config.clients; client++) {
+            clients.emplace_back([this, client, phase, sweeping, &samples] {
+                ATM atm(db);
+                mt19937_64 random(config.seed + client + phase * config.clients);
+                uniform_int_distribution<uint64_t> pickAccount(0, config.accounts - 1);
+                for (size_t i = 0; sweeping ? sweeping->load() : i < config.transfers; i++) {
+                    string fromId = LoadDriver::accountId(pickAccount(random));
+                    string toId = LoadDriver::accountId(pickAccount(random));
+                    auto begin = chrono::steady_clock::now();
+                    atm.transfer(fromId, toId, 'S', 'C', 1);
+                    auto end = chrono::steady_clock::now();
+                    samples[client].push_back(
+                        chrono::duration_cast<chrono::nanoseconds>(end - begin).count());
                 }
+            });
+        }
+        for (thread& client : clients) {
+            client.join();
+        }
+        for (const vector<int64_t>& clientSamples : samples) {
+            latencies[phase].insert(latencies[phase].end(), clientSamples.begin(), clientSamples.end());
+        }
+        sort(latencies[phase].begin(), latencies[phase].end());
+    }
+
+public:
+    explicit AccrualBenchmark(const AccrualBenchConfig& benchmark)
+        : config(benchmark), importSeconds(0), idleSweepSeconds(0), loadedSweepSeconds(0),
+          idleAccrued(0) {
+        if (config.clients == 0 || config.accounts < 2) {
+            throw invalid_argument("Need a client and at least two accounts");
+        }
+    }
+
+    void run() {
+        // Bare accounts imported a batch at a time keep ten million of them
+        // within a few gigabytes
+        static const size_t IMPORT_BATCH = 1000000;
+        auto started = chrono::steady_clock::now();
+        ImportRow row;
+        row.customer.name = "Accrual Test";
+        row.customer.isFirstLogin = false;
+        row.savings = toPaise(1e9);
+        row.current = toPaise(1e9);
+        for (size_t first = 0; first < config.accounts; first += IMPORT_BATCH) {
+            vector<ImportRow> rows;
+            for (size_t number = first; number < min(config.accounts, first + IMPORT_BATCH); number++) {
+                row.customer.customerId = LoadDriver::accountId(number);
+                rows.push_back(row);
+            }
+            db.importCustomers(std::move(rows));
+        }
+        importSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        AccrualSweeper sweeper(db);
+        sweeper.closeDay();
+        idleSweepSeconds = sweeper.waitSwept();
+        idleAccrued = sweeper.accruedAccounts();
+
+        runClients(PHASE_IDLE, nullptr);
+
+        atomic<bool> sweeping(true);
+        sweeper.closeDay();
+        thread watcher([&] {
+            loadedSweepSeconds = sweeper.waitSwept();
+            sweeping = false;
+        });
+        runClients(PHASE_SWEEP, &sweeping);
+        watcher.join();
+    }
+
+    void report(ostream& out) {
+        static const char* names[PHASE_COUNT] = {"no sweep", "during sweep"};
+        out << "accounts=" << config.accounts << " clients=" << config.clients
+            << " transfers=" << config.transfers << "\n";
+        out << fixed << setprecision(3)
+            << "setup: imported " << config.accounts << " accounts in " << importSeconds << " s\n"
+            << "sweep alone: " << idleSweepSeconds << " s for " << idleAccrued << " accounts ("
+            << setprecision(1) << idleSweepSeconds * 1e9 / max<uint64_t>(idleAccrued, 1)
+            << " ns each)\n"
+            << setprecision(3) << "sweep under load: " << loadedSweepSeconds << " s\n";
+        out << left << setw(14) << "transfers" << right << setw(10) << "count"
+            << setw(12) << "p50 (ns)" << setw(12) << "p99 (ns)" << setw(12) << "p999 (ns)"
+            << setw(12) << "max (ns)" << "\n";
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            const vector<int64_t>& samples = latencies[phase];
+            out << left << setw(14) << names[phase] << right << setw(10) << samples.size()
+                << setw(12) << LoadDriver::percentile(samples, 0.50)
+                << setw(12) << LoadDriver::percentile(samples, 0.99)
+                << setw(12) << LoadDriver::percentile(samples, 0.999)
+                << setw(12) << (samples.empty() ? 0 : samples.back()) << "\n";
+        }
+    }
+};
+
+struct VelocityBenchConfig {
+    size_t accounts = 1000000;
+    size_t transfers = 1000000;     // per client, mode and round
+    size_t clients = 4;
+    size_t rounds = 3;
+    uint64_t seed = 42;
+};
+
+// Times transfers between random accounts by clients on ATMs of their own,
+// with velocity limits off, per customer, and per customer and terminal.
+// The limits are set too high ever to decline, so the modes differ only
+// in the checks; they take turns for each round and each keeps its best.
+// Then times the check alone on random accounts, and holds two customers
+// to VelocityLimits::perCustomer to see it decline exactly at its caps.
+class VelocityBenchmark {
+private:
+    enum Mode {
+        MODE_OFF,
+        MODE_CUSTOMER,
+        MODE_TERMINAL,
+        MODE_COUNT
+    };
 
-                confirmPassword = getValidInput("Confirm new password: ", false);
+    VelocityBenchConfig config;
+    CustomerDatabase db;
+    vector<string> accountIds;
+    vector<vector<pair<uint32_t, uint32_t>>> work;
+    double seconds[MODE_COUNT];
+    size_t declined[MODE_COUNT];
+    double checkNanoseconds;
+    bool capsHold;
+    double importSeconds;
 
-                if (newPassword != confirmPassword) {
-                    throw ValidationException("Passwords do not match");
+    static VelocityLimits unreachable() {
+        return VelocityLimits{toPaise(1e9), 4000000000u, chrono::hours(24)};
+    }
+
+    void runMode(Mode mode) {
+        db.setVelocityLimits(mode == MODE_OFF ? VelocityLimits::none() : unreachable());
+        atomic<size_t> failed(0);
+        vector<thread> clients;
+        auto started = chrono::steady_clock::now();
+        for (size_t client = 0; client < config.clients; client++) {
+            clients.emplace_back([this, mode, client, &failed] {
+                ATM atm(db);
+                if (mode == MODE_TERMINAL) {
+                    atm.setTerminalLimits(unreachable());
                 }
-                valid = true;
-            } while (!valid);
+                size_t count = 0;
+                for (const pair<uint32_t, uint32_t>& transfer : work[client]) {
+                    count += atm.transfer(accountIds[transfer.first], accountIds[transfer.second],
+                                          'S', 'C', 1) == Status::VELOCITY_LIMIT;
+                }
+                failed += count;
+            });
+        }
+        for (thread& client : clients) {
+            client.join();
+        }
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        if (seconds[mode] == 0 || elapsed < seconds[mode]) {
+            seconds[mode] = elapsed;
+        }
+        declined[mode] += failed;
+    }
 
-            if (!db.changePassword(currentUserId, newPassword)) {
-                throw DatabaseException("Failed to update password");
-            }
-            cout << "Password changed successfully!" << endl;
-        } catch (const ValidationException& e) {
-            cout << "Password change failed: " << e.what() << endl;
-            if (isFirstTime) {
-                cout << "You must change your password before continuing. Please try again." << endl;
-                changePassword(true);
+    // What debitAccount adds under the account lock: a clock read, a
+    // check and a charge against the account's state
+    void timeCheck() {
+        VelocityLimiter limiter(unreachable());
+        BalanceStore& balances = db.balances();
+        mt19937_64 random(config.seed);
+        vector<uint32_t> handles(config.transfers);
+        for (uint32_t& handle : handles) {
+            handle = static_cast<uint32_t>(random() % config.accounts);
+        }
+        size_t allowed = 0;
+        auto started = chrono::steady_clock::now();
+        for (uint32_t handle : handles) {
+            int64_t time = monotonicNanoseconds();
+            VelocityState& state = balances.velocity(handle);
+            if (limiter.allows(state, 100, time)) {
+                limiter.charge(state, 100, time);
+                allowed++;
             }
-        } catch (const DatabaseException& e) {
-            cout << "Database error: " << e.what() << endl;
-        } catch (...) {
-            cout << "An unexpected error occurred while changing password" << endl;
+        }
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        checkNanoseconds = elapsed * 1e9 / handles.size();
+        if (allowed != handles.size()) {
+            throw runtime_error("Velocity check declined under unreachable limits");
         }
     }
 
-    void showMainMenu() {
-        while (true && atm.isNextInQueue(currentUserId)) {
-            try {
-                cout << "\n=== Main Menu ===" << endl;
-                cout << "1. Check Balance" << endl;
-                cout << "2. Withdraw" << endl;
-                cout << "3. Transfer" << endl;
-                cout << "4. Change Password" << endl;
-                cout << "5. Logout" << endl;
-                cout << "Choose an option: ";
+    // On the two accounts no transfer touched, one customer spends the
+    // count cap in Rs. 1 withdrawals and another the amount cap in one; the
+    // next withdrawal of each must be declined
+    void checkCaps() {
+        VelocityLimits caps = VelocityLimits::perCustomer();
+        const string& byCount = accountIds[config.accounts];
+        const string& byAmount = accountIds[config.accounts + 1];
+        db.setVelocityLimits(caps);
+        ATM atm(db);
+        capsHold = true;
+        for (uint32_t i = 0; i < caps.maxCount; i++) {
+            capsHold &= succeeded(atm.withdraw(byCount, 'S', 1));
+        }
+        capsHold &= atm.withdraw(byCount, 'S', 1) == Status::VELOCITY_LIMIT;
+        capsHold &= succeeded(atm.withdraw(byAmount, 'S', toRupees(caps.maxAmount)));
+        capsHold &= atm.withdraw(byAmount, 'S', 1) == Status::VELOCITY_LIMIT;
+        db.setVelocityLimits(VelocityLimits::none());
+    }
 
-                string choice = getValidInput("", false);
-                int option = stoi(choice);
+public:
+    explicit VelocityBenchmark(const VelocityBenchConfig& benchmark)
+        : config(benchmark), seconds(), declined(), checkNanoseconds(0), capsHold(false),
+          importSeconds(0) {
+        if (config.accounts < 2) {
+            throw invalid_argument("Need at least two accounts");
+        }
+        config.clients = max<size_t>(config.clients, 1);
+        config.rounds = max<size_t>(config.rounds, 1);
+    }
 
-                switch (option) {
-                    case 1:
-                        atm.checkBalance(currentUserId);
-                        break;
-                    case 2:
-                        handleWithdrawal();
-                        break;
-                    case 3:
-                        handleTransfer();
-                        break;
-                    case 4:
-                        changePassword();
-                        break;
-                    case 5:
-                        logout();
-                        return;
-                    default:
-                        throw ValidationException("Invalid option");
-                }
-            } catch (const ValidationException& e) {
-                cout << "Error: " << e.what() << endl;
-            } catch (const exception& e) {
-                cout << "An error occurred: " << e.what() << endl;
-            } catch (...) {
-                cout << "An unexpected error occurred" << endl;
+    void run() {
+        static const size_t IMPORT_BATCH = 1000000;
+        auto started = chrono::steady_clock::now();
+        ImportRow row;
+        row.customer.name = "Velocity Test";
+        row.customer.isFirstLogin = false;
+        row.savings = toPaise(1e9);
+        row.current = toPaise(1e9);
+        size_t imported = config.accounts + 2;     // the last two for checkCaps
+        for (size_t first = 0; first < imported; first += IMPORT_BATCH) {
+            vector<ImportRow> rows;
+            for (size_t number = first; number < min(imported, first + IMPORT_BATCH); number++) {
+                row.customer.customerId = LoadDriver::accountId(number);
+                accountIds.push_back(row.customer.customerId);
+                rows.push_back(row);
+            }
+            db.importCustomers(std::move(rows));
+        }
+        importSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        work.resize(config.clients);
+        for (size_t client = 0; client < config.clients; client++) {
+            mt19937_64 random(config.seed + 1 + client);
+            uniform_int_distribution<uint32_t> pickAccount(0, static_cast<uint32_t>(config.accounts - 1));
+            for (size_t i = 0; i < config.transfers; i++) {
+                work[client].push_back({pickAccount(random), pickAccount(random)});
             }
         }
+        for (size_t round = 0; round < config.rounds; round++) {
+            for (int mode = MODE_OFF; mode < MODE_COUNT; mode++) {
+                runMode(static_cast<Mode>(mode));
+            }
+        }
+        timeCheck();
+        checkCaps();
     }
 
-    void handleWithdrawal() {
-        try {
-            char accountType;
-            double amount;
+    void report(ostream& out) {
+        static const char* names[MODE_COUNT] = {"off", "customer", "+ terminal"};
+        size_t total = config.transfers * config.clients;
+        out << "accounts=" << config.accounts << " clients=" << config.clients
+            << " transfers=" << total << " rounds=" << config.rounds
+            << " cores=" << thread::hardware_concurrency() << "\n";
+        out << fixed << setprecision(3)
+            << "setup: imported " << config.accounts << " accounts in " << importSeconds << " s\n";
+        out << left << setw(14) << "limits" << right << setw(16) << "transfers/s"
+            << setw(16) << "ns/transfer" << setw(12) << "overhead" << setw(10) << "declined" << "\n";
+        double baseline = seconds[MODE_OFF] * 1e9 / total;
+        for (int mode = 0; mode < MODE_COUNT; mode++) {
+            double perTransfer = seconds[mode] * 1e9 / total;
+            out << left << setw(14) << names[mode] << right << setprecision(0)
+                << setw(16) << total / seconds[mode] << setprecision(1) << setw(16) << perTransfer
+                << setw(12) << perTransfer - baseline << setw(10) << declined[mode] << "\n";
+        }
+        out << "check alone: " << setprecision(1) << checkNanoseconds << " ns on random accounts, "
+            << sizeof(VelocityState) << " bytes per account\n";
+        out << "per-customer caps: " << (capsHold ? "enforced" : "NOT ENFORCED") << "\n";
+    }
+};
 
-            do {
-                string input = getValidInput("Select account (S for Savings, C for Current): ", false);
-                accountType = toupper(input[0]);
-                
-                if (accountType != 'S' && accountType != 'C') {
-                    throw ValidationException("Invalid account type. Please enter S or C");
+struct ReconBenchConfig {
+    size_t accounts = 10000000;
+    size_t threads = 0;             // reconcile workers, 0 for one per core
+    size_t clients = 1;             // threads transferring during the second pass
+    uint64_t seed = 42;
+};
+
+// Reconciles synthetic accounts twice: idle, where the report must match
+// the imported balances exactly, and while clients transfer between random
+// accounts. Transfers only move money and penalties take it out, so in
+// the second report deposits plus penalty revenue must still equal what
+// was imported.
+class ReconBenchmark {
+private:
+    enum Phase {
+        PHASE_IDLE,
+        PHASE_TRAFFIC,
+        PHASE_COUNT
+    };
+
+    ReconBenchConfig config;
+    CustomerDatabase db;
+    ReconciliationReport expected;
+    ReconciliationReport reports[PHASE_COUNT];
+    bool consistent[PHASE_COUNT];
+    uint64_t transfers;
+    double importSeconds;
+
+public:
+    explicit ReconBenchmark(const ReconBenchConfig& benchmark)
+        : config(benchmark), consistent(), transfers(0), importSeconds(0) {
+        if (config.accounts < 2) {
+            throw invalid_argument("Need at least two accounts");
+        }
+        if (config.threads == 0) {
+            config.threads = max<size_t>(1, thread::hardware_concurrency());
+        }
+    }
+
+    void run() {
+        static const size_t IMPORT_BATCH = 1000000;
+        auto started = chrono::steady_clock::now();
+        mt19937_64 random(config.seed);
+        // Straddle both minimums so the below-minimum counts are not trivial
+        uniform_int_distribution<Paise> pickSavings(0, 3 * SavingsPolicy::MIN_BALANCE);
+        uniform_int_distribution<Paise> pickCurrent(0, 3 * CurrentPolicy::MIN_BALANCE);
+        ImportRow row;
+        row.customer.name = "Reconcile Test";
+        row.customer.isFirstLogin = false;
+        for (size_t first = 0; first < config.accounts; first += IMPORT_BATCH) {
+            vector<ImportRow> rows;
+            for (size_t number = first; number < min(config.accounts, first + IMPORT_BATCH); number++) {
+                row.customer.customerId = LoadDriver::accountId(number);
+                row.savings = pickSavings(random);
+                row.current = pickCurrent(random);
+                expected.savingsTotal += row.savings;
+                expected.currentTotal += row.current;
+                expected.savingsBelowMinimum += row.savings < SavingsPolicy::MIN_BALANCE;
+                expected.currentBelowMinimum += row.current < CurrentPolicy::MIN_BALANCE;
+                rows.push_back(row);
+            }
+            db.importCustomers(std::move(rows));
+        }
+        importSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        ReconciliationReport& idle = reports[PHASE_IDLE];
+        idle = db.reconcile(config.threads);
+        consistent[PHASE_IDLE] = idle.accounts == config.accounts &&
+                                 idle.savingsTotal == expected.savingsTotal &&
+                                 idle.currentTotal == expected.currentTotal &&
+                                 idle.savingsBelowMinimum == expected.savingsBelowMinimum &&
+                                 idle.currentBelowMinimum == expected.currentBelowMinimum &&
+                                 idle.salaryTotal == 0 && idle.salaryOverdrawn == 0 &&
+                                 idle.penaltyRevenue == 0 && idle.chargeRevenue == 0;
+
+        atomic<bool> running(true);
+        atomic<uint64_t> done(0);
+        vector<thread> clients;
+        for (size_t client = 0; client < config.clients; client++) {
+            clients.emplace_back([this, client, &running, &done] {
+                ATM atm(db);
+                mt19937_64 random(config.seed + 1 + client);
+                uniform_int_distribution<uint64_t> pickAccount(0, config.accounts - 1);
+                uniform_int_distribution<int> pickRupees(1, 2000);
+                uint64_t count = 0;
+                while (running.load(memory_order_relaxed)) {
+                    string fromId = LoadDriver::accountId(pickAccount(random));
+                    string toId = LoadDriver::accountId(pickAccount(random));
+                    char fromType = ACCOUNT_RULES[random() % ACCOUNT_COLUMNS].code;
+                    char toType = ACCOUNT_RULES[random() % ACCOUNT_COLUMNS].code;
+                    atm.transfer(fromId, toId, fromType, toType, pickRupees(random));
+                    count++;
                 }
-            } while (accountType != 'S' && accountType != 'C');
+                done += count;
+            });
+        }
+        // Let the clients get going before the scan starts
+        this_thread::sleep_for(chrono::milliseconds(100));
+        ReconciliationReport& loaded = reports[PHASE_TRAFFIC];
+        loaded = db.reconcile(config.threads);
+        running = false;
+        for (thread& client : clients) {
+            client.join();
+        }
+        transfers = done;
+        consistent[PHASE_TRAFFIC] = loaded.accounts == config.accounts &&
+                                    loaded.savingsTotal + loaded.currentTotal + loaded.salaryTotal +
+                                            loaded.penaltyRevenue + loaded.chargeRevenue ==
+                                        expected.savingsTotal + expected.currentTotal;
+    }
 
-            string amountStr = getValidInput("Enter amount to withdraw: ", false);
-            try {
-                amount = stod(amountStr);
-                if (amount <= 0) {
-                    throw ValidationException("Amount must be greater than zero");
+    void report(ostream& out) {
+        static const char* names[PHASE_COUNT] = {"idle", "with traffic"};
+        out << "accounts=" << config.accounts << " threads=" << config.threads
+            << " clients=" << config.clients << " cores=" << thread::hardware_concurrency() << "\n";
+        out << fixed << setprecision(3)
+            << "setup: imported " << config.accounts << " accounts in " << importSeconds << " s\n";
+        out << left << setw(14) << "reconcile" << right << setw(12) << "pause (us)"
+            << setw(12) << "scan (ms)" << setw(16) << "accounts/s" << setw(18) << "per thread"
+            << setw(10) << "changed" << setw(12) << "totals" << "\n";
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            const ReconciliationReport& result = reports[phase];
+            double rate = result.accounts / max(result.scanSeconds, 1e-9);
+            out << left << setw(14) << names[phase] << right << setprecision(0)
+                << setw(12) << result.pauseSeconds * 1e6
+                << setprecision(1) << setw(12) << result.scanSeconds * 1e3
+                << setprecision(0) << setw(16) << rate << setw(18) << rate / config.threads
+                << setw(10) << result.changedDuringScan
+                << setw(12) << (consistent[phase] ? "match" : "MISMATCH") << "\n";
+        }
+        out << "transfers during the second pass: " << transfers << "\n";
+        reports[PHASE_TRAFFIC].print(out);
+    }
+};
+
+struct TokenBenchConfig {
+    size_t accounts = 1000000;
+    size_t sessions = 200000;       // per path
+    uint64_t seed = 42;
+};
+
+// Times the actions of a terminal session after login, first naming the
+// customer by ID on every call as the console once did, then with the
+// SessionToken login returns. Each session is twenty menu actions: eight
+// balance checks, six withdrawals, three transfers between the customer's
+// own accounts and three to other customers, each after the queue check
+// the menu makes.
+class TokenBenchmark {
+private:
+    enum Path {
+        PATH_CUSTOMER_ID,
+        PATH_TOKEN,
+        PATH_COUNT
+    };
+
+    enum Action : uint8_t {
+        ACTION_BALANCE,
+        ACTION_WITHDRAW,
+        ACTION_OWN_TRANSFER,
+        ACTION_TRANSFER
+    };
+
+    TokenBenchConfig config;
+    CustomerDatabase db;
+    vector<Action> script;
+    vector<int64_t> latencies[PATH_COUNT];
+    double importSeconds;
+
+    void runPath(Path path) {
+        ATM atm(db);
+        ostringstream out;
+        mt19937_64 random(config.seed);
+        uniform_int_distribution<uint64_t> pickAccount(0, config.accounts - 1);
+        vector<int64_t>& samples = latencies[path];
+        samples.reserve(config.sessions);
+        for (size_t i = 0; i < config.sessions; i++) {
+            string customerId = LoadDriver::accountId(pickAccount(random));
+            string otherId = LoadDriver::accountId(pickAccount(random));
+            atm.addToQueue(customerId);
+            SessionToken session;
+            if (path == PATH_TOKEN) {
+                session = db.openVerifiedSession(customerId);
+            }
+            out.str("");
+
+            auto begin = chrono::steady_clock::now();
+            for (Action action : script) {
+                if (path == PATH_TOKEN) {
+                    if (!atm.isNextInQueue(session)) {
+                        throw runtime_error("Session lost its turn");
+                    }
+                    switch (action) {
+                        case ACTION_BALANCE:
+                            atm.checkBalance(session, out);
+                            break;
+                        case ACTION_WITHDRAW:
+                            atm.withdraw(session, 'C', 1);
+                            break;
+                        case ACTION_OWN_TRANSFER:
+                            atm.transfer(session, 'C', 'S', 1);
+                            break;
+                        case ACTION_TRANSFER:
+                            atm.transfer(session, otherId, 'C', 'S', 1);
+                            break;
+                    }
+                } else {
+                    if (!atm.isNextInQueue(customerId)) {
+                        throw runtime_error("Session lost its turn");
+                    }
+                    switch (action) {
+                        case ACTION_BALANCE:
+                            atm.checkBalance(customerId, out);
+                            break;
+                        case ACTION_WITHDRAW:
+                            atm.withdraw(customerId, 'C', 1);
+                            break;
+                        case ACTION_OWN_TRANSFER:
+                            atm.transfer(customerId, customerId, 'C', 'S', 1);
+                            break;
+                        case ACTION_TRANSFER:
+                            atm.transfer(customerId, otherId, 'C', 'S', 1);
+                            break;
+                    }
                 }
-            } catch (const invalid_argument&) {
-                throw ValidationException("Invalid amount format");
             }
+            auto end = chrono::steady_clock::now();
+            samples.push_back(chrono::duration_cast<chrono::nanoseconds>(end - begin).count());
 
-            atm.withdraw(currentUserId, accountType, amount);
+            if (path == PATH_TOKEN) {
+                db.closeSession(session);
+            }
+            atm.removeFromQueue();
+        }
+        sort(samples.begin(), samples.end());
+    }
 
-        } catch (const ValidationException& e) {
-            cout << "Withdrawal failed: " << e.what() << endl;
-        } catch (const InsufficientFundsException& e) {
-            cout << "Withdrawal failed: " << e.what() << endl;
-        } catch (...) {
-            cout << "An unexpected error occurred during withdrawal" << endl;
+public:
+    explicit TokenBenchmark(const TokenBenchConfig& benchmark) : config(benchmark), importSeconds(0) {
+        if (config.accounts < 2) {
+            throw invalid_argument("Need at least two accounts");
         }
+        static const int counts[] = {8, 6, 3, 3};
+        for (int action = ACTION_BALANCE; action <= ACTION_TRANSFER; action++) {
+            script.insert(script.end(), counts[action], static_cast<Action>(action));
+        }
+        mt19937_64 random(config.seed);
+        shuffle(script.begin(), script.end(), random);
     }
 
-    void handleTransfer() {
-        try {
-            cout << "\nTransfer Options:" << endl;
-            cout << "1. Between own accounts" << endl;
-            cout << "2. To another customer" << endl;
-            
-            string choiceStr = getValidInput("Select option: ", false);
-            int choice = stoi(choiceStr);
+    void run() {
+        static const size_t IMPORT_BATCH = 1000000;
+        auto started = chrono::steady_clock::now();
+        ImportRow row;
+        row.customer.name = "Token Test";
+        row.customer.isFirstLogin = false;
+        row.savings = toPaise(1e9);
+        row.current = toPaise(1e9);
+        for (size_t first = 0; first < config.accounts; first += IMPORT_BATCH) {
+            vector<ImportRow> rows;
+            for (size_t number = first; number < min(config.accounts, first + IMPORT_BATCH); number++) {
+                row.customer.customerId = LoadDriver::accountId(number);
+                rows.push_back(row);
+            }
+            db.importCustomers(std::move(rows));
+        }
+        importSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
 
-            if (choice != 1 && choice != 2) {
-                throw ValidationException("Invalid transfer option");
+        runPath(PATH_CUSTOMER_ID);
+        runPath(PATH_TOKEN);
+    }
+
+    void report(ostream& out) {
+        static const char* names[PATH_COUNT] = {"customer id", "token"};
+        out << "accounts=" << config.accounts << " sessions=" << config.sessions
+            << " actions=" << script.size() << "\n";
+        out << fixed << setprecision(3)
+            << "setup: imported " << config.accounts << " accounts in " << importSeconds << " s\n";
+        out << left << setw(14) << "session" << right << setw(12) << "mean (ns)"
+            << setw(12) << "p50 (ns)" << setw(12) << "p99 (ns)" << setw(14) << "per action" << "\n";
+        for (int path = 0; path < PATH_COUNT; path++) {
+            const vector<int64_t>& samples = latencies[path];
+            double mean = 0;
+            for (int64_t sample : samples) {
+                mean += double(sample) / samples.size();
             }
+            out << left << setw(14) << names[path] << right << setprecision(0) << setw(12) << mean
+                << setw(12) << LoadDriver::percentile(samples, 0.50)
+                << setw(12) << LoadDriver::percentile(samples, 0.99)
+                << setprecision(1) << setw(14) << mean / script.size() << "\n";
+        }
+    }
+};
 
-            char fromAccount, toAccount;
-            string toCustomerId;
-            double amount;
+struct LedgerBenchConfig {
+    uint64_t rows = 10000000;
+    size_t accounts = 1000000;
+    uint32_t days = 30;             // the rows are spread evenly over this many days up to now
+    size_t queries = 10000;         // last-ten lookups, on random accounts
+    string path = "ledger_bench";   // replaced if it exists
+    uint64_t seed = 42;
+};
 
-            // Get source account type
-            do {
-                string input = getValidInput("From account (S/C): ", false);
-                fromAccount = toupper(input[0]);
-                if (fromAccount != 'S' && fromAccount != 'C') {
-                    throw ValidationException("Invalid source account type");
-                }
-            } while (fromAccount != 'S' && fromAccount != 'C');
+// Fills a TransactionLedger with synthetic rows, reopens it, and times the
+// two queries it is indexed for: an account's last ten transactions, and
+// today's transfers over Rs. 50,000. Both are timed cold, with the blocks
+// dropped from the page cache, and warm.
+class LedgerBenchmark {
+private:
+    enum Query {
+        QUERY_LAST_COLD,
+        QUERY_LAST_WARM,
+        QUERY_COUNT
+    };
 
-            if (choice == 1) {
-                toCustomerId = currentUserId;
-                do {
-                    string input = getValidInput("To account (S/C): ", false);
-                    toAccount = toupper(input[0]);
-                    if (toAccount != 'S' && toAccount != 'C') {
-                        throw ValidationException("Invalid destination account type");
-                    }
-                } while (toAccount != 'S' && toAccount != 'C');
+    LedgerBenchConfig config;
+    unique_ptr<TransactionLedger> ledger;
+    vector<int64_t> latencies[QUERY_COUNT];
+    double ingestSeconds;
+    double flushSeconds;
+    double reopenSeconds;
+    uint64_t storedBytes;
+    int64_t todayStart;
+    int64_t now;
+    double largeColdSeconds;
+    double largeWarmSeconds;
+    size_t largeMatches;
+
+    uint64_t random;
+
+    // splitmix64; cheaper per row than mt19937_64
+    uint64_t nextRandom() {
+        uint64_t z = (random += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    void removeFiles() {
+        for (const char* suffix : {".blocks", ".accounts", ".index", ".index.tmp"}) {
+            ::unlink((config.path + suffix).c_str());
+        }
+    }
+
+    void dropCache() {
+        int fd = ::open((config.path + ".blocks").c_str(), O_RDONLY);
+        if (fd >= 0) {
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            ::close(fd);
+        }
+    }
+
+    void ingest() {
+        vector<Paise> savings(config.accounts, toPaise(100000));
+        vector<Paise> current(config.accounts, toPaise(50000));
+        for (size_t number = 0; number < config.accounts; number++) {
+            ledger->registerAccount(LoadDriver::accountId(number));
+        }
+        int64_t span = int64_t(config.days) * 86400 * 1000000000LL;
+        int64_t start = now - span;
+        double spacing = double(span) / double(config.rows);
+        LedgerEntry entry;
+        auto started = chrono::steady_clock::now();
+        for (uint64_t row = 0; row < config.rows; row++) {
+            uint64_t bits = nextRandom();
+            uint64_t accounts = nextRandom();
+            entry.timestamp = start + static_cast<int64_t>(double(row) * spacing);
+            entry.fromAccount = static_cast<uint32_t>((accounts & 0xffffffff) % config.accounts);
+            entry.fromAccountType = (bits & 1) ? 'C' : 'S';
+            // 1% of rows move up to Rs. 1,00,000, the rest up to Rs. 5,000
+            bool large = (bits >> 40) % 100 == 0;
+            entry.amount = static_cast<Paise>((bits >> 8) % (large ? 10000000 : 500000) + 100);
+            entry.status = Status::OK;
+            entry.penalty = 0;
+            Paise& source = entry.fromAccountType == 'C' ? current[entry.fromAccount] : savings[entry.fromAccount];
+            source -= entry.amount;
+            if ((bits >> 48) % 10 != 0) {
+                entry.kind = TransactionKind::TRANSFER;
+                entry.toAccount = static_cast<uint32_t>((accounts >> 32) % config.accounts);
+                entry.toAccountType = (bits & 2) ? 'C' : 'S';
+                (entry.toAccountType == 'C' ? current : savings)[entry.toAccount] += entry.amount;
             } else {
-                toCustomerId = getValidInput("Enter recipient's Customer ID: ", false);
-                do {
-                    string input = getValidInput("To recipient's account (S/C): ", false);
-                    toAccount = toupper(input[0]);
-                    if (toAccount != 'S' && toAccount != 'C') {
-                        throw ValidationException("Invalid destination account type");
-                    }
-                } while (toAccount != 'S' && toAccount != 'C');
+                entry.kind = TransactionKind::WITHDRAWAL;
+                entry.toAccount = TransactionLedger::NO_ACCOUNT;
+                entry.toAccountType = 0;
+                if ((bits >> 56) % 16 == 0) {
+                    entry.status = Status::OK_WITH_PENALTY;
+                    entry.penalty = toPaise(10);
+                    source -= entry.penalty;
+                }
             }
+            entry.savingsAfter = savings[entry.fromAccount];
+            entry.currentAfter = current[entry.fromAccount];
+            entry.salaryAfter = 0;
+            ledger->append(entry);
+        }
+        ingestSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        started = chrono::steady_clock::now();
+        ledger->flush();
+        flushSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        storedBytes = ledger->storedBytes();
+    }
 
-            string amountStr = getValidInput("Enter amount to transfer: ", false);
-            try {
-                amount = stod(amountStr);
-                if (amount <= 0) {
-                    throw ValidationException("Amount must be greater than zero");
+    void runLastTransactions(Query query) {
+        for (size_t i = 0; i < config.queries; i++) {
+            uint32_t account = static_cast<uint32_t>(nextRandom() % config.accounts);
+            auto begin = chrono::steady_clock::now();
+            vector<LedgerEntry> entries = ledger->lastTransactions(account, 10);
+            auto end = chrono::steady_clock::now();
+            if (entries.empty() && config.rows >= config.accounts * 10) {
+                throw runtime_error("Ledger benchmark found an account without transactions");
+            }
+            latencies[query].push_back(chrono::duration_cast<chrono::nanoseconds>(end - begin).count());
+        }
+        sort(latencies[query].begin(), latencies[query].end());
+    }
+
+    double runLargeTransfers() {
+        auto begin = chrono::steady_clock::now();
+        largeMatches = ledger->findTransactions(TransactionKind::TRANSFER, toPaise(50000), todayStart, now + 1).size();
+        return chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    }
+
+public:
+    explicit LedgerBenchmark(const LedgerBenchConfig& benchmark)
+        : config(benchmark), ingestSeconds(0), flushSeconds(0), reopenSeconds(0), storedBytes(0),
+          todayStart(0), now(0), largeColdSeconds(0), largeWarmSeconds(0), largeMatches(0),
+          random(benchmark.seed) {
+        if (config.accounts < 2 || config.days == 0) {
+            throw invalid_argument("Need at least two accounts and a day");
+        }
+    }
+
+    ~LedgerBenchmark() {
+        ledger.reset();
+        removeFiles();
+    }
+
+    void run() {
+        now = chrono::duration_cast<chrono::nanoseconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
+        todayStart = now - 86400 * 1000000000LL;
+        removeFiles();
+        ledger.reset(new TransactionLedger(config.path));
+        ingest();
+
+        ledger.reset();
+        dropCache();
+        auto started = chrono::steady_clock::now();
+        ledger.reset(new TransactionLedger(config.path));
+        reopenSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        runLastTransactions(QUERY_LAST_COLD);
+        runLastTransactions(QUERY_LAST_WARM);
+        dropCache();
+        largeColdSeconds = runLargeTransfers();
+        largeWarmSeconds = runLargeTransfers();
+    }
+
+    void report(ostream& out) {
+        static const char* names[QUERY_COUNT] = {"last 10 cold", "last 10 warm"};
+        out << "rows=" << config.rows << " accounts=" << config.accounts << " days=" << config.days << "\n";
+        out << fixed << setprecision(3)
+            << "ingest: " << ingestSeconds << " s (" << setprecision(0)
+            << config.rows / max(ingestSeconds, 1e-9) << " rows/s), flush " << setprecision(3)
+            << flushSeconds << " s\n"
+            << "stored: " << storedBytes << " bytes (" << setprecision(2)
+            << double(storedBytes) / max<uint64_t>(config.rows, 1) << " per row)\n"
+            << setprecision(3) << "reopen: " << reopenSeconds << " s\n";
+        out << left << setw(14) << "query" << right << setw(10) << "count"
+            << setw(12) << "p50 (ns)" << setw(12) << "p99 (ns)" << setw(12) << "max (ns)" << "\n";
+        for (int query = 0; query < QUERY_COUNT; query++) {
+            const vector<int64_t>& samples = latencies[query];
+            out << left << setw(14) << names[query] << right << setw(10) << samples.size()
+                << setw(12) << LoadDriver::percentile(samples, 0.50)
+                << setw(12) << LoadDriver::percentile(samples, 0.99)
+                << setw(12) << (samples.empty() ? 0 : samples.back()) << "\n";
+        }
+        out << setprecision(3) << "transfers over Rs. 50,000 today: " << largeMatches << " found in "
+            << largeColdSeconds * 1000 << " ms cold, " << largeWarmSeconds * 1000 << " ms warm\n";
+    }
+};
+
+#ifdef __cpp_impl_coroutine
+
+struct SessionBenchConfig {
+    size_t threads = 1;             // server loop threads
+    size_t clients = 1;             // client threads, each multiplexing its connections
+    size_t connections = 1000;      // concurrent terminal sessions
+    size_t sessions = 100000;       // log in, one action, log out; spread over connections
+    size_t accounts = 10000;
+    string transport = "unix";      // unix or tcp
+    double readRatio = 0.2;         // as WorkloadConfig
+    double transferRatio = 0.5;
+    double skew = 0.99;
+    uint64_t seed = 42;
+    int hashCost = PasswordHasher::DEFAULT_COST;
+    size_t credentialCache = 65536;
+    string metrics;                 // as WorkloadConfig::metrics
+};
+
+// Drives a SessionServer over real sockets. Client threads keep many
+// connections open at once, each typing the same sessions LoadDriver
+// scripts one line per prompt, and time every request from sending the
+// line to receiving the next prompt.
+class SessionBenchmark {
+public:
+    enum Request {
+        REQUEST_LOGIN,
+        REQUEST_BALANCE,
+        REQUEST_WITHDRAW,
+        REQUEST_TRANSFER,
+        REQUEST_LOGOUT,
+        REQUEST_COUNT
+    };
+
+private:
+    struct Step {
+        string line;
+        const char* reply;      // the prompt that ends the response
+        Request request;
+    };
+
+    struct Connection {
+        int fd;
+        vector<Step> script;
+        size_t next;            // step being answered
+        string received;
+        chrono::steady_clock::time_point sent;
+        size_t sessionsLeft;
+    };
+
+    struct ClientStats {
+        vector<int64_t> latencies[REQUEST_COUNT];
+        size_t failures = 0;
+    };
+
+    static const char* const MENU_PROMPT;
+
+    SessionBenchConfig config;
+    CustomerDatabase db;
+    unique_ptr<SessionServer> server;
+    vector<ClientStats> stats;
+    size_t importedRows;
+    double elapsedSeconds;
+
+    static bool endsWith(const string& text, const char* suffix) {
+        size_t length = strlen(suffix);
+        return text.size() >= length && text.compare(text.size() - length, length, suffix) == 0;
+    }
+
+    void writeScript(Connection& connection, mt19937_64& random, ZipfGenerator& accounts) {
+        uniform_real_distribution<double> mix(0.0, 1.0);
+        uniform_int_distribution<int> rupees(100, 5000);
+        vector<Step>& script = connection.script;
+        script.clear();
+        script.push_back(Step{"1", "Enter Customer ID: ", REQUEST_LOGIN});
+        script.push_back(Step{LoadDriver::accountId(accounts.next(random)), "Enter Password: ", REQUEST_LOGIN});
+        script.push_back(Step{LoadDriver::PASSWORD, MENU_PROMPT, REQUEST_LOGIN});
+        if (mix(random) < config.readRatio) {
+            script.push_back(Step{"1", MENU_PROMPT, REQUEST_BALANCE});
+        } else if (mix(random) < config.transferRatio) {
+            script.push_back(Step{"3", "Select option: ", REQUEST_TRANSFER});
+            script.push_back(Step{"2", "From account (S/C/L): ", REQUEST_TRANSFER});
+            script.push_back(Step{"C", "Enter recipient's Customer ID: ", REQUEST_TRANSFER});
+            script.push_back(Step{LoadDriver::accountId(accounts.next(random)),
+                                  "To recipient's account (S/C/L): ", REQUEST_TRANSFER});
+            script.push_back(Step{"S", "Enter amount to transfer: ", REQUEST_TRANSFER});
+            script.push_back(Step{to_string(rupees(random)), MENU_PROMPT, REQUEST_TRANSFER});
+        } else {
+            script.push_back(Step{"2", "Select account (S for Savings, C for Current, L for Salary): ",
+                                  REQUEST_WITHDRAW});
+            script.push_back(Step{"S", "Enter amount to withdraw: ", REQUEST_WITHDRAW});
+            script.push_back(Step{to_string(rupees(random)), MENU_PROMPT, REQUEST_WITHDRAW});
+        }
+        script.push_back(Step{"5", MENU_PROMPT, REQUEST_LOGOUT});
+        connection.next = 0;
+        connection.sessionsLeft--;
+    }
+
+    static void sendStep(Connection& connection) {
+        string line = connection.script[connection.next].line + "\n";
+        connection.sent = chrono::steady_clock::now();
+        if (::send(connection.fd, line.data(), line.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(line.size())) {
+            throw runtime_error("Session benchmark write failed");
+        }
+    }
+
+    void runClient(size_t index, size_t connectionCount, size_t firstConnection) {
+        ClientStats& results = stats[index];
+        mt19937_64 random(config.seed + index);
+        ZipfGenerator accounts(config.accounts, config.skew);
+        int epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+        vector<Connection> connections(connectionCount);
+        for (size_t i = 0; i < connectionCount; i++) {
+            Connection& connection = connections[i];
+            connection.fd = SessionServer::connectTo(server->address());
+            ::fcntl(connection.fd, F_SETFL, ::fcntl(connection.fd, F_GETFL) | O_NONBLOCK);
+            size_t number = firstConnection + i;
+            connection.sessionsLeft = config.sessions / config.connections +
+                                      (number < config.sessions % config.connections ? 1 : 0);
+            connection.next = 0;    // nothing sent; waiting for the welcome menu
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.u64 = i;
+            ::epoll_ctl(epollFd, EPOLL_CTL_ADD, connection.fd, &event);
+        }
+
+        size_t open = connectionCount;
+        epoll_event events[64];
+        char buffer[4096];
+        while (open > 0) {
+            int count = ::epoll_wait(epollFd, events, 64, -1);
+            for (int e = 0; e < count; e++) {
+                Connection& connection = connections[events[e].data.u64];
+                ssize_t n = ::read(connection.fd, buffer, sizeof(buffer));
+                if (n <= 0) {
+                    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                        continue;
+                    }
+                    throw runtime_error("Session benchmark connection closed early");
                 }
-            } catch (const invalid_argument&) {
-                throw ValidationException("Invalid amount format");
+                connection.received.append(buffer, static_cast<size_t>(n));
+                const char* expected = connection.script.empty()
+                    ? MENU_PROMPT : connection.script[connection.next].reply;
+                if (!endsWith(connection.received, expected)) {
+                    continue;
+                }
+                if (!connection.script.empty()) {
+                    const Step& step = connection.script[connection.next];
+                    results.latencies[step.request].push_back(chrono::duration_cast<chrono::nanoseconds>(
+                        chrono::steady_clock::now() - connection.sent).count());
+                    if (connection.received.find("failed") != string::npos ||
+                        connection.received.find("Error") != string::npos) {
+                        results.failures++;
+                    }
+                    connection.next++;
+                }
+                connection.received.clear();
+                if (connection.script.empty() || connection.next == connection.script.size()) {
+                    if (connection.sessionsLeft == 0) {
+                        ::close(connection.fd);
+                        open--;
+                        continue;
+                    }
+                    writeScript(connection, random, accounts);
+                }
+                sendStep(connection);
             }
+        }
+        ::close(epollFd);
+    }
 
-            atm.transfer(currentUserId, toCustomerId, fromAccount, toAccount, amount);
+public:
+    explicit SessionBenchmark(const SessionBenchConfig& benchConfig)
+        : config(benchConfig), importedRows(0), elapsedSeconds(0) {
+        if (config.transport != "unix" && config.transport != "tcp") {
+            throw invalid_argument("Unknown transport " + config.transport);
+        }
+        if (config.connections == 0 || config.clients == 0 || config.clients > config.connections) {
+            throw invalid_argument("Session benchmark needs 1 <= clients <= connections");
+        }
+        db.credentialService().setHashCost(config.hashCost);
+        db.credentialService().setCacheCapacity(config.credentialCache);
+        importedRows = LoadDriver::importAccounts(db, config.accounts);
+        string address = config.transport == "tcp"
+            ? string("tcp:0") : "unix:/tmp/atm-sessionbench-" + to_string(::getpid()) + ".sock";
+        server.reset(new SessionServer(db, address, config.threads));
+    }
 
-        } catch (const ValidationException& e) {
-            cout << "Transfer failed: " << e.what() << endl;
-        } catch (const InsufficientFundsException& e) {
-            cout << "Transfer failed: " << e.what() << endl;
-        } catch (const DatabaseException& e) {
-            cout << "Database error: " << e.what() << endl;
-        } catch (...) {
-            cout << "An unexpected error occurred during transfer" << endl;
+    void run() {
+        stats.assign(config.clients, ClientStats());
+        vector<thread> clients;
+        auto started = chrono::steady_clock::now();
+        size_t first = 0;
+        for (size_t i = 0; i < config.clients; i++) {
+            size_t count = config.connections / config.clients + (i < config.connections % config.clients ? 1 : 0);
+            clients.emplace_back(&SessionBenchmark::runClient, this, i, count, first);
+            first += count;
+        }
+        for (thread& client : clients) {
+            client.join();
         }
+        elapsedSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        server->stop();
     }
 
-    void logout() {
-        try {
-            atm.removeFromQueue();
-            currentUserId = "";
-            cout << "Logged out successfully" << endl;
-        } catch (...) {
-            cout << "Error during logout" << endl;
+    void report(ostream& out) {
+        static const char* names[REQUEST_COUNT] = {"login", "balance", "withdraw", "transfer", "logout"};
+        size_t failures = 0;
+        vector<int64_t> merged[REQUEST_COUNT];
+        for (ClientStats& client : stats) {
+            failures += client.failures;
+            for (int request = 0; request < REQUEST_COUNT; request++) {
+                merged[request].insert(merged[request].end(), client.latencies[request].begin(),
+                                       client.latencies[request].end());
+            }
+        }
+        double serverSeconds = server->cpuSeconds();
+        out << "server-threads=" << config.threads << " clients=" << config.clients
+            << " connections=" << config.connections << " sessions=" << config.sessions
+            << " accounts=" << config.accounts << " transport=" << config.transport << "\n";
+        out << "setup: imported " << importedRows << " accounts\n";
+        out << fixed << setprecision(0)
+            << "throughput: " << config.sessions / elapsedSeconds << " sessions/s, "
+            << config.sessions / serverSeconds << " sessions per server core-second\n";
+        out << left << setw(10) << "request" << right << setw(10) << "count"
+            << setw(12) << "p50 (ns)" << setw(12) << "p99 (ns)" << setw(12) << "p999 (ns)" << "\n";
+        for (int request = 0; request < REQUEST_COUNT; request++) {
+            vector<int64_t>& samples = merged[request];
+            sort(samples.begin(), samples.end());
+            out << left << setw(10) << names[request] << right << setw(10) << samples.size()
+                << setw(12) << LoadDriver::percentile(samples, 0.50)
+                << setw(12) << LoadDriver::percentile(samples, 0.99)
+                << setw(12) << LoadDriver::percentile(samples, 0.999) << "\n";
+        }
+        out << "failed requests: " << failures << "\n";
+    }
+};
+
+const char* const SessionBenchmark::MENU_PROMPT = "Choose an option: ";
+
+#endif
+
+// Binds each --name option of a command-line mode to a field of its config
+// and fills them from the name/value pairs after the mode
+class OptionParser {
+private:
+    unordered_map<string, function<void(const string&)>> handlers;
+
+public:
+    template <typename T>
+    OptionParser& add(const string& name, T& field) {
+        handlers[name] = [&field](const string& value) {
+            if constexpr (is_same_v<T, string>) {
+                field = value;
+            } else if constexpr (is_same_v<T, vector<size_t>>) {
+                field = LookupBenchmark::parseSizes(value);
+            } else if constexpr (is_floating_point_v<T>) {
+                field = stod(value);
+            } else if constexpr (is_signed_v<T>) {
+                field = static_cast<T>(stoll(value));
+            } else {
+                field = static_cast<T>(stoull(value));
+            }
+        };
+        return *this;
+    }
+
+    // An option whose value needs more than a conversion
+    OptionParser& add(const string& name, function<void(const string&)> handler) {
+        handlers[name] = std::move(handler);
+        return *this;
+    }
+
+    void parse(int argc, char* argv[], int first) const {
+        for (int i = first; i + 1 < argc; i += 2) {
+            auto handler = handlers.find(argv[i]);
+            if (handler == handlers.end()) {
+                throw invalid_argument("Unknown option " + string(argv[i]));
+            }
+            handler->second(argv[i + 1]);
         }
     }
 };
 
-int main() {
+// Runs a benchmark built from config and prints its report, applying the
+// config's --metrics setting around the run when it has one
+template <typename Benchmark, typename Config>
+int runBenchmark(const Config& config) {
+    if constexpr (requires { config.metrics; }) {
+        applyMetricsOption(config.metrics, nullptr);
+    }
+    Benchmark benchmark(config);
+    benchmark.run();
+    benchmark.report(cout);
+    if constexpr (requires { config.metrics; }) {
+        applyMetricsOption(config.metrics, &cout);
+    }
+    return 0;
+}
+
+// A command-line mode, chosen by argv[1] when there are at least
+// minimumArgs arguments
+struct CommandMode {
+    const char* name;
+    int minimumArgs;
+    int (*run)(int argc, char* argv[]);
+};
+
+static const CommandMode COMMAND_MODES[] = {
+    {"--loadgen", 2, [](int argc, char* argv[]) {
+        // --loadgen [--accounts N] [--sessions N] [--read R] [--transfer R]
+        //           [--skew THETA] [--seed N] [--wal PATH]
+        //           [--hash-cost N] [--credential-cache N]
+        //           [--metrics text|json|off]
+        WorkloadConfig config;
+        OptionParser()
+            .add("--accounts", config.accounts)
+            .add("--sessions", config.sessions)
+            .add("--read", config.readRatio)
+            .add("--transfer", config.transferRatio)
+            .add("--skew", config.skew)
+            .add("--seed", config.seed)
+            .add("--wal", config.logPath)
+            .add("--hash-cost", config.hashCost)
+            .add("--credential-cache", config.credentialCache)
+            .add("--metrics", config.metrics)
+            .parse(argc, argv, 2);
+        return runBenchmark<LoadDriver>(config);
+    }},
+    {"--lookupbench", 2, [](int argc, char* argv[]) {
+        // --lookupbench [--sizes N,N,...] [--lookups N] [--scan-limit N] [--seed N]
+        LookupBenchConfig config;
+        OptionParser()
+            .add("--sizes", config.sizes)
+            .add("--lookups", config.lookups)
+            .add("--scan-limit", config.scanLimit)
+            .add("--seed", config.seed)
+            .parse(argc, argv, 2);
+        return runBenchmark<LookupBenchmark>(config);
+    }},
+    {"--sumbench", 2, [](int argc, char* argv[]) {
+        // --sumbench [--accounts N] [--rounds N] [--seed N]
+        SumBenchConfig config;
+        OptionParser()
+            .add("--accounts", config.accounts)
+            .add("--rounds", config.rounds)
+            .add("--seed", config.seed)
+            .parse(argc, argv, 2);
+        return runBenchmark<BalanceSumBenchmark>(config);
+    }},
+    {"--stressbench", 2, [](int argc, char* argv[]) {
+        // --stressbench [--accounts N] [--transfers N] [--threads N] [--seed N]
+        StressBenchConfig config;
+        OptionParser()
+            .add("--accounts", config.accounts)
+            .add("--transfers", config.transfers)
+            .add("--threads", config.threads)
+            .add("--seed", config.seed)
+            .parse(argc, argv, 2);
+        return runBenchmark<StressBenchmark>(config);
+    }},
+    {"--queuebench", 2, [](int argc, char* argv[]) {
+        // --queuebench [--producers N] [--consumers N] [--operations N] [--capacity N]
+        QueueBenchConfig config;
+        OptionParser()
+            .add("--producers", config.producers)
+            .add("--consumers", config.consumers)
+            .add("--operations", config.operations)
+            .add("--capacity", config.capacity)
+            .parse(argc, argv, 2);
+        return runBenchmark<QueueBenchmark>(config);
+    }},
+    {"--batchbench", 2, [](int argc, char* argv[]) {
+        // --batchbench [--accounts N] [--records N] [--batch N] [--transfer R] [--seed N]
+        BatchBenchConfig config;
+        OptionParser()
+            .add("--accounts", config.accounts)
+            .add("--records", config.records)
+            .add("--batch", config.batch)
+            .add("--transfer", config.transferRatio)
+            .add("--seed", config.seed)
+            .parse(argc, argv, 2);
+        return runBenchmark<BatchBenchmark>(config);
+    }},
+    {"--walbench", 2, [](int argc, char* argv[]) {
+        // --walbench [--path P] [--accounts N] [--clients N] [--transactions N]
+        //            [--windows 0,50,200,1000] [--recovery-accounts N] [--recovery-records N] [--seed N]
+        WalBenchConfig config;
+        OptionParser()
+            .add("--path", config.path)
+            .add("--accounts", config.accounts)
+            .add("--clients", config.clients)
+            .add("--transactions", config.transactions)
+            .add("--windows", config.windows)
+            .add("--recovery-accounts", config.recoveryAccounts)
+            .add("--recovery-records", config.recoveryRecords)
+            .add("--seed", config.seed)
+            .parse(argc, argv, 2);
+        return runBenchmark<WalBenchmark>(config);
+    }},
+    {"--snapshotbench", 2, [](int argc, char* argv[]) {
+        // --snapshotbench [--path P] [--sizes 1000000,10000000]
+        SnapshotBenchConfig config;
+        OptionParser()
+            .add("--path", config.path)
+            .add("--sizes", config.sizes)
+            .parse(argc, argv, 2);
+        return runBenchmark<SnapshotBenchmark>(config);
+    }},
+    {"--declinebench", 2, [](int argc, char* argv[]) {
+        // --declinebench [--accounts N] [--declines N] [--threads N] [--seed N]
+        DeclineBenchConfig config;
+        OptionParser()
+            .add("--accounts", config.accounts)
+            .add("--declines", config.declines)
+            .add("--threads", config.threads)
+            .add("--seed", config.seed)
+            .parse(argc, argv, 2);
+        return runBenchmark<DeclineBenchmark>(config);
+    }},
+    {"--receiptbench", 2, [](int argc, char* argv[]) {
+        // --receiptbench [--accounts N] [--transactions N] [--console PATH] [--file PATH] [--seed N]
+        ReceiptBenchConfig config;
+        OptionParser()
+            .add("--accounts", config.accounts)
+            .add("--transactions", config.transactions)
+            .add("--console", config.console)
+            .add("--file", config.file)
+            .add("--seed", config.seed)
+            .parse(argc, argv, 2);
+        return runBenchmark<ReceiptBenchmark>(config);
+    }},
+    {"--signupbench", 2, [](int argc, char* argv[]) {
+        // --signupbench [--signups N] [--threads N] [--hash-cost N]
+        SignupBenchConfig config;
+        OptionParser()
+            .add("--signups", config.signups)
+            .add("--threads", config.threads)
+            .add("--hash-cost", config.hashCost)
+            .parse(argc, argv, 2);
+        return runBenchmark<SignupBenchmark>(config);
+    }},
+    {"--profilebench", 2, [](int argc, char* argv[]) {
+        // --profilebench [--customers N]
+        ProfileBenchConfig config;
+        OptionParser()
+            .add("--customers", config.customers)
+            .parse(argc, argv, 2);
+        return runBenchmark<ProfileBenchmark>(config);
+    }},
+    {"--importbench", 2, [](int argc, char* argv[]) {
+        // --importbench [--rows N] [--threads N]
+        ImportBenchConfig config;
+        OptionParser()
+            .add("--rows", config.rows)
+            .add("--threads", config.threads)
+            .parse(argc, argv, 2);
+        return runBenchmark<ImportBenchmark>(config);
+    }},
+    {"--metricsbench", 2, [](int argc, char* argv[]) {
+        // --metricsbench [--calls N]
+        MetricsBenchConfig config;
+        OptionParser()
+            .add("--calls", config.calls)
+            .parse(argc, argv, 2);
+        return runBenchmark<MetricsBenchmark>(config);
+    }},
+    {"--policybench", 2, [](int argc, char* argv[]) {
+        // --policybench [--accounts N] [--operations N] [--passes N] [--batch-accounts N]
+        //               [--records N] [--seed N]
+        PolicyBenchConfig config;
+        OptionParser()
+            .add("--accounts", config.accounts)
+            .add("--operations", config.operations)
+            .add("--passes", config.passes)
+            .add("--batch-accounts", config.batchAccounts)
+            .add("--records", config.records)
+            .add("--seed", config.seed)
+            .parse(argc, argv, 2);
+        return runBenchmark<PolicyBenchmark>(config);
+    }},
+    {"--loginbench", 2, [](int argc, char* argv[]) {
+        // --loginbench [--costs N,N,...] [--accounts N] [--clients N] [--seconds S]
+        //              [--credential-cache N] [--seed N]
+        LoginBenchConfig config;
+        OptionParser()
+            .add("--costs", config.costs)
+            .add("--accounts", config.accounts)
+            .add("--clients", config.clients)
+            .add("--seconds", config.seconds)
+            .add("--credential-cache", config.cache)
+            .add("--seed", config.seed)
+            .parse(argc, argv, 2);
+        return runBenchmark<LoginBenchmark>(config);
+    }},
+    {"--crashtest", 2, [](int argc, char* argv[]) {
+        // --crashtest [--path P]
+        CrashTestConfig config;
+        OptionParser()
+            .add("--path", config.path)
+            .parse(argc, argv, 2);
+        return runBenchmark<CrashRecoveryTest>(config);
+    }},
+    {"--shardbench", 2, [](int argc, char* argv[]) {
+        // --shardbench [--shards N] [--accounts N] [--transfers N]
+        //              [--clients N] [--transport local|socket] [--seed N]
+        //              [--metrics text|json|off]
+        ShardBenchConfig config;
+        OptionParser()
+            .add("--shards", config.shards)
+            .add("--accounts", config.accounts)
+            .add("--transfers", config.transfers)
+            .add("--clients", config.clients)
+            .add("--transport", [&config](const string& value) {
+                if (value != "local" && value != "socket") {
+                    throw invalid_argument("Unknown transport " + value);
+                }
+                config.sockets = value == "socket";
+            })
+            .add("--seed", config.seed)
+            .add("--metrics", config.metrics)
+            .parse(argc, argv, 2);
+        return runBenchmark<ShardBenchmark>(config);
+    }},
+    {"--accrualbench", 2, [](int argc, char* argv[]) {
+        // --accrualbench [--accounts N] [--clients N] [--transfers N]
+        //                [--seed N] [--metrics text|json|off]
+        AccrualBenchConfig config;
+        OptionParser()
+            .add("--accounts", config.accounts)
+            .add("--clients", config.clients)
+            .add("--transfers", config.transfers)
+            .add("--seed", config.seed)
+            .add("--metrics", config.metrics)
+            .parse(argc, argv, 2);
+        return runBenchmark<AccrualBenchmark>(config);
+    }},
+    {"--capture", 3, [](int, char* argv[]) {
+        // --capture PATH: the usual terminal, recording what it does
+        BankApplication app;
+        app.startCapture(argv[2]);
+        app.run();
+        return 0;
+    }},
+    {"--replay", 3, [](int argc, char* argv[]) {
+        // --replay PATH [--snapshot PATH] [--log PATH] [--pace max|recorded]
+        //               [--metrics text|json|off]
+        ReplayConfig config;
+        config.capture = argv[2];
+        OptionParser()
+            .add("--snapshot", config.snapshot)
+            .add("--log", config.log)
+            .add("--pace", [&config](const string& value) {
+                if (value != "max" && value != "recorded") {
+                    throw invalid_argument("Unknown pace " + value);
+                }
+                config.paced = value == "recorded";
+            })
+            .add("--metrics", config.metrics)
+            .parse(argc, argv, 3);
+        return runBenchmark<CaptureReplay>(config);
+    }},
+    {"--velocitybench", 2, [](int argc, char* argv[]) {
+        // --velocitybench [--accounts N] [--transfers N] [--clients N]
+        //                 [--rounds N] [--seed N]
+        VelocityBenchConfig config;
+        OptionParser()
+            .add("--accounts", config.accounts)
+            .add("--transfers", config.transfers)
+            .add("--clients", config.clients)
+            .add("--rounds", config.rounds)
+            .add("--seed", config.seed)
+            .parse(argc, argv, 2);
+        return runBenchmark<VelocityBenchmark>(config);
+    }},
+    {"--reconbench", 2, [](int argc, char* argv[]) {
+        // --reconbench [--accounts N] [--threads N] [--clients N] [--seed N]
+        ReconBenchConfig config;
+        OptionParser()
+            .add("--accounts", config.accounts)
+            .add("--threads", config.threads)
+            .add("--clients", config.clients)
+            .add("--seed", config.seed)
+            .parse(argc, argv, 2);
+        return runBenchmark<ReconBenchmark>(config);
+    }},
+    {"--tokenbench", 2, [](int argc, char* argv[]) {
+        // --tokenbench [--accounts N] [--sessions N] [--seed N]
+        TokenBenchConfig config;
+        OptionParser()
+            .add("--accounts", config.accounts)
+            .add("--sessions", config.sessions)
+            .add("--seed", config.seed)
+            .parse(argc, argv, 2);
+        return runBenchmark<TokenBenchmark>(config);
+    }},
+    {"--ledgerbench", 2, [](int argc, char* argv[]) {
+        // --ledgerbench [--rows N] [--accounts N] [--days N] [--queries N]
+        //               [--path P] [--seed N]
+        LedgerBenchConfig config;
+        OptionParser()
+            .add("--rows", config.rows)
+            .add("--accounts", config.accounts)
+            .add("--days", config.days)
+            .add("--queries", config.queries)
+            .add("--path", config.path)
+            .add("--seed", config.seed)
+            .parse(argc, argv, 2);
+        return runBenchmark<LedgerBenchmark>(config);
+    }},
+    {"--hotbench", 2, [](int argc, char* argv[]) {
+        // --hotbench [--accounts N] [--transfers N] [--threads N] [--hot N]
+        //            [--skew X] [--seed N] [--metrics text|json|off]
+        HotBenchConfig config;
+        OptionParser()
+            .add("--accounts", config.accounts)
+            .add("--transfers", config.transfers)
+            .add("--threads", config.threads)
+            .add("--hot", config.hot)
+            .add("--skew", config.skew)
+            .add("--seed", config.seed)
+            .add("--metrics", config.metrics)
+            .parse(argc, argv, 2);
+        return runBenchmark<HotAccountBenchmark>(config);
+    }},
+#ifdef __cpp_impl_coroutine
+    {"--serve", 2, [](int argc, char* argv[]) {
+        // --serve [--listen unix:PATH|tcp:PORT] [--threads N] [--wal PATH]
+        //         [--metrics text|json|off]
+        // Runs until SIGINT or SIGTERM
+        string address = "unix:atm.sock";
+        string logPath = "atm.wal";
+        string metrics;
+        size_t threads = max<size_t>(thread::hardware_concurrency(), 1);
+        OptionParser()
+            .add("--listen", address)
+            .add("--threads", threads)
+            .add("--wal", logPath)
+            .add("--metrics", metrics)
+            .parse(argc, argv, 2);
+        applyMetricsOption(metrics, nullptr);
+        // Blocked before any thread starts, so only sigwait sees them
+        sigset_t stopSignals;
+        sigemptyset(&stopSignals);
+        sigaddset(&stopSignals, SIGINT);
+        sigaddset(&stopSignals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+        CustomerDatabase db;
+        if (!logPath.empty()) {
+            db.open(logPath);
+        }
+        db.setVelocityLimits(VelocityLimits::perCustomer());
+        SessionServer server(db, address, threads, VelocityLimits::perTerminal());
+        cout << "Serving on " << server.address() << " with " << server.threads()
+             << " threads" << endl;
+        int received;
+        sigwait(&stopSignals, &received);
+        server.stop();
+        applyMetricsOption(metrics, &cout);
+        return 0;
+    }},
+    {"--sessionbench", 2, [](int argc, char* argv[]) {
+        // --sessionbench [--threads N] [--clients N] [--connections N]
+        //                [--sessions N] [--accounts N] [--transport unix|tcp]
+        //                [--read R] [--transfer R] [--skew THETA] [--seed N]
+        //                [--hash-cost N] [--credential-cache N]
+        //                [--metrics text|json|off]
+        SessionBenchConfig config;
+        OptionParser()
+            .add("--threads", config.threads)
+            .add("--clients", config.clients)
+            .add("--connections", config.connections)
+            .add("--sessions", config.sessions)
+            .add("--accounts", config.accounts)
+            .add("--transport", config.transport)
+            .add("--read", config.readRatio)
+            .add("--transfer", config.transferRatio)
+            .add("--skew", config.skew)
+            .add("--seed", config.seed)
+            .add("--hash-cost", config.hashCost)
+            .add("--credential-cache", config.credentialCache)
+            .add("--metrics", config.metrics)
+            .parse(argc, argv, 2);
+        return runBenchmark<SessionBenchmark>(config);
+    }},
+#endif
+};
+
+int main(int argc, char* argv[]) {
     try {
+        for (const CommandMode& mode : COMMAND_MODES) {
+            if (argc >= mode.minimumArgs && string(argv[1]) == mode.name) {
+                return mode.run(argc, argv);
+            }
+        }
         BankApplication app;
         app.run();
     } catch (const exception& e) {
@@ -654,4 +12560,3 @@ int main() {
     }
     return 0;
 }
-        